@@ -79,6 +79,7 @@ SOURCES += megachatapi.cpp \
 
 HEADERS  += asyncTest-framework.h \
             buffer.h \
+            bufferPool.h \
             chatd.h \
             karereCommon.h \
             messageBus.h \
@@ -88,6 +89,7 @@ HEADERS  += asyncTest-framework.h \
             chatdICrypto.h \
             db.h \
             karereId.h \
+            idMap.h \
             presenced.h \
             serverListProvider.h \
             autoHandle.h \
@@ -100,6 +102,7 @@ HEADERS  += asyncTest-framework.h \
             url.h \
             base64url.h \
             chatdDb.h \
+            dbStatements.h \
             IGui.h \
             megachatapi_impl.h \
             sdkApi.h \
@@ -125,6 +128,7 @@ HEADERS  += asyncTest-framework.h \
             base/services.h \
             base/timers.hpp \
             base/trackDelete.h \
+            net/fragmentBuffer.h \
             net/libwebsocketsIO.h \
             net/websocketsIO.h \
             rtcModule/IDeviceListImpl.h \
@@ -144,6 +148,7 @@ HEADERS  += asyncTest-framework.h \
             strongvelope/tlvstore.h \
             strongvelope/strongvelope.h \
             strongvelope/cryptofunctions.h \
+            strongvelope/decryptPool.h \
             waiter/libuvWaiter.h
 
 CONFIG(qt) {
@@ -5,8 +5,10 @@ include(../../../bindings/qt/megachat.pri)
 TARGET = megachat_tests
 DEPENDPATH += ../../../tests/sdk_test
 INCLUDEPATH += ../../../tests/sdk_test
-SOURCES +=  ../../../tests/sdk_test/sdk_test.cpp
-HEADERS +=  ../../../tests/sdk_test/sdk_test.h
+SOURCES +=  ../../../tests/sdk_test/sdk_test.cpp \
+            ../../../tests/common/serverSimulator.cpp
+HEADERS +=  ../../../tests/sdk_test/sdk_test.h \
+            ../../../tests/common/serverSimulator.h
 
 macx {
     CONFIG += nofreeimage # there are symbols duplicated in libwebrtc.a. Discarded for the moment
@@ -53,6 +53,11 @@ struct TimerMsg: public megaMessage
 
 void init_uv_timer(void *ctx, uv_timer_t *timer);
 
+/** Loop where the timers run when there is no MegaChatApiImpl (i.e. the benchmarks
+ * against the server simulators). Null by default: the timers run in the loop of the
+ * MegaChatApiImpl passed as \c ctx */
+extern uv_loop_t* gTimerLoop;
+
 extern std::recursive_mutex timerMutex;
 
 template <int persist, class CB>
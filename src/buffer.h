@@ -5,6 +5,10 @@
 #include <stdexcept>
 #include <string.h>
 #include <vector>
+#include <memory>
+#ifndef KARERE_DISABLE_BUFFER_POOL
+    #include "bufferPool.h"
+#endif
 
 #if !defined(__arm__) && !defined(__aarch64__)
     #define BUFFER_ALLOW_UNALIGNED_MEMORY_ACCESS 1
@@ -165,23 +169,66 @@ class Buffer: public StaticBuffer
 {
 protected:
     size_t mBufSize;
+    /** If set, mBuf is a slice of a block kept alive by \c mOwner, rather than
+     * a block allocated by us. See Buffer(owner, data, datalen) */
+    std::shared_ptr<void> mOwner;
+#ifndef KARERE_DISABLE_BUFFER_POOL
+    /** If set, the blocks of this buffer come from the BufferPool. See Buffer(size, dataSize, pooled) */
+    bool mPooled = false;
+#endif
     enum {kMinBufSize = 64};
     void zero()
     {
         mBuf = nullptr;
         mBufSize = 0;
         mDataSize = 0;
+        mOwner.reset();
     }
-public:
-    char* buf() { return mBuf;}
-    const char* buf() const { return mBuf;}
-    size_t bufSize() const { return mBufSize;}
-    Buffer(size_t size=kMinBufSize, size_t dataSize=0)
+    // All the blocks owned by buffers are managed by these, so the ones of pooled buffers are recycled
+    char* allocBlock(size_t size)
+    {
+#ifndef KARERE_DISABLE_BUFFER_POOL
+        if (mPooled)
+            return (char*)BufferPool::instance().alloc(size);
+#endif
+        return (char*)::malloc(size);
+    }
+    char* reallocBlock(char* block, size_t oldSize, size_t newSize)
+    {
+#ifndef KARERE_DISABLE_BUFFER_POOL
+        if (mPooled)
+            return (char*)BufferPool::instance().realloc(block, oldSize, newSize);
+#endif
+        return (char*)::realloc(block, newSize);
+    }
+    void freeBlock(char* block, size_t size)
+    {
+#ifndef KARERE_DISABLE_BUFFER_POOL
+        if (mPooled)
+        {
+            BufferPool::instance().release(block, size);
+            return;
+        }
+#endif
+        ::free(block);
+    }
+    /** @brief Creates a buffer whose blocks are recycled through the BufferPool, for buffers
+     * that are allocated and freed at a high rate, i.e. the commands, freed once sent */
+    Buffer(size_t size, size_t dataSize, bool pooled)
+    {
+#ifndef KARERE_DISABLE_BUFFER_POOL
+        mPooled = pooled;
+#else
+        (void)pooled;
+#endif
+        initBlock(size, dataSize);
+    }
+    void initBlock(size_t size, size_t dataSize)
     {
         assert(dataSize <= size);
         if (size)
         {
-            mBuf = (char*)malloc(size);
+            mBuf = allocBlock(size);
             if (!mBuf)
             {
                 zero();
@@ -195,11 +242,19 @@ public:
             zero();
         }
     }
+public:
+    char* buf() { return mBuf;}
+    const char* buf() const { return mBuf;}
+    size_t bufSize() const { return mBufSize;}
+    Buffer(size_t size=kMinBufSize, size_t dataSize=0)
+    {
+        initBlock(size, dataSize);
+    }
     Buffer(const char* data, size_t datalen)
     {
         if (data && datalen)
         {
-            mBuf = (char*)malloc(datalen);
+            mBuf = allocBlock(datalen);
             mBufSize = datalen;
             memcpy(mBuf, data, datalen);
             mDataSize = datalen;
@@ -210,18 +265,66 @@ public:
         }
     }
     Buffer(Buffer&& other)
-        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize) { other.zero(); }
+        :StaticBuffer(other.mBuf, other.mDataSize), mBufSize(other.mBufSize),
+         mOwner(std::move(other.mOwner))
+#ifndef KARERE_DISABLE_BUFFER_POOL
+         , mPooled(other.mPooled)
+#endif
+    { other.zero(); }
+
+    /** @brief Creates a buffer that references \c datalen bytes at \c data without
+     * copying them. The memory must be kept alive by \c owner, a reference to which is
+     * held by the buffer. The data can be modified in place, but it is copied to a block
+     * of our own as soon as the buffer needs to be reallocated, or when \c unshare()
+     * is called.
+     */
+    Buffer(const std::shared_ptr<void>& owner, char* data, size_t datalen)
+        :StaticBuffer(data, datalen), mBufSize(datalen), mOwner(owner) {}
+
+    /** @brief Whether the data is referenced from a block owned by someone else */
+    bool isShared() const { return mOwner != nullptr; }
+
+    /** @brief If the buffer references data owned by someone else, copies it to a block
+     * of our own and releases the reference to the owner */
+    void unshare()
+    {
+        if (!mOwner)
+            return;
+
+        char* data = mBuf;
+        if (mDataSize)
+        {
+            mBuf = allocBlock(mDataSize);
+            if (!mBuf)
+            {
+                mBuf = data;
+                throw std::runtime_error("Buffer::unshare: Out of memory allocating block of size "+ std::to_string(mDataSize));
+            }
+            memcpy(mBuf, data, mDataSize);
+        }
+        else
+        {
+            mBuf = nullptr;
+        }
+        mBufSize = mDataSize;
+        mOwner.reset();
+    }
 
     template <bool withNull>
     Buffer(const std::string& src)
     {
         mBufSize = withNull ? src.size()+1 : src.size();
-        mBuf = (char*)malloc(mBufSize);
+        mBuf = allocBlock(mBufSize);
         memcpy(mBuf, src.c_str(), mBufSize);
         mDataSize = mBufSize;
     }
     void assign(const void* data, size_t datalen)
     {
+        std::shared_ptr<void> owner(std::move(mOwner)); //keep the shared block alive, `data` may point into it
+        if (owner)
+        {
+            mBuf = nullptr;
+        }
         if (mBuf)
         {
             if (datalen <= mBufSize)
@@ -230,10 +333,10 @@ public:
                 mDataSize = datalen;
                 return;
             }
-            ::free(mBuf);
+            freeBlock(mBuf, mBufSize);
         }
         mBufSize = (kMinBufSize > datalen) ? (size_t) kMinBufSize : datalen;
-        mBuf = (char*)malloc(mBufSize);
+        mBuf = allocBlock(mBufSize);
         if (!mBuf)
         {
             zero();
@@ -247,9 +350,10 @@ public:
     void copyFrom(const StaticBuffer& src) { assign(src.buf(), src.dataSize()); }
     void reserve(size_t size)
     {
+        unshare();
         if (!mBuf)
         {
-            mBuf = (char*)::malloc(size);
+            mBuf = allocBlock(size);
             mBufSize = size;
             assert(mDataSize == 0);
         }
@@ -259,7 +363,7 @@ public:
             if (newsize <= mBufSize)
                 return;
             char* save = mBuf;
-            mBuf = (char*)::realloc(mBuf, newsize);
+            mBuf = reallocBlock(mBuf, mBufSize, newsize);
             if (!mBuf)
             {
                 mBuf = save;
@@ -307,8 +411,10 @@ public:
         {
             if (reqdSize > mBufSize)
             {
+                std::shared_ptr<void> owner(mOwner); //keep the shared block alive, `data` may point into it
+                unshare();
                 auto save = mBuf;
-                mBuf = (char*)::realloc(mBuf, reqdSize);
+                mBuf = reallocBlock(mBuf, mBufSize, reqdSize);
                 if (!mBuf)
                 {
                     mBuf = save;
@@ -346,15 +452,20 @@ public:
     {
         if (!mBuf)
             return;
-        ::free(mBuf);
+        if (mOwner)
+        {
+            zero();
+            return;
+        }
+        freeBlock(mBuf, mBufSize);
         mBuf = nullptr;
         mBufSize = mDataSize = 0;
     }
 
     ~Buffer()
     {
-        if (mBuf)
-            ::free(mBuf);
+        if (mBuf && !mOwner)
+            freeBlock(mBuf, mBufSize);
     }
 };
 #endif
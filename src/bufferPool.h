@@ -0,0 +1,250 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+
+/** @brief Recycles the small memory blocks of the buffers that are allocated and freed at
+ * a high rate, to avoid a malloc/free pair for each of them. Only the buffers created as
+ * pooled use it (see Buffer(size, dataSize, pooled)), i.e. the chatd and presenced commands,
+ * which are freed once sent. Long-lived buffers, like message payloads, are not pooled: they
+ * are still alive when the next ones are allocated, so the pool would only round them up.
+ *
+ * Blocks of up to kMaxBlockSize bytes are rounded up to a power of two size class, and when
+ * released they are kept in a free list of their class (up to kMaxFreeBlocks per class),
+ * to be reused by the next allocation of the same class. Larger blocks bypass the pool.
+ * The size passed to release() and realloc() must be the size that was requested for
+ * the block, as the class is calculated from it.
+ *
+ * Free lists are per thread, so the pool takes no lock. A block may be released by a
+ * thread other than the one that allocated it, it then goes to the free list of the
+ * releasing thread.
+ * The free lists of a thread are freed when the thread exits.
+ *
+ * The pool can be disabled at runtime, to compare with the system allocator. Blocks are
+ * always malloc()-ed, so enabling or disabling the pool at any time is safe.
+ * Build with KARERE_DISABLE_BUFFER_POOL to remove it completely.
+ */
+class BufferPool
+{
+public:
+    enum
+    {
+        kMinClassShift = 6,     // 64 bytes
+        kMaxClassShift = 12,    // 4096 bytes
+        kNumClasses = kMaxClassShift - kMinClassShift + 1,
+        kMaxBlockSize = 1 << kMaxClassShift,
+        kMaxFreeBlocks = 1024   // per class and thread
+    };
+    struct Stats
+    {
+        uint64_t allocs = 0;        // total number of allocations requested
+        uint64_t poolHits = 0;      // allocations served from a free list
+        uint64_t systemAllocs = 0;  // allocations that called malloc()
+        uint64_t systemFrees = 0;   // releases that called free()
+        size_t cachedBytes = 0;     // bytes currently held in the free lists of all threads
+    };
+
+    static BufferPool& instance()
+    {
+        // never destroyed, since buffers may be released during static destruction
+        static BufferPool* pool = new BufferPool;
+        return *pool;
+    }
+
+    static size_t blockSize(size_t size)
+    {
+        if (size > kMaxBlockSize)
+            return size;
+        size_t blockSize = (size_t)1 << kMinClassShift;
+        while (blockSize < size)
+            blockSize <<= 1;
+        return blockSize;
+    }
+
+    void* alloc(size_t size)
+    {
+        count(mAllocs);
+        int cls = sizeClass(size);
+        ThreadCache* cache = (cls >= 0) ? threadCache() : nullptr;
+        if (cache && cache->free[cls])
+        {
+            FreeBlock* block = cache->free[cls];
+            cache->free[cls] = block->next;
+            cache->count[cls]--;
+            mCachedBytes.fetch_sub(classSize(cls), std::memory_order_relaxed);
+            count(mPoolHits);
+            return block;
+        }
+        count(mSystemAllocs);
+        void* block = ::malloc(cls >= 0 ? classSize(cls) : size);
+        if (!block)
+            throw std::runtime_error("BufferPool: Out of memory allocating block of size "+std::to_string(size));
+        return block;
+    }
+
+    void release(void* block, size_t size)
+    {
+        if (!block)
+            return;
+        int cls = sizeClass(size);
+        ThreadCache* cache = (cls >= 0) ? threadCache() : nullptr;
+        if (cache && cache->count[cls] < kMaxFreeBlocks)
+        {
+            FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+            freeBlock->next = cache->free[cls];
+            cache->free[cls] = freeBlock;
+            cache->count[cls]++;
+            mCachedBytes.fetch_add(classSize(cls), std::memory_order_relaxed);
+            return;
+        }
+        count(mSystemFrees);
+        ::free(block);
+    }
+
+    /** Resizes a block allocated by the pool. If the new size falls in the same size
+     * class, the same block is returned. On failure, returns nullptr and the block is not freed */
+    void* realloc(void* block, size_t oldSize, size_t newSize)
+    {
+        if (!block)
+            return alloc(newSize);
+        if (blockSize(oldSize) == blockSize(newSize) && newSize <= kMaxBlockSize)
+            return block;
+        if (oldSize > kMaxBlockSize && newSize > kMaxBlockSize)
+            return ::realloc(block, newSize);
+
+        void* newBlock;
+        try
+        {
+            newBlock = alloc(newSize);
+        }
+        catch (std::runtime_error&)
+        {
+            return nullptr;
+        }
+        memcpy(newBlock, block, (oldSize < newSize) ? oldSize : newSize);
+        release(block, oldSize);
+        return newBlock;
+    }
+
+    void setEnabled(bool enabled)
+    {
+        mEnabled.store(enabled, std::memory_order_relaxed);
+        if (!enabled)
+            trim();
+    }
+    bool isEnabled() const
+    {
+        return mEnabled.load(std::memory_order_relaxed);
+    }
+
+    /** Frees all the blocks held in the free lists. The ones of the calling thread are
+     * freed immediately, the ones of other threads the next time they use the pool */
+    void trim()
+    {
+        mGeneration.fetch_add(1, std::memory_order_relaxed);
+        threadCache();
+    }
+
+    Stats stats() const
+    {
+        Stats stats;
+        stats.allocs = mAllocs.load(std::memory_order_relaxed);
+        stats.poolHits = mPoolHits.load(std::memory_order_relaxed);
+        stats.systemAllocs = mSystemAllocs.load(std::memory_order_relaxed);
+        stats.systemFrees = mSystemFrees.load(std::memory_order_relaxed);
+        stats.cachedBytes = mCachedBytes.load(std::memory_order_relaxed);
+        return stats;
+    }
+    void resetStats()
+    {
+        mAllocs.store(0, std::memory_order_relaxed);
+        mPoolHits.store(0, std::memory_order_relaxed);
+        mSystemAllocs.store(0, std::memory_order_relaxed);
+        mSystemFrees.store(0, std::memory_order_relaxed);
+    }
+
+protected:
+    struct FreeBlock { FreeBlock* next; };
+    struct ThreadCache
+    {
+        FreeBlock* free[kNumClasses] = {};
+        unsigned count[kNumClasses] = {};
+        unsigned generation = 0;
+
+        ~ThreadCache()
+        {
+            exited() = true;
+            BufferPool::instance().flush(*this);
+        }
+        // Blocks released after the cache of the thread was destroyed (by the destructors of
+        // other thread_local or static objects) go straight to the system allocator
+        static bool& exited()
+        {
+            static thread_local bool exited = false;
+            return exited;
+        }
+        static ThreadCache* current()
+        {
+            if (exited())
+                return nullptr;
+            static thread_local ThreadCache cache;
+            return &cache;
+        }
+    };
+
+    std::atomic<uint64_t> mAllocs{0};
+    std::atomic<uint64_t> mPoolHits{0};
+    std::atomic<uint64_t> mSystemAllocs{0};
+    std::atomic<uint64_t> mSystemFrees{0};
+    std::atomic<size_t> mCachedBytes{0};
+    std::atomic<unsigned> mGeneration{0};   // incremented by trim()
+    std::atomic<bool> mEnabled{true};
+
+    BufferPool() {}
+    static void count(std::atomic<uint64_t>& counter) { counter.fetch_add(1, std::memory_order_relaxed); }
+    static size_t classSize(int cls) { return (size_t)1 << (cls + kMinClassShift); }
+    static int sizeClass(size_t size)
+    {
+        if (size > kMaxBlockSize)
+            return -1;
+        int cls = 0;
+        while (classSize(cls) < size)
+            cls++;
+        return cls;
+    }
+
+    /** The free lists of the calling thread, or nullptr if the pool is disabled */
+    ThreadCache* threadCache()
+    {
+        ThreadCache* cache = ThreadCache::current();
+        if (!cache)
+            return nullptr;
+        unsigned generation = mGeneration.load(std::memory_order_relaxed);
+        if (cache->generation != generation)
+        {
+            flush(*cache);
+            cache->generation = generation;
+        }
+        return mEnabled.load(std::memory_order_relaxed) ? cache : nullptr;
+    }
+    void flush(ThreadCache& cache)
+    {
+        for (int i = 0; i < kNumClasses; i++)
+        {
+            while (FreeBlock* block = cache.free[i])
+            {
+                cache.free[i] = block->next;
+                ::free(block);
+                count(mSystemFrees);
+                mCachedBytes.fetch_sub(classSize(i), std::memory_order_relaxed);
+            }
+            cache.count[i] = 0;
+        }
+    }
+};
+
+#endif
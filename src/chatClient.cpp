@@ -28,6 +28,7 @@
 #include <db.h>
 #include <buffer.h>
 #include <chatdDb.h>
+#include <dbStatements.h>
 #include <megaapi_impl.h>
 #include <autoHandle.h>
 #include <asyncTools.h>
@@ -166,7 +167,7 @@ bool Client::openDb(const std::string& sid)
         return false;
     }
 
-    bool ok = db.open(path.c_str(), false);
+    bool ok = db.open(path.c_str(), false, mDbProfile);
     if (!ok)
     {
         KR_LOG_WARNING("Error opening database");
@@ -249,7 +250,7 @@ bool Client::openDb(const std::string& sid)
 
                 // Populate new table with existing node-attachments
                 db.query("insert into node_history select * from history where type=?", std::to_string(chatd::Message::Type::kMsgAttachment));
-                int count = sqlite3_changes(db);
+                int count = db.changes();
 
                 // Update DB version number
                 db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
@@ -320,6 +321,28 @@ bool Client::openDb(const std::string& sid)
                 ok = true;
                 KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
             }
+            else if (cachedVersionSuffix == "9" && (strcmp(gDbSchemaVersionSuffix, "10") == 0))
+            {
+                KR_LOG_WARNING("Updating schema of MEGAchat cache...");
+
+                // Add indexes for unread counts, for the per-chat sending queues and
+                // to find the most recent message of each user without a full scan
+                db.simpleQuery("CREATE INDEX history_unread_idx ON history(chatid, type, is_encrypted, idx);");
+                db.simpleQuery("CREATE INDEX sending_chatid_idx ON sending(chatid);");
+                db.simpleQuery("CREATE INDEX manual_sending_chatid_idx ON manual_sending(chatid);");
+                db.simpleQuery("CREATE INDEX history_userid_ts_idx ON history(userid, ts);");
+
+                // Add persisted unread counter
+                db.query("ALTER TABLE `chats` ADD unread_count int");
+
+                // Add cache of pairwise keys derived from the Cu25519 keys of peers
+                db.simpleQuery("CREATE TABLE symm_keys(userid int64 primary key, pubkey blob not null, key blob not null, mac blob not null);");
+
+                db.query("update vars set value = ? where name = 'schema_version'", currentVersion);
+                db.commit();
+                ok = true;
+                KR_LOG_WARNING("Database version has been updated to %s", gDbSchemaVersionSuffix);
+            }
         }
     }
 
@@ -330,6 +353,11 @@ bool Client::openDb(const std::string& sid)
         return false;
     }
 
+    if (mDbWriteBehind && !db.enableWriteBehind())
+    {
+        KR_LOG_WARNING("Write-behind mode is not supported for the local cache");
+    }
+
     mSid = sid;
     return true;
 }
@@ -562,6 +590,34 @@ bool Client::isChatRoomOpened(Id chatid)
     return false;
 }
 
+void Client::setDbProfile(const SqliteDbProfile& profile)
+{
+    mDbProfile = profile;
+}
+
+void Client::setDbWriteBehind(bool enable)
+{
+    mDbWriteBehind = enable;
+    if (!db.isOpen())
+        return; // it will be applied when the db is opened
+
+    try
+    {
+        if (!enable)
+        {
+            db.disableWriteBehind();
+        }
+        else if (!db.enableWriteBehind())
+        {
+            KR_LOG_WARNING("Write-behind mode is not supported for the local cache");
+        }
+    }
+    catch(std::runtime_error& e)
+    {
+        KR_LOG_ERROR("Error changing the write-behind mode of the local cache: %s", e.what());
+    }
+}
+
 void Client::saveDb()
 {
     try
@@ -673,6 +729,8 @@ Client::InitState Client::initWithAnonymousSession()
     createDb();
     mMyHandle = Id::null(); // anonymous mode should use ownHandle set to all zeros
     mUserAttrCache.reset(new UserAttrCache(*this));
+    mSymmKeyCache.reset();
+    mPlaintextCache.reset();
     mChatdClient.reset(new chatd::Client(this));
     mSessionReadyPromise.resolve();
     mInitStats.stageEnd(InitStats::kStatsInit);
@@ -700,6 +758,8 @@ promise::Promise<void> Client::initWithNewSession(const char* sid, const std::st
     mMyIdentity = initMyIdentity();
 
     mUserAttrCache.reset(new UserAttrCache(*this));
+    mSymmKeyCache.reset();
+    mPlaintextCache.reset();
     api.sdk.addGlobalListener(this);
 
     auto wptr = weakHandle();
@@ -805,6 +865,8 @@ void Client::initWithDbSession(const char* sid)
         assert(db);
         assert(!mSid.empty());
         mUserAttrCache.reset(new UserAttrCache(*this));
+        mSymmKeyCache.reset();
+        mPlaintextCache.reset();
         api.sdk.addGlobalListener(this);
 
         mMyHandle = getMyHandleFromDb();
@@ -1096,6 +1158,8 @@ void Client::wipeDb(const std::string& sid)
     db.close();
     std::string path = dbPath(sid);
     remove(path.c_str());
+    remove((path + "-wal").c_str());    // leftovers of WAL journal mode
+    remove((path + "-shm").c_str());
     struct stat info;
     if (stat(path.c_str(), &info) == 0)
         throw std::runtime_error("wipeDb: Could not delete old database file in "+mAppDir);
@@ -1105,9 +1169,14 @@ void Client::createDb()
 {
     wipeDb(mSid);
     std::string path = dbPath(mSid);
-    if (!db.open(path.c_str(), false))
+    if (!db.open(path.c_str(), false, mDbProfile))
         throw std::runtime_error("Can't access application database at "+mAppDir);
     createDbSchema(); //calls commit() at the end
+
+    if (mDbWriteBehind && !db.enableWriteBehind())
+    {
+        KR_LOG_WARNING("Write-behind mode is not supported for the local cache");
+    }
 }
 
 bool Client::checkSyncWithSdkDb(const std::string& scsn,
@@ -1563,6 +1632,8 @@ void Client::terminate(bool deleteDb)
         mUserAttrCache->removeCb(mAliasAttrHandle);
         mUserAttrCache->onLogOut();
         mUserAttrCache.reset();
+        mSymmKeyCache.reset();
+        mPlaintextCache.reset();
 
         // stop heartbeats
         if (mHeartbeatTimer)
@@ -1815,10 +1886,28 @@ bool ChatRoom::isChatdChatInitialized()
 strongvelope::ProtocolHandler* Client::newStrongvelope(karere::Id chatid, bool isPublic,
         std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted, karere::Id ph)
 {
+    if (!mSymmKeyCache)
+    {
+        // own keys are loaded at this point. Don't persist keys of anonymous sessions
+        mSymmKeyCache = std::make_shared<strongvelope::SymmKeyCache>(
+            StaticBuffer(mMyPrivCu25519, 32), anonymousMode() ? nullptr : &db);
+    }
+    if (!mPlaintextCache)
+    {
+        mPlaintextCache = std::make_shared<strongvelope::PlaintextCache>();
+    }
     return new strongvelope::ProtocolHandler(mMyHandle,
          StaticBuffer(mMyPrivCu25519, 32), StaticBuffer(mMyPrivEd25519, 32),
          StaticBuffer(mMyPrivRsa, mMyPrivRsaLen), *mUserAttrCache, db, chatid,
-         isPublic, unifiedKey, isUnifiedKeyEncrypted, ph, appCtx);
+         isPublic, unifiedKey, isUnifiedKeyEncrypted, ph, appCtx, mSymmKeyCache, mPlaintextCache);
+}
+
+void Client::invalidateSymmKey(karere::Id userid)
+{
+    if (mSymmKeyCache)
+    {
+        mSymmKeyCache->invalidate(userid);
+    }
 }
 
 void ChatRoom::createChatdChat(const karere::SetOfIds& initialUsers, bool isPublic,
@@ -1979,13 +2068,12 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
     mMemberNamesResolved = promise::when(promises);
 
     // Save Chatroom into DB
-    auto db = parent.mKarereClient.db;
+    auto& db = parent.mKarereClient.db;
     bool isPublicChat = aChat.isPublicChat();
-    db.query("insert or replace into chats(chatid, shard, peer, peer_priv, "
-             "own_priv, ts_created, archived, mode) values(?,?,-1,0,?,?,?,?)",
+    db.query(sql::kChatInsertGroup,
              mChatid, mShardNo, mOwnPriv, aChat.getCreationTime(), aChat.isArchived(), isPublicChat);
-    db.query("delete from chat_peers where chatid=?", mChatid); // clean any obsolete data
-    SqliteStmt stmt(db, "insert into chat_peers(chatid, userid, priv) values(?,?,?)");
+    db.query(sql::kPeersClear, mChatid); // clean any obsolete data
+    SqliteStmt stmt(db, sql::kPeersInsert);
     for (auto& m: mPeers)
     {
         stmt << mChatid << m.first << m.second->mPriv;
@@ -2018,7 +2106,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const mega::MegaTextChat& aCh
         Buffer unifiedKeyBuf;
         unifiedKeyBuf.write(0, (uint8_t)isUnifiedKeyEncrypted);  // prefix to indicate it's encrypted
         unifiedKeyBuf.append(unifiedKey->data(), unifiedKey->size());
-        db.query("update chats set unified_key = ? where chatid = ?", unifiedKeyBuf, mChatid);
+        db.query(sql::kChatSetUnifiedKey, unifiedKeyBuf, mChatid);
     }
 
     // Initialize chatd::Client (and strongvelope)
@@ -2040,7 +2128,7 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
     mRoomGui(nullptr)
 {
     // Initialize list of peers
-    SqliteStmt stmt(parent.mKarereClient.db, "select userid, priv from chat_peers where chatid=?");
+    SqliteStmt stmt(parent.mKarereClient.db, sql::kPeersLoad);
     stmt << mChatid;
     std::vector<promise::Promise<void> > promises;
     while(stmt.step())
@@ -2071,10 +2159,8 @@ GroupChatRoom::GroupChatRoom(ChatRoomList& parent, const uint64_t& chatid,
     unifiedKeyBuf.append(unifiedKey->data(), unifiedKey->size());
 
     //save to db
-    auto db = parent.mKarereClient.db;
-    db.query(
-        "insert or replace into chats(chatid, shard, peer, peer_priv, "
-        "own_priv, ts_created, mode, unified_key) values(?,?,-1,0,?,?,2,?)",
+    auto& db = parent.mKarereClient.db;
+    db.query(sql::kChatInsertPreview,
         mChatid, mShardNo, mOwnPriv, mCreationTs, unifiedKeyBuf);
 
     initWithChatd(true, unifiedKey, 0, publicHandle); // strongvelope only needs the public handle in preview mode (to fetch user attributes via `mcuga`)
@@ -2145,10 +2231,10 @@ PeerChatRoom::PeerChatRoom(ChatRoomList& parent, const mega::MegaTextChat& chat)
      (chatd::Priv)chat.getOwnPrivilege(), chat.getCreationTime(), chat.isArchived()),
       mPeer(getSdkRoomPeer(chat)), mPeerPriv(getSdkRoomPeerPriv(chat)), mRoomGui(nullptr)
 {
-    parent.mKarereClient.db.query("insert into chats(chatid, shard, peer, peer_priv, own_priv, ts_created, archived) values (?,?,?,?,?,?,?)",
+    parent.mKarereClient.db.query(sql::kChatInsertPeer,
         mChatid, mShardNo, mPeer, mPeerPriv, mOwnPriv, chat.getCreationTime(), chat.isArchived());
 //just in case
-    parent.mKarereClient.db.query("delete from chat_peers where chatid = ?", mChatid);
+    parent.mKarereClient.db.query(sql::kPeersClear, mChatid);
 
     KR_LOG_DEBUG("Added 1on1 chatroom '%s' from API",  ID_CSTR(mChatid));
 
@@ -2275,12 +2361,12 @@ bool ChatRoom::syncOwnPriv(chatd::Priv priv)
             mChat->setPublicHandle(Id::inval());
 
             //Remove preview mode flag from DB
-            parent.mKarereClient.db.query("update chats set mode = '1' where chatid = ?", mChatid);
+            parent.mKarereClient.db.query(sql::kChatSetModePublic, mChatid);
         }
     }
 
     mOwnPriv = priv;
-    parent.mKarereClient.db.query("update chats set own_priv = ? where chatid = ?", mOwnPriv, mChatid);
+    parent.mKarereClient.db.query(sql::kChatSetOwnPriv, mOwnPriv, mChatid);
     return true;
 }
 
@@ -2290,7 +2376,7 @@ bool ChatRoom::syncArchive(bool aIsArchived)
         return false;
 
     mIsArchived = aIsArchived;
-    parent.mKarereClient.db.query("update chats set archived = ? where chatid = ?", mIsArchived, mChatid);
+    parent.mKarereClient.db.query(sql::kChatSetArchived, mIsArchived, mChatid);
 
     return true;
 }
@@ -2301,7 +2387,7 @@ bool PeerChatRoom::syncPeerPriv(chatd::Priv priv)
         return false;
 
     mPeerPriv = priv;
-    parent.mKarereClient.db.query("update chats set peer_priv = ? where chatid = ?", mPeerPriv, mChatid);
+    parent.mKarereClient.db.query(sql::kChatSetPeerPriv, mPeerPriv, mChatid);
 
     return true;
 }
@@ -2343,7 +2429,7 @@ promise::Promise<void> GroupChatRoom::addMember(uint64_t userid, chatd::Priv pri
     }
     if (saveToDb)
     {
-        parent.mKarereClient.db.query("insert or replace into chat_peers(chatid, userid, priv) values(?,?,?)",
+        parent.mKarereClient.db.query(sql::kPeersReplace,
             mChatid, userid, priv);
     }
 
@@ -2363,7 +2449,7 @@ bool GroupChatRoom::removeMember(uint64_t userid)
 
     delete it->second;
     mPeers.erase(it);
-    parent.mKarereClient.db.query("delete from chat_peers where chatid=? and userid=?", mChatid, userid);
+    parent.mKarereClient.db.query(sql::kPeersDelete, mChatid, userid);
 
     return true;
 }
@@ -2377,11 +2463,11 @@ promise::Promise<void> GroupChatRoom::setPrivilege(karere::Id userid, chatd::Pri
         wptr.throwIfDeleted();
         if (userid == parent.mKarereClient.myHandle())
         {
-            parent.mKarereClient.db.query("update chats set own_priv=? where chatid=?", priv, mChatid);
+            parent.mKarereClient.db.query(sql::kChatSetOwnPriv, priv, mChatid);
         }
         else
         {
-            parent.mKarereClient.db.query("update chat_peers set priv=? where chatid=? and userid=?", priv, mChatid, userid);
+            parent.mKarereClient.db.query(sql::kPeersSetPriv, priv, mChatid, userid);
         }
     });
 }
@@ -2442,7 +2528,7 @@ ChatRoomList::ChatRoomList(Client& aClient)
 
 void ChatRoomList::loadFromDb()
 {
-    auto db = mKarereClient.db;
+    auto& db = mKarereClient.db;
 
     //We need to ensure that the DB does not contain any record related with a preview
     SqliteStmt stmtPreviews(db, "select chatid from chats where mode = '2'");
@@ -2611,7 +2697,7 @@ void GroupChatRoom::notifyPreviewClosed()
 void GroupChatRoom::setRemoved()
 {
     mOwnPriv = chatd::PRIV_NOTPRESENT;
-    parent.mKarereClient.db.query("update chats set own_priv=? where chatid=?", mOwnPriv, mChatid);
+    parent.mKarereClient.db.query(sql::kChatSetOwnPriv, mOwnPriv, mChatid);
     notifyExcludedFromChat();
 }
 
@@ -2714,7 +2800,7 @@ void GroupChatRoom::updateTitleInDb(const std::string &title, int isEncrypted)
     Buffer titleBuf;
     titleBuf.write(0, (uint8_t)isEncrypted);
     titleBuf.append(title.data(), title.size());
-    parent.mKarereClient.db.query("update chats set title=? where chatid=?", titleBuf, mChatid);
+    parent.mKarereClient.db.query(sql::kChatSetTitle, titleBuf, mChatid);
 }
 
 void GroupChatRoom::makeTitleFromMemberNames()
@@ -2975,6 +3061,7 @@ void ChatRoom::removeAppChatHandler()
         return;
     mAppChatHandler = nullptr;
     mChat->setListener(this);
+    mChat->trimHistoryWindow();
 }
 
 bool ChatRoom::hasChatHandler() const
@@ -3219,7 +3306,7 @@ void GroupChatRoom::enablePreview(uint64_t ph)
 {
     // Current priv is PRIV_NOTPRESENT and need to be updated
     mOwnPriv = chatd::PRIV_RDONLY;
-    parent.mKarereClient.db.query("update chats set own_priv = ? where chatid = ?", mOwnPriv, mChatid);
+    parent.mKarereClient.db.query(sql::kChatSetOwnPriv, mOwnPriv, mChatid);
     if (mRoomGui)
     {
         mRoomGui->onUserJoin(parent.mKarereClient.myHandle(), mOwnPriv);
@@ -3253,17 +3340,17 @@ bool GroupChatRoom::previewMode() const
 
 void ChatRoomList::previewCleanup(Id chatid)
 {
-    auto db = mKarereClient.db;
+    auto& db = mKarereClient.db;
     if (db.isOpen())   // upon karere::Client destruction, DB is already closed
     {
-        db.query("delete from chat_peers where chatid = ?", chatid);
-        db.query("delete from chat_vars where chatid = ?", chatid);
-        db.query("delete from chats where chatid = ?", chatid);
-        db.query("delete from history where chatid = ?", chatid);
-        db.query("delete from manual_sending where chatid = ?", chatid);
-        db.query("delete from sending where chatid = ?", chatid);
-        db.query("delete from sendkeys where chatid = ?", chatid);
-        db.query("delete from node_history where chatid = ?", chatid);
+        db.query(sql::kPeersClear, chatid);
+        db.query(sql::kChatVarsClear, chatid);
+        db.query(sql::kChatDelete, chatid);
+        db.query(sql::kHistoryClear, chatid);
+        db.query(sql::kManualSendingClear, chatid);
+        db.query(sql::kSendingClear, chatid);
+        db.query(sql::kSendKeysClear, chatid);
+        db.query(sql::kNodeHistoryClear, chatid);
     }
 }
 
@@ -3285,7 +3372,7 @@ bool GroupChatRoom::syncMembers(const mega::MegaTextChat& chat)
         }
     }
 
-    auto db = parent.mKarereClient.db;
+    auto& db = parent.mKarereClient.db;
     bool peersChanged = false;
     for (auto ourIt = mPeers.begin(); ourIt != mPeers.end();)
     {
@@ -3307,7 +3394,7 @@ bool GroupChatRoom::syncMembers(const mega::MegaTextChat& chat)
                      ID_CSTR(chatid()), ID_CSTR(userid), member->mPriv, it->second);
 
                 member->mPriv = it->second;
-                db.query("update chat_peers set priv=? where chatid=? and userid=?", member->mPriv, mChatid, userid);
+                db.query(sql::kPeersSetPriv, member->mPriv, mChatid, userid);
             }
             ourIt++;
         }
@@ -3387,7 +3474,7 @@ void GroupChatRoom::initChatTitle(const std::string &title, int isTitleEncrypted
 void GroupChatRoom::clearTitle()
 {
     makeTitleFromMemberNames();
-    parent.mKarereClient.db.query("update chats set title=NULL where chatid=?", mChatid);
+    parent.mKarereClient.db.query(sql::kChatClearTitle, mChatid);
 }
 
 bool GroupChatRoom::syncWithApi(const mega::MegaTextChat& chat)
@@ -3494,7 +3581,7 @@ void GroupChatRoom::setChatPrivateMode()
     chat().crypto()->setPrivateChatMode();
 
     //Update cache
-    parent.mKarereClient.db.query("update chats set mode = '0' where chatid = ?", mChatid);
+    parent.mKarereClient.db.query(sql::kChatSetModePrivate, mChatid);
 
     notifyChatModeChanged();
 }
@@ -31,7 +31,7 @@
 
 namespace mega { class MegaTextChat; class MegaTextChatList; }
 
-namespace strongvelope { class ProtocolHandler; }
+namespace strongvelope { class ProtocolHandler; class SymmKeyCache; class PlaintextCache; }
 
 struct sqlite3;
 class Buffer;
@@ -900,6 +900,10 @@ protected:
     std::string mMyEmail;
     uint64_t mMyIdentity = 0; // seed for CLIENTID
     std::unique_ptr<UserAttrCache> mUserAttrCache;
+    // pairwise keys derived from our Cu25519 key, shared by the strongvelope of all chats
+    std::shared_ptr<strongvelope::SymmKeyCache> mSymmKeyCache;
+    // content of the decrypted messages, shared by the strongvelope of all chats
+    std::shared_ptr<strongvelope::PlaintextCache> mPlaintextCache;
     UserAttrCache::Handle mOwnNameAttrHandle;
     UserAttrCache::Handle mAliasAttrHandle;
 
@@ -924,6 +928,12 @@ protected:
     AliasesMap mAliasesMap;
     bool mIsInBackground = false;
 
+    // whether db writes are deferred to a dedicated writer thread
+    bool mDbWriteBehind = false;
+
+    // tuning of the local cache (journal mode, mmap...) applied when it's opened
+    SqliteDbProfile mDbProfile;
+
 public:
 
     /**
@@ -1098,6 +1108,21 @@ public:
     void setCommitMode(bool commitEach);
     void saveDb();  // forces a commit
 
+    /**
+     * @brief Enables or disables the write-behind mode of the local cache. In this mode,
+     * db writes are executed and committed by a dedicated thread, so processing incoming
+     * messages doesn't wait for the disk. Pending writes are flushed before any read and
+     * upon logout/termination.
+     */
+    void setDbWriteBehind(bool enable);
+
+    /**
+     * @brief Sets the tuning (journal mode, synchronous level, mmap, page cache...)
+     * of the local cache. It takes effect the next time the db is opened, so it
+     * should be set before initialization.
+     */
+    void setDbProfile(const SqliteDbProfile& profile);
+
     /** @brief There is a call active in the chatroom*/
     bool isCallActive(karere::Id chatid = karere::Id::inval()) const;
 
@@ -1149,6 +1174,17 @@ protected:
     strongvelope::ProtocolHandler* newStrongvelope(karere::Id chatid, bool isPublic,
             std::shared_ptr<std::string> unifiedKey, int isUnifiedKeyEncrypted, karere::Id ph);
 
+public:
+    /** @brief Discards the pairwise key derived for \c userid. Called when the Cu25519
+     * public key of the user changes */
+    void invalidateSymmKey(karere::Id userid);
+
+    /** @brief Returns the cache of decrypted messages, i.e. to check its hit rate. It's
+     * null until the first chat is initialized */
+    const std::shared_ptr<strongvelope::PlaintextCache>& plaintextCache() const { return mPlaintextCache; }
+
+protected:
+
     // connection-related methods
     void connectToChatd();
     promise::Promise<void> connectToPresenced(Presence pres);
@@ -2,6 +2,7 @@
 #include "chatClient.h"
 #include "chatdICrypto.h"
 #include "base64url.h"
+#include "dbStatements.h"
 #include <algorithm>
 #include <random>
 #include <regex>
@@ -170,7 +171,7 @@ Client::Client(karere::Client *aKarereClient) :
     }
 
     // initialize the most recent message for each user
-    SqliteStmt stmt1(mKarereClient->db, "SELECT DISTINCT userid FROM history");
+    SqliteStmt stmt1(mKarereClient->db, karere::sql::kHistoryUserids);
     while (stmt1.step())
     {
         karere::Id userid = stmt1.uint64Col(0);
@@ -179,7 +180,7 @@ Client::Client(karere::Client *aKarereClient) :
             continue;
         }
 
-        SqliteStmt stmt2(mKarereClient->db, "SELECT MAX(ts) FROM history WHERE userid = ?");
+        SqliteStmt stmt2(mKarereClient->db, karere::sql::kHistoryUserLastTs);
         stmt2 << userid.val;
         if (stmt2.step())
         {
@@ -453,6 +454,7 @@ Connection::Connection(Client& chatdClient, int shardNo)
 
 void Connection::wsConnectCb()
 {
+    mTargetIp = wsConnectedIp();    // the winner of the race among the IPs
     setState(kStateConnected);
 }
 
@@ -488,7 +490,6 @@ void Connection::onSocketClose(int errcode, int errtype, const std::string& reas
 
     assert(oldState != kStateDisconnected);
 
-    usingipv6 = !usingipv6;
     mTargetIp.clear();
 
     if (oldState == kStateConnected)
@@ -593,6 +594,7 @@ void Connection::setState(State state)
     if (mState == kStateDisconnected)
     {
         mHeartbeatEnabled = false;
+        mOutputThrottled = false;   // the output queues are flushed again upon login
 
         // if a socket is opened, close it immediately
         if (wsIsConnected())
@@ -905,56 +907,32 @@ void Connection::disconnect()
 
 void Connection::doConnect()
 {
-    string ipv4, ipv6;
-    bool cachedIPs = mDnsCache.getIp(mShardNo, ipv4, ipv6);
+    std::vector<std::string> ips;
+    bool cachedIPs = mDnsCache.getIpsByPreference(mShardNo, ips);
     assert(cachedIPs);
-    mTargetIp = (usingipv6 && ipv6.size()) ? ipv6 : ipv4;
+    mTargetIp = ips.size() ? ips.front() : "";
 
     const karere::Url &url = mDnsCache.getUrl(mShardNo);
     assert (url.isValid());
 
     setState(kStateConnecting);
-    CHATDS_LOG_DEBUG("Connecting to chatd using the IP: %s", mTargetIp.c_str());
+    CHATDS_LOG_DEBUG("Connecting to chatd using %zu IPs, preferred: %s", ips.size(), mTargetIp.c_str());
 
-    bool rt = wsConnect(mChatdClient.mKarereClient->websocketIO, mTargetIp.c_str(),
+    // the IP families race each other, in order of the last successful connection (if any)
+    bool rt = wsConnect(mChatdClient.mKarereClient->websocketIO, ips,
               url.host.c_str(),
               url.port,
               url.path.c_str(),
               url.isSecure);
 
-    if (!rt)    // immediate failure --> try the other IP family (if available)
+    if (!rt)    // immediate failure of every IP
     {
-        CHATDS_LOG_DEBUG("Connection to chatd failed using the IP: %s", mTargetIp.c_str());
-
-        string oldTargetIp = mTargetIp;
-        mTargetIp.clear();
-        if (oldTargetIp == ipv6 && ipv4.size())
-        {
-            mTargetIp = ipv4;
-        }
-        else if (oldTargetIp == ipv4 && ipv6.size())
-        {
-            mTargetIp = ipv6;
-        }
-
-        if (mTargetIp.size())
-        {
-            CHATDS_LOG_DEBUG("Retrying using the IP: %s", mTargetIp.c_str());
-            if (wsConnect(mChatdClient.mKarereClient->websocketIO, mTargetIp.c_str(),
-                                      url.host.c_str(),
-                                      url.port,
-                                      url.path.c_str(),
-                                      url.isSecure))
-            {
-                return;
-            }
-            CHATDS_LOG_DEBUG("Connection to chatd failed using the IP: %s", mTargetIp.c_str());
-        }
-        else
+        CHATDS_LOG_DEBUG("Connection to chatd failed using every IP");
+        if (ips.size() < 2)
         {
             // do not close the socket, which forces a new retry attempt and turns the DNS response obsolete
             // Instead, let the DNS request to complete, in order to refresh IPs
-            CHATDS_LOG_DEBUG("Empty cached IP. Waiting for DNS resolution...");
+            CHATDS_LOG_DEBUG("No other cached IP. Waiting for DNS resolution...");
             return;
         }
 
@@ -1156,6 +1134,21 @@ bool Connection::sendBuf(Buffer&& buf)
     return rc;
 }
 
+// Returns true if the socket has too much data pending to be written, so the caller must
+// stop sending. In that case, the output queues of the chats are flushed again once it's written
+bool Connection::throttleOutput()
+{
+    if (wsSendQueueSize() < kSendQueueHighWater)
+        return false;
+
+    if (!mOutputThrottled)
+    {
+        CHATDS_LOG_DEBUG("Socket busy, pausing the output of the chats");
+        mOutputThrottled = true;
+    }
+    return true;
+}
+
 bool Connection::sendCommand(Command&& cmd)
 {
     CHATDS_LOG_DEBUG("send %s", cmd.toString().c_str());
@@ -1776,6 +1769,11 @@ Chat::Chat(Connection& conn, Id chatid, Listener* listener,
     mLastReceivedId = info.lastRecvId;
     mLastSeenIdx = mDbInterface->getIdxOfMsgidFromHistory(mLastSeenId);
     mLastReceivedIdx = mDbInterface->getIdxOfMsgidFromHistory(mLastReceivedId);
+    if (info.hasUnreadCount)
+    {
+        mUnreadCount = info.unreadCount;
+        mUnreadCountValid = true;
+    }
     std::string reactionSn = mDbInterface->getReactionSn();
     if (!reactionSn.empty())
     {
@@ -1839,17 +1837,9 @@ Idx Chat::getHistoryFromDb(unsigned count)
 {
     assert(mHasMoreHistoryInDb); //we are within the db range
     std::vector<Message*> messages;
-    CALL_DB(fetchDbHistory, lownum()-1, count, messages);
+    CALL_DB(fetchDbHistoryPage, lownum()-1, count, messages);  // messages come with their reactions
     for (auto msg: messages)
     {
-        // Load msg reactions from cache
-        ::mega::multimap<std::string, karere::Id> reactions;
-        CALL_DB(getMessageReactions, msg->id(), reactions);
-        for (auto &it : reactions)
-        {
-            msg->addReaction(it.first, it.second);
-        }
-
         msgIncoming(false, msg, true); //increments mLastHistFetch/DecryptCount, may reset mHasMoreHistoryInDb if this msgid == mLastKnownMsgid
     }
     if (mNextHistFetchIdx == CHATD_IDX_INVALID)
@@ -1888,18 +1878,50 @@ void Connection::wsHandleMsgCb(char *data, size_t len)
     execCommand(StaticBuffer(data, len));
 }
 
+void Connection::wsHandleFrameCb(const std::shared_ptr<Buffer>& frame)
+{
+    mTsLastRecv = time(NULL);
+    execCommand(*frame, frame);
+}
+
 void Connection::wsSendMsgCb(const char *, size_t)
 {
     assert(!mSendPromise.done());
     mSendPromise.resolve();
+
+    if (mOutputThrottled)
+    {
+        resumeOutput();
+    }
+}
+
+void Connection::wsSendQueueCb(size_t queued)
+{
+    if (mOutputThrottled && queued < kSendQueueLowWater)
+    {
+        resumeOutput();
+    }
+}
+
+void Connection::resumeOutput()
+{
+    CHATDS_LOG_DEBUG("Socket output below %d bytes, resuming the output of the chats", kSendQueueLowWater);
+    mOutputThrottled = false;
+    for (auto& chatid: mChatIds)
+    {
+        mChatdClient.chats(chatid).flushOutputQueue();
+    }
 }
 
 // inbound command processing
 // multiple commands can appear as one WebSocket frame, but commands never cross frame boundaries
 // CHECK: is this assumption correct on all browsers and under all circumstances?
-void Connection::execCommand(const StaticBuffer& buf)
+void Connection::execCommand(const StaticBuffer& buf, std::shared_ptr<Buffer> frame)
 {
     size_t pos = 0;
+    // the messages reference their payload in the frame until they are decrypted, instead of
+    // allocating a buffer per message (i.e. a HIST response). If the frame is not given, it's
+    // owned by the websockets layer only during this call, and it's copied once if needed
 //IMPORTANT: Increment pos before calling the command handler, because the handler may throw, in which
 //case the next iteration will not advance and will execute the same command again, resulting in
 //infinite loop
@@ -1964,14 +1986,19 @@ void Connection::execCommand(const StaticBuffer& buf)
                 READ_16(updated, 28);
                 READ_32(keyid, 30);
                 READ_32(msglen, 34);
-                const char* msgdata = buf.readPtr(pos, msglen);
+                buf.readPtr(pos, msglen);   // check bounds
+                if (!frame)
+                {
+                    frame = std::make_shared<Buffer>(buf.buf(), buf.dataSize());
+                }
+                Buffer msgdata(frame, frame->buf() + pos, msglen);
                 pos += msglen;
 
                 CHATDS_LOG_DEBUG("%s: recv %s - msgid: '%s', from user '%s' with keyid %u, ts %u, tsdelta %u",
                     ID_CSTR(chatid), Command::opcodeToStr(opcode), ID_CSTR(msgid),
                     ID_CSTR(userid), keyid, ts, updated);
 
-                std::unique_ptr<Message> msg(new Message(msgid, userid, ts, updated, msgdata, msglen, false, keyid));
+                std::unique_ptr<Message> msg(new Message(msgid, userid, ts, updated, std::move(msgdata), false, keyid, Message::kMsgInvalid));
                 msg->setEncrypted(Message::kEncryptedPending);
                 Chat& chat = mChatdClient.chats(chatid);
                 if (opcode == OP_MSGUPD)
@@ -2431,6 +2458,7 @@ void Chat::onFetchHistDone()
             mHaveAllHistory = true;
             mAttachmentNodes->setHaveAllHistory(true);
             CALL_DB(setHaveAllHistory, true);
+            invalidateUnreadCount();    // the sign of the count depends on having all history
             CHATID_LOG_DEBUG("Start of history reached");
             //last text msg stuff
             if (mLastTextMsg.isFetching())
@@ -2573,6 +2601,7 @@ void Chat::clearHistory()
 {
     initChat();
     CALL_DB(clearHistory);
+    CALL_DB(clearUnreadCount);
     CALL_CRYPTO(onHistoryReload);
     CALL_LISTENER(onHistoryReloaded);
 }
@@ -2712,6 +2741,7 @@ void Chat::initChat()
 
     mOldestKnownMsgId = 0;
     mLastSeenIdx = CHATD_IDX_INVALID;
+    mUnreadCountValid = false;
     mLastReceivedIdx = CHATD_IDX_INVALID;
     mNextHistFetchIdx = CHATD_IDX_INVALID;
     mLastIdReceivedFromServer = 0;
@@ -3448,6 +3478,7 @@ void Chat::onLastSeen(Id msgid)
     {
         Idx oldLastSeenIdx = mLastSeenIdx;
         mLastSeenIdx = idx;
+        updateUnreadCountOnSeen(oldLastSeenIdx, mLastSeenIdx);
 
         //notify about messages that have become 'seen'
         Idx  notifyOldest = oldLastSeenIdx + 1;
@@ -3476,7 +3507,20 @@ bool Chat::setMessageSeen(Idx idx)
     if ((mLastSeenIdx != CHATD_IDX_INVALID) && (idx <= mLastSeenIdx))
         return false;
 
-    auto& msg = at(idx);
+    std::unique_ptr<Message> evictedMsg;
+    if (idx < lownum())  // evicted from RAM by the history window
+    {
+        std::vector<Message*> messages;
+        mDbInterface->fetchDbHistory(idx, 1, messages);
+        if (messages.empty())
+        {
+            CHATID_LOG_WARNING("setMessageSeen: message with idx %d not found in db", idx);
+            return false;
+        }
+        evictedMsg.reset(messages[0]);
+    }
+
+    const Message& msg = evictedMsg ? *evictedMsg : at(idx);
     if (msg.userid == mChatdClient.mMyHandle)
     {
         CHATID_LOG_DEBUG("Asked to mark own message %s as seen, ignoring", ID_CSTR(msg.id()));
@@ -3508,6 +3552,7 @@ bool Chat::setMessageSeen(Idx idx)
             Idx lowest = lownum()-1;
             notifyStart = (mLastSeenIdx < lowest) ? lowest : mLastSeenIdx;
         }
+        updateUnreadCountOnSeen(mLastSeenIdx, idx);
         mLastSeenIdx = idx;
         Idx highest = highnum();
         Idx notifyEnd = (mLastSeenIdx > highest) ? highest : mLastSeenIdx;
@@ -3532,16 +3577,58 @@ bool Chat::setMessageSeen(Idx idx)
 
 bool Chat::setMessageSeen(Id msgid)
 {
+    Idx idx;
     auto it = mIdToIndexMap.find(msgid);
-    if (it == mIdToIndexMap.end())
+    if (it != mIdToIndexMap.end())
     {
-        CHATID_LOG_WARNING("setMessageSeen: unknown msgid '%s'", ID_CSTR(msgid));
-        return false;
+        idx = it->second;
+    }
+    else    // the message may have been evicted from RAM by the history window
+    {
+        idx = mDbInterface->getIdxOfMsgidFromHistory(msgid);
+        if (idx == CHATD_IDX_INVALID)
+        {
+            CHATID_LOG_WARNING("setMessageSeen: unknown msgid '%s'", ID_CSTR(msgid));
+            return false;
+        }
     }
-    return setMessageSeen(it->second);
+    return setMessageSeen(idx);
+}
+
+Message* Chat::loadEvictedMsg(Id msgid, Idx& idx) const
+{
+    idx = CHATD_IDX_INVALID;
+    if (empty() || mIdToIndexMap.find(msgid) != mIdToIndexMap.end())
+    {
+        return nullptr;
+    }
+
+    Idx dbIdx = mDbInterface->getIdxOfMsgidFromHistory(msgid);
+    if (dbIdx == CHATD_IDX_INVALID || dbIdx >= lownum())
+    {
+        return nullptr;
+    }
+
+    std::vector<Message*> messages;
+    mDbInterface->fetchDbHistory(dbIdx, 1, messages);
+    if (messages.empty())
+    {
+        return nullptr;
+    }
+    idx = dbIdx;
+    return messages[0];
 }
 
 int Chat::unreadMsgCount() const
+{
+    if (!mUnreadCountValid)
+    {
+        setUnreadCount(calculateUnreadMsgCount());
+    }
+    return mUnreadCount;
+}
+
+int Chat::calculateUnreadMsgCount() const
 {
     if (mLastSeenIdx == CHATD_IDX_INVALID)
     {
@@ -3573,6 +3660,55 @@ int Chat::unreadMsgCount() const
     return count;
 }
 
+void Chat::setUnreadCount(int count) const
+{
+    if (mUnreadCountValid && mUnreadCount == count)
+    {
+        return;
+    }
+
+    mUnreadCount = count;
+    mUnreadCountValid = true;
+    CALL_DB(setUnreadCount, count);
+}
+
+void Chat::invalidateUnreadCount()
+{
+    if (!mUnreadCountValid)
+    {
+        return;
+    }
+
+    mUnreadCountValid = false;
+    CALL_DB(clearUnreadCount);
+}
+
+void Chat::updateUnreadCountOnSeen(Idx oldLastSeenIdx, Idx newLastSeenIdx)
+{
+    if (!mUnreadCountValid)
+    {
+        return;
+    }
+
+    // the messages that become seen must be loaded in RAM, otherwise count them again from db
+    if (oldLastSeenIdx == CHATD_IDX_INVALID || oldLastSeenIdx + 1 < lownum()
+            || newLastSeenIdx > highnum() || newLastSeenIdx < oldLastSeenIdx)
+    {
+        invalidateUnreadCount();
+        return;
+    }
+
+    int seenCount = 0;
+    for (Idx i = oldLastSeenIdx + 1; i <= newLastSeenIdx; i++)
+    {
+        if (at(i).isValidUnread(mChatdClient.myHandle()))
+        {
+            seenCount++;
+        }
+    }
+    setUnreadCount(mUnreadCount - seenCount);
+}
+
 void Chat::flushOutputQueue(bool fromStart)
 {
     if (!isLoggedIn())
@@ -3583,6 +3719,10 @@ void Chat::flushOutputQueue(bool fromStart)
 
     while (mNextUnsent != mSending.end())
     {
+        // pace the output to what the socket can take, it will be resumed once it's written
+        if (mConnection.throttleOutput())
+            return;
+
         //kickstart encryption
         //return true if we encrypted at least one message
         if (!msgEncryptAndSend(mNextUnsent++))
@@ -4056,6 +4196,7 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             idx = msgit->second;
             auto& histmsg = at(idx);
             unsigned char histType = histmsg.type;
+            bool wasUnread = histmsg.isValidUnread(client().myHandle());
 
             if ( (msg->type == Message::kMsgTruncate
                   && histmsg.type == msg->type
@@ -4097,6 +4238,19 @@ void Chat::onMsgUpdated(Message* cipherMsg)
                 histmsg.keyid = msg->keyid;
             }
 
+            if (mLastSeenIdx == CHATD_IDX_INVALID)
+            {
+                invalidateUnreadCount();
+            }
+            else if (mUnreadCountValid && idx > mLastSeenIdx)
+            {
+                bool isUnread = histmsg.isValidUnread(client().myHandle());
+                if (isUnread != wasUnread)
+                {
+                    setUnreadCount(mUnreadCount + (isUnread ? 1 : -1));
+                }
+            }
+
             if (idx > mNextHistFetchIdx)
             {
                 // msg.ts is zero - chatd doesn't send the original timestamp
@@ -4154,6 +4308,7 @@ void Chat::onMsgUpdated(Message* cipherMsg)
             {
                 //update in db
                 CALL_DB(updateMsgInHistory, msg->id(), *msg);
+                invalidateUnreadCount();
             }
 
             if (msg->isDeleted()) // previous type is unknown, so cannot check for attachment type here
@@ -4199,6 +4354,7 @@ void Chat::handleTruncate(const Message& msg, Idx idx)
     CHATID_LOG_DEBUG("Truncating chat history before msgid %s, idx %d, fwdStart %d", ID_CSTR(msg.id()), idx, mForwardStart);
     CALL_CRYPTO(resetSendKey);      // discard current key, if any
     CALL_DB(truncateHistory, msg);
+    invalidateUnreadCount();
     if (idx != CHATD_IDX_INVALID)   // message is loaded in RAM
     {
         //GUI must detach and free any resources associated with
@@ -4282,6 +4438,10 @@ Id Chat::makeRandomId()
 void Chat::deleteMessagesBefore(Idx idx)
 {
     //delete everything before idx, but not including idx
+    for (Idx i = lownum(); i < idx; i++)
+    {
+        mCrypto->msgDiscarded(at(i));
+    }
     if (idx > mForwardStart)
     {
         mBackwardList.clear();
@@ -4295,6 +4455,48 @@ void Chat::deleteMessagesBefore(Idx idx)
     }
 }
 
+void Chat::trimHistoryWindow()
+{
+    unsigned window = mChatdClient.historyWindow();
+    if (!window || (unsigned)size() <= window
+            || mChatdClient.mKarereClient->isChatRoomOpened(mChatId)
+            || isFetchingFromServer()
+            || mDecryptNewHaltedAt != CHATD_IDX_INVALID
+            || mDecryptOldHaltedAt != CHATD_IDX_INVALID)
+    {
+        return;
+    }
+
+    Idx newLow = highnum() - (Idx)window + 1;
+    for (Idx i = lownum(); i < newLow; i++)
+    {
+        if (at(i).isPendingToDecrypt())  // not saved to db yet
+        {
+            newLow = i;
+            break;
+        }
+    }
+    if (newLow <= lownum())
+    {
+        return;
+    }
+
+    CHATID_LOG_DEBUG("Evicting %d messages from RAM history (idx %d - %d)", newLow - lownum(), lownum(), newLow - 1);
+    removePendingRichLinks(newLow - 1);
+    for (Idx i = lownum(); i < newLow; i++)
+    {
+        const Message& msg = at(i);
+        mIdToIndexMap.erase(msg.id());
+        if (msg.backRefId)
+        {
+            mRefidToIdxMap.erase(msg.backRefId);
+        }
+    }
+    deleteMessagesBefore(newLow);
+    mHasMoreHistoryInDb = true;
+    resetGetHistory();  // the app is not browsing the history, it will start from the newest message again
+}
+
 Message::Status Chat::getMsgStatus(const Message& msg, Idx idx) const
 {
     assert(idx != CHATD_IDX_INVALID);
@@ -4437,6 +4639,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
                 if (message->isEncrypted() != Message::kEncryptedNoType)
                 {
                     CALL_DB(updateMsgInHistory, message->id(), *message);   // update 'data' & 'is_encrypted'
+                    invalidateUnreadCount();
                 }
                 msgIncomingAfterDecrypt(isNew, true, *message, idx);
             })
@@ -4463,6 +4666,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
             "Queued messages for decrypt: %d - %d. Ignoring", e.what(),
             mDecryptOldHaltedAt, idx);
         msg.setEncrypted(Message::kEncryptedNoKey);
+        msg.unshare();  // it won't be decrypted, don't keep the received frame alive
         return true;
     }
 
@@ -4477,6 +4681,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         if (mDecryptNewHaltedAt != CHATD_IDX_INVALID)
         {
             CHATID_LOG_DEBUG("Decryption of new messages is halted, message queued for decryption");
+            mCrypto->msgDecryptAhead(&msg);
             return false;
         }
     }
@@ -4485,6 +4690,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
         if (mDecryptOldHaltedAt != CHATD_IDX_INVALID)
         {
             CHATID_LOG_DEBUG("Decryption of old messages is halted, message queued for decryption");
+            mCrypto->msgDecryptAhead(&msg);
             return false;
         }
     }
@@ -4563,6 +4769,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
             auto first = mDecryptNewHaltedAt + 1;
             mDecryptNewHaltedAt = CHATD_IDX_INVALID;
             auto last = highnum();
+            decryptBatch(true, first, last);
             for (Idx i = first; i <= last; i++)
             {
                 if (!msgIncomingAfterAdd(isNew, false, at(i), i))
@@ -4586,6 +4793,7 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
             auto first = mDecryptOldHaltedAt - 1;
             mDecryptOldHaltedAt = CHATD_IDX_INVALID;
             auto last = lownum();
+            decryptBatch(false, first, last);
             for (Idx i = first; i >= last; i--)
             {
                 if (!msgIncomingAfterAdd(isNew, false, at(i), i))
@@ -4622,6 +4830,31 @@ bool Chat::msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx)
     return false; //decrypt was not done immediately
 }
 
+void Chat::decryptBatch(bool isNew, Idx first, Idx last)
+{
+    std::vector<Message*> msgs;
+    if (isNew ? (first > last) : (first < last))
+    {
+        return;
+    }
+    for (Idx i = first; ; i += isNew ? 1 : -1)
+    {
+        Message& msg = at(i);
+        if (msg.isPendingToDecrypt())
+        {
+            msgs.push_back(&msg);
+        }
+        if (i == last)
+        {
+            break;
+        }
+    }
+    if (msgs.size() > 1)
+    {
+        mCrypto->msgDecryptBatch(msgs);
+    }
+}
+
 // Save to history db, handle received and seen pointers, call new/old message user callbacks
 void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx)
 {
@@ -4634,6 +4867,7 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
     if (!isLocal)
     {
         assert(!msg.isPendingToDecrypt()); //either decrypted or error
+        msg.unshare();  // if undecryptable, it still references the received frame
         if (!msg.empty() && msg.type == Message::kMsgNormal && (*msg.buf() == 0)) //'special' message - attachment etc
         {
             if (msg.dataSize() < 2)
@@ -4649,6 +4883,15 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
         }
         CALL_DB(addMsgToHistory, msg, idx);
 
+        if (mLastSeenIdx == CHATD_IDX_INVALID)
+        {
+            invalidateUnreadCount();
+        }
+        else if (mUnreadCountValid && idx > mLastSeenIdx && msg.isValidUnread(mChatdClient.myHandle()))
+        {
+            setUnreadCount(mUnreadCount + 1);
+        }
+
         if (mChatdClient.isMessageReceivedConfirmationActive() && !isGroup() &&
                 (msg.userid != mChatdClient.mMyHandle) && // message is not ours
                 ((mLastIdxReceivedFromServer == CHATD_IDX_INVALID) ||   // no local history
@@ -4716,6 +4959,11 @@ void Chat::msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx i
             notifyLastTextMsg();
         }
     }
+
+    if (isNew && !isLocal)
+    {
+        trimHistoryWindow();
+    }
 }
 
 bool Chat::msgNodeHistIncoming(Message *msg)
@@ -12,6 +12,7 @@
 #include <base/timers.hpp>
 #include <base/trackDelete.h>
 #include <chatdMsg.h>
+#include <idMap.h>
 #include <url.h>
 #include <net/websocketsIO.h>
 #include <userAttrCache.h>
@@ -414,7 +415,9 @@ public:
     {
         kIdleTimeout = 64,      // (in seconds) chatd closes connection after 48-64s of not receiving a response
         kEchoTimeout = 1,       // (in seconds) echo to check connection is alive when back to foreground
-        kConnectTimeout = 30    // (in seconds) timeout reconnection to succeeed
+        kConnectTimeout = 30,   // (in seconds) timeout reconnection to succeeed
+        kSendQueueHighWater = 256 * 1024,  // (in bytes) output pending to be written to the socket above which chats stop flushing their output queue
+        kSendQueueLowWater = kSendQueueHighWater / 2    // (in bytes) output pending below which chats resume flushing, before the socket runs dry
     };
 
 protected:
@@ -438,12 +441,9 @@ protected:
     /** When enabled, hearbeat() method is called periodically */
     bool mHeartbeatEnabled = false;
 
-    /** Target IP address being used for the reconnection in-flight */
+    /** Preferred IP of the reconnection in-flight, or the one that won the race once connected */
     std::string mTargetIp;
 
-    /** ip version to try first (both are tried) */
-    bool usingipv6 = false;
-
     /** RetryController that manages the reconnection's attempts */
     std::unique_ptr<karere::rh::IRetryController> mRetryCtrl;
 
@@ -464,25 +464,33 @@ protected:
     /** This promise is resolved when output data is written to the sockets */
     promise::Promise<void> mSendPromise;
 
+    /** Set when a chat stopped flushing its output queue because the socket was busy.
+     * The output queues are flushed again once the data pending is below kSendQueueLowWater */
+    bool mOutputThrottled = false;
+
     // ---- callbacks called from libwebsocketsIO ----
     virtual void wsConnectCb();
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     virtual void wsHandleMsgCb(char *data, size_t len);
+    virtual void wsHandleFrameCb(const std::shared_ptr<Buffer>& frame);
     virtual void wsSendMsgCb(const char *data, size_t len);
+    virtual void wsSendQueueCb(size_t queued);
 
     void onSocketClose(int ercode, int errtype, const std::string& reason);
     promise::Promise<void> reconnect();
     void abortRetryController();
     void disconnect();
+    void resumeOutput();
     void doConnect();
 // Destroys the buffer content
     bool sendBuf(Buffer&& buf);
+    bool throttleOutput();
     bool rejoinExistingChats();
     void resendPending();
     void join(karere::Id chatid);
     void hist(karere::Id chatid, long count);
     bool sendCommand(Command&& cmd); // used internally only for OP_HELLO
-    void execCommand(const StaticBuffer& buf);
+    void execCommand(const StaticBuffer& buf, std::shared_ptr<Buffer> frame = nullptr);
     promise::Promise<void> sendKeepalive();
     void sendEcho();
     void sendCallReqDeclineNoSupport(karere::Id chatid, karere::Id callid);
@@ -754,11 +762,15 @@ protected:
     OutputQueue mSending;
     OutputQueue::iterator mNextUnsent;
     bool mIsFirstJoin = true;
-    std::map<karere::Id, Idx> mIdToIndexMap;
+    karere::IdMap<karere::Id, Idx> mIdToIndexMap;
     karere::Id mLastReceivedId;
     Idx mLastReceivedIdx = CHATD_IDX_INVALID;
     karere::Id mLastSeenId;
     Idx mLastSeenIdx = CHATD_IDX_INVALID;
+    /// Cached value of unreadMsgCount(), maintained as messages are received, edited
+    /// or seen, and persisted in db. Only valid if \c mUnreadCountValid is true
+    mutable int mUnreadCount = 0;
+    mutable bool mUnreadCountValid = false;
     Idx mLastSeenInFlightIdx = CHATD_IDX_INVALID;
     Idx mLastIdxReceivedFromServer = CHATD_IDX_INVALID;
     karere::Id mLastIdReceivedFromServer;
@@ -840,8 +852,8 @@ protected:
     /** Indicates the reaction sequence number for this chatroom */
     karere::Id mReactionSn = karere::Id::inval();
     // ====
-    std::map<karere::Id, Message*> mPendingEdits;
-    std::map<BackRefId, Idx> mRefidToIdxMap;
+    karere::IdMap<karere::Id, Message*> mPendingEdits;
+    karere::IdMap<BackRefId, Idx> mRefidToIdxMap;
     Chat(Connection& conn, karere::Id chatid, Listener* listener,
     const karere::SetOfIds& users, uint32_t chatCreationTs, ICrypto* crypto, bool isGroup);
     void push_forward(Message* msg) { mForwardList.emplace_back(msg); }
@@ -857,6 +869,9 @@ protected:
     Message* msgRemoveFromSending(karere::Id msgxid, karere::Id msgid);
     Idx msgIncoming(bool isNew, Message* msg, bool isLocal=false);
     bool msgIncomingAfterAdd(bool isNew, bool isLocal, Message& msg, Idx idx);
+    /** @brief Passes the messages queued for decryption, from \c first to \c last (in the
+     * order they will be decrypted), to ICrypto::msgDecryptBatch() */
+    void decryptBatch(bool isNew, Idx first, Idx last);
     void msgIncomingAfterDecrypt(bool isNew, bool isLocal, Message& msg, Idx idx);
     bool msgNodeHistIncoming(Message* msg);
     void onUserJoin(karere::Id userid, Priv priv);
@@ -874,6 +889,10 @@ protected:
     void onLastReceived(karere::Id msgid);
     void onLastSeen(karere::Id msgid);
     void handleLastReceivedSeen(karere::Id msgid);
+    int calculateUnreadMsgCount() const;
+    void setUnreadCount(int count) const;
+    void invalidateUnreadCount();
+    void updateUnreadCountOnSeen(Idx oldLastSeenIdx, Idx newLastSeenIdx);
     bool msgSend(const Message& message);
     void setOnlineState(ChatState state);
     SendingItem* postMsgToSending(uint8_t opcode, Message* msg, karere::SetOfIds recipients);
@@ -974,7 +993,7 @@ public:
       *  This can be used by the app to replace the text of messages who have
       * been edited before they have been sent/confirmed. Normally the app needs
       * to display the edited text in the unsent message.*/
-    const std::map<karere::Id, Message*>& pendingEdits() const { return mPendingEdits; }
+    const karere::IdMap<karere::Id, Message*>& pendingEdits() const { return mPendingEdits; }
 
     /** @brief Whether the listener will be notified upon receiving
      * old history messages from the server.
@@ -1144,6 +1163,16 @@ public:
      */
     bool setMessageSeen(karere::Id msgid);
 
+    /**
+     * @brief Loads from the db a message that has been evicted from RAM by the history window
+     * (see Client::setHistoryWindow)
+     * @param msgid The message id
+     * @param idx Output parameter, the index of the message
+     * @return A new message owned by the caller, or NULL if the msgid is not in the db or the
+     * message is still loaded in RAM
+     */
+    Message* loadEvictedMsg(karere::Id msgid, Idx& idx) const;
+
     /** @brief The last-seen-by-us pointer */
     Idx lastSeenIdx() const { return mLastSeenIdx; }
 
@@ -1204,6 +1233,8 @@ public:
       * as more history is fetched from server.
       * Example 1: Client has 1 message pre-fetched and its msgid is the same
       * as the last-seen-msgid. The count will be returned as 0.
+      * The count is cached and updated as messages are received, edited or seen,
+      * so the history is only counted again when the cached value is invalidated.
       */
     int unreadMsgCount() const;
 
@@ -1241,6 +1272,13 @@ public:
      * history retrieval starts from the beginning.
      */
     void resetListenerState();
+    /**
+     * @brief Evicts the oldest messages from RAM, so at most Client::historyWindow()
+     * messages are kept loaded. It does nothing while the chat is opened by the app,
+     * or while history is being fetched or decrypted. Evicted messages remain in the
+     * local db, and are loaded again from there when history is requested.
+     */
+    void trimHistoryWindow();
     /**
      * @brief getMsgByXid searches the send queue for a message with the specified
      * msgxid. The message is supposed to be unconfirmed, but in reality the
@@ -1374,6 +1412,9 @@ protected:
 
     bool mMessageReceivedConfirmation = false;
 
+    // max number of messages kept in RAM for chats not opened by the app (0 means no limit)
+    unsigned mHistoryWindow = kDefaultHistoryWindow;
+
     // value of richPreview's user-attribute
     uint8_t mRichLinkState = kRichLinkNotDefined;
 
@@ -1411,6 +1452,7 @@ public:
     ~Client();
 
     enum: uint8_t { kRichLinkNotDefined = 0,  kRichLinkEnabled = 1, kRichLinkDisabled = 2};
+    enum: unsigned { kDefaultHistoryWindow = 0 };
 
     MyMegaApi *mApi;
     karere::Client *mKarereClient;
@@ -1451,6 +1493,15 @@ public:
     // True if clients send confirmation to chatd when they receive a new message
     bool isMessageReceivedConfirmationActive() const;
 
+    /** @brief Sets the max number of messages kept in RAM for chats that are not opened by the app.
+     * Older messages are evicted from RAM, and loaded again from the local db when the history is
+     * requested. Zero (the default) means no limit.
+     * @note Lookups by msgid of evicted messages that go through msgIndexFromId() fail until
+     * they are loaded again. Chat::setMessageSeen(msgid) and Chat::loadEvictedMsg() fall back
+     * to the db. */
+    void setHistoryWindow(unsigned count) { mHistoryWindow = count; }
+    unsigned historyWindow() const { return mHistoryWindow; }
+
     // The timestamps of the most recent message from userid
     mega::m_time_t getLastMsgTs(karere::Id userid) const;
     void setLastMsgTs(karere::Id userid, mega::m_time_t lastMsgTs);
@@ -1480,6 +1531,8 @@ struct ChatDbInfo
     Idx newestDbIdx;
     karere::Id lastSeenId;
     karere::Id lastRecvId;
+    int unreadCount;
+    bool hasUnreadCount;    // false if the unread count was not persisted, or was invalidated
 };
 
 class DbInterface
@@ -1501,6 +1554,16 @@ public:
     */
     virtual void fetchDbHistory(Idx startIdx, unsigned count, std::vector<Message*>& messages) = 0;
 
+    /**
+    * @brief Same as \c fetchDbHistory(), but the returned messages already have their
+    * reactions attached, so loading a page of history doesn't require a query per message
+    *
+    * @param startIdx - the start index of the requested history range
+    * @param count - the number of messages to return
+    * @param [out] messages - Same order and semantics than in \c fetchDbHistory()
+    */
+    virtual void fetchDbHistoryPage(Idx startIdx, unsigned count, std::vector<Message*>& messages) = 0;
+
     /// adds a message to the history buffer at the specified \c idx
     virtual void addMsgToHistory(const Message& msg, Idx idx) = 0;
 
@@ -1563,6 +1626,10 @@ public:
 
     virtual void setLastSeen(karere::Id msgid) = 0;
     virtual void setLastReceived(karere::Id msgid) = 0;
+    /// Persist the cached unread count of the chat, so it's available at startup without counting the history
+    virtual void setUnreadCount(int count) = 0;
+    /// Discard the persisted unread count, it will be recalculated from the history
+    virtual void clearUnreadCount() = 0;
 
     virtual void setChatVar (const char *name, bool value) = 0;
     virtual bool chatVar (const char *name) = 0;
@@ -2,6 +2,7 @@
 #define CHATD_DB_H
 
 #include "db.h"
+#include "dbStatements.h"
 #include "chatd.h"
 //extern sqlite3* db;
 
@@ -17,7 +18,7 @@ public:
         :mDb(db), mChat(chat), mSendingTblName(sendingTblName), mHistTblName(histTblName){}
     virtual void getHistoryInfo(chatd::ChatDbInfo& info)
     {
-        SqliteStmt stmt(mDb, "select min(idx), max(idx) from history where chatid=?1");
+        SqliteStmt stmt(mDb, karere::sql::kHistoryIdxRange);
         stmt.bind(mChat.chatId()).step(); //will always return a row, even if table empty
         auto minIdx = stmt.intCol(0); //WARNING: the chatd implementation uses uint32_t values for idx.
         info.newestDbIdx = stmt.intCol(1);
@@ -26,7 +27,7 @@ public:
             memset(&info, 0, sizeof(info)); //actually need to zero only oldestDbId
             return;
         }
-        SqliteStmt stmt2(mDb, "select msgid from "+mHistTblName+" where chatid=?1 and idx=?2");
+        SqliteStmt stmt2(mDb, karere::sql::histMsgidAtIdx(mHistTblName));
         stmt2 << mChat.chatId() << minIdx;
         stmt2.stepMustHaveData();
         info.oldestDbId = stmt2.uint64Col(0);
@@ -39,15 +40,20 @@ public:
             CHATD_LOG_WARNING("Db: Newest msgid in db is null, telling chatd we don't have local history");
             info.oldestDbId = 0;
         }
-        SqliteStmt stmt3(mDb, "select last_seen, last_recv from chats where chatid=?");
+        SqliteStmt stmt3(mDb, karere::sql::kChatReadState);
         stmt3 << mChat.chatId();
         stmt3.stepMustHaveData();
         info.lastSeenId = stmt3.uint64Col(0);
         info.lastRecvId = stmt3.uint64Col(1);
+        info.hasUnreadCount = (sqlite3_column_type(stmt3, 2) != SQLITE_NULL);
+        info.unreadCount = info.hasUnreadCount ? stmt3.intCol(2) : 0;
     }
     void assertAffectedRowCount(int count, const char* opname=nullptr)
     {
-        auto actual = sqlite3_changes(mDb);
+        if (mDb.isWriteBehind())
+            return; // the write may still be queued, checking it would execute it in this thread
+
+        auto actual = mDb.changes();
         if (actual == count)
             return;
         std::string msg;
@@ -62,8 +68,7 @@ public:
     void addMessage(const chatd::Message& msg, chatd::Idx idx, const std::string& table)
     {
 #ifndef NDEBUG
-        std::string checkQuery = "select min(idx), max(idx), count(*) from " + table + " where chatid = ?";
-        SqliteStmt stmt(mDb, checkQuery.c_str());
+        SqliteStmt stmt(mDb, karere::sql::histRange(table));
         stmt << mChat.chatId();
         stmt.step();
         int low = stmt.intCol(0);
@@ -79,8 +84,7 @@ public:
             assert(false);
         }
 #endif
-        std::string query = "insert into " + table + " (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) " +
-                                                     "values(?,?,?,?,?,?,?,?,?,?,?)";
+        std::string query = karere::sql::histInsert(table);
         mDb.query(query.c_str(), idx, mChat.chatId(), msg.id(), msg.keyid,
             msg.type, msg.userid, msg.ts, msg.updated, msg, msg.backRefId, msg.isEncrypted());
     }
@@ -98,21 +102,20 @@ public:
         Buffer rcpts;
         item.recipients.save(rcpts);
 
-        mDb.query("insert into sending (chatid, opcode, ts, msgid, msg, type, updated, "
-                         "recipients, backrefid, backrefs) values(?,?,?,?,?,?,?,?,?,?)",
+        mDb.query(karere::sql::kSendingInsert,
             (uint64_t)mChat.chatId(), opcode, msg->ts, msg->id(),
             *msg, msg->type, msg->updated, rcpts, msg->backRefId, msg->backrefBuf());
 
         // assign the given rowid to the SendingItem
-        item.rowid = sqlite3_last_insert_rowid(mDb);
+        item.rowid = mDb.lastInsertRowid();
     }
 
     virtual int updateSendingItemsKeyid(chatd::KeyId localkeyid, chatd::KeyId keyid)
     {
-        mDb.query("update sending set keyid = ?, key_cmd = ? where keyid = ? and chatid = ?",
+        mDb.query(karere::sql::kSendingUpdateKeyid,
                   keyid, StaticBuffer(nullptr, 0), localkeyid, mChat.chatId());
 
-        return sqlite3_changes(mDb);
+        return mDb.changes();
     }
 
     virtual void addBlobsToSendingItem(uint64_t rowid,
@@ -121,7 +124,7 @@ public:
         // possible values of `keyid`:
         // - NEWMSG/MSGUPDX: local keyxid = rowid of the KeyCmd related to this MsgCmd
         // - MSGUPD: chat keyid (already confirmed)
-        mDb.query("update sending set keyid=?, msg_cmd=?, key_cmd=? where rowid=?",
+        mDb.query(karere::sql::kSendingSetBlobs,
                   keyid, msgCmd->msg(),
                   keyCmd ? keyCmd->keyblob() : StaticBuffer(nullptr, 0),
                   rowid);
@@ -130,22 +133,21 @@ public:
 
     virtual int updateSendingItemsMsgidAndOpcode(karere::Id msgxid, karere::Id msgid)
     {
-        mDb.query(
-            "update sending set opcode=?, msgid=? where chatid=? and opcode=? and msgid=?",
+        mDb.query(karere::sql::kSendingConfirmEdit,
             chatd::OP_MSGUPD, msgid, mChat.chatId(), chatd::OP_MSGUPDX, msgxid);
-        return sqlite3_changes(mDb);
+        return mDb.changes();
     }
 
     virtual void deleteSendingItem(uint64_t rowid)
     {
-        mDb.query("delete from sending where rowid = ?1", rowid);
+        mDb.query(karere::sql::kSendingDelete, rowid);
         assertAffectedRowCount(1, "deleteSendingItem");
     }
     virtual int updateSendingItemsContentAndDelta(const chatd::Message& msg)
     {
-        mDb.query("update sending set msg = ?, updated = ? where msgid = ? and chatid = ?",
+        mDb.query(karere::sql::kSendingUpdateContent,
                   msg, msg.updated, msg.id(), mChat.chatId());
-        return sqlite3_changes(mDb);
+        return mDb.changes();
     }
     virtual void addMsgToHistory(const chatd::Message& msg, chatd::Idx idx)
     {
@@ -155,12 +157,12 @@ public:
     {
         if (msg.type == chatd::Message::kMsgTruncate)
         {
-            mDb.query("update history set type = ?, data = ?, ts = ?, userid = ?, keyid = ? where chatid = ? and msgid = ?",
+            mDb.query(karere::sql::kHistoryUpdateTruncate,
                 msg.type, msg, msg.ts, msg.userid, msg.keyid, mChat.chatId(), msgid);
         }
         else    // "updated" instead of "ts"
         {
-            mDb.query("update history set type = ?, data = ?, updated = ?, userid = ?, is_encrypted = ? where chatid = ? and msgid = ?",
+            mDb.query(karere::sql::kHistoryUpdateMsg,
                 msg.type, msg, msg.updated, msg.userid, msg.isEncrypted(), mChat.chatId(), msgid);
         }
         assertAffectedRowCount(1, "updateMsgInHistory");
@@ -168,7 +170,7 @@ public:
 
     virtual void getMessageDelta(karere::Id msgid, uint16_t *updated)
     {
-        SqliteStmt stmt3(mDb, "select updated from history where chatid = ? and msgid = ?");
+        SqliteStmt stmt3(mDb, karere::sql::kHistoryMsgDelta);
         stmt3 << mChat.chatId() << msgid;
         stmt3.stepMustHaveData();
         *updated = stmt3.intCol(0);
@@ -176,9 +178,7 @@ public:
 
     virtual void loadSendQueue(chatd::Chat::OutputQueue& queue)
     {
-        SqliteStmt stmt(mDb, "select rowid, opcode, msgid, keyid, msg, type, "
-            "ts, updated, backrefid, backrefs, recipients, msg_cmd, key_cmd "
-            "from sending where chatid=? order by rowid asc");
+        SqliteStmt stmt(mDb, karere::sql::kSendingLoad);
         stmt << mChat.chatId();
 
         // Fill the sending queue with SendingItems from DB
@@ -248,10 +248,29 @@ public:
         loadMessages(count, idx, messages, "history");
     }
 
+    virtual void fetchDbHistoryPage(chatd::Idx idx, unsigned count, std::vector<chatd::Message*>& messages)
+    {
+        size_t first = messages.size();
+        loadMessages(count, idx, messages, "history");
+        size_t loaded = messages.size() - first;
+        if (!loaded)
+            return;
+
+        // load the reactions of the whole page in a single query
+        SqliteStmt stmt(mDb, karere::sql::kHistoryPageReactions);
+        stmt << mChat.chatId() << idx << (chatd::Idx)(idx - loaded);
+        while (stmt.step())
+        {
+            chatd::Idx msgIdx = stmt.intCol(0);
+            size_t pos = first + (idx - msgIdx);   // messages are sorted from newest to oldest
+            assert(pos < messages.size());
+            messages[pos]->addReaction(stmt.stringCol(1), stmt.uint64Col(2));
+        }
+    }
+
     virtual chatd::Idx getIdxOfMsgid(karere::Id msgid, const std::string &table)
     {
-        std::string query = "select idx from " + table + " where chatid = ? and msgid = ?";
-        SqliteStmt stmt(mDb, query.c_str());
+        SqliteStmt stmt(mDb, karere::sql::histIdxOfMsgid(table));
         stmt << mChat.chatId() << msgid;
         return (stmt.step()) ? stmt.int64Col(0) : CHATD_IDX_INVALID;
     }
@@ -263,13 +282,9 @@ public:
     virtual chatd::Idx getUnreadMsgCountAfterIdx(chatd::Idx idx)
     {
         // get the unread messages count --> conditions should match the ones in Message::isValidUnread()
-        std::string sql = "select count(*) from history where (chatid = ?1)"
-                "and (userid != ?2)"
-                "and not (updated != 0 and length(data) = 0)"
-                "and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)"
-                "and (type = ?6 or type = ?7 or type = ?8 or type = ?9 or type = ?10)";
+        std::string sql = karere::sql::kHistoryUnreadCount;
         if (idx != CHATD_IDX_INVALID)
-            sql+=" and (idx > ?)";
+            sql += karere::sql::kHistoryUnreadCountAfterIdx;
 
         SqliteStmt stmt(mDb, sql);
         stmt << mChat.chatId() << mChat.client().myHandle()   // skip own messages
@@ -289,15 +304,13 @@ public:
     virtual void saveItemToManualSending(const chatd::Chat::SendingItem& item, int reason)
     {
         auto& msg = *item.msg;
-        mDb.query("insert into manual_sending(chatid, rowid, msgid, type, "
-            "ts, updated, msg, opcode, reason) values(?,?,?,?,?,?,?,?,?)",
+        mDb.query(karere::sql::kManualSendingInsert,
             mChat.chatId(), item.rowid, item.msg->id(), msg.type, msg.ts,
             msg.updated, msg, item.opcode(), reason);
     }
     virtual void loadManualSendItems(std::vector<chatd::Chat::ManualSendItem>& items)
     {
-        SqliteStmt stmt(mDb, "select rowid, msgid, type, ts, updated, msg, opcode, "
-            "reason from manual_sending where chatid=? order by rowid asc");
+        SqliteStmt stmt(mDb, karere::sql::kManualSendingLoad);
         stmt << mChat.chatId();
         while(stmt.step())
         {
@@ -311,13 +324,12 @@ public:
     }
     virtual bool deleteManualSendItem(uint64_t rowid)
     {
-        mDb.query("delete from manual_sending where rowid = ?", rowid);
-        return sqlite3_changes(mDb) != 0;
+        mDb.query(karere::sql::kManualSendingDelete, rowid);
+        return mDb.changes() != 0;
     }
     virtual void loadManualSendItem(uint64_t rowid, chatd::Chat::ManualSendItem& item)
     {
-        SqliteStmt stmt(mDb, "select msgid, type, ts, updated, msg, opcode, "
-            "reason from manual_sending where chatid=? and rowid=?");
+        SqliteStmt stmt(mDb, karere::sql::kManualSendingLoadItem);
         stmt << mChat.chatId() << rowid;
         stmt.stepMustHaveData("load manual sending item");
 
@@ -336,13 +348,13 @@ public:
         auto idx = getIdxOfMsgidFromHistory(msg.id());
         if (idx == CHATD_IDX_INVALID)
             throw std::runtime_error("dbInterface::truncateHistory: msgid "+msg.id().toString()+" does not exist in db");
-        mDb.query("delete from history where chatid = ? and idx < ?", mChat.chatId(), idx);
+        mDb.query(karere::sql::kHistoryTruncate, mChat.chatId(), idx);
 
         // Clean reactions for the truncate message
-        mDb.query("delete from chat_reactions where chatid = ? and msgid = ?", mChat.chatId(), msg.id());
+        mDb.query(karere::sql::kReactionsClean, mChat.chatId(), msg.id());
 
 #ifndef NDEBUG
-        SqliteStmt stmt(mDb, "select type from history where chatid=? and msgid=?");
+        SqliteStmt stmt(mDb, karere::sql::kHistoryMsgType);
         stmt << mChat.chatId() << msg.id();
         stmt.step();
         if (stmt.intCol(0) != chatd::Message::kMsgTruncate)
@@ -351,43 +363,45 @@ public:
     }
     virtual chatd::Idx getOldestIdx()
     {
-        SqliteStmt stmt(mDb, "select min(idx) from history where chatid = ?");
+        SqliteStmt stmt(mDb, karere::sql::kHistoryOldestIdx);
         stmt << mChat.chatId();
         stmt.stepMustHaveData(__FUNCTION__);
         return stmt.uint64Col(0);
     }
     virtual void setLastSeen(karere::Id msgid)
     {
-        mDb.query("update chats set last_seen=? where chatid=?", msgid, mChat.chatId());
+        mDb.query(karere::sql::kChatSetLastSeen, msgid, mChat.chatId());
         assertAffectedRowCount(1, "setLastSeen");
     }
     virtual void setLastReceived(karere::Id msgid)
     {
-        mDb.query("update chats set last_recv=? where chatid=?", msgid, mChat.chatId());
+        mDb.query(karere::sql::kChatSetLastRecv, msgid, mChat.chatId());
         assertAffectedRowCount(1);
     }
+    virtual void setUnreadCount(int count)
+    {
+        mDb.query(karere::sql::kChatSetUnreadCount, count, mChat.chatId());
+    }
+    virtual void clearUnreadCount()
+    {
+        mDb.query(karere::sql::kChatClearUnreadCount, mChat.chatId());
+    }
 
     virtual void setHaveAllHistory(bool haveAllHistory)
     {
-        mDb.query(
-            "insert or replace into chat_vars(chatid, name, value) "
-            "values(?, 'have_all_history', ?)", mChat.chatId(), haveAllHistory ? 1 : 0);
+        mDb.query(karere::sql::kHaveAllHistorySet, mChat.chatId(), haveAllHistory ? 1 : 0);
         assertAffectedRowCount(1, "setHaveAllHistory");
     }
     virtual bool haveAllHistory()
     {
-        SqliteStmt stmt(mDb,
-            "select value from chat_vars where chatid=? and name='have_all_history' and value='1'");
+        SqliteStmt stmt(mDb, karere::sql::kHaveAllHistoryGet);
         stmt << mChat.chatId();
         return stmt.step();
     }
 
     virtual void getLastTextMessage(chatd::Idx from, chatd::LastTextMsgState& msg, uint32_t& lastTs)
     {
-        SqliteStmt stmt(mDb,
-            "select type, idx, data, msgid, userid, ts from history where chatid=?1 and "
-            "(length(data) > 0 OR type = ?2) and type != ?3  and type != ?4 and (idx <= ?5)"
-            "order by idx desc limit 1");
+        SqliteStmt stmt(mDb, karere::sql::kHistoryLastTextMsg);
         stmt << mChat.chatId()
              << chatd::Message::kMsgTruncate
              << chatd::Message::kMsgRevokeAttachment
@@ -401,7 +415,7 @@ public:
             msg.clear();    // any existing last-msg is now obsolete
 
             // reset the last-ts to the chat creation's ts
-            SqliteStmt stmt(mDb, "select ts_created from chats where chatid=?");
+            SqliteStmt stmt(mDb, karere::sql::kChatCreationTs);
             stmt << mChat.chatId();
             stmt.stepMustHaveData();
             lastTs = int(stmt.uint64Col(0));
@@ -416,17 +430,14 @@ public:
     //Insert a new chat var related to a chat. This function receives as parameters the var name and it's value
     virtual void setChatVar(const char *name, bool value)
     {
-        mDb.query(
-            "insert or replace into chat_vars(chatid, name, value) "
-            "values(?, ?, ?)", mChat.chatId(), name, value ? 1 : 0);
+        mDb.query(karere::sql::kChatVarSet, mChat.chatId(), name, value ? 1 : 0);
         assertAffectedRowCount(1);
     }
 
     //Returns if chat var related to a chat exists
     virtual bool chatVar(const char *name)
     {
-        SqliteStmt stmt(mDb,
-            "select value from chat_vars where chatid=? and name=? and value='1'");
+        SqliteStmt stmt(mDb, karere::sql::kChatVarGet);
         stmt << mChat.chatId()
              << name;
         return stmt.step();
@@ -435,8 +446,7 @@ public:
     //Remove a chat var related to a chat
     virtual bool removeChatVar(const char *name)
     {
-        SqliteStmt stmt(mDb,
-            "delete from chat_vars where chatid = ? and name = ?");
+        SqliteStmt stmt(mDb, karere::sql::kChatVarDelete);
         stmt << mChat.chatId()
              << name;
         return stmt.step();
@@ -444,7 +454,7 @@ public:
 
     virtual void clearHistory()
     {
-        mDb.query("delete from history where chatid = ?", mChat.chatId());
+        mDb.query(karere::sql::kHistoryClear, mChat.chatId());
         setHaveAllHistory(false);
     }
 
@@ -464,7 +474,7 @@ public:
 
     virtual void deleteMsgFromNodeHistory(const chatd::Message& msg)
     {
-        mDb.query("update node_history set data = ?, updated = ?, type = ? where chatid = ? and msgid = ?",
+        mDb.query(karere::sql::kNodeHistoryDeleteMsg,
                   msg, msg.updated, msg.type, mChat.chatId(), msg.id());
         assertAffectedRowCount(1, "deleteMsgFromNodeHistory");
     }
@@ -472,17 +482,17 @@ public:
     virtual void truncateNodeHistory(karere::Id id)
     {
         auto idx = getIdxOfMsgid(id, "node_history");
-        mDb.query("delete from node_history where chatid = ? and idx <= ?", mChat.chatId(), idx);
+        mDb.query(karere::sql::kNodeHistoryTruncate, mChat.chatId(), idx);
     }
 
     virtual void clearNodeHistory()
     {
-        mDb.query("delete from node_history where chatid = ?", mChat.chatId());
+        mDb.query(karere::sql::kNodeHistoryClear, mChat.chatId());
     }
 
     virtual void getNodeHistoryInfo(chatd::Idx &newest, chatd::Idx &oldest)
     {
-        SqliteStmt stmt(mDb, "select min(idx), max(idx), count(*) from node_history where chatid=?1");
+        SqliteStmt stmt(mDb, karere::sql::histRange("node_history"));
         stmt.bind(mChat.chatId()).step(); //will always return a row, even if table empty
 
         int count = stmt.intCol(2);
@@ -503,10 +513,7 @@ public:
 
     void loadMessages(int count, chatd::Idx idx, std::vector<chatd::Message*>& messages, const std::string &table)
     {
-        std::string query = "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from " + table +
-                            " where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
-
-        SqliteStmt stmt(mDb, query.c_str());
+        SqliteStmt stmt(mDb, karere::sql::histLoadMessages(table));
         stmt << mChat.chatId() << idx << count;
         int i = 0;
         while(stmt.step())
@@ -538,7 +545,7 @@ public:
 
     std::string getReactionSn() override
     {
-        SqliteStmt stmt(mDb, "select rsn from chats where chatid = ?");
+        SqliteStmt stmt(mDb, karere::sql::kChatReactionSn);
         stmt << mChat.chatId();
         stmt.stepMustHaveData(__FUNCTION__);
         return stmt.stringCol(0);
@@ -546,30 +553,28 @@ public:
 
     void setReactionSn(const std::string &rsn) override
     {
-        mDb.query("update chats set rsn = ? where chatid = ?", rsn, mChat.chatId());
+        mDb.query(karere::sql::kChatSetReactionSn, rsn, mChat.chatId());
         assertAffectedRowCount(1);
     }
 
     void cleanReactions(karere::Id msgId) override
     {
-        mDb.query("delete from chat_reactions where chatid = ? and msgId = ?", mChat.chatId(), msgId);
+        mDb.query(karere::sql::kReactionsClean, mChat.chatId(), msgId);
     }
 
     void addReaction(karere::Id msgId, karere::Id userId, const char *reaction) override
     {
-        mDb.query("insert into chat_reactions(chatid, msgid, userid, reaction)"
-            "values(?,?,?,?)", mChat.chatId(), msgId, userId, reaction);
+        mDb.query(karere::sql::kReactionsAdd, mChat.chatId(), msgId, userId, reaction);
     }
 
     void delReaction(karere::Id msgId, karere::Id userId, const char *reaction) override
     {
-        mDb.query("delete from chat_reactions where chatid = ? and msgid = ? and userid = ? and reaction = ?",
-            mChat.chatId(), msgId, userId, reaction);
+        mDb.query(karere::sql::kReactionsDelete, mChat.chatId(), msgId, userId, reaction);
     }
 
     void getMessageReactions(karere::Id msgId, ::mega::multimap<std::string, karere::Id>& reactions) override
     {
-        SqliteStmt stmt(mDb, "select reaction, userid from chat_reactions where chatid = ? and msgid = ?");
+        SqliteStmt stmt(mDb, karere::sql::kReactionsLoad);
         stmt << mChat.chatId();
         stmt << msgId;
         while (stmt.step())
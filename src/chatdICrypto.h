@@ -20,6 +20,7 @@ enum
 class Chat;
 class ICrypto
 {
+protected:
     void *appCtx;
     
 public:
@@ -77,6 +78,31 @@ public:
      */
     virtual promise::Promise<Message*> msgDecrypt(Message* src) = 0;
 
+    /**
+     * @brief Called by the client for received messages that are queued for decryption,
+     * behind a message whose decryption has not completed yet. The crypto module may start
+     * decrypting them in the background, so that the \c msgDecrypt() call for each of them
+     * completes sooner. It must not modify the message. The default implementation does nothing.
+     */
+    virtual void msgDecryptAhead(Message* /*msg*/) {}
+
+    /**
+     * @brief Called by the client before decrypting, one by one and in order, a batch of
+     * messages that were queued for decryption (i.e. a page of history). The crypto module
+     * may verify and decrypt them together, and keep the results for the \c msgDecrypt()
+     * call of each of them. It must not modify the messages. The default implementation
+     * does nothing.
+     */
+    virtual void msgDecryptBatch(const std::vector<Message*>& /*msgs*/) {}
+
+    /**
+     * @brief Called by the client for every message removed from the history buffer
+     * (i.e. by a truncate), which may have been passed to \c msgDecryptAhead() or
+     * \c msgDecryptBatch() and will never be passed to \c msgDecrypt(). The crypto module
+     * should discard the results kept for it. The default implementation does nothing.
+     */
+    virtual void msgDiscarded(const Message& /*msg*/) {}
+
     /**
      * @brief The chatroom connection (to the chatd server shard) state state has changed.
      */
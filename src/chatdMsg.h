@@ -625,8 +625,15 @@ private:
     bool mIdIsXid = false;
 
     /* Reactions must be ordered in the same order as they were added,
-    so we need a sequence container */
-    std::vector<Reaction> mReactions;
+    so we need a sequence container. Most messages have no reactions, so
+    it's only allocated when the first one is added */
+    std::unique_ptr<std::vector<Reaction>> mReactions;
+
+    const std::vector<Reaction>& reactionList() const
+    {
+        static const std::vector<Reaction> noReactions;
+        return mReactions ? *mReactions : noReactions;
+    }
 
 protected:
     uint8_t mIsEncrypted = kNotEncrypted;
@@ -787,7 +794,7 @@ public:
     std::vector<std::string> getReactions() const
     {
         std::vector<std::string> reactions;
-        for (auto &it : mReactions)
+        for (auto &it : reactionList())
         {
             reactions.push_back(it.mReaction);
         }
@@ -797,7 +804,7 @@ public:
     /** @brief Returns true if the user has reacted to this message with the specified reaction **/
     bool hasReacted(std::string reaction, karere::Id uh) const
     {
-        for (auto &it : mReactions)
+        for (auto &it : reactionList())
         {
             if (it.mReaction == reaction)
             {
@@ -810,7 +817,7 @@ public:
     /** @brief Returns a vector with the userid's associated to an specific reaction **/
     const std::vector<karere::Id>* getReactionUsers(std::string reaction) const
     {
-        for (auto &it : mReactions)
+        for (auto &it : reactionList())
         {
             if (it.mReaction == reaction)
             {
@@ -823,7 +830,7 @@ public:
     /** @brief Returns the number of users for an specific reaction **/
     int getReactionCount(const std::string &reaction) const
     {
-        for (auto const &it : mReactions)
+        for (auto const &it : reactionList())
         {
             if (it.mReaction == reaction)
             {
@@ -837,7 +844,7 @@ public:
     int getReactionIndex(const std::string &reaction) const
     {
         int i = 0;
-        for (auto &it : mReactions)
+        for (auto &it : reactionList())
         {
             if (it.mReaction == reaction)
             {
@@ -851,11 +858,11 @@ public:
     /** @brief Clean reactions */
     void cleanReactions()
     {
-        mReactions.clear();
+        mReactions.reset();
     }
     bool hasReactions() const
     {
-        return !mReactions.empty();
+        return mReactions && !mReactions->empty();
     }
 
     /** @brief Add a reaction for an specific userid **/
@@ -865,12 +872,16 @@ public:
         int reactIndex = getReactionIndex(reaction);
         if (reactIndex >= 0)
         {
-            r =  &mReactions.at(reactIndex);
+            r =  &mReactions->at(reactIndex);
         }
         else    // not found, add
         {
-            mReactions.emplace_back(reaction);
-            r = &mReactions.back();
+            if (!mReactions)
+            {
+                mReactions.reset(new std::vector<Reaction>());
+            }
+            mReactions->emplace_back(reaction);
+            r = &mReactions->back();
         }
 
         if (!r->hasReacted(userId))
@@ -885,7 +896,7 @@ public:
         int reactIndex = getReactionIndex(reaction);
         if (reactIndex >= 0)
         {
-            Reaction &r = mReactions.at(reactIndex);
+            Reaction &r = mReactions->at(reactIndex);
 
             int userIndex = r.userIndex(userId);
             if (userIndex >= 0)
@@ -893,7 +904,11 @@ public:
                 r.mUsers.erase(r.mUsers.begin() + userIndex);
                 if (r.mUsers.empty())
                 {
-                    mReactions.erase(mReactions.begin() + reactIndex);
+                    mReactions->erase(mReactions->begin() + reactIndex);
+                    if (mReactions->empty())
+                    {
+                        mReactions.reset();
+                    }
                 }
             }
         }
@@ -919,7 +934,7 @@ private:
     Command(const Command&) = delete;
 protected:
     Command(uint8_t opcode, uint8_t reserve, uint8_t payloadSize=0)
-    : Buffer(reserve, payloadSize+1) { write(0, opcode); }
+    : Buffer(reserve, payloadSize+1, true) { write(0, opcode); }
     Command(const char* data, size_t size): Buffer(data, size){}
 public:
     enum { kBroadcastUserTyping = 1,  kBroadcastUserStopTyping = 2};
@@ -929,7 +944,7 @@ public:
     { assert(!other.buf() && !other.bufSize() && !other.dataSize()); }
 
     explicit Command(uint8_t opcode, size_t reserve=64)
-    : Buffer(reserve) { write(0, opcode); }
+    : Buffer(reserve, 0, true) { write(0, opcode); }
 
     template<class T>
     Command&& operator+(const T& val)
@@ -2,6 +2,13 @@
 #define _KARERE_DB_H
 
 #include <sqlite3.h>
+#include <map>
+#include <string>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 struct SqliteString
 {
@@ -15,17 +22,149 @@ struct SqliteString
     }
 };
 class SqliteStmt;
+class SqliteDbWriter;
+
+/** @brief Tuning applied by SqliteDb::open(). The default values keep SQLite's
+ * defaults (rollback journal, no memory-mapped I/O, default page cache...)
+ */
+struct SqliteDbProfile
+{
+    std::string journalMode;            // i.e. "WAL", or empty to keep the current one
+    int synchronous = -1;               // 0: OFF, 1: NORMAL, 2: FULL, 3: EXTRA, -1: default
+    int64_t mmapSize = -1;              // max bytes of memory-mapped I/O, -1: default
+    int cacheSize = 0;                  // as PRAGMA cache_size (negative means KiB), 0: default
+    int tempStore = -1;                 // 0: DEFAULT, 1: FILE, 2: MEMORY, -1: default
+    uint16_t checkpointInterval = 0;    // min seconds between wal_checkpoint(PASSIVE), 0: only SQLite's auto-checkpoints
+
+    /** @brief WAL journal, fsync only at checkpoints, 64MB of mmap and 8MB of page cache */
+    static SqliteDbProfile performance()
+    {
+        SqliteDbProfile profile;
+        profile.journalMode = "WAL";
+        profile.synchronous = 1;
+        profile.mmapSize = 64 * 1024 * 1024;
+        profile.cacheSize = -8 * 1024;
+        profile.tempStore = 2;
+        profile.checkpointInterval = 60;
+        return profile;
+    }
+};
 
 class SqliteDb
 {
 protected:
     friend class SqliteStmt;
+    friend class SqliteDbWriter;
+    enum { kBusyTimeoutMs = 5000 };
     sqlite3* mDb = nullptr;
     bool mCommitEach = true;
     bool mHasOpenTransaction = false;
     uint16_t mCommitInterval = 20;
     time_t mLastCommitTs = 0;
+    SqliteDbProfile mProfile;
+    time_t mLastCheckpointTs = 0;
+
+    // Cache of prepared statements, keyed by their SQL. A statement is removed from
+    // the cache while it's in use by a SqliteStmt, and put back (reset) when released
+    enum { kMaxCachedStmts = 128 };
+    std::map<std::string, sqlite3_stmt*> mStmtCache;
+    uint64_t mStmtCacheHits = 0;
+    uint64_t mStmtCacheMisses = 0;
+
+    // Write-behind mode: mutations issued via query() are queued and executed by a dedicated
+    // writer thread, in its own connection. Statements are executed in that same connection,
+    // after the queued writes (read-your-writes), without waiting for them to be committed
+    std::unique_ptr<SqliteDbWriter> mWriter;
+    bool mCommitOnStep = true;  // commit from step() when the commit interval has elapsed
     inline int step(SqliteStmt& stmt);
+    /** @brief In write-behind mode, executes the queued writes and returns the lock for the
+     * exclusive use of the writer's connection. Otherwise, returns an empty lock */
+    inline std::unique_lock<std::recursive_mutex> lease();
+    /** @brief The connection where statements are executed: the writer's one in write-behind mode */
+    inline SqliteDb& connection();
+    bool isReadOnly(const char* sql)
+    {
+        sqlite3_stmt* stmt = acquireStmt(sql);
+        bool readOnly = sqlite3_stmt_readonly(stmt);
+        releaseStmt(stmt);
+        return readOnly;
+    }
+    sqlite3_stmt* acquireStmt(const char* sql)
+    {
+        auto it = mStmtCache.find(sql);
+        if (it != mStmtCache.end())
+        {
+            sqlite3_stmt* stmt = it->second;
+            mStmtCache.erase(it);
+            mStmtCacheHits++;
+            return stmt;
+        }
+
+        mStmtCacheMisses++;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(mDb, sql, -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            const char* errMsg = sqlite3_errmsg(mDb);
+            if (!errMsg)
+                errMsg = "(Unknown error)";
+            throw std::runtime_error(std::string(
+                "Error creating sqlite statement with sql:\n'")+sql+"'\n"+errMsg);
+        }
+        return stmt;
+    }
+    void releaseStmt(sqlite3_stmt* stmt)
+    {
+        const char* sql = sqlite3_sql(stmt);
+        if (!mDb || !sql || mStmtCache.size() >= kMaxCachedStmts)
+        {
+            sqlite3_finalize(stmt);
+            return;
+        }
+
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        auto ret = mStmtCache.emplace(sql, stmt);
+        if (!ret.second) // an instance of the same statement was released meanwhile
+        {
+            sqlite3_finalize(stmt);
+        }
+    }
+    inline void setWriterCommitMode(bool commitEach);
+    inline void setWriterDirty();
+    void clearStmtCache()
+    {
+        for (auto& it: mStmtCache)
+        {
+            sqlite3_finalize(it.second);
+        }
+        mStmtCache.clear();
+    }
+    void applyProfile()
+    {
+        // the tuning is best-effort: a failure here doesn't prevent using the db
+        std::string sql;
+        if (!mProfile.journalMode.empty())
+            sql.append("PRAGMA journal_mode = ").append(mProfile.journalMode).append(";");
+        if (mProfile.synchronous >= 0)
+            sql.append("PRAGMA synchronous = ").append(std::to_string(mProfile.synchronous)).append(";");
+        if (mProfile.mmapSize >= 0)
+            sql.append("PRAGMA mmap_size = ").append(std::to_string(mProfile.mmapSize)).append(";");
+        if (mProfile.cacheSize)
+            sql.append("PRAGMA cache_size = ").append(std::to_string(mProfile.cacheSize)).append(";");
+        if (mProfile.tempStore >= 0)
+            sql.append("PRAGMA temp_store = ").append(std::to_string(mProfile.tempStore)).append(";");
+        if (!sql.empty())
+            sqlite3_exec(mDb, sql.c_str(), nullptr, nullptr, nullptr);
+    }
+    void walCheckpoint(time_t now)
+    {
+        // must be called outside of a transaction, or our own read lock would block it
+        if (!mProfile.checkpointInterval || now - mLastCheckpointTs < mProfile.checkpointInterval)
+            return;
+
+        sqlite3_wal_checkpoint_v2(mDb, nullptr, SQLITE_CHECKPOINT_PASSIVE, nullptr, nullptr);
+        mLastCheckpointTs = now;
+    }
     void beginTransaction()
     {
         assert(!mHasOpenTransaction);
@@ -45,7 +184,10 @@ public:
     SqliteDb(sqlite3* db=nullptr, uint16_t commitInterval=20)
     : mDb(db), mCommitInterval(commitInterval)
     {}
-    bool open(const char* fname, bool commitEach=true)
+    SqliteDb(const SqliteDb&) = delete; // the cached statements belong to this instance
+    SqliteDb& operator=(const SqliteDb&) = delete;
+    inline ~SqliteDb();
+    bool open(const char* fname, bool commitEach=true, const SqliteDbProfile& profile=SqliteDbProfile())
     {
         assert(!mDb);
         int ret = sqlite3_open(fname, &mDb);
@@ -65,6 +207,10 @@ public:
             return false;
         }
 
+        mProfile = profile;
+        mLastCheckpointTs = time(NULL);
+        applyProfile();
+
         mCommitEach = commitEach;
         if (!mCommitEach)
         {
@@ -77,15 +223,23 @@ public:
     {
         if (!mDb)
             return;
+        mWriter.reset();    // writes all pending changes
         if (!mCommitEach)
             commitTransaction();
+        clearStmtCache();
         sqlite3_close(mDb);
         mDb = nullptr;
         mLastCommitTs = 0;
     }
     bool isOpen() const { return mDb != nullptr; }
+    const SqliteDbProfile& profile() const { return mProfile; }
     void setCommitMode(bool commitEach)
     {
+        if (mWriter)
+        {
+            setWriterCommitMode(commitEach);
+            return;
+        }
         if (commitEach == mCommitEach)
             return;
         mCommitEach = commitEach;
@@ -101,12 +255,34 @@ public:
     }
     void setCommitInterval(uint16_t sec) { mCommitInterval = sec; }
     bool hasOpenTransaction() const { return !mHasOpenTransaction; }
+    uint64_t stmtCacheHits() const { return mStmtCacheHits; }
+    uint64_t stmtCacheMisses() const { return mStmtCacheMisses; }
+    size_t stmtCacheSize() const { return mStmtCache.size(); }
+
+    /** @brief Enables the write-behind mode. It requires a file-backed database in WAL
+     * journal mode, so the writer's open transaction doesn't block other connections */
+    inline bool enableWriteBehind();
+    /** @brief Writes all pending changes and goes back to synchronous writes */
+    inline void disableWriteBehind();
+    bool isWriteBehind() const { return mWriter != nullptr; }
+    /** @brief Barrier: executes and commits every queued mutation. Rethrows any error
+     * occurred while executing the queued mutations */
+    inline void flush();
+    /** @brief Rows affected by the last mutation, like sqlite3_changes(), but taking
+     * into account the mutations queued to the writer thread */
+    inline int changes();
+    /** @brief Like sqlite3_last_insert_rowid(), but taking into account the mutations
+     * queued to the writer thread */
+    inline int64_t lastInsertRowid();
     operator sqlite3*() { return mDb; }
     operator const sqlite3*() const { return mDb; }
     template <class... Args>
     inline bool query(const char* sql, Args&&... args);
     void simpleQuery(const char* sql)
     {
+        if (mWriter)
+            flush();
+
         SqliteString err;
         auto ret = sqlite3_exec(mDb, sql, nullptr, nullptr, &err.mStr);
         if (ret == SQLITE_OK)
@@ -122,6 +298,11 @@ public:
     }
     void commit()
     {
+        if (mWriter)
+        {
+            flush();
+            return;
+        }
         if (mCommitEach)
             return;
 
@@ -139,7 +320,11 @@ public:
         if (now - mLastCommitTs < mCommitInterval)
             return false;
 
-        commit();
+        if (commitTransaction())
+        {
+            walCheckpoint(now);
+            beginTransaction();
+        }
         return true;
     }
 };
@@ -147,6 +332,7 @@ public:
 class SqliteStmt
 {
 protected:
+    std::unique_lock<std::recursive_mutex> mLease;  // write-behind mode: use of the writer's connection
     sqlite3_stmt* mStmt;
     SqliteDb& mDb;
     int mLastBindCol = 0;
@@ -174,24 +360,20 @@ protected:
         return msg;
     }
 public:
-    SqliteStmt(SqliteDb& db, const char* sql):mDb(db)
+    SqliteStmt(SqliteDb& db, const char* sql)
+        :mLease(db.lease()), mDb(db.connection())  // the statement must see the queued writes
     {
-        if (sqlite3_prepare_v2(db, sql, -1, &mStmt, nullptr) != SQLITE_OK)
-        {
-            const char* errMsg = sqlite3_errmsg(mDb);
-            if (!errMsg)
-                errMsg = "(Unknown error)";
-            throw std::runtime_error(std::string(
-                "Error creating sqlite statement with sql:\n'")+sql+"'\n"+errMsg);
-        }
+        mStmt = mDb.acquireStmt(sql);    // reused from the connection's cache, if possible
         assert(mStmt);
+        if (db.mWriter && !sqlite3_stmt_readonly(mStmt))
+            db.setWriterDirty();
     }
     SqliteStmt(SqliteDb& db, const std::string& sql)
         :SqliteStmt(db, sql.c_str()){}
     ~SqliteStmt()
     {
         if (mStmt)
-            sqlite3_finalize(mStmt);
+            mDb.releaseStmt(mStmt);
     }
     operator sqlite3_stmt*() { return mStmt; }
     operator const sqlite3_stmt*() const {return mStmt; }
@@ -288,9 +470,345 @@ public:
     unsigned int uintCol(int num) { return (unsigned int)sqlite3_column_int(mStmt, num);}
 };
 
+/** @brief Copy of the values bound to a statement whose execution is deferred
+ * to the writer thread. The overloads match the ones of SqliteStmt::bind()
+ */
+class SqliteBindings
+{
+protected:
+    enum { kNull, kInt, kInt64, kText, kBlob };
+    struct Value
+    {
+        int type;
+        int64_t num;
+        std::string data;
+        Value(int aType, int64_t aNum): type(aType), num(aNum) {}
+        Value(int aType, const void* aData, size_t size)
+            : type(aType), num(0), data(static_cast<const char*>(aData), size) {}
+    };
+    std::vector<Value> mValues;
+public:
+    SqliteBindings& add(int val) { mValues.emplace_back(kInt, val); return *this; }
+    SqliteBindings& add(int64_t val) { mValues.emplace_back(kInt64, val); return *this; }
+    SqliteBindings& add(const std::string& val) { mValues.emplace_back(kText, val.data(), val.size()); return *this; }
+    SqliteBindings& add(const StaticBuffer& buf)
+    {
+        if (!buf.buf())
+            mValues.emplace_back(kNull, 0);
+        else
+            mValues.emplace_back(kBlob, buf.buf(), buf.dataSize());
+        return *this;
+    }
+    SqliteBindings& add(uint64_t val) { mValues.emplace_back(kInt64, (int64_t)val); return *this; }
+    SqliteBindings& add(unsigned int val) { mValues.emplace_back(kInt, (int)val); return *this; }
+    SqliteBindings& add(const char* val)
+    {
+        if (!val)
+            mValues.emplace_back(kNull, 0);
+        else
+            mValues.emplace_back(kText, val, strlen(val));
+        return *this;
+    }
+    template <class T, class... Args>
+    SqliteBindings& addV(T&& val, Args&&... args) { return add(val).addV(args...); }
+    SqliteBindings& addV() { return *this; }
+    void apply(SqliteStmt& stmt) const
+    {
+        int col = 0;
+        for (auto& val: mValues)
+        {
+            col++;
+            switch (val.type)
+            {
+                case kInt: stmt.bind(col, (int)val.num); break;
+                case kInt64: stmt.bind(col, val.num); break;
+                case kText: stmt.bind(col, val.data.data(), val.data.size()); break;
+                case kBlob: stmt.bind(col, (const void*)val.data.data(), val.data.size()); break;
+                default: sqlite3_bind_null(stmt, col); break;
+            }
+        }
+    }
+};
+
+/** @brief Executes the mutations of a SqliteDb in write-behind mode, in the same order
+ * they were queued, in a dedicated thread and connection. Changes are committed in
+ * batches, so the fsyncs don't happen in the thread that queues the writes.
+ * The statements of the SqliteDb are executed in the same connection, after executing the
+ * queued writes, so they see them without waiting for a commit.
+ */
+class SqliteDbWriter
+{
+protected:
+    friend class SqliteDb;
+    struct Job
+    {
+        std::string sql;
+        SqliteBindings bindings;
+        Job(const char* aSql, SqliteBindings&& aBindings)
+            : sql(aSql), bindings(std::move(aBindings)) {}
+    };
+    SqliteDb mDb;
+    std::recursive_mutex mConnMutex;    // exclusive use of mDb, also by nested statements
+    uint16_t mCommitInterval;
+    std::mutex mMutex;
+    std::condition_variable mCv;        // wakes up the writer thread
+    std::deque<Job> mQueue;
+    bool mCommitOnIdle = false;         // commit as soon as the queue is empty
+    bool mDirty = false;                // there are uncommitted changes
+    bool mExit = false;
+    std::string mError;                 // first error occurred since the last flush
+    std::thread mThread;
+
+    // The methods below must be called with mConnMutex locked and mMutex unlocked.
+    // The queue is only taken with mConnMutex locked, so jobs are executed in order
+    void executeQueue()
+    {
+        std::deque<Job> jobs;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mQueue.empty())
+                return;
+            jobs.swap(mQueue);
+        }
+
+        std::string err;
+        for (auto& job: jobs)
+        {
+            try
+            {
+                SqliteStmt stmt(mDb, job.sql);
+                job.bindings.apply(stmt);
+                stmt.step();
+            }
+            catch (std::exception& e)
+            {
+                if (err.empty())
+                    err = e.what();
+            }
+        }
+        setDirty(err);
+    }
+    void commit(bool onlyIfDue)
+    {
+        std::string err;
+        bool committed = true;
+        try
+        {
+            if (onlyIfDue)
+                committed = mDb.timedCommit();
+            else
+                mDb.commit();
+        }
+        catch (std::exception& e)
+        {
+            err = e.what();
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (committed)
+            mDirty = false;
+        if (!err.empty() && mError.empty())
+            mError = err;
+    }
+    void setDirty(const std::string& err)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mDirty = true;
+            if (!err.empty() && mError.empty())
+                mError = err;
+        }
+        mCv.notify_one();
+    }
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (!mExit)
+        {
+            bool commitNow = mDirty && mCommitOnIdle;
+            if (mQueue.empty() && !commitNow)
+            {
+                bool wokenUp = mCv.wait_for(lock, std::chrono::seconds(mCommitInterval), [this]
+                {
+                    return !mQueue.empty() || mExit || (mDirty && mCommitOnIdle);
+                });
+                if (wokenUp || !mDirty)
+                    continue;
+                // idle for a whole commit interval --> commit
+            }
+
+            lock.unlock();
+            {
+                std::lock_guard<std::recursive_mutex> connLock(mConnMutex);
+                executeQueue();
+                commit(!commitNow);
+            }
+            lock.lock();
+        }
+        lock.unlock();
+
+        std::lock_guard<std::recursive_mutex> connLock(mConnMutex);
+        executeQueue();
+        commit(false);
+        mDb.close();
+    }
+public:
+    SqliteDbWriter(const char* fname, uint16_t commitInterval, bool commitOnIdle, const SqliteDbProfile& profile)
+        : mCommitInterval(commitInterval ? commitInterval : 1), mCommitOnIdle(commitOnIdle)
+    {
+        mDb.setCommitInterval(mCommitInterval);
+        mDb.mCommitOnStep = false;  // statements are also stepped by the leases, commits are done by run()
+        if (!mDb.open(fname, false, profile))
+            throw std::runtime_error(std::string("SqliteDbWriter: can't open database ")+fname);
+        sqlite3_busy_timeout(mDb, SqliteDb::kBusyTimeoutMs);
+        mThread = std::thread([this]() { run(); });
+    }
+    ~SqliteDbWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mExit = true;
+        }
+        mCv.notify_one();
+        mThread.join();
+    }
+    void enqueue(const char* sql, SqliteBindings&& bindings)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mQueue.emplace_back(sql, std::move(bindings));
+        }
+        mCv.notify_one();
+    }
+    /** @brief Executes the queued writes and returns the lock of the connection */
+    std::unique_lock<std::recursive_mutex> lease()
+    {
+        std::unique_lock<std::recursive_mutex> connLock(mConnMutex);
+        executeQueue();
+        return connLock;
+    }
+    /** @brief A statement executed in the writer's connection changed the db */
+    void setDirty() { setDirty(std::string()); }
+    void flush()
+    {
+        std::string err;
+        {
+            std::lock_guard<std::recursive_mutex> connLock(mConnMutex);
+            executeQueue();
+            commit(false);
+
+            std::lock_guard<std::mutex> lock(mMutex);
+            err.swap(mError);
+        }
+        if (!err.empty())
+            throw std::runtime_error("SqliteDbWriter: error executing deferred write: "+err);
+    }
+    void setCommitOnIdle(bool commitOnIdle)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mCommitOnIdle = commitOnIdle;
+        }
+        mCv.notify_one();
+    }
+    bool commitOnIdle()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mCommitOnIdle;
+    }
+};
+
+inline SqliteDb::~SqliteDb()
+{
+    mWriter.reset();
+}
+
+inline bool SqliteDb::enableWriteBehind()
+{
+    if (mWriter)
+        return true;
+
+    const char* fname = mDb ? sqlite3_db_filename(mDb, "main") : nullptr;
+    if (!fname || !*fname)
+        return false;   // in-memory or temporary databases can't be shared between connections
+
+    {
+        // with a rollback journal, the writer's open transaction would lock out other connections
+        SqliteStmt stmt(*this, "PRAGMA journal_mode");
+        if (!stmt.step() || stmt.stringCol(0) != "wal")
+            return false;
+    }
+
+    // this connection must not keep a transaction open, or it would block the writer's one
+    bool commitEach = mCommitEach;
+    setCommitMode(true);
+    sqlite3_busy_timeout(mDb, kBusyTimeoutMs);
+    mWriter.reset(new SqliteDbWriter(fname, mCommitInterval, commitEach, mProfile));
+    return true;
+}
+
+inline void SqliteDb::disableWriteBehind()
+{
+    if (!mWriter)
+        return;
+
+    bool commitEach = mWriter->commitOnIdle();
+    flush();
+    mWriter.reset();
+    setCommitMode(commitEach);
+}
+
+inline void SqliteDb::flush()
+{
+    if (mWriter)
+        mWriter->flush();
+}
+
+inline void SqliteDb::setWriterCommitMode(bool commitEach)
+{
+    mWriter->setCommitOnIdle(commitEach);
+}
+
+inline void SqliteDb::setWriterDirty()
+{
+    mWriter->setDirty();
+}
+
+inline std::unique_lock<std::recursive_mutex> SqliteDb::lease()
+{
+    return mWriter ? mWriter->lease() : std::unique_lock<std::recursive_mutex>();
+}
+
+inline SqliteDb& SqliteDb::connection()
+{
+    return mWriter ? mWriter->mDb : *this;
+}
+
+inline int SqliteDb::changes()
+{
+    // the queued writes are executed first, so the last one executed is the last one issued
+    auto lock = lease();
+    return sqlite3_changes(connection());
+}
+
+inline int64_t SqliteDb::lastInsertRowid()
+{
+    auto lock = lease();
+    return sqlite3_last_insert_rowid(connection());
+}
+
 template <class... Args>
 inline bool SqliteDb::query(const char* sql, Args&&... args)
 {
+    if (mWriter && !isReadOnly(sql))
+    {
+        // mutations don't return rows, so they can be executed later by the writer thread
+        SqliteBindings bindings;
+        bindings.addV(args...);
+        mWriter->enqueue(sql, std::move(bindings));
+        return false;
+    }
+
     SqliteStmt stmt(*this, sql);
     stmt.bindV(args...);
     return stmt.step();
@@ -299,7 +817,7 @@ inline bool SqliteDb::query(const char* sql, Args&&... args)
 inline int SqliteDb::step(SqliteStmt& stmt)
 {
     auto ret = sqlite3_step(stmt);
-    if (ret == SQLITE_DONE)
+    if (ret == SQLITE_DONE && mCommitOnStep)
     {
         timedCommit();
     }
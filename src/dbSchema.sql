@@ -13,7 +13,7 @@ CREATE TABLE chats(chatid int64 unique primary key, shard tinyint,
     own_priv tinyint, peer int64 default -1, peer_priv tinyint default 0,
     title text, ts_created int64 not null default 0,
     last_seen int64 default 0, last_recv int64 default 0, archived tinyint default 0,
-    mode tinyint default 0, unified_key blob, rsn blob);
+    mode tinyint default 0, unified_key blob, rsn blob, unread_count int);
 
 CREATE TABLE contacts(userid int64 PRIMARY KEY, email text, visibility int,
     since int64 not null default 0);
@@ -41,5 +41,15 @@ CREATE TABLE node_history(idx int not null, chatid int64 not null, msgid int64 n
 
 CREATE TABLE dns_cache(shard tinyint primary key, url text, ipv4 text, ipv6 text);
 
+CREATE TABLE symm_keys(userid int64 primary key, pubkey blob not null, key blob not null, mac blob not null);
+
 CREATE TABLE chat_reactions(chatid int64 not null, msgid int64 not null, userid int64 not null, reaction text,
     UNIQUE(chatid, msgid, userid, reaction), FOREIGN KEY(chatid, msgid) REFERENCES history(chatid, msgid) ON DELETE CASCADE);
+
+CREATE INDEX history_unread_idx ON history(chatid, type, is_encrypted, idx);
+
+CREATE INDEX history_userid_ts_idx ON history(userid, ts);
+
+CREATE INDEX sending_chatid_idx ON sending(chatid);
+
+CREATE INDEX manual_sending_chatid_idx ON manual_sending(chatid);
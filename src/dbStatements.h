@@ -0,0 +1,198 @@
+#ifndef DB_STATEMENTS_H
+#define DB_STATEMENTS_H
+
+#include <string>
+#include <vector>
+
+/** @cond PRIVATE */
+
+// SQL statements run against the MEGAchat cache for a single chat, or for a single
+// user. Their cost must not depend on the size of the history, so all of them are
+// expected to be resolved through an index. The unit tests check the query plan of
+// every statement returned by auditedStatements(): when adding a statement here,
+// add it there too. Whole-table loads done once at startup are not listed here.
+namespace karere
+{
+namespace sql
+{
+// chats
+static const char* const kChatReadState = "select last_seen, last_recv, unread_count from chats where chatid=?";
+static const char* const kChatCreationTs = "select ts_created from chats where chatid=?";
+static const char* const kChatReactionSn = "select rsn from chats where chatid = ?";
+static const char* const kChatInsertGroup = "insert or replace into chats(chatid, shard, peer, peer_priv, "
+    "own_priv, ts_created, archived, mode) values(?,?,-1,0,?,?,?,?)";
+static const char* const kChatInsertPreview = "insert or replace into chats(chatid, shard, peer, peer_priv, "
+    "own_priv, ts_created, mode, unified_key) values(?,?,-1,0,?,?,2,?)";
+static const char* const kChatInsertPeer = "insert into chats(chatid, shard, peer, peer_priv, own_priv, "
+    "ts_created, archived) values (?,?,?,?,?,?,?)";
+static const char* const kChatDelete = "delete from chats where chatid = ?";
+static const char* const kChatSetLastSeen = "update chats set last_seen=? where chatid=?";
+static const char* const kChatSetLastRecv = "update chats set last_recv=? where chatid=?";
+static const char* const kChatSetUnreadCount = "update chats set unread_count=? where chatid=?";
+static const char* const kChatClearUnreadCount = "update chats set unread_count=NULL where chatid=?";
+static const char* const kChatSetReactionSn = "update chats set rsn = ? where chatid = ?";
+static const char* const kChatSetUnifiedKey = "update chats set unified_key = ? where chatid = ?";
+static const char* const kChatSetOwnPriv = "update chats set own_priv = ? where chatid = ?";
+static const char* const kChatSetPeerPriv = "update chats set peer_priv = ? where chatid = ?";
+static const char* const kChatSetArchived = "update chats set archived = ? where chatid = ?";
+static const char* const kChatSetTitle = "update chats set title=? where chatid=?";
+static const char* const kChatClearTitle = "update chats set title=NULL where chatid=?";
+static const char* const kChatSetModePublic = "update chats set mode = '1' where chatid = ?";
+static const char* const kChatSetModePrivate = "update chats set mode = '0' where chatid = ?";
+
+// chat_peers
+static const char* const kPeersLoad = "select userid, priv from chat_peers where chatid=?";
+static const char* const kPeersInsert = "insert into chat_peers(chatid, userid, priv) values(?,?,?)";
+static const char* const kPeersReplace = "insert or replace into chat_peers(chatid, userid, priv) values(?,?,?)";
+static const char* const kPeersSetPriv = "update chat_peers set priv=? where chatid=? and userid=?";
+static const char* const kPeersDelete = "delete from chat_peers where chatid=? and userid=?";
+static const char* const kPeersClear = "delete from chat_peers where chatid = ?";
+
+// chat_vars
+static const char* const kChatVarGet = "select value from chat_vars where chatid=? and name=? and value='1'";
+static const char* const kChatVarSet = "insert or replace into chat_vars(chatid, name, value) values(?, ?, ?)";
+static const char* const kChatVarDelete = "delete from chat_vars where chatid = ? and name = ?";
+static const char* const kChatVarsClear = "delete from chat_vars where chatid = ?";
+static const char* const kHaveAllHistoryGet = "select value from chat_vars where chatid=? and name='have_all_history' and value='1'";
+static const char* const kHaveAllHistorySet = "insert or replace into chat_vars(chatid, name, value) "
+    "values(?, 'have_all_history', ?)";
+
+// history and node_history share their layout, the table is a parameter for these
+inline std::string histMsgidAtIdx(const std::string& table)
+{
+    return "select msgid from " + table + " where chatid=?1 and idx=?2";
+}
+inline std::string histRange(const std::string& table)
+{
+    return "select min(idx), max(idx), count(*) from " + table + " where chatid = ?";
+}
+inline std::string histInsert(const std::string& table)
+{
+    return "insert into " + table + " (idx, chatid, msgid, keyid, type, userid, ts, updated, data, backrefid, is_encrypted) "
+           "values(?,?,?,?,?,?,?,?,?,?,?)";
+}
+inline std::string histIdxOfMsgid(const std::string& table)
+{
+    return "select idx from " + table + " where chatid = ? and msgid = ?";
+}
+inline std::string histLoadMessages(const std::string& table)
+{
+    return "select msgid, userid, ts, type, data, idx, keyid, backrefid, updated, is_encrypted from " + table +
+           " where chatid = ?1 and idx <= ?2 order by idx desc limit ?3";
+}
+
+// history
+static const char* const kHistoryIdxRange = "select min(idx), max(idx) from history where chatid=?1";
+static const char* const kHistoryOldestIdx = "select min(idx) from history where chatid = ?";
+static const char* const kHistoryMsgType = "select type from history where chatid=? and msgid=?";
+static const char* const kHistoryMsgDelta = "select updated from history where chatid = ? and msgid = ?";
+static const char* const kHistoryUpdateTruncate = "update history set type = ?, data = ?, ts = ?, userid = ?, keyid = ? "
+    "where chatid = ? and msgid = ?";
+static const char* const kHistoryUpdateMsg = "update history set type = ?, data = ?, updated = ?, userid = ?, is_encrypted = ? "
+    "where chatid = ? and msgid = ?";
+static const char* const kHistoryTruncate = "delete from history where chatid = ? and idx < ?";
+static const char* const kHistoryClear = "delete from history where chatid = ?";
+// the reactions of a page of history, in the order used by getMessageReactions(): by reaction, and then by userid.
+// Tables are not aliased, so that they can be recognized in the query plan
+static const char* const kHistoryPageReactions = "select history.idx, chat_reactions.reaction, chat_reactions.userid "
+    "from history join chat_reactions "
+    "on chat_reactions.chatid = history.chatid and chat_reactions.msgid = history.msgid "
+    "where history.chatid = ?1 and history.idx <= ?2 and history.idx > ?3 "
+    "order by history.idx desc, chat_reactions.reaction, chat_reactions.userid";
+// conditions should match the ones in Message::isValidUnread()
+static const char* const kHistoryUnreadCount = "select count(*) from history where (chatid = ?1)"
+    "and (userid != ?2)"
+    "and not (updated != 0 and length(data) = 0)"
+    "and (is_encrypted = ?3 or is_encrypted = ?4 or is_encrypted = ?5)"
+    "and (type = ?6 or type = ?7 or type = ?8 or type = ?9 or type = ?10)";
+// appended to kHistoryUnreadCount to count only the messages after a given idx
+static const char* const kHistoryUnreadCountAfterIdx = " and (idx > ?)";
+static const char* const kHistoryLastTextMsg = "select type, idx, data, msgid, userid, ts from history where chatid=?1 and "
+    "(length(data) > 0 OR type = ?2) and type != ?3  and type != ?4 and (idx <= ?5)"
+    "order by idx desc limit 1";
+// the distinct authors of the history, walking the userid index instead of reading every message
+static const char* const kHistoryUserids = "with recursive users(userid) as ("
+    "select min(userid) from history "
+    "union all "
+    "select (select min(userid) from history where userid > users.userid) from users where users.userid is not null) "
+    "select userid from users where userid is not null";
+static const char* const kHistoryUserLastTs = "select max(ts) from history where userid = ?";
+
+// node_history
+static const char* const kNodeHistoryDeleteMsg = "update node_history set data = ?, updated = ?, type = ? where chatid = ? and msgid = ?";
+static const char* const kNodeHistoryTruncate = "delete from node_history where chatid = ? and idx <= ?";
+static const char* const kNodeHistoryClear = "delete from node_history where chatid = ?";
+
+// sending
+static const char* const kSendingInsert = "insert into sending (chatid, opcode, ts, msgid, msg, type, updated, "
+    "recipients, backrefid, backrefs) values(?,?,?,?,?,?,?,?,?,?)";
+static const char* const kSendingLoad = "select rowid, opcode, msgid, keyid, msg, type, "
+    "ts, updated, backrefid, backrefs, recipients, msg_cmd, key_cmd "
+    "from sending where chatid=? order by rowid asc";
+static const char* const kSendingUnconfirmedKeys = "select recipients, key_cmd, keyid from sending "
+    "where chatid=? and key_cmd not null order by rowid asc";
+static const char* const kSendingUpdateKeyid = "update sending set keyid = ?, key_cmd = ? where keyid = ? and chatid = ?";
+static const char* const kSendingSetBlobs = "update sending set keyid=?, msg_cmd=?, key_cmd=? where rowid=?";
+static const char* const kSendingConfirmEdit = "update sending set opcode=?, msgid=? where chatid=? and opcode=? and msgid=?";
+static const char* const kSendingUpdateContent = "update sending set msg = ?, updated = ? where msgid = ? and chatid = ?";
+static const char* const kSendingDelete = "delete from sending where rowid = ?1";
+static const char* const kSendingClear = "delete from sending where chatid = ?";
+
+// manual_sending
+static const char* const kManualSendingInsert = "insert into manual_sending(chatid, rowid, msgid, type, "
+    "ts, updated, msg, opcode, reason) values(?,?,?,?,?,?,?,?,?)";
+static const char* const kManualSendingLoad = "select rowid, msgid, type, ts, updated, msg, opcode, "
+    "reason from manual_sending where chatid=? order by rowid asc";
+static const char* const kManualSendingLoadItem = "select msgid, type, ts, updated, msg, opcode, "
+    "reason from manual_sending where chatid=? and rowid=?";
+static const char* const kManualSendingDelete = "delete from manual_sending where rowid = ?";
+static const char* const kManualSendingClear = "delete from manual_sending where chatid = ?";
+
+// sendkeys
+static const char* const kSendKeysLoad = "select key from sendkeys where chatid = ? and userid = ? and keyid = ?";
+static const char* const kSendKeysInsert = "insert or ignore into sendkeys(chatid, userid, keyid, key, ts) values(?,?,?,?,?)";
+static const char* const kSendKeysClear = "delete from sendkeys where chatid = ?";
+
+// chat_reactions
+static const char* const kReactionsLoad = "select reaction, userid from chat_reactions where chatid = ? and msgid = ?";
+static const char* const kReactionsAdd = "insert into chat_reactions(chatid, msgid, userid, reaction) values(?,?,?,?)";
+static const char* const kReactionsDelete = "delete from chat_reactions where chatid = ? and msgid = ? and userid = ? and reaction = ?";
+static const char* const kReactionsClean = "delete from chat_reactions where chatid = ? and msgid = ?";
+
+// All the statements above, with the parameterized ones expanded for every table they are used with
+inline std::vector<std::string> auditedStatements()
+{
+    std::vector<std::string> statements = {
+        kChatReadState, kChatCreationTs, kChatReactionSn, kChatInsertGroup, kChatInsertPreview,
+        kChatInsertPeer, kChatDelete, kChatSetLastSeen, kChatSetLastRecv, kChatSetUnreadCount,
+        kChatClearUnreadCount, kChatSetReactionSn, kChatSetUnifiedKey, kChatSetOwnPriv, kChatSetPeerPriv,
+        kChatSetArchived, kChatSetTitle, kChatClearTitle, kChatSetModePublic, kChatSetModePrivate,
+        kPeersLoad, kPeersInsert, kPeersReplace, kPeersSetPriv, kPeersDelete, kPeersClear,
+        kChatVarGet, kChatVarSet, kChatVarDelete, kChatVarsClear, kHaveAllHistoryGet, kHaveAllHistorySet,
+        kHistoryIdxRange, kHistoryOldestIdx, kHistoryMsgType, kHistoryMsgDelta, kHistoryUpdateTruncate, kHistoryUpdateMsg,
+        kHistoryTruncate, kHistoryClear, kHistoryPageReactions, kHistoryUnreadCount,
+        std::string(kHistoryUnreadCount) + kHistoryUnreadCountAfterIdx, kHistoryLastTextMsg,
+        kHistoryUserids, kHistoryUserLastTs,
+        kNodeHistoryDeleteMsg, kNodeHistoryTruncate, kNodeHistoryClear,
+        kSendingInsert, kSendingLoad, kSendingUnconfirmedKeys, kSendingUpdateKeyid, kSendingSetBlobs,
+        kSendingConfirmEdit, kSendingUpdateContent, kSendingDelete, kSendingClear,
+        kManualSendingInsert, kManualSendingLoad, kManualSendingLoadItem, kManualSendingDelete, kManualSendingClear,
+        kSendKeysLoad, kSendKeysInsert, kSendKeysClear,
+        kReactionsLoad, kReactionsAdd, kReactionsDelete, kReactionsClean
+    };
+    for (const char* table: {"history", "node_history"})
+    {
+        statements.push_back(histMsgidAtIdx(table));
+        statements.push_back(histRange(table));
+        statements.push_back(histInsert(table));
+        statements.push_back(histIdxOfMsgid(table));
+        statements.push_back(histLoadMessages(table));
+    }
+    return statements;
+}
+}
+}
+
+/** @endcond */
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef _ID_MAP_H_INCLUDED_
+#define _ID_MAP_H_INCLUDED_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <new>
+#include <utility>
+#include <tuple>
+#include <iterator>
+#include <stdexcept>
+
+namespace karere
+{
+/** @brief Open-addressing hash map for 64-bit handle keys (karere::Id, BackRefId...).
+ *
+ * Handles are random 64-bit values, so the ordering of std::map buys nothing and its
+ * node-per-entry layout costs an allocation per insert and a pointer chase per level on
+ * lookups. This map keeps the entries in a flat array with linear probing.
+ *
+ * The interface follows the subset of std::map that is used in the codebase, with these
+ * differences:
+ * - Iteration order is unspecified.
+ * - Inserting may rehash, which invalidates all iterators, pointers and references
+ *   to entries. Erasing doesn't move other entries, so it only invalidates the
+ *   iterators to the erased entry (erase while iterating is safe).
+ */
+template <class K, class V>
+class IdMap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef size_t size_type;
+
+protected:
+    enum: uint8_t { kEmpty = 0, kFull = 1, kDeleted = 2 };
+    enum: size_t { kMinCapacity = 16 };
+
+    value_type* mSlots = nullptr;
+    uint8_t* mCtrl = nullptr;
+    size_t mCapacity = 0;   // always a power of two, or zero
+    size_t mSize = 0;       // number of entries
+    size_t mUsed = 0;       // number of entries plus deleted slots, bounds the probe length
+
+    static size_t hashKey(uint64_t key)
+    {
+        // 64-bit finalizer of MurmurHash3 (fmix64), since handles may have low-entropy bits
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return (size_t)key;
+    }
+
+    // returns the slot of `key`, or mCapacity if not found
+    size_t findSlot(const K& key) const
+    {
+        if (!mSize)
+            return mCapacity;
+        size_t mask = mCapacity - 1;
+        for (size_t i = hashKey((uint64_t)key) & mask;; i = (i + 1) & mask)
+        {
+            uint8_t ctrl = mCtrl[i];
+            if (ctrl == kEmpty)
+                return mCapacity;
+            if (ctrl == kFull && mSlots[i].first == key)
+                return i;
+        }
+    }
+
+    void rehash(size_t newCapacity)
+    {
+        value_type* oldSlots = mSlots;
+        uint8_t* oldCtrl = mCtrl;
+        size_t oldCapacity = mCapacity;
+
+        mSlots = static_cast<value_type*>(::operator new(newCapacity * sizeof(value_type)));
+        mCtrl = static_cast<uint8_t*>(calloc(newCapacity, 1));
+        if (!mCtrl)
+        {
+            ::operator delete(mSlots);
+            mSlots = oldSlots;
+            mCtrl = oldCtrl;
+            throw std::bad_alloc();
+        }
+        mCapacity = newCapacity;
+        mUsed = mSize;
+
+        size_t mask = mCapacity - 1;
+        for (size_t i = 0; i < oldCapacity; i++)
+        {
+            if (oldCtrl[i] != kFull)
+                continue;
+            size_t pos = hashKey((uint64_t)oldSlots[i].first) & mask;
+            while (mCtrl[pos] != kEmpty)
+                pos = (pos + 1) & mask;
+            new (&mSlots[pos]) value_type(std::move(oldSlots[i]));
+            mCtrl[pos] = kFull;
+            oldSlots[i].~value_type();
+        }
+        ::operator delete(oldSlots);
+        ::free(oldCtrl);
+    }
+
+    // finds `key`, or reserves a slot for it. Returns the slot and whether the key was found
+    std::pair<size_t, bool> findOrPrepare(const K& key)
+    {
+        size_t pos = findSlot(key);
+        if (pos != mCapacity)
+            return std::make_pair(pos, true);   // don't rehash if the key exists
+
+        // keep the table at most 3/4 used. If most of the used slots are
+        // deleted ones, rehash at the same capacity to purge them
+        if ((mUsed + 1) * 4 > mCapacity * 3)
+        {
+            size_t newCapacity = mCapacity ? mCapacity : (size_t)kMinCapacity;
+            if ((mSize + 1) * 2 > newCapacity)
+                newCapacity *= 2;
+            rehash(newCapacity);
+        }
+
+        size_t mask = mCapacity - 1;
+        size_t freeSlot = mCapacity;
+        for (size_t i = hashKey((uint64_t)key) & mask;; i = (i + 1) & mask)
+        {
+            uint8_t ctrl = mCtrl[i];
+            if (ctrl == kDeleted)
+            {
+                if (freeSlot == mCapacity)
+                    freeSlot = i;
+            }
+            else if (ctrl == kEmpty)
+            {
+                if (freeSlot == mCapacity)
+                {
+                    freeSlot = i;
+                    mUsed++;
+                }
+                return std::make_pair(freeSlot, false);
+            }
+        }
+    }
+
+    void destroyAll()
+    {
+        for (size_t i = 0; i < mCapacity; i++)
+        {
+            if (mCtrl[i] == kFull)
+                mSlots[i].~value_type();
+        }
+    }
+
+public:
+    class const_iterator;
+    template <class MapType, class ValueType>
+    class IteratorBase
+    {
+    protected:
+        MapType* mMap;
+        size_t mPos;
+        void skipFree()
+        {
+            while (mPos < mMap->mCapacity && mMap->mCtrl[mPos] != kFull)
+                mPos++;
+        }
+        friend class IdMap;
+        friend class const_iterator;
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef ValueType value_type;
+        typedef ptrdiff_t difference_type;
+        typedef ValueType* pointer;
+        typedef ValueType& reference;
+
+        IteratorBase(MapType* map=nullptr, size_t pos=0): mMap(map), mPos(pos) { if (mMap) skipFree(); }
+        ValueType& operator*() const { return mMap->mSlots[mPos]; }
+        ValueType* operator->() const { return &mMap->mSlots[mPos]; }
+        IteratorBase& operator++() { mPos++; skipFree(); return *this; }
+        IteratorBase operator++(int) { IteratorBase save(*this); ++(*this); return save; }
+        bool operator==(const IteratorBase& other) const { return mPos == other.mPos; }
+        bool operator!=(const IteratorBase& other) const { return mPos != other.mPos; }
+    };
+    typedef IteratorBase<IdMap, value_type> iterator;
+    class const_iterator: public IteratorBase<const IdMap, const value_type>
+    {
+        typedef IteratorBase<const IdMap, const value_type> Base;
+    public:
+        using Base::Base;
+        const_iterator(const iterator& other): Base(other.mMap, other.mPos) {}
+    };
+
+    IdMap() {}
+    IdMap(const IdMap& other) { *this = other; }
+    IdMap(IdMap&& other) { swap(other); }
+    ~IdMap()
+    {
+        if (!mCapacity)
+            return;
+        destroyAll();
+        ::operator delete(mSlots);
+        ::free(mCtrl);
+    }
+    IdMap& operator=(const IdMap& other)
+    {
+        if (&other == this)
+            return *this;
+        clear();
+        reserve(other.mSize);
+        for (auto& item: other)
+            emplace(item.first, item.second);
+        return *this;
+    }
+    IdMap& operator=(IdMap&& other)
+    {
+        swap(other);
+        return *this;
+    }
+    void swap(IdMap& other)
+    {
+        std::swap(mSlots, other.mSlots);
+        std::swap(mCtrl, other.mCtrl);
+        std::swap(mCapacity, other.mCapacity);
+        std::swap(mSize, other.mSize);
+        std::swap(mUsed, other.mUsed);
+    }
+
+    size_t size() const { return mSize; }
+    bool empty() const { return mSize == 0; }
+    /** Ensures that `count` entries can be inserted without rehashing */
+    void reserve(size_t count)
+    {
+        size_t capacity = kMinCapacity;
+        while (capacity * 3 < count * 4 + 4)
+            capacity *= 2;
+        if (capacity > mCapacity)
+            rehash(capacity);
+    }
+    void clear()
+    {
+        if (!mCapacity)
+            return;
+        destroyAll();
+        memset(mCtrl, kEmpty, mCapacity);
+        mSize = mUsed = 0;
+    }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, mCapacity); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, mCapacity); }
+    const_iterator cbegin() const { return begin(); }
+    const_iterator cend() const { return end(); }
+
+    iterator find(const K& key) { return iterator(this, findSlot(key)); }
+    const_iterator find(const K& key) const { return const_iterator(this, findSlot(key)); }
+    size_t count(const K& key) const { return findSlot(key) != mCapacity; }
+
+    template <class... Args>
+    std::pair<iterator, bool> emplace(const K& key, Args&&... args)
+    {
+        auto result = findOrPrepare(key);
+        if (result.second)
+            return std::make_pair(iterator(this, result.first), false);
+
+        new (&mSlots[result.first]) value_type(std::piecewise_construct,
+            std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+        mCtrl[result.first] = kFull;
+        mSize++;
+        return std::make_pair(iterator(this, result.first), true);
+    }
+    std::pair<iterator, bool> insert(const value_type& value) { return emplace(value.first, value.second); }
+
+    V& operator[](const K& key) { return emplace(key).first->second; }
+    V& at(const K& key)
+    {
+        size_t pos = findSlot(key);
+        if (pos == mCapacity)
+            throw std::out_of_range("IdMap::at: key not found");
+        return mSlots[pos].second;
+    }
+    const V& at(const K& key) const { return const_cast<IdMap*>(this)->at(key); }
+
+    iterator erase(const_iterator it)
+    {
+        size_t pos = it.mPos;
+        assert(pos < mCapacity && mCtrl[pos] == kFull);
+        mSlots[pos].~value_type();
+        mCtrl[pos] = kDeleted;
+        mSize--;
+        return iterator(this, pos + 1);
+    }
+    iterator erase(iterator it) { return erase(const_iterator(it)); }
+    size_t erase(const K& key)
+    {
+        size_t pos = findSlot(key);
+        if (pos == mCapacity)
+            return 0;
+        erase(const_iterator(this, pos));
+        return 1;
+    }
+};
+}
+#endif
@@ -14,7 +14,7 @@ namespace rtcModule {void globalCleanup(); }
 
 namespace karere
 {
-const char* gDbSchemaVersionSuffix = "9";
+const char* gDbSchemaVersionSuffix = "10";
 /*
     2 --> +3: invalidate cached chats to reload history (so call-history msgs are fetched)
     3 --> +4: invalidate both caches, SDK + MEGAchat, if there's at least one chat (so deleted chats are re-fetched from API)
@@ -24,9 +24,12 @@ const char* gDbSchemaVersionSuffix = "9";
     6 --> +7: update keyid for truncate messages in db
     7 --> +8: modify chats and create a new table chat_reactions
     8 --> +9: create table DNS cache
+    9 --> +10: create indexes for unread counts, for the sending queues and for the last message of each user,
+               add persisted unread counter to chats and create table symm_keys
 */
 
 bool gCatchException = true;
+uv_loop_t* gTimerLoop = nullptr;
 
 void globalInit(void(*postFunc)(void*, void*), uint32_t options, const char* logPath, size_t logSize)
 {
@@ -47,6 +50,11 @@ void globalCleanup()
 
 void init_uv_timer(void *ctx, uv_timer_t *timer)
 {
+    if (gTimerLoop)
+    {
+        uv_timer_init(gTimerLoop, timer);
+        return;
+    }
     uv_timer_init(((::mega::LibuvWaiter *)(((megachat::MegaChatApiImpl *)ctx)->waiter))->eventloop, timer);
 }
 }
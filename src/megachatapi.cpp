@@ -297,11 +297,21 @@ int MegaChatApi::init(const char *sid)
     return pImpl->init(sid);
 }
 
+int MegaChatApi::init(const char *sid, int dbProfile)
+{
+    return pImpl->init(sid, true, dbProfile);
+}
+
 int MegaChatApi::initLeanMode(const char *sid)
 {
     return pImpl->init(sid, false);
 }
 
+int MegaChatApi::initLeanMode(const char *sid, int dbProfile)
+{
+    return pImpl->init(sid, false, dbProfile);
+}
+
 void MegaChatApi::resetClientid()
 {
    pImpl->resetClientid();
@@ -312,6 +322,11 @@ int MegaChatApi::initAnonymous()
     return pImpl->initAnonymous();
 }
 
+int MegaChatApi::initAnonymous(int dbProfile)
+{
+    return pImpl->initAnonymous(dbProfile);
+}
+
 int MegaChatApi::getInitState()
 {
     return pImpl->getInitState();
@@ -792,6 +807,11 @@ bool MegaChatApi::isMessageReceptionConfirmationActive() const
     return pImpl->isMessageReceptionConfirmationActive();
 }
 
+void MegaChatApi::setHistoryWindow(unsigned int count)
+{
+    pImpl->setHistoryWindow(count);
+}
+
 void MegaChatApi::saveCurrentState()
 {
     pImpl->saveCurrentState();
@@ -961,6 +981,11 @@ void MegaChatApi::setCatchException(bool enable)
     MegaChatApiImpl::setCatchException(enable);
 }
 
+void MegaChatApi::setDecryptionThreads(unsigned int count)
+{
+    MegaChatApiImpl::setDecryptionThreads(count);
+}
+
 bool MegaChatApi::hasUrl(const char *text)
 {
     return MegaChatApiImpl::hasUrl(text);
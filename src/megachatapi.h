@@ -2200,6 +2200,13 @@ public:
         INIT_NO_CACHE               = 7     /// Cache not available for \c sid provided --> it requires login+fetchnodes
     };
 
+    enum
+    {
+        DB_PROFILE_DEFAULT          = 0,    /// Rollback journal and default settings of SQLite
+        DB_PROFILE_PERFORMANCE      = 1,    /// WAL journal, relaxed fsyncs, memory-mapped I/O and bigger page cache
+        DB_PROFILE_WRITE_BEHIND     = 2,    /// Same as DB_PROFILE_PERFORMANCE, and writes are done by a dedicated thread
+    };
+
     enum
     {
         DISCONNECTED    = 0,    /// No connection established
@@ -2306,6 +2313,29 @@ public:
      */
     int init(const char *sid);
 
+    /**
+     * @brief Initializes karere with a specific configuration for its local cache
+     *
+     * Same as MegaChatApi::init, but allows to choose how MEGAchat's database is
+     * opened. Valid values are:
+     *  - MegaChatApi::DB_PROFILE_DEFAULT: rollback journal and default settings of SQLite.
+     *  - MegaChatApi::DB_PROFILE_PERFORMANCE: WAL journal, fsyncs only upon checkpoints,
+     *  memory-mapped I/O, a bigger page cache and temporary tables in memory. Checkpoints
+     *  of the WAL file are done periodically.
+     *  - MegaChatApi::DB_PROFILE_WRITE_BEHIND: same as MegaChatApi::DB_PROFILE_PERFORMANCE,
+     *  but additionally the writes to the database are done by a dedicated thread, so the
+     *  processing of incoming messages doesn't wait for the disk. Pending writes are
+     *  completed upon logout and when the app calls MegaChatApi::saveCurrentState.
+     *
+     * Any other value is rejected: MEGAchat is not initialized and MegaChatApi::INIT_ERROR
+     * is returned.
+     *
+     * @param sid Session id that wants to be resumed, or NULL if a new session will be created.
+     * @param dbProfile Configuration of the local cache
+     * @return The initialization state
+     */
+    int init(const char *sid, int dbProfile);
+
     /**
      * @brief Initializes karere in Lean Mode
      *
@@ -2335,6 +2365,18 @@ public:
      */
     int initLeanMode(const char *sid);
 
+    /**
+     * @brief Initializes karere in Lean Mode with a specific configuration for its local cache
+     *
+     * Same as MegaChatApi::initLeanMode, but allows to choose how MEGAchat's database is
+     * opened. See MegaChatApi::init(const char *, int) for the valid values of \c dbProfile.
+     *
+     * @param sid Session id that wants to be resumed.
+     * @param dbProfile Configuration of the local cache
+     * @return The initialization state
+     */
+    int initLeanMode(const char *sid, int dbProfile);
+
     /**
      * @brief Reset the Client Id for chatd
      *
@@ -2366,6 +2408,17 @@ public:
      */
     int initAnonymous();
 
+    /**
+     * @brief Initializes karere in anonymous mode with a specific configuration for its local cache
+     *
+     * Same as MegaChatApi::initAnonymous, but allows to choose how MEGAchat's database is
+     * opened. See MegaChatApi::init(const char *, int) for the valid values of \c dbProfile.
+     *
+     * @param dbProfile Configuration of the local cache
+     * @return The initialization state
+     */
+    int initAnonymous(int dbProfile);
+
     /**
      * @brief Returns the current initialization state
      *
@@ -4249,6 +4302,22 @@ public:
      */
     bool isMessageReceptionConfirmationActive() const;
 
+    /**
+     * @brief Sets the max number of messages kept in memory for every chatroom that is not opened
+     *
+     * Older messages are evicted from memory, and loaded again from the local cache when the
+     * history of the chatroom is requested. By default there is no limit.
+     *
+     * MegaChatApi::getMessage and MegaChatApi::setMessageSeen still work for evicted messages,
+     * since they are retrieved from the local cache.
+     *
+     * @note This function has no effect if it's called before MegaChatApi::init or its
+     * variants.
+     *
+     * @param count Max number of messages kept in memory per chatroom. Zero means no limit.
+     */
+    void setHistoryWindow(unsigned int count);
+
     /**
      * @brief Saves the current state
      *
@@ -4861,6 +4930,22 @@ public:
 
     static void setCatchException(bool enable);
 
+    /**
+     * @brief Sets the number of threads used to verify and decrypt received messages
+     *
+     * By default (0), messages are decrypted in the thread of the app's event loop. If
+     * enabled, messages whose keys are already available are verified and decrypted by a
+     * pool of worker threads, which reduces the time the event loop is blocked when a lot
+     * of messages are received at once (i.e. upon reconnection). Messages are still
+     * notified in the same order.
+     *
+     * The setting applies to all the instances of MegaChatApi. A reasonable value is
+     * the number of CPU cores.
+     *
+     * @param count Number of threads. 0 to disable the worker threads.
+     */
+    static void setDecryptionThreads(unsigned int count);
+
     /**
      * @brief Checks whether \c text contains a URL
      *
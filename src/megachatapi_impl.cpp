@@ -36,6 +36,7 @@
 #include <base/logger.h>
 #include <IGui.h>
 #include <chatClient.h>
+#include <strongvelope/decryptPool.h>
 #include <mega/base64.h>
 
 #ifdef _WIN32
@@ -1835,10 +1836,33 @@ void MegaChatApiImpl::setLoggerClass(MegaChatLogger *megaLogger)
     }
 }
 
-int MegaChatApiImpl::initAnonymous()
+bool MegaChatApiImpl::isValidDbProfile(int dbProfile)
 {
+    return dbProfile == MegaChatApi::DB_PROFILE_DEFAULT
+            || dbProfile == MegaChatApi::DB_PROFILE_PERFORMANCE
+            || dbProfile == MegaChatApi::DB_PROFILE_WRITE_BEHIND;
+}
+
+void MegaChatApiImpl::setDbProfile(int dbProfile)
+{
+    assert(isValidDbProfile(dbProfile));
+    mClient->setDbProfile(dbProfile == MegaChatApi::DB_PROFILE_DEFAULT
+                          ? SqliteDbProfile()
+                          : SqliteDbProfile::performance());
+    mClient->setDbWriteBehind(dbProfile == MegaChatApi::DB_PROFILE_WRITE_BEHIND);
+}
+
+int MegaChatApiImpl::initAnonymous(int dbProfile)
+{
+    if (!isValidDbProfile(dbProfile))
+    {
+        API_LOG_ERROR("initAnonymous: invalid db profile (%d)", dbProfile);
+        return MegaChatApi::INIT_ERROR;
+    }
+
     sdkMutex.lock();
     createKarereClient();
+    setDbProfile(dbProfile);
 
     int state = mClient->initWithAnonymousSession();
     if (state != karere::Client::kInitAnonymousMode)
@@ -1851,10 +1875,17 @@ int MegaChatApiImpl::initAnonymous()
     return MegaChatApiImpl::convertInitState(state);
 }
 
-int MegaChatApiImpl::init(const char *sid, bool waitForFetchnodesToConnect)
+int MegaChatApiImpl::init(const char *sid, bool waitForFetchnodesToConnect, int dbProfile)
 {
+    if (!isValidDbProfile(dbProfile))
+    {
+        API_LOG_ERROR("init: invalid db profile (%d)", dbProfile);
+        return MegaChatApi::INIT_ERROR;
+    }
+
     sdkMutex.lock();
     createKarereClient();
+    setDbProfile(dbProfile);
 
     int state = mClient->init(sid, waitForFetchnodesToConnect);
     if (state != karere::Client::kInitErrNoCache &&
@@ -2021,6 +2052,11 @@ void MegaChatApiImpl::setCatchException(bool enable)
     karere::gCatchException = enable;
 }
 
+void MegaChatApiImpl::setDecryptionThreads(unsigned int count)
+{
+    strongvelope::DecryptPool::instance().setThreadCount(count);
+}
+
 bool MegaChatApiImpl::hasUrl(const char *text)
 {
     std::string url;
@@ -3269,7 +3305,16 @@ MegaChatMessage *MegaChatApiImpl::getMessage(MegaChatHandle chatid, MegaChatHand
             }
             else
             {
-                API_LOG_ERROR("Failed to find message by temporal id (id: %d)", msgid);
+                // the message may have been evicted from RAM by the history window
+                std::unique_ptr<Message> evictedMsg(chat.loadEvictedMsg(msgid, index));
+                if (evictedMsg)
+                {
+                    megaMsg = new MegaChatMessagePrivate(*evictedMsg, chat.getMsgStatus(*evictedMsg, index), index);
+                }
+                else
+                {
+                    API_LOG_ERROR("Failed to find message by temporal id (id: %d)", msgid);
+                }
             }
         }
     }
@@ -3725,6 +3770,16 @@ bool MegaChatApiImpl::isMessageReceptionConfirmationActive() const
     return mClient ? mClient->mChatdClient->isMessageReceivedConfirmationActive() : false;
 }
 
+void MegaChatApiImpl::setHistoryWindow(unsigned int count)
+{
+    sdkMutex.lock();
+    if (mClient && mClient->mChatdClient)
+    {
+        mClient->mChatdClient->setHistoryWindow(count);
+    }
+    sdkMutex.unlock();
+}
+
 void MegaChatApiImpl::saveCurrentState()
 {
     sdkMutex.lock();
@@ -961,6 +961,8 @@ private:
     void cleanChatHandlers();
 
     static int convertInitState(int state);
+    static bool isValidDbProfile(int dbProfile);
+    void setDbProfile(int dbProfile);
 
 public:
     static void megaApiPostMessage(void* msg, void* ctx);
@@ -974,8 +976,8 @@ public:
     static void setLogWithColors(bool useColors);
     static void setLogToConsole(bool enable);
 
-    int init(const char *sid, bool waitForFetchnodesToConnect = true);
-    int initAnonymous();
+    int init(const char *sid, bool waitForFetchnodesToConnect = true, int dbProfile = MegaChatApi::DB_PROFILE_DEFAULT);
+    int initAnonymous(int dbProfile = MegaChatApi::DB_PROFILE_DEFAULT);
     void createKarereClient();
     void resetClientid();
     int getInitState();
@@ -994,6 +996,7 @@ public:
 #endif
 
     static void setCatchException(bool enable);
+    static void setDecryptionThreads(unsigned int count);
     static bool hasUrl(const char* text);
     bool openNodeHistory(MegaChatHandle chatid, MegaChatNodeHistoryListener *listener);
     bool closeNodeHistory(MegaChatHandle chatid, MegaChatNodeHistoryListener *listener);
@@ -1150,6 +1153,7 @@ public:
     void sendTypingNotification(MegaChatHandle chatid, MegaChatRequestListener *listener = NULL);
     void sendStopTypingNotification(MegaChatHandle chatid, MegaChatRequestListener *listener = NULL);
     bool isMessageReceptionConfirmationActive() const;
+    void setHistoryWindow(unsigned int count);
     void saveCurrentState();
     void pushReceived(bool beep, MegaChatHandle chatid, int type, MegaChatRequestListener *listener = NULL);
 
@@ -0,0 +1,43 @@
+#ifndef fragmentBuffer_h
+#define fragmentBuffer_h
+
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include "buffer.h"
+
+/** @brief Reassembles a received websocket message that arrives in several fragments.
+ *
+ * The buffer is sized from the first fragment of a frame plus the payload of the frame
+ * still pending, and grows geometrically when a message spans several frames. Once
+ * complete, the block is handed over to the connection with \c take(), so the messages
+ * in it (i.e. a HIST response) can reference their payload without copying the frame,
+ * and the next message is reassembled in a new block.
+ */
+class FragmentBuffer
+{
+public:
+    FragmentBuffer(): mBuffer((size_t)0) {}
+    /** Appends a fragment. \c remaining is the payload still pending in its frame */
+    void append(const char* data, size_t len, size_t remaining)
+    {
+        size_t needed = mBuffer.dataSize() + len + remaining;
+        if (needed > mBuffer.bufSize())
+        {
+            mBuffer.reserve(std::max(2 * mBuffer.bufSize(), needed) - mBuffer.dataSize());
+        }
+        memcpy(mBuffer.appendPtr(len), data, len);
+    }
+    bool empty() const { return !mBuffer.dataSize(); }
+    size_t size() const { return mBuffer.dataSize(); }
+    /** Releases the reassembled message, leaving the buffer empty */
+    std::shared_ptr<Buffer> take()
+    {
+        return std::make_shared<Buffer>(std::move(mBuffer));
+    }
+
+protected:
+    Buffer mBuffer;
+};
+
+#endif /* fragmentBuffer_h */
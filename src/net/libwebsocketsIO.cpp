@@ -3,6 +3,7 @@
 
 #include <mega/http.h>
 #include <assert.h>
+#include <algorithm>
 
 using namespace std;
 
@@ -17,6 +18,34 @@ static struct lws_protocols protocols[] =
     { NULL, NULL, 0, 0 } /* terminator */
 };
 
+#ifdef KARERE_WS_COMPRESSION
+#ifdef LWS_WITHOUT_EXTENSIONS
+#error "KARERE_WS_COMPRESSION requires libwebsockets built with extensions support"
+#endif
+#ifndef KARERE_WS_DEFLATE_WINDOW_BITS
+#define KARERE_WS_DEFLATE_WINDOW_BITS 15
+#endif
+#ifndef KARERE_WS_DEFLATE_MEM_LEVEL
+#define KARERE_WS_DEFLATE_MEM_LEVEL 8
+#endif
+static_assert(KARERE_WS_DEFLATE_WINDOW_BITS >= 9 && KARERE_WS_DEFLATE_WINDOW_BITS <= 15, "Invalid deflate window bits");
+static_assert(KARERE_WS_DEFLATE_MEM_LEVEL >= 1 && KARERE_WS_DEFLATE_MEM_LEVEL <= 9, "Invalid deflate memory level");
+#define KARERE_WS_STR(x) #x
+#define KARERE_WS_XSTR(x) KARERE_WS_STR(x)
+
+// The window requested to the server bounds the memory needed to inflate what it sends,
+// the memory level applies to our own deflate stream
+static const struct lws_extension extensions[] =
+{
+    {
+        "permessage-deflate",
+        LibwebsocketsClient::wsDeflateCallback,
+        "permessage-deflate; client_max_window_bits; server_max_window_bits=" KARERE_WS_XSTR(KARERE_WS_DEFLATE_WINDOW_BITS)
+    },
+    { NULL, NULL, NULL } /* terminator */
+};
+#endif
+
 LibwebsocketsIO::LibwebsocketsIO(Mutex &mutex, ::mega::Waiter* waiter, ::mega::MegaApi *api, void *ctx) : WebsocketsIO(mutex, api, ctx)
 {
     struct lws_context_creation_info info;
@@ -30,6 +59,9 @@ LibwebsocketsIO::LibwebsocketsIO(Mutex &mutex, ::mega::Waiter* waiter, ::mega::M
     info.options |= LWS_SERVER_OPTION_DISABLE_OS_CA_CERTS;
     info.options |= LWS_SERVER_OPTION_LIBUV;
     info.options |= LWS_SERVER_OPTION_UV_NO_SIGSEGV_SIGFPE_SPIN;
+#ifdef KARERE_WS_COMPRESSION
+    info.extensions = extensions;
+#endif
     
     lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
     wscontext = lws_create_context(&info);
@@ -160,31 +192,17 @@ LibwebsocketsClient::~LibwebsocketsClient()
 
 void LibwebsocketsClient::appendMessageFragment(char *data, size_t len, size_t remaining)
 {
-    if (!recbuffer.size() && remaining)
-    {
-        recbuffer.reserve(len + remaining);
-    }
-    recbuffer.append(data, len);
+    recbuffer.append(data, len, remaining);
 }
 
 bool LibwebsocketsClient::hasFragments()
 {
-    return recbuffer.size();
-}
-
-const char *LibwebsocketsClient::getMessage()
-{
-    return recbuffer.data();
+    return !recbuffer.empty();
 }
 
-size_t LibwebsocketsClient::getMessageLength()
+std::shared_ptr<Buffer> LibwebsocketsClient::takeMessage()
 {
-    return recbuffer.size();
-}
-
-void LibwebsocketsClient::resetMessage()
-{
-    recbuffer.clear();
+    return recbuffer.take();
 }
 
 bool LibwebsocketsClient::wsSendMessage(char *msg, size_t len)
@@ -198,12 +216,20 @@ bool LibwebsocketsClient::wsSendMessage(char *msg, size_t len)
         return false;
     }
     
-    if (!sendbuffer.size())
+    // chatd parses the commands of each frame on their own, so a message must not be split
+    if (mSendQueue.empty() || mSendQueue.back().dataSize() - LWS_PRE + len > kMaxFrameSize)
+    {
+        mSendQueue.emplace_back(LWS_PRE + std::max<size_t>(len, kMinFrameSize), LWS_PRE);
+    }
+    Buffer& frame = mSendQueue.back();
+    if (frame.dataSize() + len > frame.bufSize())
     {
-        sendbuffer.reserve(LWS_PRE + len);
-        sendbuffer.resize(LWS_PRE);
+        // grow geometrically, so bursts of small messages don't reallocate on each one
+        size_t newSize = std::min<size_t>(std::max(frame.bufSize() * 2, frame.dataSize() + len), LWS_PRE + kMaxFrameSize);
+        frame.reserve(newSize - frame.dataSize());
     }
-    sendbuffer.append(msg, len);
+    memcpy(frame.appendPtr(len), msg, len);
+    mSendQueueSize += len;
 
     if (lws_callback_on_writable(wsi) <= 0)
     {
@@ -259,19 +285,54 @@ bool LibwebsocketsClient::wsIsConnected()
     return wsi != NULL;
 }
 
-const char *LibwebsocketsClient::getOutputBuffer()
+size_t LibwebsocketsClient::wsSendQueueSize()
 {
-    return sendbuffer.size() ? sendbuffer.data() + LWS_PRE : NULL;
+    return mSendQueueSize;
 }
 
-size_t LibwebsocketsClient::getOutputBufferLength()
+WebsocketsStats LibwebsocketsClient::wsStats()
 {
-    return sendbuffer.size() ? sendbuffer.size() - LWS_PRE : 0;
+    WebsocketsStats stats;
+    stats.rawSent = mRawSent;
+    stats.rawReceived = mRawReceived;
+    stats.wireSent = mDeflate ? mWireSent.load() : stats.rawSent;
+    stats.wireReceived = mDeflate ? mWireReceived.load() : stats.rawReceived;
+    return stats;
 }
 
-void LibwebsocketsClient::resetOutputBuffer()
+// Returns -1 on error, which closes the connection
+int LibwebsocketsClient::writeNextFrame()
 {
-    sendbuffer.clear();
+    if (mSendQueue.empty())
+    {
+        return 0;
+    }
+
+    // take the frame out of the queue, since wsSendMsgCb() may queue more messages, or delete us
+    Buffer frame(std::move(mSendQueue.front()));
+    mSendQueue.pop_front();
+    size_t len = frame.dataSize() - LWS_PRE;
+    mSendQueueSize -= len;
+
+    // if the socket doesn't take the whole frame, libwebsockets keeps the rest and
+    // doesn't report the socket as writable again until it has been sent
+    int written = lws_write(wsi, (unsigned char *)frame.buf() + LWS_PRE, len, LWS_WRITE_BINARY);
+    if (written < 0)
+    {
+        WEBSOCKETS_LOG_ERROR("lws_write() failed to write %zu bytes", len);
+        return -1;
+    }
+    mRawSent += len;
+
+    if (!mSendQueue.empty())
+    {
+        lws_callback_on_writable(wsi);
+        wsSendQueueCb(mSendQueueSize);
+        return 0;
+    }
+
+    wsSendMsgCb(frame.buf() + LWS_PRE, len);
+    return 0;
 }
 
 #if (OPENSSL_VERSION_NUMBER < 0x10100000L) || defined (LIBRESSL_VERSION_NUMBER) || defined (OPENSSL_IS_BORINGSSL)
@@ -364,6 +425,13 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 return -1;
             }
             
+#ifdef KARERE_WS_COMPRESSION
+            // fails if the server didn't accept the extension. Our deflate stream is
+            // created with the first message, so the option still applies
+            client->mDeflate = !lws_set_extension_option(wsi, "permessage-deflate", "mem_level",
+                                                         KARERE_WS_XSTR(KARERE_WS_DEFLATE_MEM_LEVEL));
+            WEBSOCKETS_LOG_DEBUG("permessage-deflate %s", client->mDeflate ? "negotiated" : "not accepted by the server");
+#endif
             client->wsConnectCb();
             break;
         }
@@ -392,6 +460,11 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 WEBSOCKETS_LOG_DEBUG("Diagnostic: %s", buf.c_str());
             }
 
+            WebsocketsStats stats = client->wsStats();
+            WEBSOCKETS_LOG_DEBUG("Bytes sent: %llu (%llu on the wire)  received: %llu (%llu on the wire)",
+                                 (unsigned long long)stats.rawSent, (unsigned long long)stats.wireSent,
+                                 (unsigned long long)stats.rawReceived, (unsigned long long)stats.wireReceived);
+
             if (client->wsIsConnected())
             {
                 struct lws *dwsi = client->wsi;
@@ -410,6 +483,7 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 return -1;
             }
             
+            client->mRawReceived += len;
             const size_t remaining = lws_remaining_packet_payload(wsi);
             if (!remaining && lws_is_final_fragment(wsi))
             {
@@ -417,12 +491,13 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 {
                     WEBSOCKETS_LOG_DEBUG("Fragmented data completed");
                     client->appendMessageFragment((char *)data, len, 0);
-                    data = (void *)client->getMessage();
-                    len = client->getMessageLength();
+                    // the reassembled message is handed over with its block, without copying it
+                    client->wsHandleFrameCb(client->takeMessage());
+                }
+                else
+                {
+                    client->wsHandleMsgCb((char *)data, len);
                 }
-                
-                client->wsHandleMsgCb((char *)data, len);
-                client->resetMessage();
             }
             else
             {
@@ -446,15 +521,14 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
                 return -1;
             }
             
-            data = (void *)client->getOutputBuffer();
-            len = client->getOutputBufferLength();
-            if (len && data)
+            if (lws_partial_buffered(wsi))
             {
-                lws_write(wsi, (unsigned char *)data, len, LWS_WRITE_BINARY);
-                client->wsSendMsgCb((const char *)data, len);
-                client->resetOutputBuffer();
+                // the rest of the previous frame is still being sent
+                lws_callback_on_writable(wsi);
+                break;
             }
-            break;
+
+            return client->writeNextFrame();
         }
         default:
             break;
@@ -462,3 +536,31 @@ int LibwebsocketsClient::wsCallback(struct lws *wsi, enum lws_callback_reasons r
     
     return 0;
 }
+
+#ifdef KARERE_WS_COMPRESSION
+// Wraps the permessage-deflate extension of libwebsockets to count the compressed payload:
+// the input it consumes from the received frames, and the output it produces for the sent ones
+int LibwebsocketsClient::wsDeflateCallback(struct lws_context *context, const struct lws_extension *ext, struct lws *wsi,
+                                           enum lws_extension_callback_reasons reason, void *user, void *in, size_t len)
+{
+    bool payload = (reason == LWS_EXT_CB_PAYLOAD_RX || reason == LWS_EXT_CB_PAYLOAD_TX);
+    struct lws_ext_pm_deflate_rx_ebufs *ebufs = payload ? (struct lws_ext_pm_deflate_rx_ebufs *)in : NULL;
+    size_t pending = (reason == LWS_EXT_CB_PAYLOAD_RX) ? ebufs->eb_in.len : 0;
+
+    int result = lws_extension_callback_pm_deflate(context, ext, wsi, reason, user, in, len);
+
+    LibwebsocketsClient* client = (LibwebsocketsClient*)lws_wsi_user(wsi);
+    if (payload && client && result >= 0)
+    {
+        if (reason == LWS_EXT_CB_PAYLOAD_RX)
+        {
+            client->mWireReceived += pending - ebufs->eb_in.len;
+        }
+        else
+        {
+            client->mWireSent += ebufs->eb_out.len;
+        }
+    }
+    return result;
+}
+#endif
@@ -5,8 +5,11 @@
 #include <openssl/ssl.h>
 #include <iostream>
 #include <functional>
+#include <deque>
+#include <atomic>
 
 #include "net/websocketsIO.h"
+#include "net/fragmentBuffer.h"
 
 // Websockets network layer implementation based on libwebsocket
 class LibwebsocketsIO : public WebsocketsIO
@@ -35,25 +38,40 @@ public:
     virtual ~LibwebsocketsClient();
     
 protected:
-    std::string recbuffer;
-    std::string sendbuffer;
+    // consecutive messages are coalesced in frames of up to this size, but never split
+    enum { kMaxFrameSize = 64 * 1024, kMinFrameSize = 4 * 1024 };
+
+    FragmentBuffer recbuffer;
+    // frames pending to be written, one per writable callback. Each one has LWS_PRE bytes
+    // of headroom, which lws_write() requires
+    std::deque<Buffer> mSendQueue;
+    size_t mSendQueueSize = 0;  // bytes of the messages in mSendQueue
+    // updated by the network thread, see WebsocketsStats. The wire counters are only
+    // kept when permessage-deflate was negotiated, otherwise they match the raw ones
+    std::atomic<uint64_t> mRawSent{0};
+    std::atomic<uint64_t> mWireSent{0};
+    std::atomic<uint64_t> mRawReceived{0};
+    std::atomic<uint64_t> mWireReceived{0};
+    std::atomic<bool> mDeflate{false};
 
     void appendMessageFragment(char *data, size_t len, size_t remaining);
     bool hasFragments();
-    const char *getMessage();
-    size_t getMessageLength();
-    void resetMessage();
-    const char *getOutputBuffer();
-    size_t getOutputBufferLength();
-    void resetOutputBuffer();
+    std::shared_ptr<Buffer> takeMessage();
+    int writeNextFrame();
     
     virtual bool wsSendMessage(char *msg, size_t len);
     virtual void wsDisconnect(bool immediate);
     virtual bool wsIsConnected();
+    size_t wsSendQueueSize() override;
+    WebsocketsStats wsStats() override;
     
 public:
     struct lws *wsi;
     static int wsCallback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *data, size_t len);
+#ifdef KARERE_WS_COMPRESSION
+    static int wsDeflateCallback(struct lws_context *context, const struct lws_extension *ext, struct lws *wsi,
+                                 enum lws_extension_callback_reasons reason, void *user, void *in, size_t len);
+#endif
 };
 
 
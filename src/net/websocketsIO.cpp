@@ -1,4 +1,25 @@
 #include "net/websocketsIO.h"
+#include "base/timers.hpp"
+
+struct WebsocketsClient::ConnectRace
+{
+    struct Attempt
+    {
+        std::string ip;
+        WebsocketsClientImpl *impl;
+    };
+
+    WebsocketsIO *websocketIO;
+    std::vector<std::string> ips;
+    size_t nextIp = 0;
+    std::vector<Attempt> attempts;  // in progress
+    std::string host;
+    int port;
+    std::string path;
+    bool ssl;
+    unsigned attemptDelay;
+    megaHandle timer = 0;           // to start the next attempt
+};
 
 WebsocketsIO::WebsocketsIO(Mutex &m, ::mega::MegaApi *megaApi, void *ctx)
     : mApi(*megaApi, ctx, false), mutex(m)
@@ -27,7 +48,7 @@ void WebsocketsClientImpl::wsConnectCb()
 {
     WebsocketsIO::MutexGuard lock(this->mutex);
     WEBSOCKETS_LOG_DEBUG("Connection established");
-    client->wsConnectCb();
+    client->wsConnectCbPrivate(this);
 }
 
 void WebsocketsClientImpl::wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len)
@@ -43,7 +64,7 @@ void WebsocketsClientImpl::wsCloseCb(int errcode, int errtype, const char *preas
         WEBSOCKETS_LOG_DEBUG("Connection closed by server");
     }
 
-    client->wsCloseCbPrivate(errcode, errtype, preason, reason_len);
+    client->wsCloseCbPrivate(this, errcode, errtype, preason, reason_len);
 }
 
 void WebsocketsClientImpl::wsHandleMsgCb(char *data, size_t len)
@@ -53,6 +74,13 @@ void WebsocketsClientImpl::wsHandleMsgCb(char *data, size_t len)
     client->wsHandleMsgCb(data, len);
 }
 
+void WebsocketsClientImpl::wsHandleFrameCb(const std::shared_ptr<Buffer>& frame)
+{
+    WebsocketsIO::MutexGuard lock(this->mutex);
+    WEBSOCKETS_LOG_DEBUG("Received %d bytes", frame->dataSize());
+    client->wsHandleFrameCb(frame);
+}
+
 void WebsocketsClientImpl::wsSendMsgCb(const char *data, size_t len)
 {
     WebsocketsIO::MutexGuard lock(this->mutex);
@@ -60,6 +88,12 @@ void WebsocketsClientImpl::wsSendMsgCb(const char *data, size_t len)
     client->wsSendMsgCb(data, len);
 }
 
+void WebsocketsClientImpl::wsSendQueueCb(size_t queued)
+{
+    WebsocketsIO::MutexGuard lock(this->mutex);
+    client->wsSendQueueCb(queued);
+}
+
 WebsocketsClient::WebsocketsClient()
 {
     ctx = NULL;
@@ -70,6 +104,7 @@ WebsocketsClient::WebsocketsClient()
 
 WebsocketsClient::~WebsocketsClient()
 {
+    abortRace();
     delete ctx;
     ctx = NULL;
 }
@@ -89,14 +124,16 @@ bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, cons
 
     WEBSOCKETS_LOG_DEBUG("Connecting to %s (%s)  port %d  path: %s   ssl: %d", host, ip, port, path, ssl);
 
-    assert(!ctx);
-    if (ctx)
+    assert(!ctx && !mRace);
+    if (ctx || mRace)
     {
         WEBSOCKETS_LOG_ERROR("Valid context at connect()");
         websocketIO->mApi.sdk.sendEvent(99010, "A valid previous context existed upon new wsConnect");
+        abortRace();
         delete ctx;
     }
 
+    mConnectedIp = ip;
     ctx = websocketIO->wsConnect(ip, host, port, path, ssl, this);
     if (!ctx)
     {
@@ -105,6 +142,101 @@ bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const char *ip, cons
     return ctx != NULL;
 }
 
+bool WebsocketsClient::wsConnect(WebsocketsIO *websocketIO, const std::vector<std::string> &ips,
+                                 const char *host, int port, const char *path, bool ssl, unsigned attemptDelayMs)
+{
+#if defined(_WIN32) && defined(_MSC_VER)
+    thread_id = std::this_thread::get_id();
+#else
+    thread_id = pthread_self();
+#endif
+
+    assert(!ctx && !mRace);
+    if (ctx || mRace)
+    {
+        WEBSOCKETS_LOG_ERROR("Valid context at connect()");
+        websocketIO->mApi.sdk.sendEvent(99010, "A valid previous context existed upon new wsConnect");
+        abortRace();
+        delete ctx;
+        ctx = NULL;
+    }
+
+    mConnectedIp.clear();
+    mRace.reset(new ConnectRace);
+    mRace->websocketIO = websocketIO;
+    mRace->ips = ips;
+    mRace->host = host;
+    mRace->port = port;
+    mRace->path = path;
+    mRace->ssl = ssl;
+    mRace->attemptDelay = attemptDelayMs;
+
+    if (!startNextAttempt())
+    {
+        mRace.reset();
+        return false;
+    }
+    return true;
+}
+
+// Returns false if there are no more IPs to attempt, or all of them failed immediately
+bool WebsocketsClient::startNextAttempt()
+{
+    ConnectRace &race = *mRace;
+    if (race.timer)
+    {
+        karere::cancelTimeout(race.timer, race.websocketIO->appCtx);
+        race.timer = 0;
+    }
+
+    while (race.nextIp < race.ips.size())
+    {
+        const std::string &ip = race.ips[race.nextIp++];
+        WEBSOCKETS_LOG_DEBUG("Connecting to %s (%s)  port %d  path: %s   ssl: %d", race.host.c_str(), ip.c_str(),
+                             race.port, race.path.c_str(), race.ssl);
+
+        WebsocketsClientImpl *impl = race.websocketIO->wsConnect(ip.c_str(), race.host.c_str(),
+                                                                 race.port, race.path.c_str(), race.ssl, this);
+        if (!impl)
+        {
+            WEBSOCKETS_LOG_WARNING("Immediate error in wsConnect to %s", ip.c_str());
+            continue;
+        }
+        race.attempts.push_back({ip, impl});
+
+        if (race.nextIp < race.ips.size())
+        {
+            race.timer = karere::setTimeout([this]()
+            {
+                mRace->timer = 0;
+                WEBSOCKETS_LOG_DEBUG("Not connected after %u ms, attempting the next IP", mRace->attemptDelay);
+                startNextAttempt();
+            }, race.attemptDelay, race.websocketIO->appCtx);
+        }
+        return true;
+    }
+    return false;
+}
+
+void WebsocketsClient::abortRace()
+{
+    if (!mRace)
+    {
+        return;
+    }
+
+    if (mRace->timer)
+    {
+        karere::cancelTimeout(mRace->timer, mRace->websocketIO->appCtx);
+    }
+    for (auto &attempt: mRace->attempts)
+    {
+        attempt.impl->wsDisconnect(true);
+        delete attempt.impl;
+    }
+    mRace.reset();
+}
+
 int WebsocketsClient::wsGetNoNameErrorCode(WebsocketsIO *websocketIO)
 {
     return websocketIO->wsGetNoNameErrorCode();
@@ -136,10 +268,27 @@ bool WebsocketsClient::wsSendMessage(char *msg, size_t len)
     return result;
 }
 
+size_t WebsocketsClient::wsSendQueueSize()
+{
+    return ctx ? ctx->wsSendQueueSize() : 0;
+}
+
+WebsocketsStats WebsocketsClient::wsStats()
+{
+    return ctx ? ctx->wsStats() : WebsocketsStats();
+}
+
 void WebsocketsClient::wsDisconnect(bool immediate)
 {
     WEBSOCKETS_LOG_DEBUG("Disconnecting. Immediate: %d", immediate);
     
+    if (mRace)
+    {
+        // none of the attempts is established yet, so there's nothing to close gracefully
+        abortRace();
+        return;
+    }
+
     if (!ctx)
     {
         return;
@@ -163,7 +312,7 @@ bool WebsocketsClient::wsIsConnected()
 {
     if (!ctx)
     {
-        return false;
+        return mRace != nullptr;   // connecting
     }
     
 #if defined(_WIN32) && defined(_MSC_VER)
@@ -175,9 +324,55 @@ bool WebsocketsClient::wsIsConnected()
     return ctx->wsIsConnected();
 }
 
-void WebsocketsClient::wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len)
+void WebsocketsClient::wsConnectCbPrivate(WebsocketsClientImpl *impl)
+{
+    if (mRace)
+    {
+        auto it = std::find_if(mRace->attempts.begin(), mRace->attempts.end(),
+                               [impl](const ConnectRace::Attempt &attempt) { return attempt.impl == impl; });
+        assert(it != mRace->attempts.end());
+        if (it == mRace->attempts.end())
+        {
+            return;
+        }
+
+        WEBSOCKETS_LOG_DEBUG("Connected to %s, closing %zu other attempts", it->ip.c_str(), mRace->attempts.size() - 1);
+        mConnectedIp = it->ip;
+        ctx = impl;
+        mRace->attempts.erase(it);
+        abortRace();
+    }
+
+    wsConnectCb();
+}
+
+void WebsocketsClient::wsCloseCbPrivate(WebsocketsClientImpl *impl, int errcode, int errtype, const char *preason, size_t reason_len)
 {
-    if (!ctx)   // immediate disconnect ocurred before the marshall is executed (only applies to libws)
+    if (mRace)
+    {
+        auto it = std::find_if(mRace->attempts.begin(), mRace->attempts.end(),
+                               [impl](const ConnectRace::Attempt &attempt) { return attempt.impl == impl; });
+        if (it == mRace->attempts.end())
+        {
+            return;
+        }
+
+        WEBSOCKETS_LOG_DEBUG("Connection attempt to %s failed", it->ip.c_str());
+        mConnectedIp = it->ip;
+        mRace->attempts.erase(it);
+        delete impl;
+
+        // if the last attempt in progress failed, don't wait to start the next one
+        if (!mRace->attempts.empty() || startNextAttempt())
+        {
+            return;
+        }
+        mRace.reset();
+        wsCloseCb(errcode, errtype, preason, reason_len);
+        return;
+    }
+
+    if (ctx != impl)   // immediate disconnect ocurred before the marshall is executed (only applies to libws)
     {
         return;
     }
@@ -315,6 +510,31 @@ bool DNScache::getIp(int shard, std::string &ipv4, std::string &ipv6)
     return ipv4.size() || ipv6.size();
 }
 
+bool DNScache::getIpsByPreference(int shard, std::vector<std::string> &ips)
+{
+    ips.clear();
+    auto it = mRecords.find(shard);
+    if (it == mRecords.end())
+    {
+        return false;
+    }
+
+    const DNSrecord &record = it->second;
+    assert(record.mUrl.isValid());
+    bool ipv4First = record.connectIpv4Ts > record.connectIpv6Ts;
+    const std::string &first = ipv4First ? record.ipv4 : record.ipv6;
+    const std::string &second = ipv4First ? record.ipv6 : record.ipv4;
+    if (first.size())
+    {
+        ips.push_back(first);
+    }
+    if (second.size())
+    {
+        ips.push_back(second);
+    }
+    return !ips.empty();
+}
+
 void DNScache::connectDone(int shard, const std::string &ip)
 {
     auto it = mRecords.find(shard);
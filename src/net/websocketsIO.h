@@ -4,6 +4,7 @@
 #include <iostream>
 #include <functional>
 #include <vector>
+#include <memory>
 #include <mega/waiter.h>
 #include <mega/thread.h>
 #include "base/logger.h"
@@ -37,6 +38,8 @@ public:
     // the record for the given shard must exist (to load from DB)
     bool setIp(int shard, std::string ipv4, std::string ipv6);
     bool getIp(int shard, std::string &ipv4, std::string &ipv6);
+    // cached IPs, in the order to attempt them: IPv6 first, unless IPv4 connected more recently
+    bool getIpsByPreference(int shard, std::vector<std::string> &ips);
     void connectDone(int shard, const std::string &ip);
     bool isMatch(int shard, const std::vector<std::string> &ipsv4, const std::vector<std::string> &ipsv6);
     bool isMatch(int shard, const std::string &ipv4, const std::string &ipv6);
@@ -100,6 +103,16 @@ protected:
 };
 
 
+// Payload bytes transferred by a websocket connection, as sent / received by the client (raw),
+// and as carried by the frames (wire). They only differ if the messages are compressed
+struct WebsocketsStats
+{
+    uint64_t rawSent = 0;
+    uint64_t wireSent = 0;
+    uint64_t rawReceived = 0;
+    uint64_t wireReceived = 0;
+};
+
 // Abstract class that allows to manage a websocket connection.
 // It's needed to subclass this class in order to receive callbacks
 
@@ -107,6 +120,9 @@ class WebsocketsClient
 {
 private:
     WebsocketsClientImpl *ctx;
+    struct ConnectRace;
+    std::unique_ptr<ConnectRace> mRace;     // attempts in progress of a connection to several IPs
+    std::string mConnectedIp;
 #if defined(_WIN32) && defined(_MSC_VER)
     std::thread::id thread_id;
 #else
@@ -114,21 +130,41 @@ private:
 #endif
 
 public:
+    enum { kConnectAttemptDelay = 250 };    // (in milliseconds) recommended by RFC 8305
+
     WebsocketsClient();
     virtual ~WebsocketsClient();
     bool wsResolveDNS(WebsocketsIO *websocketIO, const char *hostname, std::function<void(int, const std::vector<std::string>&, const std::vector<std::string>&)> f);
     bool wsConnect(WebsocketsIO *websocketIO, const char *ip,
                    const char *host, int port, const char *path, bool ssl);
+    // Connects to the first IP that responds (RFC 8305): the IPs are attempted in order, starting the next
+    // attempt once the previous one has failed or after attemptDelayMs, whatever happens first. The first
+    // connection established is kept and the rest are closed. wsCloseCb() is called if all of them fail
+    bool wsConnect(WebsocketsIO *websocketIO, const std::vector<std::string> &ips,
+                   const char *host, int port, const char *path, bool ssl,
+                   unsigned attemptDelayMs = kConnectAttemptDelay);
+    const std::string &wsConnectedIp() const { return mConnectedIp; }  // IP of the last connection (attempt)
     int wsGetNoNameErrorCode(WebsocketsIO *websocketIO);
     bool wsSendMessage(char *msg, size_t len);  // returns true on success, false if error
+    size_t wsSendQueueSize();   // bytes accepted by wsSendMessage() and not written to the socket yet
+    WebsocketsStats wsStats();  // of the current connection, if any
     void wsDisconnect(bool immediate);
     bool wsIsConnected();
-    void wsCloseCbPrivate(int errcode, int errtype, const char *preason, size_t reason_len);
+    void wsConnectCbPrivate(WebsocketsClientImpl *impl);
+    void wsCloseCbPrivate(WebsocketsClientImpl *impl, int errcode, int errtype, const char *preason, size_t reason_len);
 
     virtual void wsConnectCb() = 0;
     virtual void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len) = 0;
     virtual void wsHandleMsgCb(char *data, size_t len) = 0;
+    // called instead of wsHandleMsgCb() when the message is in a block that the client can keep
+    virtual void wsHandleFrameCb(const std::shared_ptr<Buffer>& frame) { wsHandleMsgCb(frame->buf(), frame->dataSize()); }
     virtual void wsSendMsgCb(const char *data, size_t len) = 0;
+    // called when a frame is written and there is still output queued, with the bytes queued
+    virtual void wsSendQueueCb(size_t /*queued*/) {}
+
+private:
+    bool startNextAttempt();
+    void abortRace();
 };
 
 
@@ -145,11 +181,17 @@ public:
     void wsConnectCb();
     void wsCloseCb(int errcode, int errtype, const char *preason, size_t reason_len);
     void wsHandleMsgCb(char *data, size_t len);
+    void wsHandleFrameCb(const std::shared_ptr<Buffer>& frame);
     void wsSendMsgCb(const char *data, size_t len);
+    void wsSendQueueCb(size_t queued);
     
     virtual bool wsSendMessage(char *msg, size_t len) = 0;
     virtual void wsDisconnect(bool immediate) = 0;
     virtual bool wsIsConnected() = 0;
+    // implementations that queue the output must call wsSendMsgCb() once all of it is written,
+    // and wsSendQueueCb() after writing part of it
+    virtual size_t wsSendQueueSize() { return 0; }
+    virtual WebsocketsStats wsStats() { return WebsocketsStats(); }
 };
 
 #endif /* websocketsIO_h */
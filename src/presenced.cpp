@@ -117,6 +117,7 @@ void Client::pushPeers()
 
 void Client::wsConnectCb()
 {
+    mTargetIp = wsConnectedIp();    // the winner of the race among the IPs
     setConnState(kConnected);
 }
 
@@ -148,7 +149,6 @@ void Client::onSocketClose(int errcode, int errtype, const std::string& reason)
 
     assert(oldState != kDisconnected);
 
-    usingipv6 = !usingipv6;
     mTargetIp.clear();
 
     if (oldState >= kConnected)
@@ -230,7 +230,7 @@ bool Client::requestLastGreen(Id userid)
 
 time_t Client::getLastGreen(Id userid)
 {
-    std::map<uint64_t, time_t>::iterator it = mPeersLastGreen.find(userid.val);
+    auto it = mPeersLastGreen.find(userid.val);
     if (it != mPeersLastGreen.end())
     {
         return it->second;
@@ -868,56 +868,32 @@ void Client::disconnect()
 
 void Client::doConnect()
 {
-    string ipv4, ipv6;
-    bool cachedIPs = mDnsCache.getIp(kPresencedShard, ipv4, ipv6);
+    std::vector<std::string> ips;
+    bool cachedIPs = mDnsCache.getIpsByPreference(kPresencedShard, ips);
     assert(cachedIPs);
-    mTargetIp = (usingipv6 && ipv6.size()) ? ipv6 : ipv4;
+    mTargetIp = ips.size() ? ips.front() : "";
 
     const karere::Url &url = mDnsCache.getUrl(kPresencedShard);
     assert (url.isValid());
 
     setConnState(kConnecting);
-    PRESENCED_LOG_DEBUG("Connecting to presenced using the IP: %s", mTargetIp.c_str());
+    PRESENCED_LOG_DEBUG("Connecting to presenced using %zu IPs, preferred: %s", ips.size(), mTargetIp.c_str());
 
-    bool rt = wsConnect(mKarereClient->websocketIO, mTargetIp.c_str(),
-          url.host.c_str(),
-          url.port,
-          url.path.c_str(),
-          url.isSecure);
+    // the IP families race each other, in order of the last successful connection (if any)
+    bool rt = wsConnect(mKarereClient->websocketIO, ips,
+              url.host.c_str(),
+              url.port,
+              url.path.c_str(),
+              url.isSecure);
 
-    if (!rt)    // immediate failure --> try the other IP family (if available)
+    if (!rt)    // immediate failure of every IP
     {
-        PRESENCED_LOG_DEBUG("Connection to presenced failed using the IP: %s", mTargetIp.c_str());
-
-        string oldTargetIp = mTargetIp;
-        mTargetIp.clear();
-        if (oldTargetIp == ipv6 && ipv4.size())
-        {
-            mTargetIp = ipv4;
-        }
-        else if (oldTargetIp == ipv4 && ipv6.size())
-        {
-            mTargetIp = ipv6;
-        }
-
-        if (mTargetIp.size())
-        {
-            PRESENCED_LOG_DEBUG("Retrying using the IP: %s", mTargetIp.c_str());
-            if (wsConnect(mKarereClient->websocketIO, mTargetIp.c_str(),
-                          url.host.c_str(),
-                          url.port,
-                          url.path.c_str(),
-                          url.isSecure))
-            {
-                return;
-            }
-            PRESENCED_LOG_DEBUG("Connection to presenced failed using the IP: %s", mTargetIp.c_str());
-        }        
-        else
+        PRESENCED_LOG_DEBUG("Connection to presenced failed using every IP");
+        if (ips.size() < 2)
         {
             // do not close the socket, which forces a new retry attempt and turns the DNS response obsolete
             // Instead, let the DNS request to complete, in order to refresh IPs
-            PRESENCED_LOG_DEBUG("Empty cached IP. Waiting for DNS resolution...");
+            PRESENCED_LOG_DEBUG("No other cached IP. Waiting for DNS resolution...");
             return;
         }
 
@@ -7,6 +7,7 @@
 #include <base/promise.h>
 #include <base/timers.hpp>
 #include <karereId.h>
+#include <idMap.h>
 #include <url.h>
 #include <base/trackDelete.h>
 #include <net/websocketsIO.h>
@@ -284,7 +285,7 @@ private:
 public:
     Command(): Buffer(){}
     Command(Command&& other): Buffer(std::forward<Buffer>(other)) {assert(!other.buf() && !other.bufSize() && !other.dataSize());}
-    Command(uint8_t opcode, uint8_t reserve=10): Buffer(reserve+1) { write(0, opcode); }
+    Command(uint8_t opcode, uint8_t reserve=10): Buffer(reserve+1, 0, true) { write(0, opcode); }
     template<class T>
     Command&& operator+(const T& val)
     {
@@ -352,12 +353,9 @@ protected:
     /** When enabled, hearbeat() method is called periodically */
     bool mHeartbeatEnabled = false;
 
-    /** Target IP address being used for the reconnection in-flight */
+    /** Preferred IP of the reconnection in-flight, or the one that won the race once connected */
     std::string mTargetIp;
 
-    /** ip version to try first (both are tried) */
-    bool usingipv6 = false;
-
     /** RetryController that manages the reconnection's attempts */
     std::unique_ptr<karere::rh::IRetryController> mRetryCtrl;
 
@@ -395,18 +393,18 @@ protected:
     IdRefMap mCurrentPeers;
 
     /** Map of userids (key) and presence (value) of any user wich we're allowed to receive it's presence */
-    std::map<uint64_t, karere::Presence> mPeersPresence;
+    karere::IdMap<uint64_t, karere::Presence> mPeersPresence;
 
     /** Map of userids (key) and last green (value) of any contact or any user in our groupchats, except ex-contacts */
-    std::map<uint64_t, time_t> mPeersLastGreen;
+    karere::IdMap<uint64_t, time_t> mPeersLastGreen;
 
     /** Map of chatids (key) and the list of peers (value) in every chat (updated only from API) */
-    std::map<uint64_t, karere::SetOfIds> mChatMembers;
+    karere::IdMap<uint64_t, karere::SetOfIds> mChatMembers;
 
     /** Map of userid of contacts (key) and their visibility (value) (updated only from API)
      * @note: ex-contacts are included.
      */
-    std::map<uint64_t, int> mContacts;
+    karere::IdMap<uint64_t, int> mContacts;
 
     /** Sequence-number for the list of peers and contacts above (initialized upon completion of catch-up phase) */
     karere::Id mLastScsn = karere::Id::inval();
@@ -0,0 +1,174 @@
+#ifndef STRONGVELOPE_DECRYPT_POOL_H
+#define STRONGVELOPE_DECRYPT_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <map>
+#include <functional>
+#include <gcmpp.h>
+
+namespace strongvelope
+{
+/** @brief Pool of worker threads to verify and decrypt received messages off the app
+ * thread, so that a burst of history (i.e. after a reconnect) doesn't starve it.
+ *
+ * A job consists of a \c work function, executed by a worker thread, and an optional
+ * \c done function, which is marshalled to the app thread once the work is finished.
+ * The \c done functions of the jobs that finish close in time are marshalled together,
+ * in the order the jobs finished, which may differ from the order of submission.
+ * The \c work function must only access data owned by the job (copies of the keys,
+ * shared pointers to immutable data...), and no promises, as they are not thread-safe.
+ *
+ * The pool has no threads by default (disabled), see \c setThreadCount()
+ */
+class DecryptPool
+{
+protected:
+    struct Job
+    {
+        std::function<void()> work;
+        std::function<void()> done;
+        void* appCtx;
+        Job(std::function<void()>&& aWork, std::function<void()>&& aDone, void* aAppCtx)
+            : work(std::move(aWork)), done(std::move(aDone)), appCtx(aAppCtx) {}
+    };
+    std::mutex mConfigMutex;            // serializes setThreadCount() calls
+    std::mutex mMutex;
+    std::condition_variable mCv;        // wakes up the workers
+    std::condition_variable mIdleCv;    // signals that there are no queued or running jobs
+    std::deque<Job> mQueue;
+    std::map<void*, std::vector<std::function<void()>>> mCompleted;   // done functions pending to be called, by appCtx
+    std::vector<std::thread> mThreads;
+    std::atomic<unsigned> mThreadCount;
+    unsigned mRunning = 0;              // jobs being executed
+    bool mExit = false;
+
+    DecryptPool(): mThreadCount(0) {}
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true)
+        {
+            mCv.wait(lock, [this] { return !mQueue.empty() || mExit; });
+            if (mQueue.empty())
+                break;  // exiting, all the queued jobs have been executed
+
+            Job job(std::move(mQueue.front()));
+            mQueue.pop_front();
+            mRunning++;
+            lock.unlock();
+
+            try
+            {
+                job.work();
+            }
+            catch (std::exception& e)
+            {
+                // jobs are expected to report their own errors
+                KARERE_LOG_ERROR(krLogChannel_strongvelope, "DecryptPool: unhandled exception in job: %s", e.what());
+            }
+            job.work = nullptr; // release the captured data in this thread
+
+            lock.lock();
+            mRunning--;
+            bool post = false;
+            if (job.done)
+            {
+                auto& completed = mCompleted[job.appCtx];
+                post = completed.empty();   // otherwise a call is already queued for them
+                completed.push_back(std::move(job.done));
+            }
+            if (mQueue.empty() && !mRunning)
+                mIdleCv.notify_all();
+
+            if (post)
+            {
+                void* appCtx = job.appCtx;
+                karere::marshallCall([this, appCtx]() { callCompleted(appCtx); }, appCtx);
+            }
+        }
+    }
+    void callCompleted(void* appCtx)
+    {
+        std::vector<std::function<void()>> completed;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            auto it = mCompleted.find(appCtx);
+            if (it == mCompleted.end())
+                return;
+            completed.swap(it->second);
+            mCompleted.erase(it);
+        }
+        for (auto& done: completed)
+            done();
+    }
+    void stopThreads()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mExit = true;
+        }
+        mCv.notify_all();
+        for (auto& thread: mThreads)
+            thread.join();
+        mThreads.clear();
+        mExit = false;
+    }
+
+public:
+    static DecryptPool& instance()
+    {
+        // never destroyed, since jobs may complete during static destruction
+        static DecryptPool* pool = new DecryptPool;
+        return *pool;
+    }
+
+    /** @brief Sets the number of worker threads. Zero disables the pool, after
+     * executing the jobs already submitted. Must not be called from a worker thread */
+    void setThreadCount(unsigned count)
+    {
+        std::lock_guard<std::mutex> lock(mConfigMutex);
+        if (count == mThreadCount)
+            return;
+
+        mThreadCount = 0;   // don't accept new jobs while restarting
+        stopThreads();
+        for (unsigned i = 0; i < count; i++)
+            mThreads.emplace_back([this]() { run(); });
+        mThreadCount = count;
+    }
+    unsigned threadCount() const { return mThreadCount; }
+    bool isEnabled() const { return mThreadCount > 0; }
+
+    /** @brief Queues a job. If the pool is disabled, the job is executed in the calling thread,
+     * and its \c done function is marshalled to the app thread as well */
+    void submit(std::function<void()>&& work, std::function<void()>&& done=nullptr, void* appCtx=nullptr)
+    {
+        if (!isEnabled())
+        {
+            work();
+            if (done)
+                karere::marshallCall(std::move(done), appCtx);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mQueue.emplace_back(std::move(work), std::move(done), appCtx);
+        }
+        mCv.notify_one();
+    }
+
+    /** @brief Waits until all the submitted jobs have been executed. Their \c done functions
+     * may not be called yet */
+    void waitIdle()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mIdleCv.wait(lock, [this] { return mQueue.empty() && !mRunning; });
+    }
+};
+}
+#endif
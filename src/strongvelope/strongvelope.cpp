@@ -23,10 +23,12 @@
 
 #include "strongvelope.h"
 #include "cryptofunctions.h"
+#include "decryptPool.h"
 #include <ctime>
 #include "sodium.h"
 #include "tlvstore.h"
 #include <userAttrCache.h>
+#include <dbStatements.h>
 #include <mega.h>
 #include <megaapi.h>
 #include <db.h>
@@ -74,6 +76,21 @@ const char* tlvTypeToString(uint8_t type)
     }
 }
 
+/** Lists the record types set in a bitmask (bit N set for type N), for logging */
+std::string tlvTypesToString(uint32_t types)
+{
+    std::string result;
+    for (uint8_t type = 0; type < 32; type++)
+    {
+        if (!(types & (1u << type)))
+            continue;
+        if (!result.empty())
+            result.append(", ");
+        result.append(tlvTypeToString(type));
+    }
+    return result;
+}
+
 uint32_t getKeyIdLength(uint32_t protocolVersion)
 {
     return (protocolVersion == 1) ? 8 : 4;
@@ -91,21 +108,21 @@ EncryptedMessage::EncryptedMessage(const Message& msg, const StaticBuffer& aKey)
     *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0; //zero the 32-bit counter
     assert(derivedNonce.dataSize() == AES::BLOCKSIZE);
 
+    // build the cleartext and encrypt it in place
     size_t brsize = msg.backRefs.size()*8;
     size_t binsize = 10+brsize;
-    Buffer buf(binsize+msg.dataSize());
-    buf.append<uint64_t>(msg.backRefId)
+    ciphertext.reserve(binsize+msg.dataSize());
+    ciphertext.append<uint64_t>(msg.backRefId)
        .append<uint16_t>(brsize);
     if (brsize)
     {
-        buf.append((const char*)(&msg.backRefs[0]), brsize);
+        ciphertext.append((const char*)(&msg.backRefs[0]), brsize);
     }
     if (!msg.empty())
     {
-        buf.append(msg);
+        ciphertext.append(msg);
     }
-    ciphertext = aesCTREncrypt(std::string(buf.buf(), buf.dataSize()),
-        key, derivedNonce);
+    aesCTRCrypt(key, derivedNonce, ciphertext);
 }
 
 /**
@@ -123,6 +140,21 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     }
     Id chatid = mProtoHandler.chatid;   // for the log below
     STRONGVELOPE_LOG_DEBUG("Decrypting msg %s", outMsg.id().toString().c_str());
+    Buffer cleartext(payload.dataSize());
+    decryptPayload(key, cleartext);
+    setDecryptedPayload(cleartext, outMsg);
+}
+
+/**
+ * Decrypts the payload using AES-128-CTR into \c cleartext, without parsing it.
+ * It doesn't access the ProtocolHandler nor the message, so it can be called
+ * from a DecryptPool thread.
+ *
+ * @param key Symmetric encryption key.
+ * @param cleartext The buffer to write the decrypted payload to.
+ */
+void ParsedMessage::decryptPayload(const StaticBuffer& key, Buffer& cleartext) const
+{
     Key<32> derivedNonce;
     // deriveNonceSecret() needs at least 32 bytes output buffer
     deriveNonceSecret(nonce, derivedNonce);
@@ -130,9 +162,13 @@ void ParsedMessage::symmetricDecrypt(const StaticBuffer& key, Message& outMsg)
     // For AES CRT mode, we take the first 12 bytes as the nonce,
     // and the remaining 4 bytes as the counter, which is initialized to zero
     *reinterpret_cast<uint32_t*>(derivedNonce.buf()+SVCRYPTO_NONCE_SIZE) = 0;
-    std::string cleartext = aesCTRDecrypt(std::string(payload.buf(), payload.dataSize()),
-        key, derivedNonce);
-    parsePayload(StaticBuffer(cleartext, false), outMsg);
+    cleartext.clear();
+    aesCTRCrypt(key, derivedNonce, payload, cleartext);
+}
+
+void ParsedMessage::setDecryptedPayload(const StaticBuffer& cleartext, Message& outMsg)
+{
+    parsePayload(cleartext, outMsg);
     outMsg.setEncrypted(Message::kNotEncrypted);
 }
 
@@ -173,10 +209,14 @@ void ProtocolHandler::signMessage(const StaticBuffer& signedData,
     assert(signature.dataSize() == crypto_sign_BYTES);
 // To save space, myPrivEd25519 holds only the 32-bit seed of the priv key,
 // without the pubkey part, so we add it here
-    Buffer key(myPrivEd25519.dataSize()+myPubEd25519.dataSize());
-    key.append(myPrivEd25519).append(myPubEd25519);
-
-    Buffer toSign(msgKey.dataSize()+signedData.dataSize()+SVCRYPTO_SIG.size()+10);
+    assert(myPrivEd25519.dataSize()+myPubEd25519.dataSize() == crypto_sign_SECRETKEYBYTES);
+    unsigned char key[crypto_sign_SECRETKEYBYTES];
+    memcpy(key, myPrivEd25519.buf(), myPrivEd25519.dataSize());
+    memcpy(key+myPrivEd25519.dataSize(), myPubEd25519.buf(), myPubEd25519.dataSize());
+
+    Buffer& toSign = mSignatureBuf;
+    toSign.clear();
+    toSign.reserve(msgKey.dataSize()+signedData.dataSize()+SVCRYPTO_SIG.size()+10);
     toSign.append(SVCRYPTO_SIG)
           .append<uint8_t>(protoVersion)
           .append<uint8_t>(msgType)
@@ -184,16 +224,23 @@ void ProtocolHandler::signMessage(const StaticBuffer& signedData,
           .append(signedData);
 
     crypto_sign_detached(signature.ubuf(), NULL, toSign.ubuf(),
-        toSign.dataSize(), key.ubuf());
+        toSign.dataSize(), key);
 }
 
 bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey)
+{
+    Buffer messageStr(SVCRYPTO_SIG.size()+sendKey.dataSize()+signedContent.dataSize()+2);
+    return verifySignature(pubKey, sendKey, messageStr);
+}
+
+bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey, Buffer& scratch) const
 {
     assert(pubKey.dataSize() == 32);
+    Buffer& messageStr = scratch;
+    messageStr.clear();
     if (protocolVersion < 2)
     {
         //legacy
-        Buffer messageStr(SVCRYPTO_SIG.size()+signedContent.dataSize());
         messageStr.append(SVCRYPTO_SIG.c_str(), SVCRYPTO_SIG.size())
         .append(signedContent);
         return (crypto_sign_verify_detached(signature.ubuf(), messageStr.ubuf(),
@@ -201,8 +248,6 @@ bool ParsedMessage::verifySignature(const StaticBuffer& pubKey, const SendKey& s
     }
 
     assert(sendKey.dataSize() == SVCRYPTO_KEY_SIZE);
-    Buffer messageStr(SVCRYPTO_SIG.size()+sendKey.dataSize()+signedContent.dataSize()+2);
-
     messageStr.append(SVCRYPTO_SIG.c_str(), SVCRYPTO_SIG.size())
     .append<uint8_t>(protocolVersion)
     .append<uint8_t>(type)
@@ -241,13 +286,253 @@ void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const st
     memcpy(output.buf(), step2.buf(), AES::BLOCKSIZE);
 }
 
+const std::string SVCRYPTO_SYMMKEY_CACHE = "karere symmetric key cache";
+
+SymmKeyCache::SymmKeyCache(const StaticBuffer& privCu25519, SqliteDb* db)
+: mDb(db)
+{
+    deriveSharedKey(privCu25519, mMacKey, SVCRYPTO_SYMMKEY_CACHE);
+    if (mDb)
+    {
+        loadFromDb();
+    }
+}
+
+void SymmKeyCache::computeMac(karere::Id user, const StaticBuffer& pubKey, const SendKey& key, Key<32>& mac) const
+{
+    Buffer data(sizeof(uint64_t) + pubKey.dataSize() + key.dataSize());
+    data.append<uint64_t>(user.val).append(pubKey).append(key);
+    hmac_sha256_bytes(data, mMacKey, mac);
+}
+
+void SymmKeyCache::loadFromDb()
+{
+    std::vector<karere::Id> invalid;
+    SqliteStmt stmt(*mDb, "select userid, pubkey, key, mac from symm_keys");
+    while (stmt.step())
+    {
+        karere::Id user(stmt.uint64Col(0));
+        if (sqlite3_column_bytes(stmt, 2) != SVCRYPTO_KEY_SIZE
+                || sqlite3_column_bytes(stmt, 3) != 32)
+        {
+            invalid.push_back(user);
+            continue;
+        }
+        Buffer pubKey;
+        stmt.blobCol(1, pubKey);
+        auto key = std::make_shared<SendKey>();
+        stmt.blobCol(2, *key);
+        Key<32> mac;
+        computeMac(user, pubKey, *key, mac);
+        if (memcmp(mac.buf(), sqlite3_column_blob(stmt, 3), mac.dataSize()) != 0)
+        {
+            invalid.push_back(user);
+            continue;
+        }
+        mKeys.emplace(user, pubKey, key);
+    }
+    KARERE_LOG_DEBUG(krLogChannel_strongvelope, "Loaded %zu symmetric keys from database", mKeys.size());
+
+    if (invalid.empty())
+    {
+        return;
+    }
+    KARERE_LOG_WARNING(krLogChannel_strongvelope, "Removing %zu symmetric keys that failed the check from database", invalid.size());
+    try
+    {
+        for (auto& user: invalid)
+        {
+            mDb->query("delete from symm_keys where userid = ?", user);
+        }
+    }
+    catch (std::exception& e)
+    {
+        // not fatal, they are ignored again in the next session
+        KARERE_LOG_ERROR(krLogChannel_strongvelope, "Error removing symmetric keys from db: %s", e.what());
+    }
+}
+
+std::shared_ptr<SendKey> SymmKeyCache::get(karere::Id user, const StaticBuffer& pubKey) const
+{
+    auto it = mKeys.find(user);
+    if (it == mKeys.end())
+    {
+        return nullptr;
+    }
+    auto& entry = it->second;
+    if (entry.pubKey.size() != pubKey.dataSize()
+            || memcmp(entry.pubKey.data(), pubKey.buf(), pubKey.dataSize()) != 0)
+    {
+        return nullptr;
+    }
+    return entry.key;
+}
+
+void SymmKeyCache::put(karere::Id user, const StaticBuffer& pubKey, const std::shared_ptr<SendKey>& key)
+{
+    mKeys.erase(user);
+    mKeys.emplace(user, pubKey, key);
+    if (!mDb)
+    {
+        return;
+    }
+
+    Key<32> mac;
+    computeMac(user, pubKey, *key, mac);
+    try
+    {
+        mDb->query("insert or replace into symm_keys(userid, pubkey, key, mac) values(?,?,?,?)",
+            user, pubKey, *key, mac);
+    }
+    catch (std::exception& e)
+    {
+        // not fatal, the key will be derived again in the next session
+        KARERE_LOG_ERROR(krLogChannel_strongvelope, "Error saving symmetric key of user %s to db: %s",
+                         user.toString().c_str(), e.what());
+    }
+}
+
+void SymmKeyCache::invalidate(karere::Id user)
+{
+    if (!mKeys.erase(user) || !mDb)
+    {
+        return;
+    }
+
+    try
+    {
+        mDb->query("delete from symm_keys where userid = ?", user);
+    }
+    catch (std::exception& e)
+    {
+        // the entry won't be used anyway, since its public key doesn't match
+        KARERE_LOG_ERROR(krLogChannel_strongvelope, "Error removing symmetric key of user %s from db: %s",
+                         user.toString().c_str(), e.what());
+    }
+}
+
+void PlaintextCache::digest(const StaticBuffer& encrypted, Digest& output)
+{
+    crypto_generichash(output.data, kDigestSize, encrypted.ubuf(), encrypted.dataSize(), nullptr, 0);
+}
+
+PlaintextCache::Entry* PlaintextCache::find(karere::Id chatid, const Message& msg)
+{
+    auto it = mEntries.find(msg.id());
+    if (it == mEntries.end())
+    {
+        return nullptr;
+    }
+    auto& entry = it->second;
+    if (entry.chatid != chatid || entry.updated != msg.updated
+            || entry.userid != msg.userid || entry.keyid != msg.keyid)
+    {
+        return nullptr;
+    }
+    return &entry;
+}
+
+bool PlaintextCache::get(karere::Id chatid, Message& msg)
+{
+    Entry* entry = find(chatid, msg);
+    if (entry)
+    {
+        Digest msgDigest;
+        digest(msg, msgDigest);
+        if (memcmp(msgDigest.data, entry->digest.data, kDigestSize) != 0)
+        {
+            entry = nullptr;
+        }
+    }
+    if (!entry)
+    {
+        mStats.misses++;
+        return false;
+    }
+
+    mStats.hits++;
+    mLru.splice(mLru.begin(), mLru, entry->lruPos);
+    msg.type = entry->type;
+    msg.backRefId = entry->backRefId;
+    msg.backRefs = entry->backRefs;
+    if (entry->content.empty())
+    {
+        msg.clear();
+    }
+    else
+    {
+        msg.assign(entry->content.data(), entry->content.size());
+    }
+    msg.setEncrypted(Message::kNotEncrypted);
+    return true;
+}
+
+void PlaintextCache::put(karere::Id chatid, const Digest& digest, const Message& msg)
+{
+    // don't let a single message flush a significant part of the cache
+    if (msg.dataSize() > mMaxBytes / 16)
+    {
+        return;
+    }
+
+    auto it = mEntries.find(msg.id());
+    if (it != mEntries.end())
+    {
+        remove(it);
+    }
+
+    auto& entry = mEntries[msg.id()];
+    entry.chatid = chatid;
+    entry.userid = msg.userid;
+    entry.updated = msg.updated;
+    entry.keyid = msg.keyid;
+    entry.type = msg.type;
+    entry.digest = digest;
+    entry.backRefId = msg.backRefId;
+    entry.backRefs = msg.backRefs;
+    if (!msg.empty())
+    {
+        entry.content.assign(msg.buf(), msg.dataSize());
+    }
+    mLru.push_front(msg.id());
+    entry.lruPos = mLru.begin();
+    mStats.bytes += entry.bytes();
+    mStats.entries++;
+    mStats.inserts++;
+
+    while (mStats.bytes > mMaxBytes)
+    {
+        remove(mEntries.find(mLru.back()));
+        mStats.evictions++;
+    }
+}
+
+void PlaintextCache::remove(karere::IdMap<karere::Id, Entry>::iterator it)
+{
+    assert(it != mEntries.end());
+    mStats.bytes -= it->second.bytes();
+    mStats.entries--;
+    mLru.erase(it->second.lruPos);
+    mEntries.erase(it);
+}
+
+void PlaintextCache::clear()
+{
+    mEntries.clear();
+    mLru.clear();
+    mStats.bytes = 0;
+    mStats.entries = 0;
+}
+
 ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& protoHandler)
-: mProtoHandler(protoHandler)
+: mProtoHandler(protoHandler), mSource(binaryMessage.dataSize())
 {
     if(binaryMessage.empty())
     {
         throw std::runtime_error("parsedMessage::parse: Empty binary message");
     }
+    // a single copy of the message, the records are parsed as views into it
+    mSource.assign(binaryMessage.buf(), binaryMessage.dataSize());
     protocolVersion = binaryMessage.read<uint8_t>(0);
     if (protocolVersion > SVCRYPTO_PROTOCOL_VERSION)
         throw std::runtime_error("Message protocol version "+std::to_string(protocolVersion)+" is newer than the latest supported by this client. Message dump: "+binaryMessage.toString());
@@ -273,19 +558,20 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             callEndedInfo.reset(new chatd::Message::CallEndedInfo());
         }
     }
-    TlvParser tlv(binaryMessage, offset, isLegacy);
-    TlvRecord record(binaryMessage);
-    std::string recordNames;
+    TlvParser tlv(mSource, offset, isLegacy);
+    TlvRecord record(mSource);
+    uint32_t recordTypes = 0;   // bitmask, for the log below
     while (tlv.getRecord(record))
     {
-        recordNames.append(tlvTypeToString(record.type))+=", ";
+        if (record.type < 32)
+            recordTypes |= (1u << record.type);
         switch (record.type)
         {
             case TLV_TYPE_SIGNATURE:
             {
-                signature.assign(record.buf(), record.dataLen);
+                signature = record.view();
                 auto nextOffset = record.dataOffset+record.dataLen;
-                signedContent.assign(binaryMessage.buf()+nextOffset, binaryMessage.dataSize()-nextOffset);
+                signedContent.assign(mSource.buf()+nextOffset, mSource.dataSize()-nextOffset);
                 break;
             }
             case TLV_TYPE_NONCE:
@@ -356,7 +642,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             }
             case TLV_TYPE_KEYBLOB:
             {
-                encryptedKey.assign(record.buf(), record.dataLen);
+                encryptedKey = record.view();
                 break;
             }
             //legacy key stuff
@@ -372,13 +658,13 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
                 if (managementInfo->target)
                     throw std::runtime_error("Already had one RECIPIENT tlv record");
                 record.validateDataLen(8);
-                managementInfo->target = binaryMessage.read<uint64_t>(record.dataOffset);
+                managementInfo->target = mSource.read<uint64_t>(record.dataOffset);
                 break;
             }
             case TLV_TYPE_KEYS:
             {
 //KEYS, not KEY, because these can be pairs of current+previous key, concatenated and encrypted together
-                encryptedKey.assign(record.buf(), record.dataLen);
+                encryptedKey = record.view();
                 break;
             }
             case TLV_TYPE_KEY_IDS:
@@ -394,16 +680,16 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
 //if we attempt to read past end of buffer, read() will throw
                 if (keyIdLength == 4)
                 {
-                    keyId = ntohl(binaryMessage.read<uint32_t>(record.dataOffset));
+                    keyId = ntohl(mSource.read<uint32_t>(record.dataOffset));
                     prevKeyId = (record.dataLen > 4)
-                        ? ntohl(binaryMessage.read<uint32_t>(record.dataOffset+4))
+                        ? ntohl(mSource.read<uint32_t>(record.dataOffset+4))
                         : 0;
                 }
                 else if (keyIdLength == 8)
                 {
-                    keyId = be64toh(binaryMessage.read<uint64_t>(record.dataOffset));
+                    keyId = be64toh(mSource.read<uint64_t>(record.dataOffset));
                     prevKeyId = (record.dataLen > 8)
-                        ? be64toh(binaryMessage.read<uint64_t>(record.dataOffset+8))
+                        ? be64toh(mSource.read<uint64_t>(record.dataOffset+8))
                         : 0;
                 }
                 break;
@@ -413,7 +699,7 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
             {
 //                if (type != SVCRYPTO_MSGTYPE_KEYED && type != SVCRYPTO_MSGTYPE_FOLLOWUP)
 //                    throw std::runtime_error("Payload record found in a non-regular message");
-                payload.assign(binaryMessage.buf()+record.dataOffset, record.dataLen);
+                payload = record.view();
                 break;
             }
             case TLV_TYPE_OPENMODE:
@@ -425,12 +711,11 @@ ParsedMessage::ParsedMessage(const Message& binaryMessage, ProtocolHandler& prot
                 throw std::runtime_error("Unknown TLV record type "+std::to_string(record.type)+" in message "+binaryMessage.id().toString());
         }
     }
-    if (!recordNames.empty())
+    if (recordTypes)
     {
-        recordNames.resize(recordNames.size()-2);
         Id chatid = protoHandler.chatid;
         STRONGVELOPE_LOG_DEBUG("msg %s: read %s",
-            binaryMessage.id().toString().c_str(), recordNames.c_str());
+            binaryMessage.id().toString().c_str(), tlvTypesToString(recordTypes).c_str());
     }
 }
 
@@ -552,13 +837,28 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
     const StaticBuffer& privCu25519, const StaticBuffer& privEd25519,
     const StaticBuffer& privRsa,karere::UserAttrCache& userAttrCache,
     SqliteDb &db, Id aChatId, bool isPublic, std::shared_ptr<std::string> unifiedKey,
-    int isUnifiedKeyEncrypted, karere::Id ph, void *ctx)
+    int isUnifiedKeyEncrypted, karere::Id ph, void *ctx,
+    const std::shared_ptr<SymmKeyCache>& symmKeyCache,
+    const std::shared_ptr<PlaintextCache>& plaintextCache)
 : chatd::ICrypto(ctx), mOwnHandle(ownHandle), myPrivCu25519(privCu25519),
   myPrivEd25519(privEd25519), myPrivRsaKey(privRsa), mUserAttrCache(userAttrCache),
-  mDb(db), chatid(aChatId), mPh(ph)
+  mDb(db), mSymmKeyCache(symmKeyCache), mPlaintextCache(plaintextCache), chatid(aChatId), mPh(ph)
 {
+    if (!mSymmKeyCache)
+    {
+        mSymmKeyCache = std::make_shared<SymmKeyCache>(myPrivCu25519, nullptr);
+    }
+    if (!mPlaintextCache)
+    {
+        mPlaintextCache = std::make_shared<PlaintextCache>();
+    }
     getPubKeyFromPrivKey(myPrivEd25519, kKeyTypeEd25519, myPubEd25519);
-    loadKeysFromDb();
+    static bool aesLogged = false;
+    if (!aesLogged)
+    {
+        aesLogged = true;
+        KARERE_LOG_INFO(krLogChannel_strongvelope, "AES implementation: %s", aesImplementation().c_str());
+    }
     loadUnconfirmedKeysFromDb();
     auto var = getenv("KRCHAT_FORCE_RSA");
     if (var)
@@ -610,7 +910,7 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
                 Buffer auxBuf;
                 auxBuf.write(0, (uint8_t)kDecrypted);  // prefix to indicate it's decrypted
                 auxBuf.append(*unifiedKey);
-                mDb.query("update chats set unified_key = ? where chatid = ?", auxBuf, chatid);
+                mDb.query(karere::sql::kChatSetUnifiedKey, auxBuf, chatid);
             })
             .fail([this, wptr, bufunifiedkey](const ::promise::Error& err)
             {
@@ -621,7 +921,7 @@ ProtocolHandler::ProtocolHandler(karere::Id ownHandle,
                 Buffer auxBuf;
                 auxBuf.write(0, (uint8_t)kUndecryptable);  // prefix to indicate it's undecryptable
                 auxBuf.append(*bufunifiedkey);
-                mDb.query("update chats set unified_key = ? where chatid = ?", auxBuf, chatid);
+                mDb.query(karere::sql::kChatSetUnifiedKey, auxBuf, chatid);
                 return err;
             });
         }
@@ -753,32 +1053,72 @@ unsigned int ProtocolHandler::getCacheVersion() const
     return mCacheVersion;
 }
 
-void ProtocolHandler::loadKeysFromDb()
+ProtocolHandler::KeyMap::iterator ProtocolHandler::findKey(UserKeyId ukid)
 {
-    SqliteStmt stmt(mDb, "select userid, keyid, key from sendkeys where chatid=?");
-    stmt << chatid;
-    while(stmt.step())
+    auto it = mKeys.find(ukid);
+    if (it == mKeys.end())
     {
-        auto key = std::make_shared<SendKey>();
-        stmt.blobCol(2, *key);
-        Id userid(stmt.uint64Col(0));
-        uint64_t keyid = stmt.uint64Col(1);
+        auto key = loadKeyFromDb(ukid);
+        if (!key)
+        {
+            return mKeys.end();
+        }
+        it = mKeys.emplace(ukid, KeyEntry(key)).first;
+    }
+    if (it->second.key)
+    {
+        touchKey(it);
+    }
+    return it;
+}
 
-#ifndef NDEBUG
-        auto ret =
-#endif
-        mKeys.emplace(std::piecewise_construct,
-            std::forward_as_tuple(userid, keyid),
-            std::forward_as_tuple(key));
-        assert(ret.second);
+ProtocolHandler::KeyEntry& ProtocolHandler::keyEntry(UserKeyId ukid)
+{
+    auto it = findKey(ukid);
+    if (it == mKeys.end())
+    {
+        it = mKeys.emplace(ukid, KeyEntry()).first;
+    }
+    return it->second;
+}
+
+std::shared_ptr<SendKey> ProtocolHandler::loadKeyFromDb(UserKeyId ukid)
+{
+    SqliteStmt stmt(mDb, karere::sql::kSendKeysLoad);
+    stmt << chatid << ukid.user << ukid.keyid;
+    if (!stmt.step())
+    {
+        return nullptr;
+    }
+    auto key = std::make_shared<SendKey>();
+    stmt.blobCol(0, *key);
+    return key;
+}
+
+void ProtocolHandler::touchKey(KeyMap::iterator it)
+{
+    auto& entry = it->second;
+    assert(entry.key);
+    if (entry.inLru)
+    {
+        mKeyLru.splice(mKeyLru.begin(), mKeyLru, entry.lruPos);
+        return;
+    }
+
+    mKeyLru.push_front(it->first);
+    entry.lruPos = mKeyLru.begin();
+    entry.inLru = true;
+    while (mKeyLru.size() > kMaxCachedKeys)
+    {
+        // the key is in db, it will be loaded again if needed
+        mKeys.erase(mKeyLru.back());
+        mKeyLru.pop_back();
     }
-    STRONGVELOPE_LOG_DEBUG("(%" PRId64 "): Loaded %zu send keys from database", chatid, mKeys.size());
 }
 
 void ProtocolHandler::loadUnconfirmedKeysFromDb()
 {
-    SqliteStmt stmt(mDb, "select recipients, key_cmd, keyid from sending "
-                    "where chatid=? and key_cmd not null order by rowid asc");
+    SqliteStmt stmt(mDb, karere::sql::kSendingUnconfirmedKeys);
     stmt << chatid;
     while(stmt.step())
     {
@@ -854,55 +1194,61 @@ void ProtocolHandler::msgEncryptWithKey(const Message& src, MsgCommand& dest,
     EncryptedMessage encryptedMessage(src, key);
     assert(!encryptedMessage.ciphertext.empty());
 
-    // prepare TLV for content: <nonce><ciphertext>
-    TlvWriter tlv(encryptedMessage.ciphertext.size()+128); //only signed content goes here
+    // the MsgCommand is: <protVer><msgType><sigTLV><contentTLV>. The sizes are known in
+    // advance, so the TLVs are written directly into it
+    size_t sigSize = TlvSpanWriter::recordSize(crypto_sign_BYTES);
+    size_t contentSize = TlvSpanWriter::recordSize(encryptedMessage.nonce.dataSize())
+        + TlvSpanWriter::recordSize(encryptedMessage.ciphertext.dataSize());
+    char* out = dest.appendPtr(2+sigSize+contentSize);
+    out[0] = SVCRYPTO_PROTOCOL_VERSION;
+    out[1] = SVCRYPTO_MSGTYPE_FOLLOWUP;
+
+    // content TLV: <nonce><ciphertext>, only signed content goes here. It must always be last,
+    // and the payload must always be last within the tlv, because the payload may span
+    // till end of message, (len code = 0xffff)
+    char* content = out+2+sigSize;
+    TlvSpanWriter tlv(content, contentSize);
     tlv.addRecord(TLV_TYPE_NONCE, encryptedMessage.nonce);
-    tlv.addRecord(TLV_TYPE_PAYLOAD, StaticBuffer(encryptedMessage.ciphertext, false));
+    tlv.addRecord(TLV_TYPE_PAYLOAD, encryptedMessage.ciphertext);
 
-    // prepare TLV for signature: <signature>
+    // signature TLV, in the slot left before the content
     Signature signature;
-    signMessage(tlv, SVCRYPTO_PROTOCOL_VERSION, SVCRYPTO_MSGTYPE_FOLLOWUP,
-                encryptedMessage.key, signature);
-    TlvWriter sigTlv;
-    sigTlv.addRecord(TLV_TYPE_SIGNATURE, signature);
-
-    // finally, prepare the MsgCommand: <protVer><msgType><sigTLV><contentTLV>
-    dest.reserve(tlv.dataSize()+sigTlv.dataSize()+2);
-    dest.append<uint8_t>(SVCRYPTO_PROTOCOL_VERSION)
-        .append<uint8_t>(SVCRYPTO_MSGTYPE_FOLLOWUP)
-        .append(sigTlv)
-        .append(tlv.buf(), tlv.dataSize()); //tlv must always be last, and the payload must always be last within the tlv, because the payload may span till end of message, (len code = 0xffff)
+    signMessage(StaticBuffer(content, contentSize), SVCRYPTO_PROTOCOL_VERSION,
+                SVCRYPTO_MSGTYPE_FOLLOWUP, encryptedMessage.key, signature);
+    TlvSpanWriter(out+2, sigSize).addRecord(TLV_TYPE_SIGNATURE, signature);
     dest.updateMsgSize();
 }
 
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::computeSymmetricKey(karere::Id userid, const std::string& padString)
 {
-    auto it = mSymmKeyCache.find(userid);
-    if (it != mSymmKeyCache.end())
-    {
-        return it->second;
-    }
+    // the cache only holds pairwise keys
+    bool useCache = (padString == SVCRYPTO_PAIRWISE_KEY);
     auto wptr = weakHandle();
+    // the public key is usually in the attribute cache already (loaded from db),
+    // so this doesn't involve a round trip
     return mUserAttrCache.getAttr(userid, ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
-    .then([wptr, this, userid, padString](const StaticBuffer* pubKey) -> promise::Promise<std::shared_ptr<SendKey>>
+    .then([wptr, this, userid, padString, useCache](const StaticBuffer* pubKey) -> promise::Promise<std::shared_ptr<SendKey>>
     {
         wptr.throwIfDeleted();
-        // We may have had 2 almost parallel requests, and the second may
-        // have put the key into the cache already
-        auto it = mSymmKeyCache.find(userid);
-        if (it != mSymmKeyCache.end())
-            return it->second;
-
         if (pubKey->empty())
             return ::promise::Error("Empty Cu25519 chat key for user "+userid.toString());
+
+        if (useCache)
+        {
+            auto cached = mSymmKeyCache->get(userid, *pubKey);
+            if (cached)
+                return cached;
+        }
+
         Key<crypto_scalarmult_BYTES> sharedSecret;
         sharedSecret.setDataSize(crypto_scalarmult_BYTES);
         auto ignore = crypto_scalarmult(sharedSecret.ubuf(), myPrivCu25519.ubuf(), pubKey->ubuf());
         (void)ignore;
         auto result = std::make_shared<SendKey>();
         deriveSharedKey(sharedSecret, *result, padString);
-        mSymmKeyCache.emplace(userid, result);
+        if (useCache)
+            mSymmKeyCache->put(userid, *pubKey, result);
         return result;
     });
 }
@@ -1200,6 +1546,21 @@ Message* ProtocolHandler::legacyMsgDecrypt(const std::shared_ptr<ParsedMessage>&
 void ProtocolHandler::onHistoryReload()
 {
     mCacheVersion++;
+    auto& stats = mPlaintextCache->stats();
+    STRONGVELOPE_LOG_DEBUG("History reload, plaintext cache: %zu messages (%zu bytes), hit rate %.2f",
+        stats.entries, stats.bytes, stats.hitRate());
+
+    // the messages will be decrypted again, if still needed. Rejecting may
+    // trigger callbacks, so don't iterate the map itself
+    auto pooled = std::move(mPooledDecrypts);
+    for (auto& item: pooled)
+    {
+        auto& entry = item.second;
+        if (!entry.done.done())
+        {
+            entry.done.reject("History was reloaded", EINVAL, SVCRYPTO_ENOMSG);
+        }
+    }
 }
 
 promise::Promise<Message*> ProtocolHandler::handleManagementMessage(
@@ -1288,6 +1649,24 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
             return Promise<Message*>(message);
         }
 
+        // already queued to the DecryptPool by msgDecryptAhead()
+        auto pooled = mPooledDecrypts.find(message->id());
+        if (pooled != mPooledDecrypts.end())
+        {
+            if (pooled->second.job->updated == message->updated)
+            {
+                message->type = pooled->second.job->parsedMsg->type;
+                return pooledDecryptResult(message);
+            }
+            mPooledDecrypts.erase(pooled);  // the message was edited meanwhile, discard the result
+        }
+
+        // already verified and decrypted, i.e. history fetched again after a reload
+        if (mPlaintextCache->get(chatid, *message))
+        {
+            return Promise<Message*>(message);
+        }
+
         // Get type
         auto parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
         message->type = parsedMsg->type;
@@ -1317,6 +1696,11 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
             keyid = message->keyid;
         }
 
+        if (!isLegacy && startPooledDecrypt(*message, parsedMsg))
+        {
+            return pooledDecryptResult(message);
+        }
+
         auto ctx = std::make_shared<Context>();
 
         promise::Promise<std::shared_ptr<SendKey>> symPms;
@@ -1356,7 +1740,7 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
                 return ::promise::Error("msgDecrypt: history was reloaded, ignore message", EINVAL, SVCRYPTO_ENOMSG);
             }
 
-            if (!parsedMsg->verifySignature(ctx->edKey, *ctx->sendKey))
+            if (!parsedMsg->verifySignature(ctx->edKey, *ctx->sendKey, mSignatureBuf))
             {
                 return ::promise::Error("Signature invalid for message "+
                                       message->id().toString(), EINVAL, SVCRYPTO_ESIGNATURE);
@@ -1368,7 +1752,10 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
             }
 
             // Decrypt message payload.
+            PlaintextCache::Digest digest;
+            PlaintextCache::digest(*message, digest);
             parsedMsg->symmetricDecrypt(*ctx->sendKey, *message);
+            mPlaintextCache->put(chatid, digest, *message);
 
             return message;
         });
@@ -1380,13 +1767,272 @@ Promise<Message*> ProtocolHandler::msgDecrypt(Message* message)
     }
 }
 
+void ProtocolHandler::msgDecryptAhead(Message* message)
+{
+    if (!DecryptPool::instance().isEnabled()
+            || message->empty()
+            || message->userid == karere::Id::COMMANDER()
+            || mPooledDecrypts.count(message->id())
+            || mPlaintextCache->has(chatid, *message))
+    {
+        return;
+    }
+
+    try
+    {
+        auto parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
+        bool isManagement = (parsedMsg->type >= Message::kMsgManagementLowest
+                             && parsedMsg->type <= Message::kMsgManagementHighest);
+        if (parsedMsg->protocolVersion >= 2 && !isManagement)
+        {
+            startPooledDecrypt(*message, parsedMsg);
+        }
+    }
+    catch (std::runtime_error&)
+    {
+        // malformed message, msgDecrypt() will report it
+    }
+}
+
+void ProtocolHandler::msgDecryptBatch(const std::vector<Message*>& messages)
+{
+    std::vector<std::pair<karere::Id, std::shared_ptr<PooledDecrypt>>> jobs;
+    for (Message* message: messages)
+    {
+        if (mPooledDecryptsRunning + jobs.size() >= kMaxPooledDecrypts)
+        {
+            break;
+        }
+        if (message->empty()
+                || message->userid == karere::Id::COMMANDER()
+                || mPooledDecrypts.count(message->id())
+                || mPlaintextCache->has(chatid, *message))
+        {
+            continue;
+        }
+
+        try
+        {
+            auto parsedMsg = std::make_shared<ParsedMessage>(*message, *this);
+            bool isManagement = (parsedMsg->type >= Message::kMsgManagementLowest
+                                 && parsedMsg->type <= Message::kMsgManagementHighest);
+            if (parsedMsg->protocolVersion < 2 || isManagement)
+            {
+                continue;
+            }
+            auto job = preparePooledDecrypt(*message, parsedMsg);
+            if (job)
+            {
+                jobs.emplace_back(message->id(), job);
+            }
+        }
+        catch (std::runtime_error&)
+        {
+            // malformed message, msgDecrypt() will report it
+        }
+    }
+
+    if (!jobs.empty())
+    {
+        STRONGVELOPE_LOG_DEBUG("Decrypting a batch of %zu messages", jobs.size());
+        submitPooledDecrypts(std::move(jobs));
+    }
+}
+
+void ProtocolHandler::msgDiscarded(const Message& message)
+{
+    auto it = mPooledDecrypts.find(message.id());
+    if (it != mPooledDecrypts.end() && !it->second.awaited)
+    {
+        // if the job is still running, its completion finds no entry to resolve
+        mPooledDecrypts.erase(it);
+    }
+}
+
+bool ProtocolHandler::startPooledDecrypt(const Message& msg, const std::shared_ptr<ParsedMessage>& parsedMsg)
+{
+    if (!DecryptPool::instance().isEnabled() || mPooledDecryptsRunning >= kMaxPooledDecrypts)
+    {
+        return false;
+    }
+
+    auto job = preparePooledDecrypt(msg, parsedMsg);
+    if (!job)
+    {
+        return false;
+    }
+
+    std::vector<std::pair<karere::Id, std::shared_ptr<PooledDecrypt>>> jobs;
+    jobs.emplace_back(msg.id(), job);
+    submitPooledDecrypts(std::move(jobs));
+    return true;
+}
+
+std::shared_ptr<ProtocolHandler::PooledDecrypt>
+ProtocolHandler::preparePooledDecrypt(const Message& msg, const std::shared_ptr<ParsedMessage>& parsedMsg)
+{
+    // the keys must be available, otherwise the message goes the regular way
+    std::shared_ptr<SendKey> sendKey;
+    if (msg.keyid == CHATD_KEYID_INVALID)
+    {
+        if (!mUnifiedKeyDecrypted.succeeded())
+        {
+            return nullptr;
+        }
+        sendKey = mUnifiedKeyDecrypted.value();
+    }
+    else
+    {
+        auto it = findKey(UserKeyId(msg.userid, msg.keyid));
+        if (it == mKeys.end() || !it->second.key)
+        {
+            return nullptr;
+        }
+        sendKey = it->second.key;
+    }
+
+    auto edPms = mUserAttrCache.getAttr(parsedMsg->sender, ::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY, mPh);
+    if (!edPms.succeeded())
+    {
+        return nullptr;
+    }
+
+    auto job = std::make_shared<PooledDecrypt>();
+    job->parsedMsg = parsedMsg;
+    job->sendKey = sendKey;
+    Buffer* edKey = edPms.value();
+    job->edKey.assign(edKey->buf(), edKey->dataSize());
+    job->updated = msg.updated;
+    return job;
+}
+
+void ProtocolHandler::runPooledDecrypt(PooledDecrypt& job, Buffer& scratch)
+{
+    try
+    {
+        job.signatureOk = job.parsedMsg->verifySignature(job.edKey, *job.sendKey, scratch);
+        if (job.signatureOk && !job.parsedMsg->payload.empty())
+        {
+            job.parsedMsg->decryptPayload(*job.sendKey, job.cleartext);
+        }
+    }
+    catch (std::exception& e)
+    {
+        job.error = e.what();
+    }
+}
+
+void ProtocolHandler::submitPooledDecrypts(std::vector<std::pair<karere::Id, std::shared_ptr<PooledDecrypt>>>&& jobs)
+{
+    for (auto& item: jobs)
+    {
+        mPooledDecrypts.emplace(item.first, item.second);
+    }
+    mPooledDecryptsRunning += jobs.size();
+
+    // each message is verified on its own, so a bad signature is reported
+    // for its message only, but they share the buffer for the signed data
+    auto batch = std::make_shared<std::vector<std::pair<karere::Id, std::shared_ptr<PooledDecrypt>>>>(std::move(jobs));
+    auto work = [batch]()
+    {
+        Buffer scratch;
+        for (auto& item: *batch)
+        {
+            runPooledDecrypt(*item.second, scratch);
+        }
+    };
+    auto wptr = weakHandle();
+    auto done = [this, wptr, batch]()
+    {
+        if (wptr.deleted())
+        {
+            return;
+        }
+        assert(mPooledDecryptsRunning >= batch->size());
+        mPooledDecryptsRunning -= batch->size();
+        for (auto& item: *batch)
+        {
+            auto it = mPooledDecrypts.find(item.first);
+            if (it != mPooledDecrypts.end() && it->second.job == item.second)   // not discarded meanwhile
+            {
+                it->second.done.resolve();
+            }
+        }
+    };
+
+    if (DecryptPool::instance().isEnabled())
+    {
+        DecryptPool::instance().submit(std::move(work), std::move(done), appCtx);
+    }
+    else
+    {
+        work();
+        done();
+    }
+}
+
+Promise<Message*> ProtocolHandler::pooledDecryptResult(Message* message)
+{
+    unsigned int cacheVersion = mCacheVersion;
+    karere::Id msgid = message->id();
+    auto it = mPooledDecrypts.find(msgid);
+    assert(it != mPooledDecrypts.end());
+    it->second.awaited = true;
+    // copies, since the entry is erased by the callback, which may be called synchronously
+    auto job = it->second.job;
+    auto done = it->second.done;
+    auto wptr = weakHandle();
+    return done.then([this, wptr, message, msgid, job, cacheVersion]() -> promise::Promise<Message*>
+    {
+        if (wptr.deleted())
+        {
+            return ::promise::Error("msgDecrypt: strongvelop deleted, ignore message", EINVAL, SVCRYPTO_EEXPIRED);
+        }
+
+        auto it = mPooledDecrypts.find(msgid);
+        if (it != mPooledDecrypts.end() && it->second.job == job)
+        {
+            mPooledDecrypts.erase(it);
+        }
+
+        if (cacheVersion != mCacheVersion)
+        {
+            return ::promise::Error("msgDecrypt: history was reloaded, ignore message", EINVAL, SVCRYPTO_ENOMSG);
+        }
+
+        if (!job->error.empty())
+        {
+            return ::promise::Error(job->error, EINVAL, SVCRYPTO_EMALFORMED);
+        }
+
+        if (!job->signatureOk)
+        {
+            return ::promise::Error("Signature invalid for message "+
+                                  message->id().toString(), EINVAL, SVCRYPTO_ESIGNATURE);
+        }
+
+        PlaintextCache::Digest digest;
+        PlaintextCache::digest(*message, digest);
+        if (job->parsedMsg->payload.empty())
+        {
+            message->clear();
+        }
+        else
+        {
+            job->parsedMsg->setDecryptedPayload(job->cleartext, *message);
+        }
+        mPlaintextCache->put(chatid, digest, *message);
+        return message;
+    });
+}
+
 Promise<void>
 ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedMsg)
 {
     if (parsedMsg->encryptedKey.empty())
         return ::promise::Error("legacyExtractKeys: No encrypted keys found in parsed message", EPROTO, SVCRYPTO_ERRTYPE);
 
-    auto& key1 = mKeys[UserKeyId(parsedMsg->sender, parsedMsg->keyId)];
+    auto& key1 = keyEntry(UserKeyId(parsedMsg->sender, parsedMsg->keyId));
     if (!key1.key)
     {
         if (!key1.pms)
@@ -1394,7 +2040,7 @@ ProtocolHandler::legacyExtractKeys(const std::shared_ptr<ParsedMessage>& parsedM
     }
     if (parsedMsg->prevKeyId)
     {
-        auto& key2 = mKeys[UserKeyId(parsedMsg->sender, parsedMsg->prevKeyId)];
+        auto& key2 = keyEntry(UserKeyId(parsedMsg->sender, parsedMsg->prevKeyId));
         if (!key2.key)
         {
             if (!key2.pms)
@@ -1433,7 +2079,7 @@ void ProtocolHandler::onKeyReceived(KeyId keyid, Id sender, Id receiver,
     }
 
     // check if key is already being decrypted (received twice)
-    auto& entry = mKeys[ukid];
+    auto& entry = keyEntry(ukid);
     if (entry.pms)
     {
         STRONGVELOPE_LOG_WARNING("Key %d from user %s is already being decrypted", keyid, sender.toString().c_str());
@@ -1470,7 +2116,12 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
     assert(key->dataSize() == SVCRYPTO_KEY_SIZE);
     STRONGVELOPE_LOG_DEBUG("Adding key %lld of user %s", ukid.keyid, ukid.user.toString().c_str());
 
-    auto& entry = mKeys[ukid];
+    auto it = findKey(ukid);
+    if (it == mKeys.end())
+    {
+        it = mKeys.emplace(ukid, KeyEntry()).first;
+    }
+    auto& entry = it->second;
     if (entry.key)  // if KeyEntry already had a decrypted key assigned to it...
     {
         if (memcmp(entry.key->buf(), key->buf(), SVCRYPTO_KEY_SIZE))
@@ -1483,7 +2134,7 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
         entry.key = key;
         try
         {
-            mDb.query("insert or ignore into sendkeys(chatid, userid, keyid, key, ts) values(?,?,?,?,?)",
+            mDb.query(karere::sql::kSendKeysInsert,
                 chatid, ukid.user, ukid.keyid, *key, (int)time(NULL));
         }
         catch(std::exception& e)
@@ -1491,6 +2142,7 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
             STRONGVELOPE_LOG_ERROR("Exception while saving sendkey to db: %s", e.what());
             throw std::runtime_error("addDecryptedKey: Exception while saving sendkey to db: "+std::string(e.what()));
         }
+        touchKey(it);
     }
 
     // finally, notify anyone waiting for decryption of the received key (if decryption was asynchronous)
@@ -1503,7 +2155,7 @@ void ProtocolHandler::addDecryptedKey(UserKeyId ukid, const std::shared_ptr<Send
 promise::Promise<std::shared_ptr<SendKey>>
 ProtocolHandler::getKey(UserKeyId ukid, bool legacy)
 {
-    auto kit = mKeys.find(ukid);
+    auto kit = findKey(ukid);
     if (kit == mKeys.end())
     {
         if (legacy)
@@ -1632,30 +2284,79 @@ KeyId ProtocolHandler::createLocalKeyId()
 promise::Promise<std::pair<KeyCommand*, std::shared_ptr<SendKey>>>
 ProtocolHandler::encryptKeyToAllParticipants(const std::shared_ptr<SendKey>& key, const SetOfIds &participants, KeyId localkeyid)
 {
-    auto keyCmd = new KeyCommand(chatid, localkeyid);
+    struct Context
+    {
+        std::vector<karere::Id> users;
+        std::vector<std::shared_ptr<SendKey>> symKeys;  // null if the EC key is not available
+    };
 
     // Users and send key may change while we are getting pubkeys of current
     // users, so make a snapshot
-    SetOfIds users = participants;
-    std::vector<Promise<void>> promises;
-    promises.reserve(users.size());
+    auto ctx = std::make_shared<Context>();
+    ctx->users.assign(participants.begin(), participants.end());
+    ctx->symKeys.resize(ctx->users.size());
 
-    for (auto& user: users)
+    // Request all the pairwise keys before waiting for any of them, so the public
+    // keys that are not cached are fetched in a single batch (see UserAttrCache::fetchAttr())
+    std::vector<Promise<void>> promises;
+    for (size_t i = 0; i < ctx->users.size(); i++)
     {
-        auto pms = encryptKeyTo(key, user)
-        .then([keyCmd, user](const std::shared_ptr<Buffer>& encryptedKey)
+        auto pms = computeSymmetricKey(ctx->users[i]);
+        if (pms.succeeded())
         {
-            assert(encryptedKey && !encryptedKey->empty());
-            keyCmd->addKey(user, encryptedKey->buf(), encryptedKey->dataSize());
-        });
-        promises.push_back(pms);
+            ctx->symKeys[i] = pms.value();
+        }
+        else if (!pms.failed())
+        {
+            promises.push_back(pms.then([ctx, i](const std::shared_ptr<SendKey>& symKey)
+            {
+                ctx->symKeys[i] = symKey;
+            })
+            .fail([](const ::promise::Error&)
+            {
+                return _Void(); // the user falls back to RSA
+            }));
+        }
     }
 
-    // wait for key encrypted to all participants (immediate only if all pubkeys were available)
+    // wait for the pairwise keys (immediate only if all pubkeys were available)
+    auto wptr = weakHandle();
     return promise::when(promises)
-    .then([keyCmd, key]()
+    .then([wptr, this, ctx, key, localkeyid]()
     {
-        return std::make_pair(keyCmd, key);
+        wptr.throwIfDeleted();
+
+        // header + (userid.8+len.2+key.16) per user, unless falling back to RSA
+        size_t count = ctx->users.size();
+        auto keyCmd = new KeyCommand(chatid, localkeyid, 17 + count * (10 + AES::BLOCKSIZE));
+        std::vector<Promise<void>> fallbacks;
+        SendKey encryptedKey;
+        for (size_t i = 0; i < count; i++)
+        {
+            karere::Id user = ctx->users[i];
+            auto& symKey = ctx->symKeys[i];
+            if (symKey && !mForceRsa)
+            {
+                assert(symKey->dataSize() == SVCRYPTO_KEY_SIZE);
+                aesECBEncrypt(*key, *symKey, encryptedKey);
+                keyCmd->addKey(user, encryptedKey.buf(), encryptedKey.dataSize());
+                continue;
+            }
+
+            auto pms = encryptKeyTo(key, user)
+            .then([keyCmd, user](const std::shared_ptr<Buffer>& rsaKey)
+            {
+                assert(rsaKey && !rsaKey->empty());
+                keyCmd->addKey(user, rsaKey->buf(), rsaKey->dataSize());
+            });
+            fallbacks.push_back(pms);
+        }
+
+        return promise::when(fallbacks)
+        .then([keyCmd, key]()
+        {
+            return std::make_pair(keyCmd, key);
+        });
     });
 }
 
@@ -1702,28 +2403,35 @@ ProtocolHandler::encryptChatTitle(const std::string& data, uint64_t extraUser, b
             chatd::KeyCommand& keyCmd = *result.first;
             assert(keyCmd.dataSize() >= 17);
 
-            TlvWriter tlv;
+            // <protVer><msgType><sigTLV><contentTLV>, written in one pass as in msgEncryptWithKey()
+            StaticBuffer keyBlob(keyCmd.buf()+17, keyCmd.dataSize()-17);
+            size_t sigSize = TlvSpanWriter::recordSize(crypto_sign_BYTES);
+            size_t contentSize = TlvSpanWriter::recordSize(sizeof(mOwnHandle.val))
+                + TlvSpanWriter::recordSize(enc.nonce.dataSize())
+                + TlvSpanWriter::recordSize(keyBlob.dataSize())
+                + TlvSpanWriter::recordSize(enc.ciphertext.dataSize())
+                + (createNewKey ? 0 : TlvSpanWriter::recordSize(sizeof(bool)));
+            auto blob = std::make_shared<Buffer>(2+sigSize+contentSize);
+            char* out = blob->appendPtr(2+sigSize+contentSize);
+            out[0] = SVCRYPTO_PROTOCOL_VERSION;
+            out[1] = Message::kMsgChatTitle;
+
+            char* content = out+2+sigSize;
+            TlvSpanWriter tlv(content, contentSize);
             tlv.addRecord(TLV_TYPE_INVITOR, mOwnHandle.val);
             tlv.addRecord(TLV_TYPE_NONCE, enc.nonce);
-            tlv.addRecord(TLV_TYPE_KEYBLOB, StaticBuffer(keyCmd.buf()+17, keyCmd.dataSize()-17));
-            tlv.addRecord(TLV_TYPE_PAYLOAD, StaticBuffer(enc.ciphertext, false));
+            tlv.addRecord(TLV_TYPE_KEYBLOB, keyBlob);
+            tlv.addRecord(TLV_TYPE_PAYLOAD, enc.ciphertext);
             if (!createNewKey)
             {
                 tlv.addRecord(TLV_TYPE_OPENMODE, true);
             }
+            assert(!tlv.remaining());
 
             Signature signature;
-            signMessage(tlv, SVCRYPTO_PROTOCOL_VERSION, Message::kMsgChatTitle,
-                enc.key, signature);
-            TlvWriter sigTlv;
-            sigTlv.addRecord(TLV_TYPE_SIGNATURE, signature);
-
-            auto blob = std::make_shared<Buffer>(512);
-            blob->clear();
-            blob->append<uint8_t>(SVCRYPTO_PROTOCOL_VERSION);
-            blob->append<uint8_t>(Message::kMsgChatTitle);
-            blob->append(sigTlv);
-            blob->append(tlv);
+            signMessage(StaticBuffer(content, contentSize), SVCRYPTO_PROTOCOL_VERSION,
+                Message::kMsgChatTitle, enc.key, signature);
+            TlvSpanWriter(out+2, sigSize).addRecord(TLV_TYPE_SIGNATURE, signature);
             return blob;
         });
     });
@@ -9,11 +9,13 @@
 #define STRONGVELOPE_H_
 #include <vector>
 #include <map>
+#include <list>
 #include <string>
 #include <assert.h>
 #include <iostream>
 #include <buffer.h>
 #include <karereId.h>
+#include <idMap.h>
 #include <chatdMsg.h>
 #include <chatdICrypto.h>
 #include <promise.h>
@@ -171,9 +173,12 @@ struct ParsedMessage: public karere::DeleteTrackable
     uint8_t protocolVersion;
     karere::Id sender;
     Key<32> nonce;
-    Buffer payload;
-    Buffer signedContent;
-    Buffer signature;
+    /** Copy of the binary message. The message itself may be decrypted in place or
+     * deleted while this object is still in use, so the records below are views into it */
+    Buffer mSource;
+    StaticBuffer payload = StaticBuffer(nullptr, 0);
+    StaticBuffer signedContent = StaticBuffer(nullptr, 0);
+    StaticBuffer signature = StaticBuffer(nullptr, 0);
     unsigned char type;
 
     /** True when the message is posted in open mode. It allows to decrypt the `ct` of management
@@ -183,16 +188,21 @@ struct ParsedMessage: public karere::DeleteTrackable
     //legacy key stuff
     uint64_t keyId;
     uint64_t prevKeyId;
-    Buffer encryptedKey; //may contain also the prev key, concatenated
+    StaticBuffer encryptedKey = StaticBuffer(nullptr, 0); //may contain also the prev key, concatenated
 
     std::unique_ptr<chatd::Message::ManagementInfo> managementInfo;
     std::unique_ptr<chatd::Message::CallEndedInfo> callEndedInfo;
 
     ParsedMessage(const chatd::Message& src, ProtocolHandler& protoHandler);
     bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey);
+    /** @brief Like verifySignature(), but builds the signed data in \c scratch, so
+     * it can be reused to verify a batch of messages without allocations */
+    bool verifySignature(const StaticBuffer& pubKey, const SendKey& sendKey, Buffer& scratch) const;
     void parsePayload(const StaticBuffer& data, chatd::Message& msg);
     void parsePayloadWithUtfBackrefs(const StaticBuffer& data, chatd::Message& msg);
     void symmetricDecrypt(const StaticBuffer& key, chatd::Message& outMsg);
+    void decryptPayload(const StaticBuffer& key, Buffer& cleartext) const;
+    void setDecryptedPayload(const StaticBuffer& cleartext, chatd::Message& outMsg);
     promise::Promise<chatd::Message*> decryptChatTitle(chatd::Message* msg, bool msgCanBeDeleted);
 };
 
@@ -233,7 +243,7 @@ enum
  *  nonce */
 struct EncryptedMessage
 {
-    std::string ciphertext; //crypto++ does not support binary buffers in AES CTR mode, which is used for encrypting messages
+    Buffer ciphertext;
     SendKey key;
     chatd::BackRefId backRefId;
     Key<SVCRYPTO_NONCE_SIZE> nonce;
@@ -262,6 +272,115 @@ class TlvWriter;
 extern const std::string SVCRYPTO_PAIRWISE_KEY;
 void deriveSharedKey(const StaticBuffer& sharedSecret, SendKey& output, const std::string& padString=SVCRYPTO_PAIRWISE_KEY);
 
+/**
+ * @brief Cache of the pairwise symmetric keys, derived from our private Cu25519 key
+ * and the public Cu25519 key of each peer (see ProtocolHandler::computeSymmetricKey()).
+ *
+ * It's shared by all the chats of a client, and if a db is provided, it's persisted in it.
+ * The keys are stored in plaintext: the db already holds our private Cu25519 key, so they
+ * would be as exposed if encrypted with any key derived from it. Each row is authenticated
+ * with an HMAC keyed with a key derived from our private Cu25519 key, and rows that fail the
+ * check (corrupted, or stored for a different own key) are dropped when loaded.
+ * Each entry keeps the public key of the peer it was derived from, and it's only used for
+ * that public key. Entries are also invalidated when the peer's Cu25519 attribute changes.
+ */
+class SymmKeyCache
+{
+protected:
+    struct Entry
+    {
+        std::string pubKey;
+        std::shared_ptr<SendKey> key;
+        Entry(const StaticBuffer& aPubKey, const std::shared_ptr<SendKey>& aKey)
+            : pubKey(aPubKey.buf(), aPubKey.dataSize()), key(aKey) {}
+    };
+    karere::IdMap<karere::Id, Entry> mKeys;
+    SqliteDb* mDb;
+    SendKey mMacKey;    // authenticates the rows stored in the db
+
+    void loadFromDb();
+    void computeMac(karere::Id user, const StaticBuffer& pubKey, const SendKey& key, Key<32>& mac) const;
+public:
+    /** @param db Database to persist the keys in. If null, they are kept only in memory */
+    SymmKeyCache(const StaticBuffer& privCu25519, SqliteDb* db);
+    /** Returns the key derived for \c user and the public key \c pubKey, or null if not cached */
+    std::shared_ptr<SendKey> get(karere::Id user, const StaticBuffer& pubKey) const;
+    void put(karere::Id user, const StaticBuffer& pubKey, const std::shared_ptr<SendKey>& key);
+    /** Removes the key of \c user, i.e. when the Cu25519 public key of the user has changed */
+    void invalidate(karere::Id user);
+    size_t size() const { return mKeys.size(); }
+};
+
+/**
+ * @brief Cache of the decrypted content of received messages, so that the history that is
+ * fetched again from the server (i.e. after a history reload) is not verified and decrypted
+ * again.
+ *
+ * It's shared by all the chats of a client. Entries are keyed by (chatid, msgid, updated),
+ * and each one keeps a digest of the encrypted message, so an entry is only used for the very
+ * same message that was verified and decrypted. The cache is bounded by the size of the
+ * cached content, evicting the least recently used entries.
+ * Only regular messages of protocol version 2 or higher are cached.
+ */
+class PlaintextCache
+{
+public:
+    enum
+    {
+        kDigestSize = 16,
+        kDefaultMaxBytes = 4 * 1024 * 1024
+    };
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t inserts = 0;
+        uint64_t evictions = 0;
+        size_t bytes = 0;           // current size of the cached content
+        size_t entries = 0;
+        double hitRate() const { return (hits + misses) ? (double)hits / (hits + misses) : 0; }
+    };
+    struct Digest { unsigned char data[kDigestSize]; };
+
+protected:
+    struct Entry
+    {
+        karere::Id chatid;
+        karere::Id userid;
+        uint16_t updated;
+        chatd::KeyId keyid;
+        unsigned char type;
+        Digest digest;
+        chatd::BackRefId backRefId;
+        std::vector<chatd::BackRefId> backRefs;
+        std::string content;
+        std::list<karere::Id>::iterator lruPos;
+        size_t bytes() const { return content.size() + backRefs.size() * sizeof(chatd::BackRefId) + sizeof(Entry); }
+    };
+    karere::IdMap<karere::Id, Entry> mEntries;  // by msgid
+    std::list<karere::Id> mLru;                 // most recently used first
+    size_t mMaxBytes;
+    Stats mStats;
+
+    // returns the entry of the message if it matches the message, ignoring its content
+    Entry* find(karere::Id chatid, const chatd::Message& msg);
+    void remove(karere::IdMap<karere::Id, Entry>::iterator it);
+public:
+    PlaintextCache(size_t maxBytes = kDefaultMaxBytes): mMaxBytes(maxBytes) {}
+    /** Calculates the digest of the encrypted content of a message */
+    static void digest(const StaticBuffer& encrypted, Digest& output);
+    /** @brief Returns whether the message is likely cached, without checking its content
+     * nor updating the stats. Used to avoid decrypting ahead messages that will be hits */
+    bool has(karere::Id chatid, const chatd::Message& msg) { return find(chatid, msg) != nullptr; }
+    /** @brief If the still encrypted message \c msg is cached, replaces its content with the
+     * decrypted one, and marks it as decrypted. Returns whether it was cached */
+    bool get(karere::Id chatid, chatd::Message& msg);
+    /** @brief Adds the decrypted message \c msg, whose encrypted content had the digest \c digest */
+    void put(karere::Id chatid, const Digest& digest, const chatd::Message& msg);
+    void clear();
+    const Stats& stats() const { return mStats; }
+};
+
 /**
  * @brief The ProtocolHandler class implements ICrypto.
  * @see chatd::ICrypto for more details.
@@ -276,14 +395,20 @@ protected:
      * Such promise will be resolved once the key is successfully decrypted.
      * If decryption fails, then the promise will be rejected.
      * For new keys getting confirmed, the promise is never used.
+     * Entries with a decrypted key are also linked in the LRU list (mKeyLru), so they
+     * can be evicted and loaded again from db on demand.
      */
     struct KeyEntry
     {
         std::shared_ptr<SendKey> key;
         std::shared_ptr<promise::Promise<std::shared_ptr<SendKey>>> pms;
+        std::list<UserKeyId>::iterator lruPos;  // only valid if `inLru` is set
+        bool inLru = false;
         KeyEntry(){}
         KeyEntry(const std::shared_ptr<SendKey>& aKey): key(aKey){}
     };
+    typedef std::map<UserKeyId, KeyEntry> KeyMap;
+    enum { kMaxCachedKeys = 128 };
 
     // own keys
     karere::Id mOwnHandle;
@@ -319,11 +444,18 @@ protected:
 
     bool mForceRsa = false; // for testing of legacy-mode
 
-    // received and confirmed keys (doesn't include unconfirmed keys)
-    std::map<UserKeyId, KeyEntry> mKeys;
+    // received and confirmed keys (doesn't include unconfirmed keys). Keys are loaded
+    // from db on demand, and at most kMaxCachedKeys decrypted keys are kept in memory
+    KeyMap mKeys;
 
-    // cache of symmetric keys (pubCu255 * privCu255)
-    std::map<karere::Id, std::shared_ptr<SendKey>> mSymmKeyCache;
+    // decrypted keys in mKeys, most recently used first
+    std::list<UserKeyId> mKeyLru;
+
+    // cache of symmetric keys (pubCu255 * privCu255), shared by all chats
+    std::shared_ptr<SymmKeyCache> mSymmKeyCache;
+
+    // cache of the content of decrypted messages, shared by all chats
+    std::shared_ptr<PlaintextCache> mPlaintextCache;
 
     // current list of participants (mapped to the `chatd::Client::mUsers`)
     karere::SetOfIds* mParticipants = nullptr;
@@ -333,6 +465,36 @@ protected:
     std::shared_ptr<UnifiedKey> mUnifiedKey;
     promise::Promise<std::shared_ptr<UnifiedKey>> mUnifiedKeyDecrypted;
 
+    /** @brief Verification and decryption of a message by the DecryptPool. The worker
+     * thread only accesses this struct until the job is completed */
+    struct PooledDecrypt
+    {
+        std::shared_ptr<ParsedMessage> parsedMsg;
+        std::shared_ptr<SendKey> sendKey;
+        EcKey edKey;
+        uint16_t updated;           // to detect edits of the message while it's being decrypted
+        bool signatureOk = false;
+        Buffer cleartext;
+        std::string error;          // set if the decryption threw
+    };
+    struct PooledDecryptEntry
+    {
+        std::shared_ptr<PooledDecrypt> job;
+        promise::Promise<void> done;    // resolved in the app thread when the job completes
+        bool awaited = false;           // msgDecrypt() is waiting for the result
+        PooledDecryptEntry(const std::shared_ptr<PooledDecrypt>& aJob): job(aJob) {}
+    };
+    enum { kMaxPooledDecrypts = 512 };
+
+    // messages decrypted or being decrypted by the DecryptPool, by msgid, until
+    // their msgDecrypt() consumes the result or they are discarded
+    karere::IdMap<karere::Id, PooledDecryptEntry> mPooledDecrypts;
+    // jobs not completed yet, limited to kMaxPooledDecrypts
+    size_t mPooledDecryptsRunning = 0;
+
+    // to build the signed data of the messages signed or verified in the app thread
+    Buffer mSignatureBuf;
+
 public:
     karere::Id chatid;
     karere::Id mPh = karere::Id::inval();     // it's only valid during preview mode (required to fetch user-attributes)
@@ -343,7 +505,9 @@ public:
         const StaticBuffer& privEd25519,
         const StaticBuffer& privRsa, karere::UserAttrCache& userAttrCache,
         SqliteDb& db, karere::Id aChatId, bool isPublic, std::shared_ptr<std::string> unifiedKey,
-        int isUnifiedKeyEncrypted, karere::Id ph, void *ctx);
+        int isUnifiedKeyEncrypted, karere::Id ph, void *ctx,
+        const std::shared_ptr<SymmKeyCache>& symmKeyCache = nullptr,
+        const std::shared_ptr<PlaintextCache>& plaintextCache = nullptr);
 
     promise::Promise<std::shared_ptr<SendKey>> //must be public to access from ParsedMessage
         decryptKey(std::shared_ptr<Buffer>& key, karere::Id sender, karere::Id receiver);
@@ -351,7 +515,15 @@ public:
     unsigned int getCacheVersion() const;
 
 protected:
-    void loadKeysFromDb();
+    /** @brief Returns the entry of the key, loading it from db if it's not in memory,
+     * or mKeys.end() if the key is unknown */
+    KeyMap::iterator findKey(UserKeyId ukid);
+    /** @brief Like findKey(), but adds an empty entry if the key is unknown */
+    KeyEntry& keyEntry(UserKeyId ukid);
+    std::shared_ptr<SendKey> loadKeyFromDb(UserKeyId ukid);
+    /** @brief Marks the decrypted key of the entry as the most recently used, and
+     * evicts the least recently used ones if there are too many in memory */
+    void touchKey(KeyMap::iterator it);
 
     /**
      * @brief Load unconfirmed keys stored in cache
@@ -409,6 +581,26 @@ protected:
     chatd::Message* legacyMsgDecrypt(const std::shared_ptr<ParsedMessage>& parsedMsg,
         chatd::Message* msg, const SendKey& key);
 
+    /**
+     * @brief Queues the verification and decryption of a message to the DecryptPool,
+     * if it's enabled and the keys required are already available.
+     * @return True if the job was queued (an entry was added to \c mPooledDecrypts)
+     */
+    bool startPooledDecrypt(const chatd::Message& msg, const std::shared_ptr<ParsedMessage>& parsedMsg);
+
+    /** @brief Creates the job to verify and decrypt a message, if the keys required are
+     * already available. Otherwise returns null */
+    std::shared_ptr<PooledDecrypt> preparePooledDecrypt(const chatd::Message& msg,
+        const std::shared_ptr<ParsedMessage>& parsedMsg);
+
+    /** @brief Adds the jobs to \c mPooledDecrypts and executes them as a single job of the
+     * DecryptPool. If the pool is disabled, they are executed and completed right away */
+    void submitPooledDecrypts(std::vector<std::pair<karere::Id, std::shared_ptr<PooledDecrypt>>>&& jobs);
+    static void runPooledDecrypt(PooledDecrypt& job, Buffer& scratch);
+
+    /** @brief Returns the result of the pooled decryption of \c msg, applied to it */
+    promise::Promise<chatd::Message*> pooledDecryptResult(chatd::Message* msg);
+
     void fetchUserKeys(karere::Id userid);
 
 // legacy RSA encryption methods
@@ -429,6 +621,9 @@ public:
     promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*>>
     msgEncrypt(chatd::Message *message, const karere::SetOfIds &recipients, chatd::MsgCommand* msgCmd) override;
     promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* message) override;
+    void msgDecryptAhead(chatd::Message* message) override;
+    void msgDecryptBatch(const std::vector<chatd::Message*>& messages) override;
+    void msgDiscarded(const chatd::Message& message) override;
     void onKeyReceived(chatd::KeyId keyid, karere::Id sender,
         karere::Id receiver, const char* data, uint16_t dataLen) override;
     void onKeyConfirmed(chatd::KeyId localkeyid, chatd::KeyId keyid) override;
@@ -20,6 +20,8 @@ struct TlvRecord
             throw std::runtime_error("parseMessageContent: Unexpected length of TLV record with type "+std::to_string(type)+ ": expected "+std::to_string(expected)+" actual: "+std::to_string(dataLen));
     }
     char* buf() const { return sourceBuf.buf()+dataOffset; }
+    /** A view of the payload data, pointing into the container (no copy) */
+    StaticBuffer view() const { return StaticBuffer(buf(), dataLen); }
     template <class T>
     T read() { validateDataLen(sizeof(T)); return sourceBuf.read<T>(dataOffset); }
     template <class T>
@@ -57,9 +59,15 @@ public:
        if (mOffset == Buffer::kNotFound)
             return false;
         size_t typeLen = mLegacyMode ? 2 : 1;
-        record.type = mSource.read<uint8_t>(mOffset);
+        // check the whole header at once and read it directly
+        if (mOffset+typeLen+2 > mSource.dataSize())
+            throw std::runtime_error("TlvContainer::getRecord: Corrupt data - record header spans outside of physical buffer");
+        const char* header = mSource.buf()+mOffset;
+        record.type = (uint8_t)header[0];
         record.dataOffset = mOffset+typeLen+2;
-        uint16_t valueLen = ntohs(mSource.read<uint16_t>(mOffset+typeLen));
+        uint16_t valueLen;
+        memcpy(&valueLen, header+typeLen, sizeof(valueLen));
+        valueLen = ntohs(valueLen);
 
         if ((valueLen == 0xffff) && !mLegacyMode)
         {
@@ -80,6 +88,49 @@ public:
         return true;
 }
 };
+/** @brief Writes TLV records into a memory area provided by the caller, in one pass and
+ * without allocating. The size of the area must be precalculated by adding the
+ * \c recordSize() of each record. Overflowing the area throws.
+ */
+class TlvSpanWriter
+{
+protected:
+    char* mPos;
+    char* mEnd;
+    void writeHeader(uint8_t type, size_t dataLen)
+    {
+        if ((size_t)(mEnd-mPos) < recordSize(dataLen))
+            throw std::runtime_error("TlvSpanWriter::addRecord: Record of "+std::to_string(dataLen)+" bytes doesn't fit in the remaining "+std::to_string(mEnd-mPos)+" bytes");
+        *mPos++ = (char)type;
+        // a length code of 0xffff means that the record spans till the end of the container
+        uint16_t lenCode = htons((dataLen >= 0xffff) ? 0xffff : (uint16_t)dataLen);
+        memcpy(mPos, &lenCode, sizeof(lenCode));
+        mPos += sizeof(lenCode);
+    }
+public:
+    TlvSpanWriter(void* buf, size_t size): mPos((char*)buf), mEnd(mPos+size){}
+    /** Size of the encoded record with a payload of \c dataLen bytes */
+    static size_t recordSize(size_t dataLen) { return 3+dataLen; }
+    /** Pointer to where the next record will be written */
+    char* pos() const { return mPos; }
+    size_t remaining() const { return mEnd-mPos; }
+
+    void addRecord(uint8_t type, const StaticBuffer& value)
+    {
+        writeHeader(type, value.dataSize());
+        memcpy(mPos, value.buf(), value.dataSize());
+        mPos += value.dataSize();
+    }
+
+    template <typename T, typename=typename std::enable_if<std::is_pod<T>::value>::type>
+    void addRecord(uint8_t type, T val)
+    {
+        writeHeader(type, sizeof(val));
+        memcpy(mPos, &val, sizeof(val));
+        mPos += sizeof(val);
+    }
+};
+
 class TlvWriter: public Buffer
 {
 protected:
@@ -88,6 +139,7 @@ protected:
 #endif
 public:
     explicit TlvWriter(size_t reserve=128): Buffer(reserve){}
+    static size_t recordSize(size_t dataLen) { return TlvSpanWriter::recordSize(dataLen); }
 
 /**
  * Generates a binary encoded TLV record from a key-value pair.
@@ -99,27 +151,20 @@ public:
 void addRecord(uint8_t type, const StaticBuffer& value)
 {
     assert(!mEnded);
-    append(type);
-    if (value.dataSize() >= 0xffff)
-    {
-        append<uint16_t>(0xffff);
+    size_t size = recordSize(value.dataSize());
+    TlvSpanWriter(appendPtr(size), size).addRecord(type, value);
 #ifdef NODEBUG
+    if (value.dataSize() >= 0xffff)
         mEnded = true;
 #endif
-    }
-    else
-    {
-        append<uint16_t>(htons(value.dataSize()));
-    }
-    append(value);
 }
 
 template <typename T, typename=typename std::enable_if<std::is_pod<T>::value>::type>
 void addRecord(uint8_t type, T val)
 {
     assert(!mEnded);
-    append(type);
-    append<uint16_t>(htons(sizeof(val))).append(val);
+    size_t size = recordSize(sizeof(val));
+    TlvSpanWriter(appendPtr(size), size).addRecord(type, val);
 }
 };
 }
@@ -246,6 +246,12 @@ void UserAttrCache::onUserAttrChange(uint64_t userid, int changed)
             continue; //the change is not of this attrib type
 
         int type = it->first;
+        if (type == ::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY)
+        {
+            // even if the attribute isn't cached, a key derived from it may be
+            mClient.invalidateSymmKey(userid);
+        }
+
         UserAttrPair key(userid, type);
         auto it = find(key);
         if (it == end()) //we don't have such attribute
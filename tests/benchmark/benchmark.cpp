@@ -0,0 +1,1645 @@
+/**
+ * Benchmarks of the hot paths of karere, which don't require an account
+ * nor a connection (the protocol benchmarks run against the in-process
+ * servers of serverSimulator.h). Run in a Release build:
+ *     benchmark [iterations]
+ */
+
+#include <strongvelope/strongvelope.h>
+#include <strongvelope/cryptofunctions.h>
+#include <strongvelope/decryptPool.h>
+#include <strongvelope/tlvstore.h>
+#include <chatClient.h>
+#include <chatdDb.h>
+#include <dbStatements.h>
+#include <chatdICrypto.h>
+#include <userAttrCache.h>
+#include <bufferPool.h>
+#include <idMap.h>
+#include <net/fragmentBuffer.h>
+#include <db.h>
+#include <megaapi.h>
+#include <presenced.h>
+#include <cryptopp/filters.h>
+#ifndef KARERE_DISABLE_WEBRTC
+#include <rtcCrypto.h>
+#endif
+#include "../common/serverSimulator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace strongvelope;
+
+// counts the allocations of the benchmarks, see AllocCount
+static std::atomic<uint64_t> gNewCount(0);
+
+void* operator new(size_t size)
+{
+    gNewCount++;
+    if (void* ptr = malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+namespace
+{
+const std::string kSigPrefix = "strongvelopesig";
+
+/** A signed and encrypted message, as the data that strongvelope verifies and decrypts */
+struct EncryptedSample
+{
+    std::string signedContent;
+    std::string ciphertext;
+    unsigned char signature[crypto_sign_BYTES];
+};
+
+class Timer
+{
+    std::chrono::steady_clock::time_point mStart = std::chrono::steady_clock::now();
+public:
+    double elapsedSec() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - mStart).count();
+    }
+};
+
+void printResult(const std::string& name, size_t ops, size_t bytes, double sec, const std::string& extra = "")
+{
+    std::cout << "    " << std::left << std::setw(36) << name << std::right
+              << std::setw(12) << std::fixed << std::setprecision(0) << ops / sec << " ops/s"
+              << std::setw(10) << std::setprecision(1) << bytes / sec / (1024 * 1024) << " MB/s"
+              << "  " << extra << std::endl;
+}
+
+/** Allocations done since a point in time: operator new, and the blocks that the
+ * BufferPool (Buffer, Message) had to request to the system allocator */
+struct AllocCount
+{
+    uint64_t news = gNewCount;
+    uint64_t poolAllocs = BufferPool::instance().stats().systemAllocs;
+
+    std::string perOp(size_t ops) const
+    {
+        std::ostringstream result;
+        result << std::fixed << std::setprecision(1)
+               << (double)(gNewCount - news) / ops << " new/op, "
+               << (double)(BufferPool::instance().stats().systemAllocs - poolAllocs) / ops << " malloc/op";
+        return result.str();
+    }
+};
+
+/** Verifies and decrypts a message, like ParsedMessage::verifySignature() + decryptPayload() */
+bool verifyAndDecrypt(const EncryptedSample& sample, const Key<32>& pubKey,
+                      const SendKey& key, const Key<16>& iv)
+{
+    std::string toVerify = kSigPrefix;
+    toVerify.append(sample.signedContent);
+    if (crypto_sign_verify_detached(sample.signature, (const unsigned char*)toVerify.data(),
+                                    toVerify.size(), pubKey.ubuf()) != 0)
+    {
+        return false;
+    }
+    Buffer cleartext(sample.ciphertext.size());
+    aesCTRCrypt(key, iv, StaticBuffer(sample.ciphertext, false), cleartext);
+    return cleartext.dataSize() == sample.ciphertext.size();
+}
+
+/** Throughput of the message verification and decryption, depending on the number
+ * of threads of the DecryptPool (0 means decrypting in the calling thread) */
+void benchDecryptPool(unsigned iterations)
+{
+    std::cout << "DecryptPool: verify + decrypt of " << iterations << " messages" << std::endl;
+
+    unsigned char seed[32];
+    randombytes_buf(seed, sizeof(seed));
+    unsigned char sk[crypto_sign_SECRETKEYBYTES];
+    Key<32> pubKey;
+    crypto_sign_seed_keypair(pubKey.ubuf(), sk, seed);
+    pubKey.setDataSize(crypto_sign_PUBLICKEYBYTES);
+
+    SendKey key;
+    randombytes_buf(key.ubuf(), key.dataSize());
+    Key<16> iv;
+    randombytes_buf(iv.ubuf(), iv.dataSize());
+
+    // typical text messages of a few hundred bytes
+    std::vector<EncryptedSample> samples(iterations);
+    size_t totalBytes = 0;
+    for (unsigned i = 0; i < iterations; i++)
+    {
+        auto& sample = samples[i];
+        std::string text(64 + (i * 37) % 512, 'a' + i % 26);
+        sample.ciphertext = aesCTREncrypt(text, key, iv);
+        sample.signedContent.assign(key.buf(), key.dataSize());
+        sample.signedContent.append(sample.ciphertext);
+        std::string toSign = kSigPrefix + sample.signedContent;
+        crypto_sign_detached(sample.signature, nullptr, (const unsigned char*)toSign.data(), toSign.size(), sk);
+        totalBytes += text.size();
+    }
+
+    auto& pool = DecryptPool::instance();
+    unsigned maxThreads = std::max(1u, std::thread::hardware_concurrency());
+    double baseline = 0;
+    for (unsigned threads = 0; threads <= maxThreads; threads = threads ? threads * 2 : 1)
+    {
+        pool.setThreadCount(threads);
+        std::vector<char> ok(iterations, 0);
+        Timer timer;
+        for (unsigned i = 0; i < iterations; i++)
+        {
+            const EncryptedSample* sample = &samples[i];
+            char* result = &ok[i];
+            pool.submit([sample, result, &pubKey, &key, &iv]()
+            {
+                *result = verifyAndDecrypt(*sample, pubKey, key, iv);
+            });
+        }
+        pool.waitIdle();
+        double sec = timer.elapsedSec();
+
+        for (char result: ok)
+        {
+            if (!result)
+            {
+                std::cout << "    ERROR: message verification failed" << std::endl;
+                break;
+            }
+        }
+        double rate = iterations / sec;
+        if (!threads)
+        {
+            baseline = rate;
+        }
+        std::ostringstream speedup;
+        speedup << "x" << std::setprecision(2) << std::fixed << rate / baseline;
+        printResult(threads ? std::to_string(threads) + " threads" : "app thread", iterations, totalBytes, sec, speedup.str());
+    }
+    pool.setThreadCount(0);
+}
+
+/** AES-128-CTR of a message payload, with the former Crypto++ pipeline
+ * (StringSource -> StreamTransformationFilter -> StringSink) and with the buffer-based
+ * functions, which can work in place */
+void benchAesCtr()
+{
+    std::cout << "AES-128-CTR (" << aesImplementation() << ")" << std::endl;
+
+    SendKey key;
+    randombytes_buf(key.ubuf(), key.dataSize());
+    Key<16> iv;
+    randombytes_buf(iv.ubuf(), iv.dataSize());
+
+    for (size_t size = 16; size <= 64 * 1024; size *= 4)
+    {
+        unsigned ops = std::max<size_t>(1000, (32 * 1024 * 1024) / size);
+        std::string text(size, 'x');
+        Buffer buf(text.data(), text.size());
+        std::string label = std::to_string(size) + " bytes";
+        {
+            size_t total = 0;
+            Timer timer;
+            for (unsigned i = 0; i < ops; i++)
+            {
+                CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption encryptor;
+                encryptor.SetKeyWithIV(key.ubuf(), key.dataSize(), iv.ubuf());
+                std::string cipher;
+                CryptoPP::StringSource src(text, true,
+                    new CryptoPP::StreamTransformationFilter(encryptor, new CryptoPP::StringSink(cipher)));
+                Buffer result(cipher.data(), cipher.size());  // callers copied the result to a Buffer
+                total += result.dataSize();
+            }
+            printResult(label + ", pipeline", ops, total, timer.elapsedSec());
+        }
+        {
+            size_t total = 0;
+            Timer timer;
+            for (unsigned i = 0; i < ops; i++)
+            {
+                Buffer result(size);
+                aesCTRCrypt(key, iv, buf, result);
+                total += result.dataSize();
+            }
+            printResult(label + ", to buffer", ops, total, timer.elapsedSec());
+        }
+        {
+            Timer timer;
+            for (unsigned i = 0; i < ops; i++)
+            {
+                aesCTRCrypt(key, iv, buf);
+            }
+            printResult(label + ", in place", ops, (size_t)ops * size, timer.elapsedSec());
+        }
+    }
+}
+
+/** Encryption of a new send key to every participant of a group (the KeyCommand of a key
+ * rotation), with the pairwise keys already derived. The former way chained promises per
+ * participant and grew the KeyCommand for each key. ProtocolHandler::encryptKeyToAllParticipants()
+ * now wraps the keys in a loop into a preallocated KeyCommand */
+void benchKeyFanOut(const std::vector<unsigned>& groupSizes, unsigned rotations)
+{
+    std::cout << "Send key fan-out: " << rotations << " key rotations" << std::endl;
+    SendKey sendKey;
+    randombytes_buf(sendKey.ubuf(), sendKey.dataSize());
+
+    for (unsigned size: groupSizes)
+    {
+        std::vector<karere::Id> users;
+        std::vector<std::shared_ptr<SendKey>> symKeys;
+        for (unsigned i = 0; i < size; i++)
+        {
+            users.emplace_back(1000 + i);
+            symKeys.push_back(std::make_shared<SendKey>());
+            randombytes_buf(symKeys.back()->ubuf(), symKeys.back()->dataSize());
+        }
+        std::string label = std::to_string(size) + " users";
+        size_t keys = (size_t)size * rotations;
+        {
+            Timer timer;
+            for (unsigned r = 0; r < rotations; r++)
+            {
+                std::unique_ptr<chatd::KeyCommand> keyCmd(new chatd::KeyCommand(1, CHATD_KEYID_UNCONFIRMED));
+                chatd::KeyCommand* cmd = keyCmd.get();
+                std::vector<promise::Promise<void>> promises;
+                for (unsigned i = 0; i < size; i++)
+                {
+                    karere::Id user = users[i];
+                    promise::Promise<std::shared_ptr<SendKey>> pms;
+                    promises.push_back(pms.then([&sendKey](const std::shared_ptr<SendKey>& symKey)
+                    {
+                        auto result = std::make_shared<Buffer>((size_t)AES::BLOCKSIZE);
+                        result->setDataSize(AES::BLOCKSIZE);
+                        aesECBEncrypt(sendKey, *symKey, *result);
+                        return result;
+                    })
+                    .then([cmd, user](const std::shared_ptr<Buffer>& encryptedKey)
+                    {
+                        cmd->addKey(user, encryptedKey->buf(), encryptedKey->dataSize());
+                    }));
+                    pms.resolve(symKeys[i]);
+                }
+                promise::when(promises);
+            }
+            printResult(label + ", promise per user", keys, keys * AES::BLOCKSIZE, timer.elapsedSec());
+        }
+        {
+            Timer timer;
+            for (unsigned r = 0; r < rotations; r++)
+            {
+                chatd::KeyCommand keyCmd(1, CHATD_KEYID_UNCONFIRMED, 17 + size * (10 + AES::BLOCKSIZE));
+                SendKey encryptedKey;
+                for (unsigned i = 0; i < size; i++)
+                {
+                    aesECBEncrypt(sendKey, *symKeys[i], encryptedKey);
+                    keyCmd.addKey(users[i], encryptedKey.buf(), encryptedKey.dataSize());
+                }
+            }
+            printResult(label + ", loop", keys, keys * AES::BLOCKSIZE, timer.elapsedSec());
+        }
+    }
+}
+
+/** Startup cost of the send keys of a large account: loading all the keys of every
+ * chat (as ProtocolHandler did on construction), versus loading from db only the keys
+ * needed to decrypt the last messages of each chat */
+void benchSendKeys(unsigned chats, unsigned keysPerChat, unsigned keysUsed)
+{
+    std::cout << "Send keys: " << chats << " chats, " << keysPerChat << " keys per chat, "
+              << keysUsed << " used per chat" << std::endl;
+
+    const char* fname = "benchmark_sendkeys.db";
+    remove(fname);
+    SqliteDb db;
+    if (!db.open(fname, false) || sqlite3_exec(db, gDbSchema, nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        std::cout << "    ERROR: can't create the database" << std::endl;
+        return;
+    }
+    SendKey key;
+    for (unsigned chat = 1; chat <= chats; chat++)
+    {
+        for (unsigned i = 0; i < keysPerChat; i++)
+        {
+            randombytes_buf(key.ubuf(), key.dataSize());
+            db.query("insert into sendkeys(chatid, userid, keyid, key, ts) values(?,?,?,?,?)",
+                     (uint64_t)chat, (uint64_t)(i % 16 + 1), (uint64_t)i, key, 0);
+        }
+    }
+    db.commit();
+
+    // approximate memory of a cached key: map node + entry + key
+    const size_t bytesPerKey = 4 * sizeof(void*) + sizeof(UserKeyId)
+            + 2 * sizeof(std::shared_ptr<SendKey>) + sizeof(SendKey) + 16;
+    {
+        std::map<std::pair<uint64_t, uint64_t>, std::shared_ptr<SendKey>> keys;
+        size_t loaded = 0;
+        Timer timer;
+        for (unsigned chat = 1; chat <= chats; chat++)
+        {
+            SqliteStmt stmt(db, "select userid, keyid, key from sendkeys where chatid=?");
+            stmt << (uint64_t)chat;
+            while (stmt.step())
+            {
+                auto sendKey = std::make_shared<SendKey>();
+                stmt.blobCol(2, *sendKey);
+                keys.emplace(std::make_pair(stmt.uint64Col(0), stmt.uint64Col(1)), sendKey);
+            }
+            loaded += keys.size();
+            keys.clear();
+        }
+        double sec = timer.elapsedSec();
+        printResult("load all keys", chats, loaded * SVCRYPTO_KEY_SIZE, sec,
+                    std::to_string(loaded) + " keys, ~" + std::to_string(loaded * bytesPerKey / 1024) + " KB");
+    }
+    {
+        size_t loaded = 0;
+        Timer timer;
+        for (unsigned chat = 1; chat <= chats; chat++)
+        {
+            for (unsigned i = keysPerChat - std::min(keysUsed, keysPerChat); i < keysPerChat; i++)
+            {
+                SqliteStmt stmt(db, "select key from sendkeys where chatid = ? and userid = ? and keyid = ?");
+                stmt << (uint64_t)chat << (uint64_t)(i % 16 + 1) << (uint64_t)i;
+                if (stmt.step())
+                {
+                    auto sendKey = std::make_shared<SendKey>();
+                    stmt.blobCol(0, *sendKey);
+                    loaded++;
+                }
+            }
+        }
+        double sec = timer.elapsedSec();
+        printResult("load keys on demand", chats, loaded * SVCRYPTO_KEY_SIZE, sec,
+                    std::to_string(loaded) + " keys, ~" + std::to_string(loaded * bytesPerKey / 1024) + " KB");
+    }
+    db.close();
+    remove(fname);
+}
+
+/** Message ingest and cold start of a file db with each of the profiles of MegaChatApi::init():
+ * DB_PROFILE_DEFAULT, DB_PROFILE_PERFORMANCE and DB_PROFILE_WRITE_BEHIND. The db is opened as
+ * karere::Client does, with the changes committed in batches.
+ * - ingest: \c messages messages spread over \c chats chats, written as chatd does for each
+ *   received message (insert into history and update of last_recv), and a final commit.
+ *   The time on the calling thread is reported separately, as it's the one of the app.
+ * - cold start: reopens the db and runs the startup queries of every chat (history range
+ *   and first page) and of chatd::Client (last message of each user). The OS page cache
+ *   is not dropped, so the reads are served from memory */
+void benchDbProfiles(unsigned chats, unsigned messages)
+{
+    std::cout << "DB profiles: " << messages << " messages in " << chats << " chats" << std::endl;
+    struct Profile
+    {
+        const char* name;
+        SqliteDbProfile profile;
+        bool writeBehind;
+    };
+    std::vector<Profile> profiles = {
+        {"default", SqliteDbProfile(), false},
+        {"performance", SqliteDbProfile::performance(), false},
+        {"write-behind", SqliteDbProfile::performance(), true}
+    };
+    const char* fname = "benchmark_profiles.db";
+    const std::string walName = std::string(fname) + "-wal";
+    const std::string shmName = std::string(fname) + "-shm";
+    std::string text(200, 't');
+    std::string insertMsg = karere::sql::histInsert("history");
+    std::string loadMsgs = karere::sql::histLoadMessages("history");
+
+    for (auto& profile: profiles)
+    {
+        remove(fname);
+        remove(walName.c_str());
+        remove(shmName.c_str());
+        SqliteDb db;
+        if (!db.open(fname, false, profile.profile) || sqlite3_exec(db, gDbSchema, nullptr, nullptr, nullptr) != SQLITE_OK)
+        {
+            std::cout << "    ERROR: can't create the database" << std::endl;
+            return;
+        }
+        for (unsigned chat = 1; chat <= chats; chat++)
+        {
+            db.query("insert into chats(chatid, shard, own_priv) values(?,?,?)", (uint64_t)chat, 0, (int)chatd::PRIV_OPER);
+        }
+        db.commit();
+        if (profile.writeBehind && !db.enableWriteBehind())
+        {
+            std::cout << "    ERROR: write-behind not supported by " << profile.name << std::endl;
+            return;
+        }
+
+        std::string label = std::string(profile.name) + ", ";
+        {
+            Timer timer;
+            for (unsigned i = 0; i < messages; i++)
+            {
+                uint64_t chatid = i % chats + 1;
+                uint64_t msgid = i + 1;
+                db.query(insertMsg.c_str(), (int)(i / chats), chatid, msgid, 1u, (int)chatd::Message::kMsgNormal,
+                         (uint64_t)(SimConfig::kFirstPeer + i % 16), 1000 + i, 0, StaticBuffer(text.data(), text.size()),
+                         (uint64_t)0, (int)chatd::Message::kNotEncrypted);
+                db.query(karere::sql::kChatSetLastRecv, msgid, chatid);
+            }
+            double appSec = timer.elapsedSec();
+            db.commit();
+            db.flush();
+            double sec = timer.elapsedSec();
+            std::ostringstream extra;
+            extra << std::fixed << std::setprecision(0) << messages / appSec << " msgs/s on the calling thread";
+            printResult(label + "ingest", messages, (size_t)messages * text.size(), sec, extra.str());
+        }
+        db.close();
+
+        {
+            size_t loaded = 0;
+            Timer timer;
+            if (!db.open(fname, false, profile.profile) || (profile.writeBehind && !db.enableWriteBehind()))
+            {
+                std::cout << "    ERROR: can't reopen the database" << std::endl;
+                return;
+            }
+            SqliteStmt users(db, karere::sql::kHistoryUserids);
+            while (users.step())
+            {
+                SqliteStmt lastTs(db, karere::sql::kHistoryUserLastTs);
+                lastTs << users.uint64Col(0);
+                lastTs.step();
+            }
+            for (unsigned chat = 1; chat <= chats; chat++)
+            {
+                SqliteStmt range(db, karere::sql::kHistoryIdxRange);
+                range << (uint64_t)chat;
+                range.step();
+                SqliteStmt page(db, loadMsgs);
+                page << (uint64_t)chat << range.intCol(1) << 32;
+                Buffer data;
+                while (page.step())
+                {
+                    page.blobCol(4, data);
+                    loaded++;
+                }
+            }
+            double sec = timer.elapsedSec();
+            std::ostringstream extra;
+            extra << std::fixed << std::setprecision(2) << sec * 1000 << " ms, " << loaded << " msgs";
+            printResult(label + "cold start", chats, 0, sec, extra.str());
+        }
+        db.close();
+    }
+    remove(fname);
+    remove(walName.c_str());
+    remove(shmName.c_str());
+}
+
+/** TLV container of a message: signature, nonce and payload records */
+void benchTlv(unsigned iterations)
+{
+    std::cout << "TLV: write + parse of " << iterations << " containers" << std::endl;
+    Key<64> signature;
+    randombytes_buf(signature.ubuf(), signature.dataSize());
+    Key<12> nonce;
+    randombytes_buf(nonce.ubuf(), nonce.dataSize());
+
+    for (size_t size: {64, 1024, 16 * 1024})
+    {
+        Buffer payload(size);
+        randombytes_buf(payload.appendPtr(size), size);
+        std::string label = std::to_string(size) + " bytes payload";
+        size_t total = 0;
+        AllocCount allocs;
+        Timer timer;
+        for (unsigned i = 0; i < iterations; i++)
+        {
+            TlvWriter tlv;
+            tlv.addRecord(TLV_TYPE_SIGNATURE, signature);
+            tlv.addRecord(TLV_TYPE_NONCE, nonce);
+            tlv.addRecord(TLV_TYPE_PAYLOAD, payload);
+
+            TlvParser parser(tlv, 0, false);
+            TlvRecord record(tlv);
+            while (parser.getRecord(record))
+            {
+                total += record.dataLen;
+            }
+        }
+        printResult(label, iterations, total, timer.elapsedSec(), allocs.perOp(iterations));
+
+        // the same container, with the size precalculated and written in one pass
+        // into a reused buffer, as msgEncryptWithKey() does
+        size_t containerSize = TlvSpanWriter::recordSize(signature.dataSize())
+            + TlvSpanWriter::recordSize(nonce.dataSize()) + TlvSpanWriter::recordSize(size);
+        Buffer container(containerSize, containerSize);
+        total = 0;
+        AllocCount spanAllocs;
+        Timer spanTimer;
+        for (unsigned i = 0; i < iterations; i++)
+        {
+            TlvSpanWriter tlv(container.buf(), containerSize);
+            tlv.addRecord(TLV_TYPE_SIGNATURE, signature);
+            tlv.addRecord(TLV_TYPE_NONCE, nonce);
+            tlv.addRecord(TLV_TYPE_PAYLOAD, payload);
+
+            TlvParser parser(container, 0, false);
+            TlvRecord record(container);
+            while (parser.getRecord(record))
+            {
+                total += record.view().dataSize();
+            }
+        }
+        printResult(label + ", one pass", iterations, total, spanTimer.elapsedSec(), spanAllocs.perOp(iterations));
+    }
+}
+
+/** Feeds a message of \c size bytes in frames of up to \c frameSize bytes, and each frame
+ * in fragments, as libwebsockets delivers it: \c remaining is what's left of the frame */
+template <class Append, class Complete>
+void receiveFragmented(size_t size, size_t frameSize, const std::string& fragment, Append&& append, Complete&& complete)
+{
+    for (size_t frameStart = 0; frameStart < size; frameStart += frameSize)
+    {
+        size_t frameEnd = std::min(size, frameStart + frameSize);
+        for (size_t received = frameStart; received < frameEnd; received += fragment.size())
+        {
+            size_t len = std::min(fragment.size(), frameEnd - received);
+            append(fragment.data(), len, frameEnd - received - len);
+        }
+    }
+    complete();
+}
+
+/** Reassembly of large websocket messages (i.e. HIST responses), received in fragments
+ * of the size of the libwebsockets rx buffer, in a single frame or in several ones: into
+ * a new string per message, into a string kept by the connection (as LibwebsocketsClient
+ * did), and into a FragmentBuffer, whose block is handed over with each message */
+void benchFragments()
+{
+    const size_t kFragmentSize = 128 * 1024;
+    const size_t kTotalSize = 512 * 1024 * 1024;
+    std::cout << "websocket message reassembly, " << kFragmentSize / 1024 << " KB fragments" << std::endl;
+    std::string fragment(kFragmentSize, 'x');
+
+    // (message size, frame size)
+    std::vector<std::pair<size_t, size_t>> cases = {
+        {512 * 1024, 512 * 1024},
+        {4 * 1024 * 1024, 4 * 1024 * 1024},
+        {16 * 1024 * 1024, 16 * 1024 * 1024},
+        {4 * 1024 * 1024, 256 * 1024},
+        {16 * 1024 * 1024, 256 * 1024}
+    };
+    for (auto& sizes: cases)
+    {
+        size_t size = sizes.first;
+        size_t frameSize = sizes.second;
+        size_t messages = kTotalSize / size;
+        std::string label = std::to_string(size / 1024) + " KB messages";
+        if (frameSize < size)
+        {
+            label += " in " + std::to_string(size / frameSize) + " frames";
+        }
+        {
+            size_t total = 0;
+            AllocCount allocs;
+            Timer timer;
+            for (size_t i = 0; i < messages; i++)
+            {
+                std::string message;
+                receiveFragmented(size, frameSize, fragment,
+                    [&message](const char* data, size_t len, size_t) { message.append(data, len); },
+                    [&message, &total]() { total += message.size(); });
+            }
+            printResult(label + ", new string", messages, total, timer.elapsedSec(), allocs.perOp(messages));
+        }
+        {
+            size_t total = 0;
+            std::string recbuffer;
+            AllocCount allocs;
+            Timer timer;
+            for (size_t i = 0; i < messages; i++)
+            {
+                receiveFragmented(size, frameSize, fragment,
+                    [&recbuffer](const char* data, size_t len, size_t remaining)
+                    {
+                        if (!recbuffer.size() && remaining)
+                            recbuffer.reserve(len + remaining);
+                        recbuffer.append(data, len);
+                    },
+                    [&recbuffer, &total]() { total += recbuffer.size(); recbuffer.clear(); });
+            }
+            printResult(label + ", kept string", messages, total, timer.elapsedSec(), allocs.perOp(messages));
+        }
+        {
+            size_t total = 0;
+            FragmentBuffer recbuffer;
+            AllocCount allocs;
+            Timer timer;
+            for (size_t i = 0; i < messages; i++)
+            {
+                receiveFragmented(size, frameSize, fragment,
+                    [&recbuffer](const char* data, size_t len, size_t remaining) { recbuffer.append(data, len, remaining); },
+                    [&recbuffer, &total]() { total += recbuffer.take()->dataSize(); });
+            }
+            printResult(label + ", FragmentBuffer", messages, total, timer.elapsedSec(), allocs.perOp(messages));
+        }
+    }
+}
+
+/** Commands built and freed one after the other by several threads at the same time, with
+ * the BufferPool enabled and disabled. Each one is a NEWMSG with a payload of 16..1024 bytes,
+ * built as chatd::Chat does and freed once written, as Connection::sendBuf() does. The
+ * commands are the buffers created as pooled, the rest use the system allocator */
+void benchBufferPool(unsigned commands)
+{
+    std::cout << "BufferPool: " << commands << " NEWMSG commands per thread" << std::endl;
+    std::vector<uint16_t> sizes(commands);
+    randombytes_buf(sizes.data(), sizes.size() * sizeof(uint16_t));
+    for (auto& size: sizes)
+    {
+        size = 16 + size % 1009;
+    }
+    std::string payload(1024, 'x');
+    const bool wasEnabled = BufferPool::instance().isEnabled();
+
+    for (bool enabled: {true, false})
+    {
+        for (unsigned threads: {1u, 4u})
+        {
+            BufferPool::instance().setEnabled(enabled);
+            std::atomic<size_t> bytes(0);
+            AllocCount allocs;
+            Timer timer;
+            std::vector<std::thread> workers;
+            for (unsigned t = 0; t < threads; t++)
+            {
+                workers.emplace_back([&]()
+                {
+                    size_t written = 0;
+                    for (unsigned i = 0; i < commands; i++)
+                    {
+                        chatd::Command cmd(chatd::OP_NEWMSG);
+                        cmd.append<uint64_t>(SimConfig::kFirstChat).append<uint64_t>(0).append<uint64_t>(i + 1)
+                           .append<uint32_t>(i).append<uint16_t>(0).append<uint32_t>(1)
+                           .append<uint32_t>(sizes[i]).append(payload.data(), sizes[i]);
+                        written += cmd.dataSize();
+                        cmd.free();
+                    }
+                    bytes += written;
+                });
+            }
+            for (auto& worker: workers)
+            {
+                worker.join();
+            }
+
+            size_t ops = (size_t)commands * threads;
+            std::ostringstream label;
+            label << "commands, pool " << (enabled ? "on" : "off") << ", " << threads << " threads";
+            printResult(label.str(), ops, bytes, timer.elapsedSec(), allocs.perOp(ops));
+        }
+    }
+    BufferPool::instance().setEnabled(wasEnabled);
+}
+
+/** Inserts, finds (present and missing keys, in random order) and erases \c ids in a map */
+template <class Map>
+void benchMap(const std::string& label, const std::vector<uint64_t>& ids, const std::vector<uint64_t>& missing)
+{
+    std::vector<uint64_t> lookups(ids);
+    std::random_shuffle(lookups.begin(), lookups.end());
+    size_t n = ids.size();
+    size_t found = 0;
+    Map map;
+    {
+        AllocCount allocs;
+        Timer timer;
+        for (size_t i = 0; i < n; i++)
+        {
+            map[ids[i]] = (int)i;
+        }
+        printResult(label + ", insert", n, 0, timer.elapsedSec(), allocs.perOp(n));
+    }
+    {
+        Timer timer;
+        for (auto id: lookups)
+        {
+            found += map.find(id) != map.end();
+        }
+        printResult(label + ", find", n, 0, timer.elapsedSec());
+    }
+    {
+        Timer timer;
+        for (auto id: missing)
+        {
+            found += map.find(id) != map.end();
+        }
+        printResult(label + ", find missing", missing.size(), 0, timer.elapsedSec());
+    }
+    {
+        Timer timer;
+        for (auto id: lookups)
+        {
+            found += map.erase(id);
+        }
+        printResult(label + ", erase", n, 0, timer.elapsedSec());
+    }
+    if (found != 2 * n)
+    {
+        std::cout << "    ERROR: " << found << " keys found, expected " << 2 * n << std::endl;
+    }
+}
+
+/** karere::IdMap against std::map and std::unordered_map, with random 64-bit handles */
+void benchIdMap(const std::vector<size_t>& sizes)
+{
+    std::cout << "id maps: random 64-bit keys" << std::endl;
+    for (size_t size: sizes)
+    {
+        std::vector<uint64_t> ids(size);
+        std::vector<uint64_t> missing(size);
+        randombytes_buf(ids.data(), size * sizeof(uint64_t));
+        randombytes_buf(missing.data(), size * sizeof(uint64_t));
+        std::string label = std::to_string(size) + " keys";
+        benchMap<karere::IdMap<uint64_t, int>>(label + ", IdMap", ids, missing);
+        benchMap<std::map<uint64_t, int>>(label + ", std::map", ids, missing);
+        benchMap<std::unordered_map<uint64_t, int>>(label + ", std::unordered_map", ids, missing);
+    }
+}
+
+/** Key pairs of a user of the end-to-end benchmarks */
+struct BenchUser
+{
+    karere::Id handle;
+    EcKey privEd25519;
+    EcKey pubEd25519;
+    EcKey privCu25519;
+    EcKey pubCu25519;
+    explicit BenchUser(uint64_t aHandle): handle(aHandle)
+    {
+        unsigned char sk[crypto_sign_SECRETKEYBYTES];
+        randombytes_buf(privEd25519.ubuf(), privEd25519.dataSize());
+        crypto_sign_seed_keypair(pubEd25519.ubuf(), sk, privEd25519.ubuf());
+        randombytes_buf(privCu25519.ubuf(), privCu25519.dataSize());
+        crypto_scalarmult_base(pubCu25519.ubuf(), privCu25519.ubuf());
+    }
+};
+
+/** The MegaApi of the benchmarks, which is never logged in */
+::mega::MegaApi& benchSdk()
+{
+    static auto sdk = new ::mega::MegaApi("benchmark", (const char*)nullptr, "karere benchmark");
+    return *sdk;
+}
+
+bool openMemoryDb(SqliteDb& db)
+{
+    return db.open(":memory:") && sqlite3_exec(db, gDbSchema, nullptr, nullptr, nullptr) == SQLITE_OK;
+}
+
+class BenchApp: public karere::IApp
+{
+public:
+    IChatListHandler* chatListHandler() override { return nullptr; }
+    void onPresenceConfigChanged(const presenced::Config&, bool) override {}
+    void onPresenceLastGreenUpdated(karere::Id, uint16_t) override {}
+#ifndef KARERE_DISABLE_WEBRTC
+    rtcModule::ICallHandler* onIncomingCall(rtcModule::ICall&, karere::AvFlags) override { return nullptr; }
+    rtcModule::ICallHandler* onGroupCallActive(karere::Id, karere::Id, uint32_t) override { return nullptr; }
+#endif
+};
+
+/** A karere::Client that is never logged in, with an in-memory db whose user
+ * attributes are the public keys of the benchmark users. Its UserAttrCache
+ * loads them from the db, so all the key lookups are served from memory */
+class BenchClient: public karere::Client
+{
+public:
+    BenchClient(::mega::MegaApi& sdk, karere::IApp& app, WebsocketsIO* websocketsIO = nullptr)
+        : karere::Client(sdk, websocketsIO, app, "", 0, nullptr) {}
+
+    bool init(const BenchUser& own, const std::vector<const BenchUser*>& users)
+    {
+        if (!openMemoryDb(db))
+        {
+            return false;
+        }
+        for (auto user: users)
+        {
+            db.query("insert into userattrs(userid, type, data) values(?,?,?)",
+                     user->handle, (int)::mega::MegaApi::USER_ATTR_ED25519_PUBLIC_KEY, user->pubEd25519);
+            db.query("insert into userattrs(userid, type, data) values(?,?,?)",
+                     user->handle, (int)::mega::MegaApi::USER_ATTR_CU25519_PUBLIC_KEY, user->pubCu25519);
+        }
+        // rich links disabled ("0" in base64url), as chatd::Client reads it at startup
+        db.query("insert into userattrs(userid, type, data) values(?,?,?)",
+                 own.handle, (int)::mega::MegaApi::USER_ATTR_RICH_PREVIEWS, StaticBuffer("MA", 2));
+        mMyHandle = own.handle;
+        memcpy(mMyPrivCu25519, own.privCu25519.buf(), sizeof(mMyPrivCu25519));
+        memcpy(mMyPrivEd25519, own.privEd25519.buf(), sizeof(mMyPrivEd25519));
+        mUserAttrCache.reset(new karere::UserAttrCache(*this));
+        return true;
+    }
+};
+
+/** strongvelope end-to-end between two users of a chat: msgEncrypt() by the sender,
+ * msgDecrypt() by the receiver (first time and again after a history reload),
+ * reactions and chat titles. Keys are exchanged as chatd would do it. Also the
+ * RtcCrypto primitives, which use the same pairwise keys */
+void benchStrongvelope(unsigned iterations)
+{
+    std::cout << "strongvelope end-to-end: " << iterations << " messages" << std::endl;
+    BenchUser alice(0x1001);
+    BenchUser bob(0x1002);
+
+    // never destroyed, since a karere::Client must be terminated first, which requires a session
+    auto app = new BenchApp;
+    auto client = new BenchClient(benchSdk(), *app);
+    SqliteDb aliceDb;
+    SqliteDb bobDb;
+    if (!client->init(alice, {&alice, &bob}) || !openMemoryDb(aliceDb) || !openMemoryDb(bobDb))
+    {
+        std::cout << "    ERROR: can't create the databases" << std::endl;
+        return;
+    }
+
+    karere::Id chatid(0x2001);
+    karere::SetOfIds participants;
+    participants.insert(alice.handle);
+    participants.insert(bob.handle);
+    ProtocolHandler aliceCrypto(alice.handle, alice.privCu25519, alice.privEd25519, StaticBuffer(nullptr, 0),
+        client->userAttrCache(), aliceDb, chatid, false, nullptr, 0, karere::Id::inval(), nullptr);
+    auto plaintextCache = std::make_shared<PlaintextCache>();
+    ProtocolHandler bobCrypto(bob.handle, bob.privCu25519, bob.privEd25519, StaticBuffer(nullptr, 0),
+        client->userAttrCache(), bobDb, chatid, false, nullptr, 0, karere::Id::inval(), nullptr,
+        nullptr, plaintextCache);
+    aliceCrypto.setUsers(&participants);
+    bobCrypto.setUsers(&participants);
+
+    // the first message creates the send key, which chatd confirms and delivers to bob
+    const chatd::KeyId keyid = 1;
+    bool keyExchanged = false;
+    for (size_t size: {100, 4096})
+    {
+        std::string text(size, 'x');
+        std::string label = std::to_string(size) + " bytes";
+        std::vector<std::string> encrypted;
+        encrypted.reserve(iterations);
+        uint64_t firstMsgid = 0x100000 + size * iterations;
+        {
+            AllocCount allocs;
+            Timer timer;
+            for (unsigned i = 0; i < iterations; i++)
+            {
+                karere::Id msgid(firstMsgid + i);
+                chatd::Message msg(msgid, alice.handle, 1000 + i, 0, text.data(), text.size(),
+                                   true, CHATD_KEYID_INVALID, chatd::Message::kMsgNormal);
+                chatd::MsgCommand cmd(chatd::OP_NEWMSG, chatid, alice.handle, msgid, 1000 + i, 0);
+                auto pms = aliceCrypto.msgEncrypt(&msg, participants, &cmd);
+                if (!pms.succeeded())
+                {
+                    std::cout << "    ERROR: msgEncrypt failed" << std::endl;
+                    return;
+                }
+                if (chatd::KeyCommand* keyCmd = pms.value().second)
+                {
+                    auto bobKey = keyCmd->getKeyByUserId(bob.handle);
+                    aliceCrypto.onKeyConfirmed(keyCmd->localKeyid(), keyid);
+                    bobCrypto.onKeyReceived(keyid, alice.handle, bob.handle, bobKey->buf(), (uint16_t)bobKey->dataSize());
+                    keyExchanged = true;
+                    delete keyCmd;
+                }
+                StaticBuffer blob = cmd.msg();
+                encrypted.emplace_back(blob.buf(), blob.dataSize());
+            }
+            printResult(label + ", msgEncrypt", iterations, (size_t)iterations * size, timer.elapsedSec(),
+                        allocs.perOp(iterations));
+        }
+        if (!keyExchanged)
+        {
+            std::cout << "    ERROR: no send key was created" << std::endl;
+            return;
+        }
+
+        // the second pass is history fetched again after a reload, served by the PlaintextCache
+        for (const char* pass: {", msgDecrypt", ", msgDecrypt reloaded"})
+        {
+            unsigned failed = 0;
+            uint64_t hits = plaintextCache->stats().hits;
+            AllocCount allocs;
+            Timer timer;
+            for (unsigned i = 0; i < iterations; i++)
+            {
+                std::unique_ptr<chatd::Message> msg(new chatd::Message(karere::Id(firstMsgid + i), alice.handle,
+                    1000 + i, 0, encrypted[i].data(), encrypted[i].size(), false, keyid));
+                auto pms = bobCrypto.msgDecrypt(msg.get());
+                if (!pms.succeeded() || msg->dataSize() != size)
+                {
+                    failed++;
+                }
+            }
+            double sec = timer.elapsedSec();
+            std::string extra = allocs.perOp(iterations) + ", "
+                    + std::to_string(plaintextCache->stats().hits - hits) + " cache hits";
+            if (failed)
+            {
+                extra += ", " + std::to_string(failed) + " FAILED";
+            }
+            printResult(label + pass, iterations, (size_t)iterations * size, sec, extra);
+            bobCrypto.onHistoryReload();
+        }
+    }
+
+    {
+        chatd::Message msg(karere::Id(0x100000), alice.handle, 1000, 0, "x", 1, false, keyid);
+        std::string reaction = "\xf0\x9f\x91\x8d";
+        std::vector<std::string> encrypted;
+        encrypted.reserve(iterations);
+        {
+            AllocCount allocs;
+            Timer timer;
+            for (unsigned i = 0; i < iterations; i++)
+            {
+                auto pms = aliceCrypto.reactionEncrypt(msg, reaction);
+                if (pms.succeeded())
+                {
+                    encrypted.emplace_back(pms.value()->buf(), pms.value()->dataSize());
+                }
+            }
+            printResult("reactionEncrypt", iterations, (size_t)iterations * reaction.size(), timer.elapsedSec(),
+                        allocs.perOp(iterations));
+        }
+        {
+            unsigned decrypted = 0;
+            AllocCount allocs;
+            Timer timer;
+            for (auto& data: encrypted)
+            {
+                auto pms = bobCrypto.reactionDecrypt(msg, data);
+                if (pms.succeeded() && pms.value()->dataSize() == reaction.size())
+                {
+                    decrypted++;
+                }
+            }
+            printResult("reactionDecrypt", encrypted.size(), encrypted.size() * reaction.size(), timer.elapsedSec(),
+                        allocs.perOp(std::max<size_t>(1, encrypted.size())) + ", "
+                        + std::to_string(decrypted) + "/" + std::to_string(iterations) + " ok");
+        }
+    }
+
+    {
+        std::string title = "Benchmark group chat";
+        unsigned ops = std::max(1u, iterations / 10);
+        size_t total = 0;
+        AllocCount allocs;
+        Timer timer;
+        for (unsigned i = 0; i < ops; i++)
+        {
+            auto pms = aliceCrypto.encryptChatTitle(title);
+            if (pms.succeeded())
+            {
+                total += pms.value()->dataSize();
+            }
+        }
+        printResult("encryptChatTitle", ops, total, timer.elapsedSec(), allocs.perOp(ops));
+    }
+
+#ifndef KARERE_DISABLE_WEBRTC
+    {
+        rtcModule::RtcCrypto rtcCrypto(*client);
+        rtcModule::SdpKey key;
+        randombytes_buf(key.data, sizeof(key.data));
+        rtcModule::SdpKey encryptedKey;
+        rtcModule::SdpKey output;
+        std::string sdp(2048, 'x');
+        {
+            AllocCount allocs;
+            Timer timer;
+            for (unsigned i = 0; i < iterations; i++)
+            {
+                rtcCrypto.encryptKeyTo(bob.handle, key, encryptedKey);
+                rtcCrypto.decryptKeyFrom(bob.handle, encryptedKey, output);
+            }
+            printResult("RtcCrypto encrypt + decrypt key", iterations, (size_t)iterations * 2 * sizeof(key.data),
+                        timer.elapsedSec(), allocs.perOp(iterations));
+        }
+        {
+            AllocCount allocs;
+            Timer timer;
+            for (unsigned i = 0; i < iterations; i++)
+            {
+                rtcCrypto.mac(sdp, key, output);
+            }
+            printResult("RtcCrypto mac of 2KB SDP", iterations, (size_t)iterations * sdp.size(),
+                        timer.elapsedSec(), allocs.perOp(iterations));
+        }
+    }
+#endif
+}
+
+typedef SimLoop::Clock Clock;
+
+double msSince(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/** Prints the percentiles of the latencies of a phase of the simulation, in milliseconds */
+void printLatencies(const std::string& name, std::vector<double>& samples, const std::string& extra = "")
+{
+    if (samples.empty())
+    {
+        std::cout << "    " << std::left << std::setw(36) << name << "no samples" << std::endl;
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&samples](double p) { return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))]; };
+    std::cout << "    " << std::left << std::setw(36) << name << std::right << std::fixed << std::setprecision(2)
+              << "p50 " << percentile(0.5) << " ms, p90 " << percentile(0.9) << " ms, p99 " << percentile(0.99)
+              << " ms, max " << samples.back() << " ms  " << extra << std::endl;
+}
+
+std::string perSec(double count, double sec, const char* unit)
+{
+    std::ostringstream result;
+    result << std::fixed << std::setprecision(count / sec < 100 ? 1 : 0) << count / sec << " " << unit << "/s";
+    return result.str();
+}
+
+/** Latencies of all the simulated accounts */
+struct SimResults
+{
+    std::vector<double> connect;
+    std::vector<double> login;
+    std::vector<double> join;
+    std::vector<double> hist;
+    std::vector<double> send;
+    std::vector<double> delivery;
+    size_t histMsgs = 0;
+    size_t histMsgBytes = 0;
+    size_t rejects = 0;
+};
+
+/** ICrypto of the simulated chats. The simulators relay the blobs as received, so
+ * the messages are sent and received in plaintext, with a fixed keyid */
+class SimCrypto: public chatd::ICrypto
+{
+public:
+    enum: chatd::KeyId { kKeyid = 1 };
+    explicit SimCrypto(karere::Client& client): chatd::ICrypto(client.appCtx), mClient(client) {}
+    void setUsers(karere::SetOfIds*) override {}
+    promise::Promise<std::pair<chatd::MsgCommand*, chatd::KeyCommand*>>
+    msgEncrypt(chatd::Message* msg, const karere::SetOfIds&, chatd::MsgCommand* cmd) override
+    {
+        msg->keyid = kKeyid;
+        cmd->setKeyId(kKeyid);
+        cmd->setMsg(msg->buf(), msg->dataSize());
+        return std::make_pair(cmd, (chatd::KeyCommand*)nullptr);
+    }
+    promise::Promise<chatd::Message*> msgDecrypt(chatd::Message* src) override
+    {
+        src->type = chatd::Message::kMsgNormal;
+        src->setEncrypted(chatd::Message::kNotEncrypted);
+        return src;
+    }
+    void onKeyReceived(chatd::KeyId, karere::Id, karere::Id, const char*, uint16_t) override {}
+    void onKeyConfirmed(chatd::KeyId, chatd::KeyId) override {}
+    void onKeyRejected() override {}
+    void resetSendKey() override {}
+    bool handleLegacyKeys(chatd::Message&) override { return false; }
+    void randomBytes(void* buf, size_t bufsize) const override { randombytes_buf(buf, bufsize); }
+    promise::Promise<std::shared_ptr<Buffer>> encryptChatTitle(const std::string&, uint64_t, bool) override { return notSupported(); }
+    promise::Promise<chatd::KeyCommand*> encryptUnifiedKeyForAllParticipants(uint64_t) override { return notSupported(); }
+    promise::Promise<std::string> decryptChatTitleFromApi(const Buffer&) override { return notSupported(); }
+    promise::Promise<std::string> encryptUnifiedKeyToUser(karere::Id) override { return notSupported(); }
+    promise::Promise<std::string> decryptUnifiedKey(std::shared_ptr<Buffer>&, uint64_t, uint64_t) override { return notSupported(); }
+    promise::Promise<std::shared_ptr<std::string>> getUnifiedKey() override { return notSupported(); }
+    bool previewMode() override { return false; }
+    bool isPublicChat() const override { return false; }
+    void setPrivateChatMode() override {}
+    void onHistoryReload() override {}
+    uint64_t getPublicHandle() const override { return karere::Id::inval().val; }
+    void setPublicHandle(const uint64_t) override {}
+    karere::UserAttrCache& userAttrCache() override { return mClient.userAttrCache(); }
+    promise::Promise<std::shared_ptr<Buffer>> reactionEncrypt(const chatd::Message&, const std::string&) override { return notSupported(); }
+    promise::Promise<std::shared_ptr<Buffer>> reactionDecrypt(const chatd::Message&, const std::string&) override { return notSupported(); }
+
+protected:
+    karere::Client& mClient;
+    static ::promise::Error notSupported() { return ::promise::Error("Not supported by the simulated chats"); }
+};
+
+class SimAccount;
+
+/** chatd::Listener of a simulated chat, which takes the latencies of the phases of
+ * the simulation from the callbacks of the real chatd::Chat */
+class SimChatListener: public chatd::Listener
+{
+public:
+    chatd::Chat* chat = nullptr;
+    bool online = false;
+    bool histDone = false;
+    size_t pendingSends = 0;
+
+    SimChatListener(SimAccount& account, SimResults& results): mAccount(account), mResults(results) {}
+    void requestHistory(unsigned count)
+    {
+        mHistStart = Clock::now();
+        chat->getHistory(count);
+    }
+    void sendMessage(size_t size)
+    {
+        std::string blob(std::max<size_t>(size, 8), 'z');
+        SimLoop::writeTimestamp(&blob[0]);
+        chatd::Message* msg = chat->msgSubmit(blob.data(), blob.size(), chatd::Message::kMsgNormal, nullptr);
+        mSendStart[msg->id()] = Clock::now();
+        pendingSends++;
+    }
+
+    void init(chatd::Chat& aChat, chatd::DbInterface*& dbIntf) override;
+    void onOnlineStateChange(chatd::ChatState state) override;
+    void onRecvHistoryMessage(chatd::Idx, chatd::Message& msg, chatd::Message::Status, bool) override
+    {
+        mResults.histMsgs++;
+        mResults.histMsgBytes += msg.dataSize();
+    }
+    void onHistoryDone(chatd::HistSource) override
+    {
+        if (!histDone && mHistStart != Clock::time_point())
+        {
+            histDone = true;
+            mResults.hist.push_back(msSince(mHistStart));
+        }
+    }
+    void onMessageConfirmed(karere::Id msgxid, const chatd::Message&, chatd::Idx) override
+    {
+        auto it = mSendStart.find(msgxid);
+        if (it != mSendStart.end())
+        {
+            mResults.send.push_back(msSince(it->second));
+            mSendStart.erase(it);
+            pendingSends--;
+        }
+    }
+    void onMessageRejected(const chatd::Message&, uint8_t) override { mResults.rejects++; }
+    void onRecvNewMessage(chatd::Idx, chatd::Message& msg, chatd::Message::Status) override;
+
+protected:
+    SimAccount& mAccount;
+    SimResults& mResults;
+    Clock::time_point mJoinStart;
+    Clock::time_point mHistStart;
+    std::map<karere::Id, Clock::time_point> mSendStart;
+};
+
+/** An account of the simulation: a karere::Client with the real chatd::Client and
+ * presenced::Client, connected to the simulators through SimWebsocketsIO. It has the
+ * chats of SimConfig, and the cached URLs of the simulators */
+class SimAccount: public BenchClient
+{
+public:
+    std::vector<std::unique_ptr<SimChatListener>> chats;
+    bool chatdConnected = false;
+    bool presencedLoggedIn = false;
+
+    SimAccount(SimWebsocketsIO& io, karere::IApp& app, SimResults& results)
+        : BenchClient(benchSdk(), app, &io), mResults(results) {}
+
+    bool init(const SimConfig& config, unsigned account)
+    {
+        BenchUser own(config.account(account).val);
+        if (!BenchClient::init(own, {}))
+        {
+            return false;
+        }
+        mDnsCache.addRecord(0, "wss://chatd.sim");
+        mDnsCache.addRecord(presenced::Client::kPresencedShard, "wss://presenced.sim");
+        mChatdClient.reset(new chatd::Client(this));
+
+        karere::SetOfIds users;
+        users.insert(mMyHandle);
+        for (unsigned p = 0; p < config.peersPerChat; p++)
+        {
+            users.insert(config.peer(p));
+        }
+        for (unsigned c = 0; c < config.chatsPerAccount; c++)
+        {
+            karere::Id chatid = config.chat(account, c);
+            db.query("insert into chats(chatid, shard, own_priv) values(?,?,?)", chatid, 0, (int)chatd::PRIV_OPER);
+            chats.emplace_back(new SimChatListener(*this, mResults));
+            mChatdClient->createChat(chatid, 0, chats.back().get(), users, new SimCrypto(*this), (uint32_t)time(NULL), true);
+        }
+        return true;
+    }
+    void connect()
+    {
+        mConnectStart = Clock::now();
+        mPresencedClient.connect();
+        for (auto& chat: chats)
+        {
+            chat->chat->connect();  // the first one connects the shard, and all of them join once connected
+        }
+    }
+    void disconnect()
+    {
+        mChatdClient->disconnect();
+        mPresencedClient.disconnect();
+    }
+    void onChatJoining()
+    {
+        if (!chatdConnected)
+        {
+            chatdConnected = true;
+            mResults.connect.push_back(msSince(mConnectStart));
+        }
+    }
+
+protected:
+    SimResults& mResults;
+    Clock::time_point mConnectStart;
+
+    void onConnStateChange(presenced::Client::ConnState state) override
+    {
+        if (state == presenced::Client::kConnected)
+        {
+            mResults.connect.push_back(msSince(mConnectStart));
+        }
+        else if (state == presenced::Client::kLoggedIn && !presencedLoggedIn)
+        {
+            presencedLoggedIn = true;
+            mResults.login.push_back(msSince(mConnectStart));
+        }
+    }
+};
+
+void SimChatListener::init(chatd::Chat& aChat, chatd::DbInterface*& dbIntf)
+{
+    chat = &aChat;
+    dbIntf = new ChatdSqliteDb(aChat, mAccount.db);
+}
+
+void SimChatListener::onOnlineStateChange(chatd::ChatState state)
+{
+    if (state == chatd::kChatStateJoining)
+    {
+        mJoinStart = Clock::now();
+        mAccount.onChatJoining();
+    }
+    else if (state == chatd::kChatStateOnline && !online)
+    {
+        online = true;
+        mResults.join.push_back(msSince(mJoinStart));
+    }
+}
+
+void SimChatListener::onRecvNewMessage(chatd::Idx, chatd::Message& msg, chatd::Message::Status)
+{
+    if (msg.userid != mAccount.myHandle() && msg.dataSize() >= 8)
+    {
+        mResults.delivery.push_back(SimLoop::msSinceTimestamp(msg.buf()));
+    }
+}
+
+/** Load and latency of chatd and presenced against the in-process simulators (see
+ * serverSimulator.h), through the real chatd::Client and presenced::Client: an account
+ * per SimConfig::accounts, which connects to both servers, joins all its chats (JOIN
+ * and the initial HIST), loads \c historyDepth messages of each chat, sends
+ * \c sendsPerChat messages to each chat at once, and then receives \c incomingRate
+ * messages per second from the peers for a couple of seconds */
+void benchSimulator(const SimConfig& config, unsigned sendsPerChat, double incomingRate)
+{
+    std::cout << "chatd/presenced simulator: " << config.accounts << " accounts, " << config.chatsPerAccount
+              << " chats each, " << config.historyDepth << " messages of history" << std::endl;
+    SimLoop loop;
+    ChatdSimulator chatdServer(config);
+    PresencedSimulator presencedServer(config);
+    loop.addTicker([&chatdServer]() { chatdServer.tick(); });
+    SimWebsocketsIO io(loop, &benchSdk(), nullptr);
+    io.addServer("chatd.sim", chatdServer);
+    io.addServer("presenced.sim", presencedServer);
+
+    // never destroyed, since a karere::Client must be terminated first, which requires a session
+    auto app = new BenchApp;
+    SimResults results;
+    std::vector<SimAccount*> accounts;
+    for (unsigned i = 0; i < config.accounts; i++)
+    {
+        accounts.push_back(new SimAccount(io, *app, results));
+        if (!accounts.back()->init(config, i))
+        {
+            std::cout << "    ERROR: failed to initialize the accounts" << std::endl;
+            return;
+        }
+    }
+    size_t chatCount = (size_t)config.accounts * config.chatsPerAccount;
+    auto allChats = [&accounts](const std::function<bool(SimChatListener&)>& check)
+    {
+        for (auto account: accounts)
+        {
+            for (auto& chat: account->chats)
+            {
+                if (!check(*chat))
+                    return false;
+            }
+        }
+        return true;
+    };
+    auto report = [](const char* name, std::vector<double>& samples, bool done, const std::string& extra)
+    {
+        printLatencies(name, samples, done ? extra : extra + " (TIMED OUT)");
+    };
+
+    Timer timer;
+    for (auto account: accounts)
+    {
+        account->connect();
+    }
+    bool done = loop.runUntil([&]()
+    {
+        return std::all_of(accounts.begin(), accounts.end(),
+                           [](SimAccount* account) { return account->chatdConnected && account->presencedLoggedIn; });
+    }, 10);
+    report("connect", results.connect, done, perSec(config.accounts * 2, timer.elapsedSec(), "conns"));
+    report("presenced connect -> PREFS", results.login, done, perSec(config.accounts, timer.elapsedSec(), "logins"));
+
+    done = loop.runUntil([&]() { return allChats([](SimChatListener& chat) { return chat.online; }); }, 10);
+    report("chatd JOIN + HIST -> online", results.join, done, perSec(chatCount, timer.elapsedSec(), "joins"));
+
+    timer = Timer();
+    allChats([&config](SimChatListener& chat) { chat.requestHistory(config.historyDepth); return true; });
+    done = loop.runUntil([&]() { return allChats([](SimChatListener& chat) { return chat.histDone; }); }, 30);
+    double sec = timer.elapsedSec();
+    report("getHistory -> onHistoryDone", results.hist, done, perSec(results.histMsgs, sec, "msgs") + ", "
+           + perSec((double)results.histMsgBytes / (1024 * 1024), sec, "MB"));
+
+    timer = Timer();
+    allChats([&config, sendsPerChat](SimChatListener& chat)
+    {
+        for (unsigned m = 0; m < sendsPerChat; m++)
+        {
+            chat.sendMessage(config.messageSize);
+        }
+        return true;
+    });
+    done = loop.runUntil([&]() { return allChats([](SimChatListener& chat) { return chat.pendingSends == 0; }); }, 30);
+    report("msgSubmit -> onMessageConfirmed", results.send, done, perSec(results.send.size(), timer.elapsedSec(), "msgs"));
+
+    const double kIncomingSec = 2;
+    chatdServer.setIncomingRate(incomingRate);
+    loop.runUntil([]() { return false; }, kIncomingSec);
+    chatdServer.setIncomingRate(0);
+    loop.runPending();
+    std::ostringstream incoming;
+    incoming << "incoming NEWMSG at " << std::fixed << std::setprecision(0) << incomingRate << "/s";
+    report(incoming.str().c_str(), results.delivery, true, perSec(results.delivery.size(), kIncomingSec, "msgs"));
+
+    uint64_t errors = chatdServer.stats().errors + presencedServer.stats().errors;
+    if (errors || results.rejects)
+    {
+        std::cout << "    ERROR: " << errors << " malformed commands, " << results.rejects << " rejected" << std::endl;
+    }
+
+    for (auto account: accounts)
+    {
+        account->disconnect();
+    }
+    loop.runPending();
+}
+
+/** chatd::Listener of the chat of benchHistoryOpen(), which counts the loaded messages */
+class HistoryOpenListener: public chatd::Listener
+{
+public:
+    ChatdSqliteDb* db = nullptr;
+    size_t histMsgs = 0;
+
+    explicit HistoryOpenListener(SqliteDb& sqliteDb): mSqliteDb(sqliteDb) {}
+    void init(chatd::Chat& chat, chatd::DbInterface*& dbIntf) override
+    {
+        db = new ChatdSqliteDb(chat, mSqliteDb);
+        dbIntf = db;
+    }
+    void onRecvHistoryMessage(chatd::Idx, chatd::Message&, chatd::Message::Status, bool) override
+    {
+        histMsgs++;
+    }
+
+protected:
+    SqliteDb& mSqliteDb;
+};
+
+/** Opening a chat with \c messages messages in db, each with \c reactionsPerMsg reactions:
+ * createChat() loads the first page (as when the app opens the chat), and then the whole
+ * history is scrolled back with getHistory(), in pages of 32 messages. The same pages are
+ * also loaded straight from the DbInterface: with fetchDbHistoryPage(), and as before it,
+ * with fetchDbHistory() plus a query for the reactions of each message */
+void benchHistoryOpen(unsigned messages, unsigned reactionsPerMsg)
+{
+    std::cout << "History open: " << messages << " messages in db, " << reactionsPerMsg
+              << " reactions each" << std::endl;
+    const int kPageSize = 32;
+    const char* kReactions[] = {"\xF0\x9F\x91\x8D", "\xF0\x9F\x98\x82", "\xE2\x9D\xA4", "\xF0\x9F\x8E\x89"};
+    BenchUser own(0x1001);
+    karere::Id chatid(SimConfig::kFirstChat);
+    karere::SetOfIds users;
+    users.insert(own.handle);
+    for (unsigned p = 0; p < reactionsPerMsg; p++)
+    {
+        users.insert(karere::Id(SimConfig::kFirstPeer + p));
+    }
+
+    // never destroyed, since a karere::Client must be terminated first, which requires a session
+    auto app = new BenchApp;
+    auto client = new BenchClient(benchSdk(), *app);
+    if (!client->init(own, {}))
+    {
+        std::cout << "    ERROR: can't create the database" << std::endl;
+        return;
+    }
+    SqliteDb& db = client->db;
+    db.query("insert into chats(chatid, shard, own_priv) values(?,?,?)", chatid, 0, (int)chatd::PRIV_OPER);
+    db.query(karere::sql::kHaveAllHistorySet, chatid, 1);
+    std::string text(100, 't');
+    std::string insertMsg = karere::sql::histInsert("history");
+    for (unsigned i = 0; i < messages; i++)
+    {
+        karere::Id msgid(i + 1);
+        db.query(insertMsg.c_str(), (int)i, chatid, msgid, (unsigned)SimCrypto::kKeyid, (int)chatd::Message::kMsgNormal,
+                 karere::Id(SimConfig::kFirstPeer + i % 4), 1000 + i, 0, StaticBuffer(text.data(), text.size()),
+                 (uint64_t)0, (int)chatd::Message::kNotEncrypted);
+        for (unsigned r = 0; r < reactionsPerMsg; r++)
+        {
+            db.query(karere::sql::kReactionsAdd, chatid, msgid, karere::Id(SimConfig::kFirstPeer + r), kReactions[r % 4]);
+        }
+    }
+    db.commit();
+    client->mChatdClient.reset(new chatd::Client(client));
+
+    auto listener = new HistoryOpenListener(db);  // never destroyed, as the chat that uses it
+    Timer timer;
+    chatd::Chat& chat = client->mChatdClient->createChat(chatid, 0, listener, users, new SimCrypto(*client), 1000, true);
+    double sec = timer.elapsedSec();
+    std::ostringstream open;
+    open << std::fixed << std::setprecision(2) << sec * 1000 << " ms";
+    printResult("createChat (first page)", 1, 0, sec, open.str());
+
+    std::vector<double> latencies;
+    size_t loadedBefore = listener->histMsgs;
+    timer = Timer();
+    for (;;)
+    {
+        Clock::time_point start = Clock::now();
+        chatd::HistSource source = chat.getHistory(kPageSize);
+        if (source != chatd::kHistSourceRam && source != chatd::kHistSourceDb)
+        {
+            break;
+        }
+        latencies.push_back(msSince(start));
+    }
+    sec = timer.elapsedSec();
+    size_t scrolled = listener->histMsgs - loadedBefore;
+    printLatencies("getHistory(32)", latencies, perSec(scrolled, sec, "msgs"));
+
+    for (bool pageLoader: {true, false})
+    {
+        size_t loaded = 0;
+        size_t reactions = 0;
+        AllocCount allocs;
+        latencies.clear();
+        timer = Timer();
+        for (chatd::Idx idx = messages - 1; idx >= 0; idx -= kPageSize)
+        {
+            Clock::time_point start = Clock::now();
+            std::vector<chatd::Message*> page;
+            if (pageLoader)
+            {
+                listener->db->fetchDbHistoryPage(idx, kPageSize, page);
+            }
+            else
+            {
+                listener->db->fetchDbHistory(idx, kPageSize, page);
+                for (auto msg: page)
+                {
+                    ::mega::multimap<std::string, karere::Id> msgReactions;
+                    listener->db->getMessageReactions(msg->id(), msgReactions);
+                    for (auto& reaction: msgReactions)
+                    {
+                        msg->addReaction(reaction.first, reaction.second);
+                    }
+                }
+            }
+            latencies.push_back(msSince(start));
+            for (auto msg: page)
+            {
+                reactions += msg->getReactions().size();
+                delete msg;
+            }
+            loaded += page.size();
+        }
+        sec = timer.elapsedSec();
+        printLatencies(pageLoader ? "fetchDbHistoryPage(32)" : "fetchDbHistory(32) + reactions per msg", latencies,
+                       perSec(loaded, sec, "msgs") + ", " + allocs.perOp(loaded));
+        if (reactions != (size_t)messages * std::min(reactionsPerMsg, 4u))
+        {
+            std::cout << "    ERROR: loaded " << reactions << " reactions" << std::endl;
+        }
+    }
+}
+
+/** A HIST burst of \c messages messages in a single chat: once the chat is online with the
+ * initial history fetch, getHistory() requests the rest from the simulated chatd, which answers
+ * with one HIST response. Measures the time until onHistoryDone() and the allocations per
+ * message received, which include the parsing of the OLDMSG commands of the frame */
+void benchHistBurst(unsigned messages)
+{
+    const unsigned kInitialFetch = 32;  // default of chatd::Chat::initialHistoryFetchCount
+    SimConfig config;
+    config.accounts = 1;
+    config.chatsPerAccount = 1;
+    config.historyDepth = messages + kInitialFetch;
+    std::cout << "HIST burst: " << messages << " messages of " << config.messageSize << " bytes" << std::endl;
+    SimLoop loop;
+    ChatdSimulator chatdServer(config);
+    PresencedSimulator presencedServer(config);
+    loop.addTicker([&chatdServer]() { chatdServer.tick(); });
+    SimWebsocketsIO io(loop, &benchSdk(), nullptr);
+    io.addServer("chatd.sim", chatdServer);
+    io.addServer("presenced.sim", presencedServer);
+
+    // never destroyed, see benchSimulator()
+    auto app = new BenchApp;
+    SimResults results;
+    auto account = new SimAccount(io, *app, results);
+    if (!account->init(config, 0))
+    {
+        std::cout << "    ERROR: failed to initialize the account" << std::endl;
+        return;
+    }
+    account->connect();
+    SimChatListener& chat = *account->chats.front();
+    if (!loop.runUntil([&chat]() { return chat.online; }, 10))
+    {
+        std::cout << "    ERROR: the chat didn't get online" << std::endl;
+        return;
+    }
+
+    results.histMsgs = 0;
+    results.histMsgBytes = 0;
+    AllocCount allocs;
+    Timer timer;
+    chat.requestHistory(config.historyDepth);
+    bool done = loop.runUntil([&chat]() { return chat.histDone; }, 30);
+    double sec = timer.elapsedSec();
+    printResult("HIST -> onHistoryDone", results.histMsgs, results.histMsgBytes, sec,
+                done ? allocs.perOp(results.histMsgs) : "TIMED OUT");
+    if (results.histMsgs != config.historyDepth || chatdServer.stats().errors || results.rejects)
+    {
+        std::cout << "    ERROR: received " << results.histMsgs << " messages, " << chatdServer.stats().errors
+                  << " malformed commands, " << results.rejects << " rejected" << std::endl;
+    }
+    account->disconnect();
+    loop.runPending();
+}
+}
+
+int main(int argc, char** argv)
+{
+    if (sodium_init() == -1)
+    {
+        std::cerr << "Error initializing libsodium" << std::endl;
+        return 1;
+    }
+    unsigned iterations = (argc > 1) ? std::stoul(argv[1]) : 20000;
+
+    benchTlv(iterations);
+    benchFragments();
+    benchBufferPool(100000);
+    benchIdMap({1000, 100000, 1000000});
+    benchStrongvelope(iterations);
+    benchAesCtr();
+    benchDecryptPool(iterations);
+    benchKeyFanOut({10, 100, 500, 1000}, 200);
+    benchSendKeys(200, 2000, 50);
+    benchDbProfiles(100, 100000);
+    benchSimulator(SimConfig(), 20, 5000);
+    benchHistoryOpen(100000, 4);
+    benchHistBurst(10000);
+    return 0;
+}
@@ -0,0 +1,716 @@
+#include "serverSimulator.h"
+#include <presenced.h>
+#include <base/gcmpp.h>
+
+#include <algorithm>
+#include <string.h>
+#include <thread>
+#include <time.h>
+
+using namespace karere;
+
+SimLoop* SimLoop::sInstance = nullptr;
+
+SimLoop::SimLoop()
+{
+    assert(!sInstance);
+    sInstance = this;
+    mPrevPost = megaPostMessageToGui;
+    megaPostMessageToGui = &SimLoop::post;
+    uv_loop_init(&mTimerLoop);
+    assert(!karere::gTimerLoop);
+    karere::gTimerLoop = &mTimerLoop;
+}
+
+SimLoop::~SimLoop()
+{
+    // execute the calls still queued, so they free their data. The ones of
+    // destroyed sockets are discarded
+    runPending();
+    megaPostMessageToGui = mPrevPost;
+    sInstance = nullptr;
+    // the timers still active belong to clients that are never destroyed (see
+    // benchSimulator()), and they can't fire anymore
+    karere::gTimerLoop = nullptr;
+    uv_loop_close(&mTimerLoop);
+}
+
+void SimLoop::post(void* msg, void* /*appCtx*/)
+{
+    // may be called from any thread (i.e. DecryptPool)
+    std::lock_guard<std::mutex> lock(sInstance->mQueueMutex);
+    sInstance->mQueue.push_back(msg);
+}
+
+size_t SimLoop::processQueue()
+{
+    // the expired timers post their callbacks to the queue
+    uv_run(&mTimerLoop, UV_RUN_NOWAIT);
+    std::deque<void*> queue;
+    {
+        std::lock_guard<std::mutex> lock(mQueueMutex);
+        queue.swap(mQueue);
+    }
+    for (void* msg: queue)
+    {
+        megaProcessMessage(msg);
+    }
+    return queue.size();
+}
+
+void SimLoop::runPending()
+{
+    while (processQueue());
+}
+
+bool SimLoop::runUntil(const std::function<bool()>& done, double timeoutSec)
+{
+    auto deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeoutSec));
+    while (!done())
+    {
+        if (Clock::now() >= deadline)
+        {
+            return false;
+        }
+        for (auto& ticker: mTickers)
+        {
+            ticker();
+        }
+        if (!processQueue())
+        {
+            std::this_thread::yield();
+        }
+    }
+    return true;
+}
+
+void SimLoop::writeTimestamp(void* data)
+{
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    memcpy(data, &now, sizeof(now));
+}
+
+double SimLoop::msSinceTimestamp(const void* data)
+{
+    int64_t sent;
+    memcpy(&sent, data, sizeof(sent));
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    return (now - sent) / 1e6;
+}
+
+SimSocket::SimSocket(WebsocketsIO::Mutex& mutex, WebsocketsClient* client, SimServer* server, void* appCtx)
+    : WebsocketsClientImpl(mutex, client), mServer(server), mAppCtx(appCtx), mAlive(std::make_shared<bool>(true))
+{
+    if (!mServer)
+    {
+        return;
+    }
+    // the connection is established asynchronously, as a real one
+    auto alive = mAlive;
+    marshallCall([this, alive]()
+    {
+        if (*alive)
+            onConnected();
+    }, mAppCtx);
+}
+
+SimSocket::~SimSocket()
+{
+    *mAlive = false;
+    detach();
+}
+
+void SimSocket::onConnected()
+{
+    if (!mServer)
+    {
+        return; // disconnected before connecting
+    }
+    mConnected = true;
+    mServer->onConnect(*this);
+    wsConnectCb();
+}
+
+void SimSocket::detach()
+{
+    mConnected = false;
+    if (mServer)
+    {
+        mServer->onClose(*this);
+        mServer = nullptr;
+    }
+}
+
+void SimSocket::deliver(Buffer&& frame)
+{
+    auto data = std::make_shared<Buffer>(std::move(frame));
+    auto alive = mAlive;
+    marshallCall([this, alive, data]()
+    {
+        if (*alive && mConnected)
+            wsHandleFrameCb(data);
+    }, mAppCtx);
+}
+
+bool SimSocket::wsSendMessage(char* msg, size_t len)
+{
+    if (!mConnected)
+    {
+        return false;
+    }
+    auto data = std::make_shared<Buffer>(msg, len);
+    auto alive = mAlive;
+    marshallCall([this, alive, data]()
+    {
+        if (!*alive || !mServer)
+            return;
+        wsSendMsgCb(data->buf(), data->dataSize());
+        if (*alive && mServer)  // the client may have disconnected from the callback
+            mServer->onFrame(*this, *data);
+    }, mAppCtx);
+    return true;
+}
+
+void SimSocket::wsDisconnect(bool immediate)
+{
+    disconnecting = true;
+    detach();
+    if (!immediate)
+    {
+        auto alive = mAlive;
+        marshallCall([this, alive]()
+        {
+            if (*alive)
+                wsCloseCb(0, 0, "", 0);
+        }, mAppCtx);
+    }
+}
+
+bool SimSocket::wsIsConnected()
+{
+    return mConnected;
+}
+
+SimWebsocketsIO::SimWebsocketsIO(SimLoop& loop, ::mega::MegaApi* api, void* ctx)
+    : WebsocketsIO(loop.mutex(), api, ctx)
+{
+}
+
+bool SimWebsocketsIO::wsResolveDNS(const char* hostname, std::function<void(int, const std::vector<std::string>&, const std::vector<std::string>&)> f)
+{
+    // as the real resolution, the result is always reported asynchronously
+    bool found = mServers.find(hostname) != mServers.end();
+    marshallCall([f, found]()
+    {
+        if (found)
+            f(0, std::vector<std::string>{"127.0.0.1"}, std::vector<std::string>{"::1"});
+        else
+            f(kNoNameError, std::vector<std::string>(), std::vector<std::string>());
+    }, appCtx);
+    return false;   // no immediate error
+}
+
+WebsocketsClientImpl* SimWebsocketsIO::wsConnect(const char* ip, const char* host, int /*port*/, const char* /*path*/,
+                                                 bool /*ssl*/, WebsocketsClient* client)
+{
+    auto it = mServers.find(host);
+    if (it == mServers.end())
+    {
+        return nullptr;
+    }
+    mConnectAttempts.push_back(ip);
+    bool unreachable = mUnreachableIps.find(ip) != mUnreachableIps.end();
+    return new SimSocket(mutex, client, unreachable ? nullptr : it->second, appCtx);
+}
+
+void SimServer::onConnect(SimSocket& socket)
+{
+    mSockets.insert(&socket);
+    onConnected(socket);
+}
+
+void SimServer::onClose(SimSocket& socket)
+{
+    if (!mSockets.erase(&socket))
+    {
+        return;
+    }
+    mOutput.erase(&socket);
+    onDisconnected(socket);
+}
+
+void SimServer::onFrame(SimSocket& socket, const StaticBuffer& frame)
+{
+    mStats.framesIn++;
+    size_t pos = 0;
+    try
+    {
+        while (pos < frame.dataSize())
+        {
+            mStats.commandsIn++;
+            pos = execCommand(socket, frame, pos);
+        }
+    }
+    catch (std::exception& e)
+    {
+        mStats.errors++;
+        KR_LOG_WARNING("SimServer: discarding the rest of a frame: %s", e.what());
+    }
+    flush();
+}
+
+void SimServer::send(SimSocket& socket, const StaticBuffer& cmd)
+{
+    assert(mSockets.count(&socket));
+    mOutput[&socket].append(cmd);
+}
+
+void SimServer::flush()
+{
+    for (auto& output: mOutput)
+    {
+        if (output.second.empty())
+            continue;
+        mStats.framesOut++;
+        output.first->deliver(std::move(output.second));
+    }
+    mOutput.clear();
+}
+
+ChatdSimulator::ChatdSimulator(const SimConfig& config)
+    : SimServer(config)
+{
+    uint32_t now = (uint32_t)time(NULL);
+    std::string blob(std::max<size_t>(config.messageSize, 8), 'x');
+    for (unsigned acc = 0; acc < config.accounts; acc++)
+    {
+        for (unsigned i = 0; i < config.chatsPerAccount; i++)
+        {
+            SimChat& chat = mChats[config.chat(acc, i)];
+            chat.chatid = config.chat(acc, i);
+            chat.users.push_back(config.account(acc));
+            for (unsigned p = 0; p < config.peersPerChat; p++)
+            {
+                chat.users.push_back(config.peer(p));
+            }
+
+            // the key of the history, encrypted to each participant (the blobs are opaque to chatd)
+            chat.lastKeyid = 1;
+            Buffer keys;
+            for (auto user: chat.users)
+            {
+                keys.append<uint64_t>(user.val).append<chatd::KeyId>(chat.lastKeyid).append<uint16_t>(16);
+                keys.appendFill(0x55, 16);
+            }
+            chat.keys[chat.lastKeyid].assign(keys.buf(), keys.dataSize());
+
+            for (unsigned h = 0; h < config.historyDepth; h++)
+            {
+                Id sender = config.peersPerChat ? chat.users[1 + h % config.peersPerChat] : chat.users[0];
+                storeMessage(chat, sender, now - config.historyDepth + h, chat.lastKeyid, blob.data(), blob.size());
+            }
+            mChatList.push_back(&chat);
+        }
+    }
+}
+
+ChatdSimulator::SimChat& ChatdSimulator::chat(Id chatid)
+{
+    auto it = mChats.find(chatid);
+    if (it == mChats.end())
+    {
+        throw std::runtime_error("Unknown chat "+chatid.toString());
+    }
+    return it->second;
+}
+
+ChatdSimulator::StoredMsg& ChatdSimulator::storeMessage(SimChat& chat, Id userid, uint32_t ts, chatd::KeyId keyid,
+                                                        const char* data, size_t len)
+{
+    Id msgid(mNextMsgid++);
+    chat.msgIdx[msgid] = chat.msgs.size();
+    chat.msgs.push_back(StoredMsg{msgid, userid, ts, 0, keyid, std::string(data, len)});
+    return chat.msgs.back();
+}
+
+void ChatdSimulator::sendMessage(SimSocket& socket, uint8_t opcode, Id chatid, const StoredMsg& msg)
+{
+    chatd::Command cmd(opcode, 39 + msg.data.size());
+    cmd + chatid + msg.userid + msg.msgid + msg.ts + msg.updated + msg.keyid + (uint32_t)msg.data.size() + msg.data;
+    send(socket, cmd);
+}
+
+void ChatdSimulator::sendJoins(SimSocket& socket, const SimChat& chat)
+{
+    for (auto user: chat.users)
+    {
+        send(socket, chatd::Command(chatd::OP_JOIN) + chat.chatid + user + (int8_t)chatd::PRIV_OPER);
+    }
+}
+
+void ChatdSimulator::sendKeys(SimSocket& socket, const SimChat& chat)
+{
+    for (auto& key: chat.keys)
+    {
+        send(socket, chatd::Command(chatd::OP_NEWKEY, 17 + key.second.size()) + chat.chatid + key.first
+             + (uint32_t)key.second.size() + key.second);
+    }
+}
+
+void ChatdSimulator::broadcast(const SimChat& chat, const StaticBuffer& cmd, SimSocket* except)
+{
+    for (auto socket: chat.joined)
+    {
+        if (socket != except)
+            send(*socket, cmd);
+    }
+}
+
+void ChatdSimulator::onConnected(SimSocket& socket)
+{
+    mConns[&socket];
+}
+
+void ChatdSimulator::onDisconnected(SimSocket& socket)
+{
+    mConns.erase(&socket);
+    for (auto& chat: mChats)
+    {
+        chat.second.joined.erase(&socket);
+    }
+}
+
+size_t ChatdSimulator::execCommand(SimSocket& socket, const StaticBuffer& frame, size_t pos)
+{
+    ConnState& conn = mConns[&socket];
+    uint8_t opcode = frame.read<uint8_t>(pos++);
+    switch (opcode)
+    {
+        case chatd::OP_KEEPALIVE:
+        case chatd::OP_KEEPALIVEAWAY:
+            return pos;
+
+        case chatd::OP_ECHO:
+            send(socket, chatd::Command(chatd::OP_ECHO));
+            return pos;
+
+        case chatd::OP_CLIENTID:
+        {
+            frame.read<uint64_t>(pos);  // seed
+            conn.clientid = mNextClientid++;
+            send(socket, chatd::Command(chatd::OP_CLIENTID) + conn.clientid);
+            return pos + 8;
+        }
+        case chatd::OP_SYNC:
+        {
+            Id chatid(frame.read<uint64_t>(pos));
+            chat(chatid);
+            send(socket, chatd::Command(chatd::OP_SYNC) + chatid);
+            return pos + 8;
+        }
+        case chatd::OP_JOIN:
+        {
+            Id chatid(frame.read<uint64_t>(pos));
+            frame.read<int8_t>(pos + 16);   // userid and priv
+            auto it = mChats.find(chatid);
+            if (it == mChats.end())
+            {
+                send(socket, chatd::Command(chatd::OP_REJECT) + chatid + chatid + (uint8_t)chatd::OP_JOIN + (uint8_t)0);
+                return pos + 17;
+            }
+            sendJoins(socket, it->second);
+            it->second.joined.insert(&socket);
+            return pos + 17;
+        }
+        case chatd::OP_JOINRANGEHIST:
+        {
+            Id chatid(frame.read<uint64_t>(pos));
+            Id oldest(frame.read<uint64_t>(pos + 8));
+            Id newest(frame.read<uint64_t>(pos + 16));
+            SimChat& ch = chat(chatid);
+            sendJoins(socket, ch);
+            ch.joined.insert(&socket);
+
+            auto oldestIt = ch.msgIdx.find(oldest);
+            if (oldestIt != ch.msgIdx.end())
+            {
+                conn.histCursor[chatid] = oldestIt->second;
+            }
+            auto newestIt = ch.msgIdx.find(newest);
+            if (newestIt != ch.msgIdx.end())
+            {
+                for (size_t i = newestIt->second + 1; i < ch.msgs.size(); i++)
+                {
+                    sendMessage(socket, chatd::OP_NEWMSG, chatid, ch.msgs[i]);
+                }
+            }
+            send(socket, chatd::Command(chatd::OP_HISTDONE) + chatid);
+            return pos + 24;
+        }
+        case chatd::OP_HIST:
+        {
+            Id chatid(frame.read<uint64_t>(pos));
+            int32_t count = frame.read<int32_t>(pos + 8);
+            SimChat& ch = chat(chatid);
+            auto cursorIt = conn.histCursor.find(chatid);
+            size_t cursor = (cursorIt != conn.histCursor.end()) ? cursorIt->second : ch.msgs.size();
+
+            if (!ch.lastSeen.isNull())
+            {
+                send(socket, chatd::Command(chatd::OP_SEEN) + chatid + ch.lastSeen);
+            }
+            if (!ch.lastReceived.isNull())
+            {
+                send(socket, chatd::Command(chatd::OP_RECEIVED) + chatid + ch.lastReceived);
+            }
+            sendKeys(socket, ch);
+            // newest first, as chatd does
+            size_t end = (cursor > (size_t)std::abs(count)) ? cursor - std::abs(count) : 0;
+            while (cursor > end)
+            {
+                sendMessage(socket, chatd::OP_OLDMSG, chatid, ch.msgs[--cursor]);
+            }
+            conn.histCursor[chatid] = cursor;
+            send(socket, chatd::Command(chatd::OP_HISTDONE) + chatid);
+            return pos + 12;
+        }
+        case chatd::OP_NEWMSG:
+        case chatd::OP_NEWNODEMSG:
+        {
+            Id chatid(frame.read<uint64_t>(pos));
+            Id userid(frame.read<uint64_t>(pos + 8));
+            Id msgxid(frame.read<uint64_t>(pos + 16));
+            uint32_t ts = frame.read<uint32_t>(pos + 24);
+            chatd::KeyId keyid = frame.read<chatd::KeyId>(pos + 30);
+            uint32_t len = frame.read<uint32_t>(pos + 34);
+            const char* data = frame.readPtr(pos + 38, len);
+            SimChat& ch = chat(chatid);
+
+            auto sent = ch.msgxids.find(msgxid);
+            if (sent != ch.msgxids.end())   // a resend after a reconnection
+            {
+                send(socket, chatd::Command(chatd::OP_MSGID) + msgxid + sent->second);
+                return pos + 38 + len;
+            }
+            if (chatd::isLocalKeyId(keyid))
+            {
+                auto key = conn.pendingKey.find(chatid);
+                if (key == conn.pendingKey.end())
+                {
+                    send(socket, chatd::Command(chatd::OP_REJECT) + chatid + msgxid + opcode + (uint8_t)0);
+                    return pos + 38 + len;
+                }
+                keyid = key->second;
+            }
+
+            StoredMsg& msg = storeMessage(ch, userid, ts, keyid, data, len);
+            ch.msgxids[msgxid] = msg.msgid;
+            mMessagesStored++;
+            send(socket, chatd::Command(chatd::OP_NEWMSGID) + msgxid + msg.msgid);
+            for (auto other: ch.joined)
+            {
+                if (other != &socket)
+                    sendMessage(*other, chatd::OP_NEWMSG, chatid, msg);
+            }
+            return pos + 38 + len;
+        }
+        case chatd::OP_MSGUPD:
+        case chatd::OP_MSGUPDX:
+        {
+            Id chatid(frame.read<uint64_t>(pos));
+            Id msgid(frame.read<uint64_t>(pos + 16));
+            uint16_t updated = frame.read<uint16_t>(pos + 28);
+            uint32_t len = frame.read<uint32_t>(pos + 34);
+            const char* data = frame.readPtr(pos + 38, len);
+            SimChat& ch = chat(chatid);
+
+            if (opcode == chatd::OP_MSGUPDX)
+            {
+                auto sent = ch.msgxids.find(msgid);
+                msgid = (sent != ch.msgxids.end()) ? sent->second : Id::inval();
+            }
+            auto idx = ch.msgIdx.find(msgid);
+            if (idx == ch.msgIdx.end() || updated <= ch.msgs[idx->second].updated)
+            {
+                send(socket, chatd::Command(chatd::OP_REJECT) + chatid + msgid + opcode + (uint8_t)0);
+                return pos + 38 + len;
+            }
+            StoredMsg& msg = ch.msgs[idx->second];
+            msg.updated = updated;
+            msg.data.assign(data, len);
+            for (auto other: ch.joined)
+            {
+                sendMessage(*other, chatd::OP_MSGUPD, chatid, msg);
+            }
+            return pos + 38 + len;
+        }
+        case chatd::OP_NEWKEY:
+        {
+            Id chatid(frame.read<uint64_t>(pos));
+            chatd::KeyId keyxid = frame.read<chatd::KeyId>(pos + 8);
+            uint32_t len = frame.read<uint32_t>(pos + 12);
+            size_t end = pos + 16 + len;
+            frame.checkDataSize(end);
+            SimChat& ch = chat(chatid);
+
+            // convert the keys to the format sent to clients, which includes the keyid
+            chatd::KeyId keyid = ++ch.lastKeyid;
+            Buffer keys(len + len / 2);
+            for (size_t keyPos = pos + 16; keyPos < end;)
+            {
+                uint64_t userid = frame.read<uint64_t>(keyPos);
+                uint16_t keylen = frame.read<uint16_t>(keyPos + 8);
+                keys.append<uint64_t>(userid).append<chatd::KeyId>(keyid).append<uint16_t>(keylen);
+                keys.append(frame.readPtr(keyPos + 10, keylen), keylen);
+                keyPos += 10 + keylen;
+            }
+            std::string& payload = ch.keys[keyid];
+            payload.assign(keys.buf(), keys.dataSize());
+            conn.pendingKey[chatid] = keyid;
+
+            send(socket, chatd::Command(chatd::OP_NEWKEYID) + chatid + keyxid + keyid);
+            broadcast(ch, chatd::Command(chatd::OP_NEWKEY, 17 + payload.size()) + chatid + keyid
+                      + (uint32_t)payload.size() + payload, &socket);
+            return end;
+        }
+        case chatd::OP_SEEN:
+        case chatd::OP_RECEIVED:
+        {
+            Id chatid(frame.read<uint64_t>(pos));
+            Id msgid(frame.read<uint64_t>(pos + 8));
+            SimChat& ch = chat(chatid);
+            if (opcode == chatd::OP_SEEN)
+                ch.lastSeen = msgid;
+            else
+                ch.lastReceived = msgid;
+            // to the other devices of the user, and to the peers for RECEIVED
+            broadcast(ch, chatd::Command(opcode) + chatid + msgid, &socket);
+            return pos + 16;
+        }
+        case chatd::OP_BROADCAST:
+        {
+            Id chatid(frame.read<uint64_t>(pos));
+            Id userid(frame.read<uint64_t>(pos + 8));
+            uint8_t type = frame.read<uint8_t>(pos + 16);
+            broadcast(chat(chatid), chatd::Command(chatd::OP_BROADCAST) + chatid + userid + type, &socket);
+            return pos + 17;
+        }
+        default:
+            throw std::runtime_error("ChatdSimulator: unsupported opcode "+std::to_string(opcode));
+    }
+}
+
+void ChatdSimulator::setIncomingRate(double msgsPerSec)
+{
+    mIncomingRate = msgsPerSec;
+    mIncomingSent = 0;
+    mIncomingStart = SimLoop::Clock::now();
+}
+
+void ChatdSimulator::tick()
+{
+    if (mIncomingRate <= 0 || mChatList.empty())
+    {
+        return;
+    }
+    double elapsed = std::chrono::duration<double>(SimLoop::Clock::now() - mIncomingStart).count();
+    uint64_t due = (uint64_t)(elapsed * mIncomingRate);
+    if (mIncomingSent >= due)
+    {
+        return;
+    }
+
+    std::string blob(std::max<size_t>(mConfig.messageSize, 8), 'y');
+    uint32_t now = (uint32_t)time(NULL);
+    size_t skipped = 0; // chats without joined connections don't receive traffic
+    while (mIncomingSent < due && skipped < mChatList.size())
+    {
+        SimChat& ch = *mChatList[mNextIncomingChat];
+        mNextIncomingChat = (mNextIncomingChat + 1) % mChatList.size();
+        if (ch.joined.empty())
+        {
+            skipped++;
+            continue;
+        }
+        skipped = 0;
+        Id sender = ch.users[ch.users.size() > 1 ? 1 + mIncomingSent % (ch.users.size() - 1) : 0];
+        SimLoop::writeTimestamp(&blob[0]);
+        StoredMsg& msg = storeMessage(ch, sender, now, ch.lastKeyid, blob.data(), blob.size());
+        for (auto socket: ch.joined)
+        {
+            sendMessage(*socket, chatd::OP_NEWMSG, ch.chatid, msg);
+        }
+        mIncomingSent++;
+        mMessagesGenerated++;
+    }
+    mIncomingSent = due;    // don't accumulate the messages of chats without connections
+    flush();
+}
+
+size_t PresencedSimulator::execCommand(SimSocket& socket, const StaticBuffer& frame, size_t pos)
+{
+    uint8_t opcode = frame.read<uint8_t>(pos++);
+    switch (opcode)
+    {
+        case presenced::OP_KEEPALIVE:
+            send(socket, presenced::Command(presenced::OP_KEEPALIVE));
+            return pos;
+
+        case presenced::OP_HELLO:
+        {
+            frame.read<uint16_t>(pos);  // version and capabilities
+            auto prefs = mPrefs.emplace(&socket, (uint16_t)kDefaultPrefs).first;
+            send(socket, presenced::Command(presenced::OP_PREFS) + prefs->second);
+            return pos + 2;
+        }
+        case presenced::OP_PREFS:
+        {
+            uint16_t prefs = frame.read<uint16_t>(pos);
+            mPrefs[&socket] = prefs;
+            send(socket, presenced::Command(presenced::OP_PREFS) + prefs);  // ack
+            return pos + 2;
+        }
+        case presenced::OP_USERACTIVE:
+            frame.read<uint8_t>(pos);
+            return pos + 1;
+
+        case presenced::OP_SNSETPEERS:
+        case presenced::OP_SNADDPEERS:
+        case presenced::OP_SNDELPEERS:
+            pos += 8;   // sn
+            // fall through
+        case presenced::OP_ADDPEERS:
+        case presenced::OP_DELPEERS:
+        {
+            uint32_t count = frame.read<uint32_t>(pos);
+            pos += 4;
+            frame.checkDataSize(pos + (size_t)count * 8);
+            if (opcode != presenced::OP_SNDELPEERS && opcode != presenced::OP_DELPEERS)
+            {
+                for (uint32_t i = 0; i < count; i++)
+                {
+                    sendPeerStatus(socket, frame.read<uint64_t>(pos + i * 8));
+                }
+            }
+            return pos + count * 8;
+        }
+        case presenced::OP_LASTGREEN:
+        {
+            Id userid(frame.read<uint64_t>(pos));
+            send(socket, presenced::Command(presenced::OP_LASTGREEN) + userid + (uint16_t)5);
+            return pos + 8;
+        }
+        default:
+            throw std::runtime_error("PresencedSimulator: unsupported opcode "+std::to_string(opcode));
+    }
+}
+
+void PresencedSimulator::onDisconnected(SimSocket& socket)
+{
+    mPrefs.erase(&socket);
+}
+
+void PresencedSimulator::sendPeerStatus(SimSocket& socket, Id peer)
+{
+    send(socket, presenced::Command(presenced::OP_PEERSTATUS) + mConfig.peerPresence + peer);
+}
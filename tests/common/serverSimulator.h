@@ -0,0 +1,251 @@
+#ifndef SERVER_SIMULATOR_H
+#define SERVER_SIMULATOR_H
+
+/**
+ * In-process stand-ins of chatd and presenced, to load-test the client side without
+ * the MEGA servers. They speak the binary protocol of chatdMsg.h and presenced.h and
+ * are reached through SimWebsocketsIO, an implementation of the websockets network
+ * layer that connects to them instead of opening sockets. Everything runs in the app
+ * thread: network events are marshalled with marshallCall(), as the real layer does,
+ * and SimLoop is the message loop that executes them.
+ *
+ * The servers don't decrypt anything: message and key blobs are stored and relayed
+ * as received, like chatd does.
+ */
+
+#include <net/websocketsIO.h>
+#include <base/timers.hpp>
+#include <base/gcm.h>
+#include <chatdMsg.h>
+#include <karereId.h>
+#include <buffer.h>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+class SimServer;
+
+/** @brief Message loop of the app thread for the simulations. Installs itself as the
+ * megaPostMessageToGui() handler, so the calls marshalled by karere and by the
+ * simulated network are executed by runUntil(). It also runs the karere timers
+ * (reconnections, connection races...), in place of the loop of the MegaChatApiImpl */
+class SimLoop
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+    SimLoop();
+    ~SimLoop();
+    /** Registers a function that is called on every iteration of the loop (i.e. to
+     * generate traffic at a given rate) */
+    void addTicker(std::function<void()>&& ticker) { mTickers.push_back(std::move(ticker)); }
+    /** Runs the loop until \c done returns true. Returns false if \c timeoutSec elapsed before */
+    bool runUntil(const std::function<bool()>& done, double timeoutSec);
+    /** Processes the queued messages, and the ones posted meanwhile, until the queue is empty */
+    void runPending();
+    WebsocketsIO::Mutex& mutex() { return mMutex; }
+    /** The synthetic messages carry the time they were sent, in their first 8 bytes,
+     * to measure the delivery latency */
+    static void writeTimestamp(void* data);
+    static double msSinceTimestamp(const void* data);
+
+protected:
+    static SimLoop* sInstance;
+    std::mutex mQueueMutex;
+    std::deque<void*> mQueue;
+    std::vector<std::function<void()>> mTickers;
+    WebsocketsIO::Mutex mMutex;     // the mutex of the network layer
+    GcmPostFunc mPrevPost;          // restored on destruction
+    uv_loop_t mTimerLoop;           // see karere::gTimerLoop
+    static void post(void* msg, void* appCtx);
+    size_t processQueue();
+};
+
+/** @brief The client side of a simulated websocket connection. Without a server, the
+ * connection is never established (i.e. an unreachable IP) */
+class SimSocket: public WebsocketsClientImpl
+{
+public:
+    SimSocket(WebsocketsIO::Mutex& mutex, WebsocketsClient* client, SimServer* server, void* appCtx);
+    ~SimSocket() override;
+    /** Called by the server to send a frame to the client */
+    void deliver(Buffer&& frame);
+
+protected:
+    SimServer* mServer;     // null once disconnected
+    void* mAppCtx;
+    bool mConnected = false;
+    // invalidated on destruction, so the calls marshalled for this socket are discarded
+    std::shared_ptr<bool> mAlive;
+    void onConnected();
+    void detach();
+    bool wsSendMessage(char* msg, size_t len) override;
+    void wsDisconnect(bool immediate) override;
+    bool wsIsConnected() override;
+};
+
+/** @brief Network layer that connects to simulated servers, by hostname */
+class SimWebsocketsIO: public WebsocketsIO
+{
+public:
+    enum { kNoNameError = -1 };
+    SimWebsocketsIO(SimLoop& loop, ::mega::MegaApi* api, void* ctx);
+    void addServer(const std::string& host, SimServer& server) { mServers[host] = &server; }
+    /** The connections to \c ip are never established, nor fail */
+    void addUnreachableIp(const std::string& ip) { mUnreachableIps.insert(ip); }
+    /** IPs of the connections requested so far, in order */
+    const std::vector<std::string>& connectAttempts() const { return mConnectAttempts; }
+    void clearConnectAttempts() { mConnectAttempts.clear(); }
+    void addevents(::mega::Waiter*, int) override {}
+
+protected:
+    std::map<std::string, SimServer*> mServers;
+    std::set<std::string> mUnreachableIps;
+    std::vector<std::string> mConnectAttempts;
+    bool wsResolveDNS(const char* hostname, std::function<void(int, const std::vector<std::string>&, const std::vector<std::string>&)> f) override;
+    WebsocketsClientImpl* wsConnect(const char* ip, const char* host, int port, const char* path, bool ssl,
+                                    WebsocketsClient* client) override;
+    int wsGetNoNameErrorCode() override { return kNoNameError; }
+};
+
+/** @brief Configuration of the synthetic accounts served by the simulators */
+struct SimConfig
+{
+    unsigned accounts = 10;         // handles are kFirstAccount + i
+    unsigned chatsPerAccount = 10;  // chats of each account, not shared with other accounts
+    unsigned peersPerChat = 2;      // synthetic participants besides the account, handles kFirstPeer + i
+    unsigned historyDepth = 256;    // messages in each chat at startup
+    size_t messageSize = 200;       // size of the synthetic message blobs
+    uint8_t peerPresence = 3;       // presence of the peers (online)
+
+    enum: uint64_t { kFirstAccount = 0x10000, kFirstPeer = 0x20000, kFirstChat = 0x30000 };
+    karere::Id account(unsigned i) const { return karere::Id(kFirstAccount + i); }
+    karere::Id peer(unsigned i) const { return karere::Id(kFirstPeer + i); }
+    karere::Id chat(unsigned account, unsigned i) const { return karere::Id(kFirstChat + (uint64_t)account * chatsPerAccount + i); }
+};
+
+/** @brief Base of the simulated servers. The replies to a frame (or to a tick) are
+ * accumulated per connection and sent in a single frame, as the real servers do */
+class SimServer
+{
+public:
+    struct Stats
+    {
+        uint64_t framesIn = 0;
+        uint64_t framesOut = 0;
+        uint64_t commandsIn = 0;
+        uint64_t errors = 0;        // malformed or unknown commands
+    };
+    explicit SimServer(const SimConfig& config): mConfig(config) {}
+    virtual ~SimServer() {}
+    void onConnect(SimSocket& socket);
+    void onClose(SimSocket& socket);
+    void onFrame(SimSocket& socket, const StaticBuffer& frame);
+    const Stats& stats() const { return mStats; }
+    size_t connectionCount() const { return mSockets.size(); }
+
+protected:
+    const SimConfig& mConfig;
+    Stats mStats;
+    std::set<SimSocket*> mSockets;
+    std::map<SimSocket*, Buffer> mOutput;
+    /** Queues a command for the connection, to be sent by flush() */
+    void send(SimSocket& socket, const StaticBuffer& cmd);
+    void flush();
+    /** Executes the command at \c pos, returning the position of the next one. Throws
+     * on malformed or unknown commands, which discards the rest of the frame */
+    virtual size_t execCommand(SimSocket& socket, const StaticBuffer& frame, size_t pos) = 0;
+    virtual void onConnected(SimSocket&) {}
+    virtual void onDisconnected(SimSocket&) {}
+};
+
+/** @brief chatd stand-in. Serves the chats of the synthetic accounts, with their
+ * history, and relays the messages, keys and receipts among the connections joined
+ * to each chat. See the opcodes in chatdMsg.h */
+class ChatdSimulator: public SimServer
+{
+public:
+    explicit ChatdSimulator(const SimConfig& config);
+    /** Starts sending synthetic messages from the peers to the joined chats, at
+     * \c msgsPerSec in total. Zero stops them */
+    void setIncomingRate(double msgsPerSec);
+    /** Sends the synthetic messages due at the current rate */
+    void tick();
+    uint64_t messagesStored() const { return mMessagesStored; }
+    uint64_t messagesGenerated() const { return mMessagesGenerated; }
+
+protected:
+    struct StoredMsg
+    {
+        karere::Id msgid;
+        karere::Id userid;
+        uint32_t ts;
+        uint16_t updated;
+        chatd::KeyId keyid;
+        std::string data;
+    };
+    struct SimChat
+    {
+        karere::Id chatid;
+        std::vector<karere::Id> users;
+        std::vector<StoredMsg> msgs;            // oldest first
+        std::map<karere::Id, size_t> msgIdx;    // msgid -> index in msgs
+        std::map<karere::Id, karere::Id> msgxids;   // msgxid -> msgid, to detect resends
+        std::map<chatd::KeyId, std::string> keys;   // payload of the NEWKEY sent to clients
+        chatd::KeyId lastKeyid = 0;
+        karere::Id lastSeen;
+        karere::Id lastReceived;
+        std::set<SimSocket*> joined;
+    };
+    struct ConnState
+    {
+        uint32_t clientid = 0;
+        std::map<karere::Id, size_t> histCursor;    // index of the oldest message sent by HIST
+        std::map<karere::Id, chatd::KeyId> pendingKey; // key of the last NEWKEY, by chat
+    };
+    std::map<karere::Id, SimChat> mChats;
+    std::map<SimSocket*, ConnState> mConns;
+    std::vector<SimChat*> mChatList;    // to pick the chats of the synthetic traffic
+    uint64_t mNextMsgid = 0x1000000;
+    uint32_t mNextClientid = 1;
+    uint64_t mMessagesStored = 0;
+    uint64_t mMessagesGenerated = 0;
+    double mIncomingRate = 0;
+    uint64_t mIncomingSent = 0;     // since the rate was set
+    size_t mNextIncomingChat = 0;
+    SimLoop::Clock::time_point mIncomingStart;
+
+    size_t execCommand(SimSocket& socket, const StaticBuffer& frame, size_t pos) override;
+    void onConnected(SimSocket& socket) override;
+    void onDisconnected(SimSocket& socket) override;
+    SimChat& chat(karere::Id chatid);
+    StoredMsg& storeMessage(SimChat& chat, karere::Id userid, uint32_t ts, chatd::KeyId keyid, const char* data, size_t len);
+    void sendMessage(SimSocket& socket, uint8_t opcode, karere::Id chatid, const StoredMsg& msg);
+    void sendJoins(SimSocket& socket, const SimChat& chat);
+    void sendKeys(SimSocket& socket, const SimChat& chat);
+    void broadcast(const SimChat& chat, const StaticBuffer& cmd, SimSocket* except);
+};
+
+/** @brief presenced stand-in. Reports the configured presence of the peers, and keeps
+ * the preferences of each connection (the real server identifies the user by the
+ * session in the URL, the simulator doesn't need to). See the opcodes in presenced.h */
+class PresencedSimulator: public SimServer
+{
+public:
+    explicit PresencedSimulator(const SimConfig& config): SimServer(config) {}
+
+protected:
+    enum: uint16_t { kDefaultPrefs = 2 | (600 << 4) };  // online (code relative to kOffline), autoaway after 10 minutes
+    std::map<SimSocket*, uint16_t> mPrefs;
+    size_t execCommand(SimSocket& socket, const StaticBuffer& frame, size_t pos) override;
+    void onDisconnected(SimSocket& socket) override;
+    void sendPeerStatus(SimSocket& socket, karere::Id peer);
+};
+
+#endif
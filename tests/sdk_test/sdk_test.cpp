@@ -2,14 +2,20 @@
 
 #include <megaapi.h>
 #include "../../src/chatd.h"
+#include "../../src/dbStatements.h"
 #include "../../src/megachatapi.h"
 #include "../../src/karereCommon.h" // for logging with karere facility
+#include "../../src/strongvelope/strongvelope.h"
+#include "../../src/strongvelope/tlvstore.h"
+#include "../common/serverSimulator.h"
 
+#include <algorithm>
 #include <signal.h>
 #include <stdio.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <sqlite3.h>
 
 using namespace mega;
 using namespace megachat;
@@ -35,6 +41,7 @@ int main(int argc, char **argv)
     // TODO: uncomment this test once the reaction's support is deployed into shards 0 and 1 (currently, it only works in shard 2)
     // EXECUTE_TEST(t.TEST_Reactions(0, 1), "TEST Chat Reactions");
     EXECUTE_TEST(t.TEST_ClearHistory(0, 1), "TEST Clear history");
+    EXECUTE_TEST(t.TEST_HistoryWindow(0, 1), "TEST History window");
     EXECUTE_TEST(t.TEST_GroupLastMessage(0, 1), "TEST Last message (group)");
 
     // Test using a 1on1 chat
@@ -66,6 +73,12 @@ int main(int argc, char **argv)
     MegaChatApiUnitaryTest unitaryTest;
     std::cout << "[========] Unitary tests " << std::endl;
     unitaryTest.UNITARYTEST_ParseUrl();
+    unitaryTest.UNITARYTEST_DbQueryPlans();
+    unitaryTest.UNITARYTEST_IdMap();
+    unitaryTest.UNITARYTEST_SymmKeyCache();
+    unitaryTest.UNITARYTEST_PlaintextCache();
+    unitaryTest.UNITARYTEST_TlvStore();
+    unitaryTest.UNITARYTEST_ConnectRace();
     std::cout << "[========] End Unitary tests " << std::endl;
 
     return t.mFailedTests + unitaryTest.mFailedTests;
@@ -2089,6 +2102,91 @@ void MegaChatApiTest::TEST_ClearHistory(unsigned int a1, unsigned int a2)
     sessionSecondary = NULL;
 }
 
+/**
+ * @brief TEST_HistoryWindow
+ *
+ * Requirements:
+ * - Both accounts should be conctacts
+ * - The 1on1 chatroom between them should exist
+ * (if not accomplished, the test automatically solves the above)
+ *
+ * This test does the following:
+ *
+ * - Limit the messages kept in memory by the secondary account to two
+ * - Send five mesages to chatroom
+ * - Close the chatroom, so the three oldest messages are evicted from memory
+ * Check the oldest message can still be retrieved
+ * Check the oldest message can still be marked as seen
+ *
+ */
+void MegaChatApiTest::TEST_HistoryWindow(unsigned int a1, unsigned int a2)
+{
+    char *sessionPrimary = login(a1);
+    char *sessionSecondary = login(a2);
+
+    MegaUser *user = megaApi[a1]->getContact(mAccounts[a2].getEmail().c_str());
+    if (!user || (user->getVisibility() != MegaUser::VISIBILITY_VISIBLE))
+    {
+        makeContact(a1, a2);
+    }
+    delete user;
+    user = NULL;
+
+    MegaChatHandle chatid = getPeerToPeerChatRoom(a1, a2);
+    megaChatApi[a2]->setHistoryWindow(2);
+
+    // Open chatrooms
+    TestChatRoomListener *chatroomListener = new TestChatRoomListener(this, megaChatApi, chatid);
+    ASSERT_CHAT_TEST(megaChatApi[a1]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a1+1));
+    ASSERT_CHAT_TEST(megaChatApi[a2]->openChatRoom(chatid, chatroomListener), "Can't open chatRoom account " + std::to_string(a2+1));
+
+    // Load some message to feed history
+    loadHistory(a1, chatid, chatroomListener);
+    loadHistory(a2, chatid, chatroomListener);
+
+    // Send 5 messages, so the oldest ones exceed the window
+    std::vector<MegaChatHandle> msgids;
+    std::string oldestContent;
+    for (int i = 0; i < 5; i++)
+    {
+        string msg0 = "HI " + mAccounts[a2].getEmail() + " - Testing history window. This messages is the number " + std::to_string(i);
+        if (i == 0)
+        {
+            oldestContent = msg0;
+        }
+
+        MegaChatMessage *message = sendTextMessageOrUpdate(a1, a2, chatid, msg0, chatroomListener);
+        msgids.push_back(message->getMsgId());
+
+        delete message;
+        message = NULL;
+    }
+
+    // Close the chatrooms --> the secondary account evicts the oldest messages
+    megaChatApi[a1]->closeChatRoom(chatid, chatroomListener);
+    megaChatApi[a2]->closeChatRoom(chatid, chatroomListener);
+    delete chatroomListener;
+    chatroomListener = NULL;
+
+    // --> Check the evicted message is retrieved from the local cache
+    MegaChatMessage *message = megaChatApi[a2]->getMessage(chatid, msgids[0]);
+    ASSERT_CHAT_TEST(message, "Failed to retrieve a message evicted from memory");
+    ASSERT_CHAT_TEST(message->getMsgId() == msgids[0], "Wrong message id for evicted message");
+    ASSERT_CHAT_TEST(!strcmp(oldestContent.c_str(), message->getContent()), "Content of evicted message doesn't match the content of sent message");
+    delete message;
+    message = NULL;
+
+    // --> Check the evicted message can be marked as seen
+    ASSERT_CHAT_TEST(megaChatApi[a2]->setMessageSeen(chatid, msgids[0]), "Failed to set an evicted message as seen");
+
+    megaChatApi[a2]->setHistoryWindow(0);
+
+    delete [] sessionPrimary;
+    sessionPrimary = NULL;
+    delete [] sessionSecondary;
+    sessionSecondary = NULL;
+}
+
 /**
  * @brief TEST_SwitchAccounts
  *
@@ -4733,3 +4831,459 @@ bool MegaChatApiUnitaryTest::UNITARYTEST_ParseUrl()
     std::cout << "          TEST - Message::parseUrl() - Executed Tests : " << executedTests << "   Failure Tests : " << failureTests << std::endl;
     return succesful;
 }
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_DbQueryPlans()
+{
+    // Statements run against the cache for a single chat or user (see dbStatements.h). None of them
+    // should scan a table, since their cost would grow with the size of the cache
+    mOKTests ++;
+    std::cout << "          TEST - DB query plans" << std::endl;
+    int executedTests = 0;
+    int failureTests = 0;
+
+    sqlite3* db = nullptr;
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK
+            || sqlite3_exec(db, gDbSchema, nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        std::cout << "         [" << " FAILED DB schema" << "] " << (db ? sqlite3_errmsg(db) : "") << std::endl;
+        sqlite3_close(db);
+        mFailedTests ++;
+        return false;
+    }
+
+    // the plan also reports scans of subqueries and CTEs, only the ones of real tables matter
+    std::set<std::string> tables;
+    sqlite3_stmt* stmt = nullptr;
+    sqlite3_prepare_v2(db, "select name from sqlite_master where type = 'table'", -1, &stmt, nullptr);
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        tables.insert(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+    }
+    sqlite3_finalize(stmt);
+
+    // tables that grow with the history, which must not be scanned even through an index
+    std::set<std::string> largeTables = {"history", "node_history", "sendkeys"};
+
+    for (auto& sql: karere::sql::auditedStatements())
+    {
+        executedTests ++;
+        std::string plan;
+        bool fullScan = false;
+        std::string explain = "EXPLAIN QUERY PLAN " + sql;
+        if (sqlite3_prepare_v2(db, explain.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        {
+            failureTests ++;
+            std::cout << "         [" << " FAILED Prepare" << "] " << sql << ": " << sqlite3_errmsg(db) << std::endl;
+            continue;
+        }
+
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            // the detail is "SCAN <table>" (or "SCAN TABLE <table>", in older versions of SQLite)
+            const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+            std::string detail(text ? text : "");
+            plan.append(detail).append("; ");
+            if (detail.compare(0, 5, "SCAN ") != 0)
+            {
+                continue;
+            }
+
+            std::string name = detail.substr(5);
+            if (name.compare(0, 6, "TABLE ") == 0)
+            {
+                name = name.substr(6);
+            }
+            bool usingIndex = (name.find(" USING ") != std::string::npos);
+            name = name.substr(0, name.find(' '));
+            if (!tables.count(name))
+            {
+                continue;
+            }
+
+            if (largeTables.count(name) || !usingIndex)
+            {
+                fullScan = true;
+            }
+        }
+        sqlite3_finalize(stmt);
+
+        if (fullScan)
+        {
+            failureTests ++;
+            std::cout << "         [" << " FAILED Scan" << "] " << sql << std::endl
+                      << "             plan: " << plan << std::endl;
+            LOG_debug << "Table scan for query: " << sql;
+        }
+    }
+    sqlite3_close(db);
+
+    if (failureTests > 0)
+    {
+        mFailedTests ++;
+    }
+
+    std::cout << "          TEST - DB query plans - Executed Tests : " << executedTests << "   Failure Tests : " << failureTests << std::endl;
+    return failureTests == 0;
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_IdMap()
+{
+    // Random inserts and erases (including while iterating) compared against std::map
+    mOKTests ++;
+    std::cout << "          TEST - karere::IdMap" << std::endl;
+    int executedTests = 0;
+    int failureTests = 0;
+
+    karere::IdMap<karere::Id, int> map;
+    std::map<karere::Id, int> reference;
+    srand(12345);
+    for (int round = 0; round < 20; round++)
+    {
+        executedTests ++;
+        for (int i = 0; i < 2000; i++)
+        {
+            // a small key range, so that erases and re-inserts hit existing entries
+            karere::Id key((uint64_t)(rand() % 4096) << 20);
+            if (rand() % 3)
+            {
+                map[key] = i;
+                reference[key] = i;
+            }
+            else if (map.erase(key) != reference.erase(key))
+            {
+                failureTests ++;
+                break;
+            }
+        }
+        for (auto it = map.begin(); it != map.end();)
+        {
+            if (it->second % 5 == 0)
+            {
+                reference.erase(it->first);
+                it = map.erase(it);
+            }
+            else
+            {
+                it++;
+            }
+        }
+
+        bool match = (map.size() == reference.size());
+        for (auto& item: reference)
+        {
+            auto it = map.find(item.first);
+            if (it == map.end() || it->second != item.second)
+            {
+                match = false;
+                break;
+            }
+        }
+        if (!match)
+        {
+            failureTests ++;
+            std::cout << "         [" << " FAILED IdMap content differs" << "] round " << round << std::endl;
+        }
+    }
+
+    if (failureTests > 0)
+    {
+        mFailedTests ++;
+    }
+
+    std::cout << "          TEST - karere::IdMap - Executed Tests : " << executedTests << "   Failure Tests : " << failureTests << std::endl;
+    return failureTests == 0;
+}
+
+bool MegaChatApiUnitaryTest::reportChecks(const std::string& name, const Checks& checks)
+{
+    int executedTests = 0;
+    int failureTests = 0;
+    for (auto& check: checks)
+    {
+        executedTests ++;
+        if (!check.second)
+        {
+            failureTests ++;
+            std::cout << "         [" << " FAILED " << check.first << "] " << std::endl;
+        }
+    }
+
+    if (failureTests > 0)
+    {
+        mFailedTests ++;
+    }
+
+    std::cout << "          TEST - " << name << " - Executed Tests : " << executedTests << "   Failure Tests : " << failureTests << std::endl;
+    return failureTests == 0;
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_SymmKeyCache()
+{
+    // Keys derived from the Cu25519 keys of peers, persisted in the db with a check value
+    mOKTests ++;
+    std::cout << "          TEST - strongvelope::SymmKeyCache" << std::endl;
+
+    SqliteDb db;
+    if (!db.open(":memory:") || sqlite3_exec(db, gDbSchema, nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        std::cout << "         [" << " FAILED DB schema" << "] " << std::endl;
+        mFailedTests ++;
+        return false;
+    }
+
+    strongvelope::Key<32> privKey;
+    memset(privKey.buf(), 0x5a, privKey.dataSize());
+    strongvelope::Key<32> pubKey1;
+    memset(pubKey1.buf(), 0x01, pubKey1.dataSize());
+    strongvelope::Key<32> pubKey2;
+    memset(pubKey2.buf(), 0x02, pubKey2.dataSize());
+    auto key = std::make_shared<strongvelope::SendKey>();
+    memset(key->buf(), 0x33, key->dataSize());
+    karere::Id user(0x1234567890ULL);
+
+    Checks checks;
+    {
+        strongvelope::SymmKeyCache cache(privKey, &db);
+        cache.put(user, pubKey1, key);
+        checks.emplace_back("cached key", cache.get(user, pubKey1) == key);
+        checks.emplace_back("other public key", !cache.get(user, pubKey2));
+
+        SqliteStmt stmt(db, "select mac from symm_keys where userid = ?");
+        stmt << user;
+        checks.emplace_back("check value in db", stmt.step() && sqlite3_column_bytes(stmt, 0) == 32);
+    }
+    {
+        strongvelope::SymmKeyCache cache(privKey, &db);
+        auto loaded = cache.get(user, pubKey1);
+        checks.emplace_back("loaded from db", loaded && memcmp(loaded->buf(), key->buf(), key->dataSize()) == 0);
+        cache.invalidate(user);
+        checks.emplace_back("invalidated", !cache.get(user, pubKey1));
+    }
+    {
+        strongvelope::SymmKeyCache cache(privKey, &db);
+        checks.emplace_back("invalidated in db", cache.size() == 0);
+        cache.put(user, pubKey1, key);
+    }
+    {
+        // rows stored for a different own key fail the check
+        strongvelope::Key<32> otherPrivKey;
+        memset(otherPrivKey.buf(), 0xa5, otherPrivKey.dataSize());
+        strongvelope::SymmKeyCache cache(otherPrivKey, &db);
+        checks.emplace_back("other own key", cache.size() == 0);
+    }
+    {
+        strongvelope::SymmKeyCache cache(privKey, &db);
+        cache.put(user, pubKey1, key);
+        strongvelope::SendKey tampered;
+        memset(tampered.buf(), 0x44, tampered.dataSize());
+        db.query("update symm_keys set key = ? where userid = ?", tampered, user);
+    }
+    {
+        strongvelope::SymmKeyCache cache(privKey, &db);
+        checks.emplace_back("tampered key", cache.size() == 0);
+        SqliteStmt stmt(db, "select count(*) from symm_keys");
+        checks.emplace_back("tampered key removed from db", stmt.step() && stmt.intCol(0) == 0);
+    }
+
+    return reportChecks("strongvelope::SymmKeyCache", checks);
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_PlaintextCache()
+{
+    // Decrypted content of messages, reused when the same messages are fetched again
+    mOKTests ++;
+    std::cout << "          TEST - strongvelope::PlaintextCache" << std::endl;
+
+    karere::Id chatid(0x1111ULL);
+    karere::Id userid(0x2222ULL);
+    auto encrypted = [userid](uint64_t msgid, uint16_t updated, const std::string& blob)
+    {
+        chatd::Message msg(karere::Id(msgid), userid, 1000, updated, blob.data(), blob.size(), false, 3);
+        msg.setEncrypted(chatd::Message::kEncryptedPending);
+        return msg;
+    };
+    auto add = [chatid](strongvelope::PlaintextCache& cache, chatd::Message& msg, const std::string& content)
+    {
+        strongvelope::PlaintextCache::Digest digest;
+        strongvelope::PlaintextCache::digest(msg, digest);
+        msg.assign(content.data(), content.size());
+        msg.type = chatd::Message::kMsgNormal;
+        msg.backRefId = 0x77;
+        msg.backRefs.push_back(0x55);
+        msg.setEncrypted(chatd::Message::kNotEncrypted);
+        cache.put(chatid, digest, msg);
+    };
+
+    Checks checks;
+    {
+        strongvelope::PlaintextCache cache;
+        auto msg = encrypted(1, 0, "ciphertext");
+        add(cache, msg, "hello");
+
+        auto refetched = encrypted(1, 0, "ciphertext");
+        bool hit = cache.get(chatid, refetched);
+        checks.emplace_back("refetched message", hit && std::string(refetched.buf(), refetched.dataSize()) == "hello"
+            && refetched.backRefId == 0x77 && refetched.backRefs.size() == 1
+            && refetched.isEncrypted() == chatd::Message::kNotEncrypted);
+
+        auto tampered = encrypted(1, 0, "ciphertexT");
+        checks.emplace_back("different content", !cache.get(chatid, tampered) && tampered.isEncrypted() != chatd::Message::kNotEncrypted);
+        auto edited = encrypted(1, 1, "ciphertext");
+        checks.emplace_back("edited message", !cache.get(chatid, edited));
+        auto other = encrypted(1, 0, "ciphertext");
+        checks.emplace_back("other chat", !cache.get(karere::Id(0x3333ULL), other));
+        checks.emplace_back("hit rate", cache.stats().hits == 1 && cache.stats().misses == 3);
+    }
+    {
+        strongvelope::PlaintextCache cache(16 * 1024);
+        std::string content(200, 'x');
+        for (uint64_t i = 1; i <= 200; i++)
+        {
+            auto msg = encrypted(i, 0, "ciphertext" + std::to_string(i));
+            add(cache, msg, content);
+        }
+        auto first = encrypted(1, 0, "ciphertext1");
+        auto last = encrypted(200, 0, "ciphertext200");
+        checks.emplace_back("bounded by bytes", cache.stats().bytes <= 16 * 1024 && cache.stats().evictions > 0);
+        checks.emplace_back("evicts least recently used", !cache.get(chatid, first) && cache.get(chatid, last));
+    }
+
+    return reportChecks("strongvelope::PlaintextCache", checks);
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_TlvStore()
+{
+    // TLV records written in one pass into a preallocated area, and parsed back as views
+    mOKTests ++;
+    std::cout << "          TEST - strongvelope::TlvSpanWriter" << std::endl;
+
+    Checks checks;
+    {
+        std::string nonce(12, 'n');
+        std::string payload(300, 'p');
+        uint64_t invitor = 0x1122334455667788ULL;
+        size_t size = strongvelope::TlvSpanWriter::recordSize(sizeof(invitor))
+            + strongvelope::TlvSpanWriter::recordSize(nonce.size())
+            + strongvelope::TlvSpanWriter::recordSize(payload.size());
+
+        Buffer span(size, size);
+        strongvelope::TlvSpanWriter writer(span.buf(), size);
+        writer.addRecord(strongvelope::TLV_TYPE_INVITOR, invitor);
+        writer.addRecord(strongvelope::TLV_TYPE_NONCE, StaticBuffer(nonce, false));
+        writer.addRecord(strongvelope::TLV_TYPE_PAYLOAD, StaticBuffer(payload, false));
+        checks.emplace_back("size precomputed", writer.remaining() == 0);
+
+        strongvelope::TlvWriter tlv;
+        tlv.addRecord(strongvelope::TLV_TYPE_INVITOR, invitor);
+        tlv.addRecord(strongvelope::TLV_TYPE_NONCE, StaticBuffer(nonce, false));
+        tlv.addRecord(strongvelope::TLV_TYPE_PAYLOAD, StaticBuffer(payload, false));
+        checks.emplace_back("same encoding as TlvWriter", tlv.dataSize() == size && memcmp(tlv.buf(), span.buf(), size) == 0);
+
+        strongvelope::TlvParser parser(span, 0, false);
+        strongvelope::TlvRecord record(span);
+        std::vector<StaticBuffer> views;
+        while (parser.getRecord(record))
+            views.push_back(record.view());
+        checks.emplace_back("parsed as views", views.size() == 3
+            && views[0].dataSize() == sizeof(invitor) && views[0].read<uint64_t>(0) == invitor
+            && views[1].buf() >= span.buf() && views[1].buf() < span.buf() + size
+            && std::string(views[2].buf(), views[2].dataSize()) == payload);
+
+        bool thrown = false;
+        try
+        {
+            strongvelope::TlvSpanWriter small(span.buf(), 10);
+            small.addRecord(strongvelope::TLV_TYPE_NONCE, StaticBuffer(nonce, false));
+        }
+        catch (std::runtime_error&)
+        {
+            thrown = true;
+        }
+        checks.emplace_back("overflow throws", thrown);
+
+        thrown = false;
+        try
+        {
+            StaticBuffer truncated(span.buf(), 2);
+            strongvelope::TlvParser truncatedParser(truncated, 0, false);
+            strongvelope::TlvRecord truncatedRecord(truncated);
+            truncatedParser.getRecord(truncatedRecord);
+        }
+        catch (std::runtime_error&)
+        {
+            thrown = true;
+        }
+        checks.emplace_back("truncated header throws", thrown);
+    }
+    {
+        // payloads of 0xffff bytes or more span till the end of the container
+        std::string payload(0x10000, 'p');
+        size_t size = strongvelope::TlvSpanWriter::recordSize(payload.size());
+        Buffer span(size, size);
+        strongvelope::TlvSpanWriter(span.buf(), size).addRecord(strongvelope::TLV_TYPE_PAYLOAD, StaticBuffer(payload, false));
+
+        strongvelope::TlvParser parser(span, 0, false);
+        strongvelope::TlvRecord record(span);
+        checks.emplace_back("long payload", parser.getRecord(record) && record.dataLen == payload.size()
+            && !parser.getRecord(record));
+    }
+
+    return reportChecks("strongvelope::TlvSpanWriter", checks);
+}
+
+bool MegaChatApiUnitaryTest::UNITARYTEST_ConnectRace()
+{
+    // WebsocketsClient::wsConnect() to several IPs, against the presenced simulator
+    mOKTests ++;
+    std::cout << "          TEST - WebsocketsClient connection race" << std::endl;
+
+    class RaceClient: public WebsocketsClient
+    {
+    public:
+        bool connected = false;
+        bool closed = false;
+        void wsConnectCb() override { connected = true; }
+        void wsCloseCb(int, int, const char*, size_t) override { closed = true; }
+        void wsHandleMsgCb(char*, size_t) override {}
+        void wsSendMsgCb(const char*, size_t) override {}
+    };
+
+    const unsigned attemptDelay = 200;
+    SimLoop loop;
+    SimConfig config;
+    PresencedSimulator server(config);
+    MegaApi api("sdk_test", (const char*)nullptr, "MEGAchat unit test");
+    SimWebsocketsIO io(loop, &api, nullptr);
+    io.addServer("presenced.sim", server);
+    io.addUnreachableIp("::1");
+
+    // the first IP never connects, so the second one is attempted after the delay and wins
+    // if both IPs are reachable, the first one wins. The second one is not attempted, unless
+    // the loop is delayed beyond the attempt delay, and then it's attempted after the first
+    std::vector<std::pair<std::string, std::vector<std::string>>> races = {
+        {"127.0.0.1", {"::1", "127.0.0.1"}},
+        {"127.0.0.2", {"127.0.0.2", "127.0.0.1"}}
+    };
+    Checks checks;
+    for (auto& race: races)
+    {
+        RaceClient client;
+        io.clearConnectAttempts();
+        bool started = client.wsConnect(&io, race.second, "presenced.sim", 443, "/", true, attemptDelay);
+        bool done = started && loop.runUntil([&client]() { return client.connected || client.closed; }, 5);
+        const std::vector<std::string>& attempts = io.connectAttempts();
+        bool firstWins = race.second.front() == race.first;
+        bool inOrder = !attempts.empty() && attempts.size() <= race.second.size()
+                && std::equal(attempts.begin(), attempts.end(), race.second.begin());
+
+        checks.emplace_back("connected to " + race.first, done && client.connected && !client.closed);
+        checks.emplace_back("winner " + race.first, client.wsConnectedIp() == race.first);
+        checks.emplace_back("attempts in order", inOrder && (firstWins || attempts.size() == race.second.size()));
+        checks.emplace_back("other attempts closed", server.connectionCount() == 1);
+
+        client.wsDisconnect(true);
+        loop.runPending();
+    }
+
+    return reportChecks("WebsocketsClient connection race", checks);
+}
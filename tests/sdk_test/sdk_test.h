@@ -191,6 +191,7 @@ public:
     void TEST_Reactions(unsigned int a1, unsigned int a2);
     void TEST_OfflineMode(unsigned int a1, unsigned int a2);
     void TEST_ClearHistory(unsigned int a1, unsigned int a2);
+    void TEST_HistoryWindow(unsigned int a1, unsigned int a2);
     void TEST_SwitchAccounts(unsigned int a1, unsigned int a2);
     void TEST_SendContact(unsigned int a1, unsigned int a2);
     void TEST_Attachment(unsigned int a1, unsigned int a2);
@@ -416,9 +417,21 @@ class MegaChatApiUnitaryTest
 {
 public:
     bool UNITARYTEST_ParseUrl();
+    bool UNITARYTEST_DbQueryPlans();
+    bool UNITARYTEST_IdMap();
+    bool UNITARYTEST_SymmKeyCache();
+    bool UNITARYTEST_PlaintextCache();
+    bool UNITARYTEST_TlvStore();
+    bool UNITARYTEST_ConnectRace();
 
     unsigned mOKTests = 0;
     unsigned mFailedTests = 0;
+
+private:
+    typedef std::vector<std::pair<std::string, bool>> Checks;
+
+    // prints the failed checks and the summary of the test, returns true if all checks passed
+    bool reportChecks(const std::string& name, const Checks& checks);
 };
 
 #endif // CHATTEST_H